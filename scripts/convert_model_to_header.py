@@ -77,15 +77,16 @@ assign("is_scaled", "false")
 
 num_states = len(model)
 
-print "\ttmp.states.resize(%d);" % (num_states)
+print "\tstd::vector<PoreModelStateParams> states(%d);" % (num_states)
 print "\tfor(size_t i = 0; i < %d; ++i) {" % (num_states)
-print "\t\ttmp.states[i].level_mean = %s[4*i + 0];" % (data_name)
-print "\t\ttmp.states[i].level_stdv = %s[4*i + 1];" % (data_name)
-print "\t\ttmp.states[i].sd_mean = %s[4*i + 2];" % (data_name)
-print "\t\ttmp.states[i].sd_stdv = %s[4*i + 3];" % (data_name)
-print "\t\ttmp.states[i].update_sd_lambda();"
-print "\t\ttmp.states[i].update_logs();"
+print "\t\tstates[i].level_mean = %s[4*i + 0];" % (data_name)
+print "\t\tstates[i].level_stdv = %s[4*i + 1];" % (data_name)
+print "\t\tstates[i].sd_mean = %s[4*i + 2];" % (data_name)
+print "\t\tstates[i].sd_stdv = %s[4*i + 3];" % (data_name)
+print "\t\tstates[i].update_sd_lambda();"
+print "\t\tstates[i].update_logs();"
 print "\t}"
+print "\ttmp.set_states(states);"
 
 #print "\ttmp.states = {"
 #for ki, t in enumerate(model):
@@ -9,10 +9,10 @@
 #include <assert.h>
 #include <algorithm>
 #include "nanopolish_alignment_db.h"
-#include "htslib/faidx.h"
 #include "htslib/hts.h"
 #include "htslib/sam.h"
 #include "nanopolish_methyltrain.h"
+#include "nanopolish_bam_utils.h"
 
 // Various file handle and structures
 // needed to traverse a bam file
@@ -65,12 +65,38 @@ EventAlignmentRecord::EventAlignmentRecord(SquiggleRead* sr,
 
         size_t kmer_pos_ref_strand = seq_record.aligned_bases[i].read_pos;
         size_t kmer_pos_read_strand = seq_record.rc ? this->sr->flip_k_strand(kmer_pos_ref_strand) : kmer_pos_ref_strand;
-        size_t event_idx = this->sr->get_closest_event_to(kmer_pos_read_strand, strand_idx);
-        this->aligned_events.push_back( { seq_record.aligned_bases[i].ref_pos, (int)event_idx });
+        int event_idx = this->sr->get_closest_event_to(kmer_pos_read_strand, strand_idx);
+
+        // reads that were loaded from a slice of the signal have no events outside of the slice
+        if(event_idx == -1) {
+            continue;
+        }
+        this->aligned_events.push_back( { seq_record.aligned_bases[i].ref_pos, event_idx });
     }
     this->rc = strand_idx == 0 ? seq_record.rc : !seq_record.rc;
     this->strand = strand_idx;
-    this->stride = this->aligned_events.front().read_pos < this->aligned_events.back().read_pos ? 1 : -1;
+    this->stride = this->aligned_events.empty() ||
+                   this->aligned_events.front().read_pos < this->aligned_events.back().read_pos ? 1 : -1;
+}
+
+EventAlignmentRecord::EventAlignmentRecord(SquiggleRead* sr,
+                                           const int strand_idx,
+                                           const std::vector<EventAlignment>& alignment)
+{
+    this->sr = sr;
+    for(const EventAlignment& ea : alignment) {
+        if(ea.hmm_state == 'B') {
+            continue;
+        }
+
+        if(this->aligned_events.empty() || this->aligned_events.back().ref_pos != ea.ref_position) {
+            this->aligned_events.push_back( { ea.ref_position, ea.event_idx });
+        }
+    }
+    this->rc = alignment.empty() ? 0 : alignment.front().rc;
+    this->strand = strand_idx;
+    this->stride = this->aligned_events.empty() ||
+                   this->aligned_events.front().read_pos < this->aligned_events.back().read_pos ? 1 : -1;
 }
 
 //
@@ -82,12 +108,28 @@ AlignmentDB::AlignmentDB(const std::string& reads_file,
                          const std::string& sequence_bam,
                          const std::string& event_bam,
                          bool calibrate_reads) :
-                            m_reference_file(reference_file),
+                            m_reference(std::make_shared<PackedReference>(reference_file)),
                             m_sequence_bam(sequence_bam),
                             m_event_bam(event_bam),
                             m_calibrate_on_load(calibrate_reads)
 {
-    m_read_db.load(reads_file);
+    std::shared_ptr<ReadDB> read_db = std::make_shared<ReadDB>();
+    read_db->load(reads_file);
+    m_read_db = read_db;
+    _clear_region();
+}
+
+AlignmentDB::AlignmentDB(std::shared_ptr<const ReadDB> read_db,
+                         std::shared_ptr<const PackedReference> reference,
+                         const std::string& sequence_bam,
+                         const std::string& event_bam,
+                         bool calibrate_reads) :
+                            m_reference(reference),
+                            m_sequence_bam(sequence_bam),
+                            m_event_bam(event_bam),
+                            m_calibrate_on_load(calibrate_reads),
+                            m_read_db(read_db)
+{
     _clear_region();
 }
 
@@ -163,7 +205,7 @@ std::vector<HMMInputData> AlignmentDB::get_event_subsequences(const std::string&
     assert(m_region_end >= stop_position);
 
     std::vector<HMMInputData> out;
-    for(size_t i = 0; i < m_event_records.size(); ++i) {
+    for(size_t i : _get_event_records_containing(start_position, stop_position)) {
         const EventAlignmentRecord& record = m_event_records[i];
         if(record.aligned_events.empty()) {
             continue;
@@ -213,7 +255,7 @@ std::vector<HMMInputData> AlignmentDB::get_events_aligned_to(const std::string&
     assert(m_region_end >= position);
 
     std::vector<HMMInputData> out;
-    for(size_t i = 0; i < m_event_records.size(); ++i) {
+    for(size_t i : _get_event_records_containing(position, position)) {
         const EventAlignmentRecord& record = m_event_records[i];
         if(record.aligned_events.empty()) {
             continue;
@@ -356,17 +398,15 @@ void AlignmentDB::load_region(const std::string& contig,
                               int start_position,
                               int stop_position)
 {
-    // load reference fai file
-    faidx_t *fai = fai_load(m_reference_file.c_str());
-
     // Adjust end position to make sure we don't go out-of-range
     m_region_contig = contig;
     m_region_start = start_position;
-    int contig_length = faidx_seq_len(fai, contig.c_str());
-    if(contig_length == -1) {
-        fprintf(stderr, "Error: could not retrieve length of contig %s from the faidx.\n", contig.c_str());
+    int contig_id = m_reference->get_contig_id(contig);
+    if(contig_id == -1) {
+        fprintf(stderr, "Error: could not retrieve length of contig %s from the reference.\n", contig.c_str());
         exit(EXIT_FAILURE);
     }
+    int contig_length = m_reference->get_contig_length(contig_id);
 
     m_region_end = std::min(stop_position, contig_length);
     
@@ -375,10 +415,7 @@ void AlignmentDB::load_region(const std::string& contig,
     assert(m_region_end >= 0);
 
     // load the reference sequence for this region
-    // its ok to use the unthreadsafe fetch_seq here since we have our own fai
-    int fetched_len = 0;
-    char* ref_segment = faidx_fetch_seq(fai, m_region_contig.c_str(), m_region_start, m_region_end, &fetched_len);
-    m_region_ref_sequence = ref_segment;
+    m_reference->copy_substring(contig_id, m_region_start, m_region_end, m_region_ref_sequence);
     
     // load base-space alignments
     m_sequence_records = _load_sequence_by_region(m_sequence_bam);
@@ -390,6 +427,8 @@ void AlignmentDB::load_region(const std::string& contig,
         m_event_records = _load_events_by_region_from_bam(m_event_bam);
     }
 
+    _build_event_record_index();
+
     // If an alternative basecall set was provided, load it
     // intentially overwriting the current records
     if(!m_alternative_basecalls_bam.empty()) {
@@ -397,24 +436,15 @@ void AlignmentDB::load_region(const std::string& contig,
     }
 
     //_debug_print_alignments();
-
-    free(ref_segment);
-    fai_destroy(fai);
 }
 
 void AlignmentDB::_clear_region()
 {
-    // Delete the SquiggleReads
-    for(SquiggleReadMap::iterator iter = m_squiggle_read_map.begin();
-        iter != m_squiggle_read_map.end(); ++iter) 
-    {
-        delete iter->second;
-        iter->second = NULL;
-    }
-
+    // Release the SquiggleReads, they are deleted once no cache or region uses them
     m_squiggle_read_map.clear();
     m_sequence_records.clear();
     m_event_records.clear();
+    m_event_record_bins.clear();
 
     m_region_contig = "";
     m_region_start = -1;
@@ -431,6 +461,7 @@ BamHandles _initialize_bam_itr(const std::string& bam_filename,
     // load bam file
     handles.bam_fh = sam_open(bam_filename.c_str(), "r");
     assert(handles.bam_fh != NULL);
+    attach_hts_thread_pool(handles.bam_fh);
 
     // load bam index file
     hts_idx_t* bam_idx = sam_index_load(handles.bam_fh, bam_filename.c_str());
@@ -503,7 +534,7 @@ std::vector<EventAlignmentRecord> AlignmentDB::_load_events_by_region_from_bam(c
 
         std::string read_name = full_name.substr(0, suffix_pos);
         _load_squiggle_read(read_name);
-        event_record.sr = m_squiggle_read_map[read_name];
+        event_record.sr = m_squiggle_read_map[read_name].get();
 
         // extract the event stride tag which tells us whether the
         // event indices are increasing or decreasing
@@ -523,7 +554,7 @@ std::vector<EventAlignmentRecord> AlignmentDB::_load_events_by_region_from_bam(c
             fprintf(stderr, "Rescale for %s strand: %d rc: %d\n", event_record.sr->read_name.c_str(), event_record.strand, event_record.rc);
             event_record.sr->print_scaling_parameters(stderr, event_record.strand);
             fprintf(stderr, "recal events: %zu\n", event_alignment.size());
-            recalibrate_model(*event_record.sr, event_record.strand, event_alignment, &gDNAAlphabet, true, false);
+            recalibrate_model(*event_record.sr, event_record.strand, event_alignment, true, false);
             event_record.sr->print_scaling_parameters(stderr, event_record.strand);
         }
 
@@ -563,7 +594,7 @@ std::vector<EventAlignmentRecord> AlignmentDB::_load_events_by_region_from_read(
             }
     
             // skip reads that do not have events here
-            SquiggleRead* sr = m_squiggle_read_map[seq_record.read_name];
+            SquiggleRead* sr = m_squiggle_read_map[seq_record.read_name].get();
             if(!sr->has_events_for_strand(si)) {
                 continue;
             }
@@ -575,6 +606,43 @@ std::vector<EventAlignmentRecord> AlignmentDB::_load_events_by_region_from_read(
     return records;
 }
 
+void AlignmentDB::_build_event_record_index()
+{
+    size_t num_bins = (m_region_end - m_region_start) / EVENT_RECORD_BIN_SIZE + 1;
+    m_event_record_bins.assign(num_bins, std::vector<uint32_t>());
+
+    for(size_t i = 0; i < m_event_records.size(); ++i) {
+        const auto& aligned_events = m_event_records[i].aligned_events;
+        if(aligned_events.empty()) {
+            continue;
+        }
+
+        // aligned_events is sorted by reference position, clamp its span to the region
+        int first = std::max(aligned_events.front().ref_pos, m_region_start);
+        int last = std::min(aligned_events.back().ref_pos, m_region_end);
+        for(int bin = (first - m_region_start) / EVENT_RECORD_BIN_SIZE;
+                bin <= (last - m_region_start) / EVENT_RECORD_BIN_SIZE; ++bin) {
+            m_event_record_bins[bin].push_back(i);
+        }
+    }
+}
+
+std::vector<size_t> AlignmentDB::_get_event_records_containing(int start_position, int stop_position) const
+{
+    // A record can only be bounded by _find_by_ref_bounds if its first aligned
+    // position is at most start_position and its last is at least stop_position.
+    // Every such record is in the bin of start_position.
+    std::vector<size_t> out;
+    const auto& bin = m_event_record_bins[(start_position - m_region_start) / EVENT_RECORD_BIN_SIZE];
+    for(uint32_t i : bin) {
+        const auto& aligned_events = m_event_records[i].aligned_events;
+        if(aligned_events.front().ref_pos <= start_position && aligned_events.back().ref_pos >= stop_position) {
+            out.push_back(i);
+        }
+    }
+    return out;
+}
+
 void AlignmentDB::_debug_print_alignments()
 {
     // Build a map from a squiggle read to the middle base of the reference region it aligned to
@@ -612,8 +680,12 @@ void AlignmentDB::_load_squiggle_read(const std::string& read_name)
 {
     // Do we need to load this fast5 file?
     if(m_squiggle_read_map.find(read_name) == m_squiggle_read_map.end()) {
-        SquiggleRead* sr = new SquiggleRead(read_name, m_read_db);
-        m_squiggle_read_map[read_name] = sr;
+        auto load = [&]() { return new SquiggleRead(read_name, *m_read_db); };
+        if(m_squiggle_read_cache != NULL && !m_calibrate_on_load) {
+            m_squiggle_read_map[read_name] = m_squiggle_read_cache->get(read_name + "\t" + m_model_type_string, load);
+        } else {
+            m_squiggle_read_map[read_name].reset(load());
+        }
     }
 }
 
@@ -638,12 +710,13 @@ std::vector<EventAlignment> AlignmentDB::_build_event_alignment(const EventAlign
         assert(kmer.size() == k);
 
         // ref data
-        ea.ref_name = "read"; // not needed
+        ea.ref_contig_id = -1; // not needed
         ea.read_idx = -1; // not needed
-        ea.ref_kmer = kmer;
+        ea.ref_kmer_rank = alphabet->kmer_rank(kmer.c_str(), k);
+        ea.k = k;
         ea.strand_idx = event_record.strand;
         ea.rc = event_record.rc;
-        ea.model_kmer = kmer;
+        ea.model_kmer_rank = ea.rc ? alphabet->kmer_rank(alphabet->reverse_complement(kmer).c_str(), k) : ea.ref_kmer_rank;
         ea.hmm_state = 'M';
         alignment.push_back(ea);
     }
@@ -12,11 +12,17 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include "nanopolish_anchor.h"
+#include "nanopolish_squiggle_read_cache.h"
+#include "nanopolish_packed_reference.h"
 #include "nanopolish_variant.h"
 
 #define MAX_EVENT_TO_BP_RATIO 20
 
+// the event records are indexed by the reference bins they overlap
+#define EVENT_RECORD_BIN_SIZE 128
+
 // structs
 struct SequenceAlignmentRecord
 {
@@ -35,6 +41,11 @@ struct EventAlignmentRecord
                          const int strand_idx,
                          const SequenceAlignmentRecord& seq_record);
 
+    // use the first event aligned to each reference position by align_read_to_ref
+    EventAlignmentRecord(SquiggleRead* sr,
+                         const int strand_idx,
+                         const std::vector<EventAlignment>& alignment);
+
     SquiggleRead* sr;
     uint8_t rc; // with respect to reference genome
     uint8_t strand; // 0 = template, 1 = complement
@@ -43,7 +54,7 @@ struct EventAlignmentRecord
 };
 
 // typedefs
-typedef std::map<std::string, SquiggleRead*> SquiggleReadMap;
+typedef std::map<std::string, std::shared_ptr<SquiggleRead>> SquiggleReadMap;
 
 class AlignmentDB
 {
@@ -54,6 +65,13 @@ class AlignmentDB
                     const std::string& event_bam,
                     const bool calibrate_reads = false);
 
+        // Use an already loaded read database and reference, which may be shared between many AlignmentDBs
+        AlignmentDB(std::shared_ptr<const ReadDB> read_db,
+                    std::shared_ptr<const PackedReference> reference,
+                    const std::string& sequence_bam,
+                    const std::string& event_bam,
+                    const bool calibrate_reads = false);
+
         ~AlignmentDB();
 
         void load_region(const std::string& contig,
@@ -99,6 +117,11 @@ class AlignmentDB
         int get_region_end() const { return m_region_end; }
         
         void set_alternative_model_type(const std::string model_type_string) { m_model_type_string = model_type_string; }
+
+        // Load SquiggleReads through a cache that is shared with other AlignmentDBs,
+        // so reads are not reloaded for overlapping regions. The cache is not used
+        // when reads are calibrated on load as this modifies the read.
+        void set_squiggle_read_cache(SquiggleReadCache* cache) { m_squiggle_read_cache = cache; }
         
         // Search the vector of AlignedPairs using lower_bound/upper_bound
         // and the input reference coordinates. If the search succeeds,
@@ -124,6 +147,14 @@ class AlignmentDB
 
         void _clear_region();
 
+        // Bin the event records by the reference positions they span so region
+        // queries only need to look at records that overlap the query
+        void _build_event_record_index();
+
+        // Return the indices, in increasing order, of the event records that may
+        // contain the reference interval [start_position, stop_position]
+        std::vector<size_t> _get_event_records_containing(int start_position, int stop_position) const;
+
         void _debug_print_alignments();
 
         std::vector<EventAlignment> _build_event_alignment(const EventAlignmentRecord& event_record) const;
@@ -132,7 +163,7 @@ class AlignmentDB
         //
         // data
         //
-        std::string m_reference_file;
+        std::shared_ptr<const PackedReference> m_reference;
         std::string m_sequence_bam;
         std::string m_event_bam;
         std::string m_alternative_basecalls_bam;
@@ -147,11 +178,13 @@ class AlignmentDB
         int m_region_end;
 
         // cached alignments for a region
-        ReadDB m_read_db;
+        std::shared_ptr<const ReadDB> m_read_db;
         std::vector<SequenceAlignmentRecord> m_sequence_records;
         std::vector<EventAlignmentRecord> m_event_records;
+        std::vector<std::vector<uint32_t>> m_event_record_bins;
         SquiggleReadMap m_squiggle_read_map;
         std::string m_model_type_string;
+        SquiggleReadCache* m_squiggle_read_cache = NULL;
 };
 
 #endif
@@ -10,6 +10,7 @@
 #include <string>
 #include <stdio.h>
 #include <assert.h>
+#include <algorithm>
 #include "htslib/faidx.h"
 #include "nanopolish_common.h"
 #include "nanopolish_anchor.h"
@@ -80,6 +81,39 @@ std::vector<AlignedPair> get_aligned_pairs(const bam1_t* record, int read_stride
     return out;
 }
 
+bool get_read_range_for_ref_region(const bam1_t* record,
+                                   int ref_start,
+                                   int ref_end,
+                                   int& read_start,
+                                   int& read_end)
+{
+    std::vector<AlignedPair> aligned_pairs = get_aligned_pairs(record);
+
+    AlignedPairRefLBComp lb_comp;
+    AlignedPairConstIter start_iter = std::lower_bound(aligned_pairs.begin(), aligned_pairs.end(),
+                                                       ref_start, lb_comp);
+
+    AlignedPairRefUBComp ub_comp;
+    AlignedPairConstIter stop_iter = std::upper_bound(aligned_pairs.begin(), aligned_pairs.end(),
+                                                      ref_end, ub_comp);
+
+    if(start_iter == aligned_pairs.end() || stop_iter == aligned_pairs.begin() || start_iter >= stop_iter) {
+        return false;
+    }
+
+    read_start = start_iter->read_pos;
+    read_end = (stop_iter - 1)->read_pos;
+
+    // flip the coordinates onto the strand of the read
+    if(bam_is_rev(record)) {
+        int query_length = bam_cigar2qlen(record->core.n_cigar, bam_get_cigar(record));
+        int tmp = read_start;
+        read_start = query_length - 1 - read_end;
+        read_end = query_length - 1 - tmp;
+    }
+    return true;
+}
+
 std::vector<int> uniformally_sample_read_positions(const std::vector<AlignedPair>& aligned_pairs,
                                                    int ref_start,
                                                    int ref_end,
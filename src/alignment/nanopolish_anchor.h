@@ -85,4 +85,13 @@ struct HMMRealignmentInput
 // read_stride should be -1
 std::vector<AlignedPair> get_aligned_pairs(const bam1_t* record, int read_stride = 1);
 
+// Find the range of read bases that are aligned to the reference interval [ref_start, ref_end].
+// The output coordinates are with respect to the original strand of the read (as in the FASTQ),
+// not the strand matching the reference. Returns false if no read base aligns within the interval.
+bool get_read_range_for_ref_region(const bam1_t* record,
+                                   int ref_start,
+                                   int ref_end,
+                                   int& read_start,
+                                   int& read_end);
+
 #endif
@@ -20,8 +20,12 @@
 #include <omp.h>
 #include <getopt.h>
 #include <iterator>
+#include <limits>
 #include "htslib/faidx.h"
 #include "nanopolish_eventalign.h"
+#include "nanopolish_eventalign_binary.h"
+#include "nanopolish_eventalign_aggregate.h"
+#include "nanopolish_signal_dump.h"
 #include "nanopolish_iupac.h"
 #include "nanopolish_poremodel.h"
 #include "nanopolish_transition_parameters.h"
@@ -30,6 +34,10 @@
 #include "nanopolish_anchor.h"
 #include "nanopolish_read_db.h"
 #include "nanopolish_hmm_input_sequence.h"
+#include "nanopolish_bam_processor.h"
+#include "nanopolish_bam_utils.h"
+#include "nanopolish_output_writer.h"
+#include "nanopolish_fast_format.h"
 #include "nanopolish_pore_model_set.h"
 #include "H5pubconf.h"
 #include "profiler.h"
@@ -53,18 +61,29 @@ static const char *EVENTALIGN_USAGE_MESSAGE =
 "  -v, --verbose                        display verbose output\n"
 "      --version                        display version\n"
 "      --help                           display this help and exit\n"
-"      --sam                            write output in SAM format\n"
+"      --sam                            write the alignments to stdout in BAM format (not SAM)\n"
+"      --format=STR                     write the event table as STR, either tsv or binary (default: tsv)\n"
 "  -w, --window=STR                     compute the consensus for window STR (format: ctg:start_id-end_id)\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
+"                                       use - to stream sam/bam from stdin (unsorted input is fine without --window)\n"
 "  -g, --genome=FILE                    the genome we are computing a consensus for is in FILE\n"
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
 "      --scale-events                   scale events to the model, rather than vice-versa\n"
 "      --progress                       print out a progress message\n"
 "  -n, --print-read-names               print read names instead of indexes\n"
 "      --summary=FILE                   summarize the alignment of each read/strand in FILE\n"
+"      --compress                       write the tsv output and the summary as BGZF. Use nanopolish sort-tsv\n"
+"                                       to sort and tabix index the tsv output\n"
+"      --aggregate=STR                  write summary statistics of the events for each reference position and\n"
+"                                       model k-mer (STR=position) or for each model k-mer (STR=kmer) instead of\n"
+"                                       the events. Outlier events are not included.\n"
+"      --aggregate-samples=NUM          with --aggregate, also write a random sample of NUM event levels for each row\n"
 "      --stdv                           enable stdv modelling\n"
 "      --samples                        write the raw samples for the event to the tsv output\n"
+"      --signal-index                   write the range of raw sample indices of the event to the tsv output\n"
+"      --signal-dump=FILE               write the scaled signal of each aligned read strand to the binary FILE,\n"
+"                                       which can be memory mapped and indexed with --signal-index\n"
 "      --models-fofn=FILE               read alternative k-mer models from FILE\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
@@ -77,19 +96,24 @@ namespace opt
     static std::string region;
     static std::string summary_file;
     static std::string models_fofn;
+    static std::string output_format = "tsv";
+    static std::string aggregate;
+    static int aggregate_samples = 0;
     static int output_sam = 0;
+    static int compress = 0;
     static int progress = 0;
     static int num_threads = 1;
     static int scale_events = 0;
-    static int batch_size = 128;
     static bool print_read_names;
     static bool full_output;
     static bool write_samples = false;
+    static bool write_signal_index = false;
+    static std::string signal_dump_file;
 }
 
 static const char* shortopts = "r:b:g:t:w:vn";
 
-enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS, OPT_SAM, OPT_SUMMARY, OPT_SCALE_EVENTS, OPT_STDV, OPT_MODELS_FOFN, OPT_SAMPLES };
+enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS, OPT_SAM, OPT_SUMMARY, OPT_SCALE_EVENTS, OPT_STDV, OPT_MODELS_FOFN, OPT_SAMPLES, OPT_FORMAT, OPT_COMPRESS, OPT_AGGREGATE, OPT_AGGREGATE_SAMPLES, OPT_SIGNAL_INDEX, OPT_SIGNAL_DUMP };
 
 static const struct option longopts[] = {
     { "verbose",          no_argument,       NULL, 'v' },
@@ -103,22 +127,34 @@ static const struct option longopts[] = {
     { "print-read-names", no_argument,       NULL, 'n' },
     { "stdv",             no_argument,       NULL, OPT_STDV },
     { "samples",          no_argument,       NULL, OPT_SAMPLES },
+    { "signal-index",     no_argument,       NULL, OPT_SIGNAL_INDEX },
+    { "signal-dump",      required_argument, NULL, OPT_SIGNAL_DUMP },
     { "scale-events",     no_argument,       NULL, OPT_SCALE_EVENTS },
     { "sam",              no_argument,       NULL, OPT_SAM },
+    { "format",           required_argument, NULL, OPT_FORMAT },
+    { "compress",         no_argument,       NULL, OPT_COMPRESS },
+    { "aggregate",        required_argument, NULL, OPT_AGGREGATE },
+    { "aggregate-samples", required_argument, NULL, OPT_AGGREGATE_SAMPLES },
     { "progress",         no_argument,       NULL, OPT_PROGRESS },
     { "help",             no_argument,       NULL, OPT_HELP },
     { "version",          no_argument,       NULL, OPT_VERSION },
     { NULL, 0, NULL, 0 }
 };
 
-// convenience wrapper for the two output modes
+// convenience wrapper for the output modes
 struct EventalignWriter
 {
-    FILE* tsv_fp;
+    TextOutputFile* tsv_out;
     htsFile* sam_fp;
-    FILE* summary_fp;
+    EventalignBinaryWriter* binary_writer;
+    EventalignAggregator* aggregator;
+    SignalDumpWriter* signal_dump;
+    TextOutputFile* summary_out;
 };
 
+// the text streams of the output writer
+enum { EVENTALIGN_TSV_STREAM = 0, EVENTALIGN_SUMMARY_STREAM };
+
 // Summarize the event alignment for a read strand
 struct EventalignSummary
 {
@@ -187,18 +223,16 @@ int get_end_pair(const std::vector<AlignedPair>& aligned_pairs, int ref_pos_max,
 }
 
 // get the specified reference region, threadsafe
-std::string get_reference_region_ts(const faidx_t* fai, const char* ref_name, int start, int end, int* fetched_len)
+std::string get_reference_region_ts(const PackedReference* reference, const char* ref_name, int start, int end, int* fetched_len)
 {
 
-    // faidx_fetch_seq is not threadsafe
-    char* cref_seq;
-    #pragma omp critical
-    cref_seq = faidx_fetch_seq(fai, ref_name, start, end, fetched_len);
-    
-    assert(cref_seq != NULL);
+    // the packed reference is read only so threads do not wait on each other
+    int contig_id = reference->get_contig_id(ref_name);
+    assert(contig_id >= 0);
 
-    std::string out(cref_seq);
-    free(cref_seq);
+    std::string out;
+    reference->copy_substring(contig_id, start, end, out);
+    *fetched_len = out.size();
     return out;
 }
 
@@ -206,17 +240,21 @@ std::string get_reference_region_ts(const faidx_t* fai, const char* ref_name, in
 //
 //
 
-void emit_tsv_header(FILE* fp)
+void emit_tsv_header(std::string& out, bool print_read_names, bool write_samples, bool write_signal_index)
 {
-    fprintf(fp, "%s\t%s\t%s\t%s\t%s\t", "contig", "position", "reference_kmer",
-            (not opt::print_read_names? "read_index" : "read_name"), "strand");
-    fprintf(fp, "%s\t%s\t%s\t%s\t", "event_index", "event_level_mean", "event_stdv", "event_length");
-    fprintf(fp, "%s\t%s\t%s\t%s", "model_kmer", "model_mean", "model_stdv", "standardized_level");
+    out.append("contig\tposition\treference_kmer\t");
+    out.append(not print_read_names ? "read_index" : "read_name");
+    out.append("\tstrand\tevent_index\tevent_level_mean\tevent_stdv\tevent_length\t");
+    out.append("model_kmer\tmodel_mean\tmodel_stdv\tstandardized_level");
 
-    if(opt::write_samples) {
-        fprintf(fp, "\t%s", "samples");
+    if(write_samples) {
+        out.append("\tsamples");
+    }
+
+    if(write_signal_index) {
+        out.append("\tstart_idx\tend_idx");
     }
-    fprintf(fp, "\n");
+    out.append("\n");
 }
 
 void emit_sam_header(samFile* fp, const bam_hdr_t* hdr)
@@ -298,10 +336,9 @@ std::vector<uint32_t> event_alignment_to_cigar(const std::vector<EventAlignment>
     return out;
 }
 
-void emit_event_alignment_sam(htsFile* fp,
+void emit_event_alignment_sam(OutputBuffer& buffer,
                               const SquiggleRead& sr,
-                              const bam_hdr_t* base_hdr,
-                              const bam1_t* base_record, 
+                              const bam1_t* base_record,
                               const std::vector<EventAlignment>& alignments)
 {
     if(alignments.empty())
@@ -360,88 +397,292 @@ void emit_event_alignment_sam(htsFile* fp,
     int stride = alignments.front().event_idx < alignments.back().event_idx ? 1 : -1;
     bam_aux_append(event_record, "ES", 'i', 4, reinterpret_cast<uint8_t*>(&stride));
 
-    sam_write1(fp, base_hdr, event_record);
-    bam_destroy1(event_record); // automatically frees malloc'd segment
+    // the buffer frees the record once it is written
+    buffer.add_record(event_record);
+}
+
+// Calculate the event and model levels that are written for an aligned event
+EventalignLevels get_event_alignment_levels(const SquiggleRead& sr,
+                                            const EventAlignment& ea)
+{
+    EventalignLevels levels;
+    levels.event_mean = sr.get_drift_corrected_level(ea.event_idx, ea.strand_idx);
+    levels.event_stdv = sr.get_stdv(ea.event_idx, ea.strand_idx);
+    levels.event_length = sr.get_duration(ea.event_idx, ea.strand_idx);
+    levels.model_mean = 0.0;
+    levels.model_stdv = 0.0;
+
+    uint32_t rank = ea.model_kmer_rank;
+    if(opt::scale_events) {
+
+        // scale reads to the model
+        levels.event_mean = (levels.event_mean - sr.pore_model[ea.strand_idx].shift) / sr.pore_model[ea.strand_idx].scale;
+
+        // unscaled model parameters
+        if(ea.hmm_state != 'B') {
+            PoreModelStateParams model = sr.pore_model[ea.strand_idx].get_parameters(rank);
+            levels.model_mean = model.level_mean;
+            levels.model_stdv = model.level_stdv;
+        }
+    } else {
+
+        // scale model to the reads
+        if(ea.hmm_state != 'B') {
+            GaussianParameters model = sr.pore_model[ea.strand_idx].get_scaled_parameters(rank);
+            levels.model_mean = model.mean;
+            levels.model_stdv = model.stdv;
+        }
+    }
+
+    levels.standardized_level = (levels.event_mean - levels.model_mean) / (sqrt(sr.pore_model[ea.strand_idx].var) * levels.model_stdv);
+    return levels;
+}
+
+void emit_event_tsv_row(std::string& out,
+                        const char* contig,
+                        int position,
+                        const char* ref_kmer,
+                        const char* read_label,
+                        int strand_idx,
+                        int event_idx,
+                        const EventalignLevels& levels,
+                        const char* model_kmer,
+                        const float* samples,
+                        size_t num_samples,
+                        int64_t start_idx,
+                        int64_t end_idx)
+{
+    // basic information
+    out.append(contig);
+    out.push_back('\t');
+    append_int(out, position);
+    out.push_back('\t');
+    out.append(ref_kmer);
+    out.push_back('\t');
+    out.append(read_label);
+    out.push_back('\t');
+    out.push_back("tc"[strand_idx]);
+    out.push_back('\t');
+
+    // event information
+    append_int(out, event_idx);
+    out.push_back('\t');
+    append_fixed(out, levels.event_mean, 2);
+    out.push_back('\t');
+    append_fixed(out, levels.event_stdv, 3);
+    out.push_back('\t');
+    append_fixed(out, levels.event_length, 5);
+    out.push_back('\t');
+    out.append(model_kmer);
+    out.push_back('\t');
+    append_fixed(out, levels.model_mean, 2);
+    out.push_back('\t');
+    append_fixed(out, levels.model_stdv, 2);
+    out.push_back('\t');
+    append_fixed(out, levels.standardized_level, 2);
+
+    // comma-separated samples, formatted like an std::ostream would
+    if(samples != NULL) {
+        out.push_back('\t');
+        for(size_t i = 0; i < num_samples; ++i) {
+            if(i > 0) {
+                out.push_back(',');
+            }
+            append_general(out, samples[i]);
+        }
+    }
+
+    if(start_idx >= 0) {
+        out.push_back('\t');
+        append_int(out, start_idx);
+        out.push_back('\t');
+        append_int(out, end_idx);
+    }
+    out.push_back('\n');
 }
 
-void emit_event_alignment_tsv(FILE* fp,
+void emit_event_alignment_tsv(std::string& out,
                               const SquiggleRead& sr,
                               uint32_t strand_idx,
                               const EventAlignmentParameters& params,
                               const std::vector<EventAlignment>& alignments)
+{
+    std::string read_label = opt::print_read_names ? sr.read_name : std::to_string(params.read_idx);
+
+    // reused for every event
+    std::vector<float> samples;
+    std::string ref_kmer;
+    std::string model_kmer;
+
+    for(size_t i = 0; i < alignments.size(); ++i) {
+
+        const EventAlignment& ea = alignments[i];
+        EventalignLevels levels = get_event_alignment_levels(sr, ea);
+
+        // the k-mers are only formatted here, when the row is written
+        ref_kmer.resize(ea.k);
+        model_kmer.resize(ea.k);
+        get_event_alignment_kmer(ea, params.alphabet, false, &ref_kmer[0]);
+        get_event_alignment_kmer(ea, params.alphabet, true, &model_kmer[0]);
+
+        size_t start_idx = 0;
+        size_t end_idx = 0;
+        if(opt::write_samples || opt::write_signal_index) {
+            sr.get_sample_range_for_event(ea.strand_idx, ea.event_idx, start_idx, end_idx);
+        }
+
+        if(opt::write_samples) {
+            samples.clear();
+            sr.append_scaled_samples(ea.strand_idx, start_idx, end_idx, samples);
+        }
+
+        emit_event_tsv_row(out,
+                           params.hdr->target_name[ea.ref_contig_id],
+                           ea.ref_position,
+                           ref_kmer.c_str(),
+                           read_label.c_str(),
+                           ea.strand_idx,
+                           ea.event_idx,
+                           levels,
+                           model_kmer.c_str(),
+                           opt::write_samples ? samples.data() : NULL,
+                           samples.size(),
+                           opt::write_signal_index ? (int64_t)start_idx : -1,
+                           (int64_t)end_idx);
+    }
+}
+
+// The rows of a read strand for the binary output. The k-mers and read are
+// encoded on the writer thread, which owns the dictionaries of the binary writer.
+struct PendingBinaryRows
+{
+    size_t read_idx;
+    std::string read_name;
+    std::vector<EventalignBinaryRecord> records;
+
+    // the reference and model k-mer of each record
+    std::vector<std::string> kmers;
+    std::vector<std::vector<float>> samples;
+};
+
+void emit_event_alignment_binary(OutputBuffer& buffer,
+                                 EventalignBinaryWriter* writer,
+                                 const SquiggleRead& sr,
+                                 uint32_t strand_idx,
+                                 const EventAlignmentParameters& params,
+                                 const std::vector<EventAlignment>& alignments)
 {
     uint32_t k = sr.pore_model[strand_idx].k;
+    auto pending = std::make_shared<PendingBinaryRows>();
+    pending->read_idx = params.read_idx;
+    pending->read_name = sr.read_name;
+    pending->records.resize(alignments.size());
+    pending->kmers.reserve(2 * alignments.size());
+    if(opt::write_samples) {
+        pending->samples.resize(alignments.size());
+    }
+
+    size_t bytes = 0;
     for(size_t i = 0; i < alignments.size(); ++i) {
 
         const EventAlignment& ea = alignments[i];
+        EventalignLevels levels = get_event_alignment_levels(sr, ea);
+
+        EventalignBinaryRecord& record = pending->records[i];
+        record.contig_id = ea.ref_contig_id;
+        record.position = ea.ref_position;
+        record.k = k;
+        record.strand_idx = ea.strand_idx;
+        record.event_idx = ea.event_idx;
+        record.event_mean = levels.event_mean;
+        record.event_stdv = levels.event_stdv;
+        record.event_length = levels.event_length;
+        record.model_mean = levels.model_mean;
+        record.model_stdv = levels.model_stdv;
+        record.standardized_level = levels.standardized_level;
+
+        // events that were not assigned to a k-mer have no model k-mer
+        pending->kmers.push_back(get_event_alignment_kmer(ea, params.alphabet, false));
+        pending->kmers.push_back(ea.model_kmer_rank != EVENT_ALIGNMENT_NO_KMER ? get_event_alignment_kmer(ea, params.alphabet, true) : "");
 
-        // basic information
-        if (not opt::print_read_names)
-        {
-            fprintf(fp, "%s\t%d\t%s\t%zu\t%c\t",
-                    ea.ref_name.c_str(),
-                    ea.ref_position,
-                    ea.ref_kmer.c_str(),
-                    ea.read_idx,
-                    "tc"[ea.strand_idx]);
+        if(opt::write_samples) {
+            pending->samples[i] = sr.get_scaled_samples_for_event(ea.strand_idx, ea.event_idx);
+            bytes += pending->samples[i].size() * sizeof(float);
         }
-        else
-        {
-            fprintf(fp, "%s\t%d\t%s\t%s\t%c\t",
-                    ea.ref_name.c_str(),
-                    ea.ref_position,
-                    ea.ref_kmer.c_str(),
-                    sr.read_name.c_str(),
-                    "tc"[ea.strand_idx]);
+        bytes += sizeof(EventalignBinaryRecord) + 2 * k;
+    }
+
+    buffer.add_deferred([writer, pending]() {
+        uint32_t read_id = writer->add_read(pending->read_idx, pending->read_name);
+        for(size_t i = 0; i < pending->records.size(); ++i) {
+            EventalignBinaryRecord& record = pending->records[i];
+            record.read_id = read_id;
+            record.ref_kmer = writer->encode_kmer(pending->kmers[2 * i]);
+            const std::string& model_kmer = pending->kmers[2 * i + 1];
+            record.model_kmer = !model_kmer.empty() ? writer->encode_kmer(model_kmer) : EVENTALIGN_KMER_NONE;
+            writer->append(record, opt::write_samples ? &pending->samples[i] : NULL);
         }
+    }, bytes);
+}
 
-        // event information
-        float event_mean = sr.get_drift_corrected_level(ea.event_idx, ea.strand_idx);
-        float event_stdv = sr.get_stdv(ea.event_idx, ea.strand_idx);
-        float event_duration = sr.get_duration(ea.event_idx, ea.strand_idx);
-        uint32_t rank = params.alphabet->kmer_rank(ea.model_kmer.c_str(), k);
-        float model_mean = 0.0;
-        float model_stdv = 0.0;
-
-        if(opt::scale_events) {
-
-            // scale reads to the model
-            event_mean = (event_mean - sr.pore_model[ea.strand_idx].shift) / sr.pore_model[ea.strand_idx].scale;
-
-            // unscaled model parameters
-            if(ea.hmm_state != 'B') {
-                PoreModelStateParams model = sr.pore_model[ea.strand_idx].get_parameters(rank);
-                model_mean = model.level_mean;
-                model_stdv = model.level_stdv;
-            }
-        } else {
+// Write the scaled samples spanned by the aligned events of a strand to the signal file
+void emit_aligned_signal(OutputBuffer& buffer,
+                         SignalDumpWriter* writer,
+                         const SquiggleRead& sr,
+                         uint32_t strand_idx,
+                         const EventAlignmentParameters& params,
+                         const std::vector<EventAlignment>& alignments)
+{
+    if(alignments.empty()) {
+        return;
+    }
 
-            // scale model to the reads
-            if(ea.hmm_state != 'B') {
-                GaussianParameters model = sr.pore_model[ea.strand_idx].get_scaled_parameters(rank);
-                model_mean = model.mean;
-                model_stdv = model.stdv;
-            }
-        }
+    size_t range_start = std::numeric_limits<size_t>::max();
+    size_t range_end = 0;
+    for(const EventAlignment& ea : alignments) {
+        size_t start_idx;
+        size_t end_idx;
+        sr.get_sample_range_for_event(ea.strand_idx, ea.event_idx, start_idx, end_idx);
+        range_start = std::min(range_start, start_idx);
+        range_end = std::max(range_end, end_idx);
+    }
 
-        float standard_level = (event_mean - model_mean) / (sqrt(sr.pore_model[ea.strand_idx].var) * model_stdv);
-        fprintf(fp, "%d\t%.2lf\t%.3lf\t%.5lf\t", ea.event_idx, event_mean, event_stdv, event_duration);
-        fprintf(fp, "%s\t%.2lf\t%.2lf\t%.2lf", ea.model_kmer.c_str(),
-                                               model_mean,
-                                               model_stdv,
-                                               standard_level);
+    auto samples = std::make_shared<std::vector<float>>();
+    sr.append_scaled_samples(strand_idx, range_start, range_end, *samples);
 
-        if(opt::write_samples) {
-            std::vector<float> samples = sr.get_scaled_samples_for_event(ea.strand_idx, ea.event_idx);
-            std::stringstream sample_ss;
-            std::copy(samples.begin(), samples.end(), std::ostream_iterator<float>(sample_ss, ","));
-
-            // remove training comma
-            std::string sample_str = sample_ss.str();
-            sample_str.resize(sample_str.size() - 1);
-            fprintf(fp, "\t%s", sample_str.c_str());
+    size_t read_idx = params.read_idx;
+    std::string read_name = sr.read_name;
+    buffer.add_deferred([writer, samples, read_idx, read_name, strand_idx, range_start]() {
+        writer->add(read_idx, read_name, strand_idx, range_start, *samples);
+    }, samples->size() * sizeof(float));
+}
+
+// add the events to the summary statistics of the calling thread
+void aggregate_event_alignment(EventalignAggregator* aggregator,
+                               const SquiggleRead& sr,
+                               uint32_t strand_idx,
+                               const EventAlignmentParameters& params,
+                               const std::vector<EventAlignment>& alignments)
+{
+    int thread_idx = omp_get_thread_num();
+    for(size_t i = 0; i < alignments.size(); ++i) {
+
+        const EventAlignment& ea = alignments[i];
+        if(ea.hmm_state == 'B') {
+            continue;
         }
-        fprintf(fp, "\n");
+
+        EventalignLevels levels = get_event_alignment_levels(sr, ea);
+        aggregator->add(thread_idx,
+                        ea.ref_contig_id,
+                        ea.ref_position,
+                        ea.k,
+                        ea.ref_kmer_rank,
+                        ea.model_kmer_rank,
+                        params.read_idx,
+                        ea.strand_idx,
+                        levels.event_mean,
+                        levels.event_length);
     }
 }
 
@@ -452,8 +693,6 @@ EventalignSummary summarize_alignment(const SquiggleRead& sr,
 {
     EventalignSummary summary;
 
-    uint32_t k = sr.pore_model[strand_idx].k;
-
     size_t prev_ref_pos = std::string::npos;
 
     // the number of unique reference positions seen in the alignment
@@ -480,8 +719,7 @@ EventalignSummary summarize_alignment(const SquiggleRead& sr,
 
         if(ea.hmm_state == 'M') {
             
-            uint32_t rank = params.alphabet->kmer_rank(ea.model_kmer.c_str(), k);
-            GaussianParameters model = sr.pore_model[ea.strand_idx].get_scaled_parameters(rank);
+            GaussianParameters model = sr.pore_model[ea.strand_idx].get_scaled_parameters(ea.model_kmer_rank);
             float event_mean = sr.get_drift_corrected_level(ea.event_idx, ea.strand_idx);
             double z = (event_mean - model.mean) / model.stdv;
             summary.sum_z_score += z;
@@ -500,8 +738,9 @@ EventalignSummary summarize_alignment(const SquiggleRead& sr,
 
 // Realign the read in event space
 void realign_read(EventalignWriter writer,
+                  OutputBuffer& buffer,
                   const ReadDB& read_db, 
-                  const faidx_t* fai, 
+                  const PackedReference* reference, 
                   const bam_hdr_t* hdr, 
                   const bam1_t* record, 
                   size_t read_idx,
@@ -511,8 +750,24 @@ void realign_read(EventalignWriter writer,
     // Load a squiggle read for the mapped read
     std::string read_name = bam_get_qname(record);
 
+    // If we are only emitting events for a window of the reference, only load the
+    // part of the signal that is aligned to the window. The event indices of a slice
+    // differ from those of the whole read, so this is only done for the aggregated
+    // output, which does not contain them.
+    IndexPair base_range;
+    if(region_start != -1 && region_end != -1 && writer.aggregator != NULL) {
+        get_read_range_for_ref_region(record, region_start, region_end, base_range.start, base_range.stop);
+    }
+
     // load read
-    SquiggleRead sr(read_name, read_db, opt::write_samples ? SRF_LOAD_RAW_SAMPLES : 0);
+    // the signal index only needs the sample times, not the samples
+    uint32_t flags = 0;
+    if(opt::write_samples || writer.signal_dump != NULL) {
+        flags |= SRF_LOAD_RAW_SAMPLES;
+    } else if(opt::write_signal_index) {
+        flags |= SRF_LOAD_SAMPLE_TIMES;
+    }
+    SquiggleRead sr(read_name, read_db, flags, base_range);
 
     if(opt::verbose > 1) {
         fprintf(stderr, "Realigning %s [%zu %zu]\n", 
@@ -528,7 +783,7 @@ void realign_read(EventalignWriter writer,
 
         EventAlignmentParameters params;
         params.sr = &sr;
-        params.fai = fai;
+        params.reference = reference;
         params.hdr = hdr;
         params.record = record;
         params.strand_idx = strand_idx;
@@ -540,27 +795,49 @@ void realign_read(EventalignWriter writer,
         std::vector<EventAlignment> alignment = align_read_to_ref(params);
 
         EventalignSummary summary;
-        if(writer.summary_fp != NULL) {
+        if(writer.summary_out != NULL) {
             summary = summarize_alignment(sr, strand_idx, params, alignment);
         }
 
-        // write to disk
-        #pragma omp critical
-        {
-            if(opt::output_sam) {
-                emit_event_alignment_sam(writer.sam_fp, sr, hdr, record, alignment);
-            } else {
-                emit_event_alignment_tsv(writer.tsv_fp, sr, strand_idx, params, alignment);
-            }
+        // format the output, it is written to disk by the output writer thread
+        if(opt::output_sam) {
+            emit_event_alignment_sam(buffer, sr, record, alignment);
+        } else if(writer.binary_writer != NULL) {
+            emit_event_alignment_binary(buffer, writer.binary_writer, sr, strand_idx, params, alignment);
+        } else if(writer.aggregator != NULL) {
+            aggregate_event_alignment(writer.aggregator, sr, strand_idx, params, alignment);
+        } else {
+            emit_event_alignment_tsv(buffer.text(EVENTALIGN_TSV_STREAM), sr, strand_idx, params, alignment);
+        }
 
-            if(writer.summary_fp != NULL && summary.num_events > 0) {
+        if(writer.signal_dump != NULL) {
+            emit_aligned_signal(buffer, writer.signal_dump, sr, strand_idx, params, alignment);
+        }
 
-                PoreModel& pore_model = sr.pore_model[strand_idx];
-                fprintf(writer.summary_fp, "%zu\t%s\t%s\t", read_idx, read_name.c_str(), sr.fast5_path.c_str());
-                fprintf(writer.summary_fp, "%s\t%s\t", pore_model.name.c_str(), strand_idx == 0 ? "template" : "complement");
-                fprintf(writer.summary_fp, "%d\t%d\t%d\t%d\t", summary.num_events, summary.num_steps, summary.num_skips, summary.num_stays);
-                fprintf(writer.summary_fp, "%.2lf\t%.3lf\t%.3lf\t%.3lf\t%.3lf\n", summary.sum_duration, pore_model.shift, pore_model.scale, pore_model.drift, pore_model.var);
+        if(writer.summary_out != NULL && summary.num_events > 0) {
+
+            PoreModel& pore_model = sr.pore_model[strand_idx];
+            std::string& out = buffer.text(EVENTALIGN_SUMMARY_STREAM);
+            append_uint(out, read_idx);
+            out.push_back('\t');
+            out.append(read_name);
+            out.push_back('\t');
+            out.append(sr.fast5_path);
+            out.push_back('\t');
+            out.append(pore_model.name);
+            out.push_back('\t');
+            out.append(strand_idx == 0 ? "template" : "complement");
+            for(int count : { summary.num_events, summary.num_steps, summary.num_skips, summary.num_stays }) {
+                out.push_back('\t');
+                append_int(out, count);
+            }
+            out.push_back('\t');
+            append_fixed(out, summary.sum_duration, 2);
+            for(double parameter : { pore_model.shift, pore_model.scale, pore_model.drift, pore_model.var }) {
+                out.push_back('\t');
+                append_fixed(out, parameter, 3);
             }
+            out.push_back('\n');
         }
     }
 }
@@ -569,7 +846,7 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
 {
     // Sanity check input parameters
     assert(params.sr != NULL);
-    assert(params.fai != NULL);
+    assert(params.reference != NULL);
     assert(params.hdr != NULL);
     assert(params.record != NULL);
     assert(params.strand_idx < NUM_STRANDS);
@@ -581,7 +858,7 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
     int fetched_len = 0;
     int ref_offset = params.record->core.pos;
     std::string ref_name(params.hdr->target_name[params.record->core.tid]);
-    std::string ref_seq = get_reference_region_ts(params.fai, ref_name.c_str(), ref_offset, 
+    std::string ref_seq = get_reference_region_ts(params.reference, ref_name.c_str(), ref_offset, 
                                                   bam_endpos(params.record), &fetched_len);
 
     // k from read pore model
@@ -718,23 +995,24 @@ std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& pa
                 EventAlignment ea;
                 
                 // ref
-                ea.ref_name = ref_name;
+                ea.ref_contig_id = params.record->core.tid;
                 ea.ref_position = curr_start_ref + as.kmer_idx;
-                ea.ref_kmer = ref_seq.substr(ea.ref_position - ref_offset, k);
+                ea.ref_kmer_rank = params.alphabet->kmer_rank(ref_seq.c_str() + ea.ref_position - ref_offset, k);
 
                 // event
                 ea.read_idx = params.read_idx;
                 ea.strand_idx = params.strand_idx;
                 ea.event_idx = as.event_idx;
+                ea.k = k;
                 ea.rc = input.rc;
 
                 // hmm
                 ea.hmm_state = as.state;
 
                 if(ea.hmm_state != 'B') {
-                    ea.model_kmer = hmm_sequence.get_kmer(as.kmer_idx, k, input.rc);
+                    ea.model_kmer_rank = hmm_sequence.get_kmer_rank(as.kmer_idx, k, input.rc);
                 } else {
-                    ea.model_kmer = std::string(k, 'N');
+                    ea.model_kmer_rank = EVENT_ALIGNMENT_NO_KMER;
                 }
 
                 // store
@@ -783,11 +1061,17 @@ void parse_eventalign_options(int argc, char** argv)
             case 'f': opt::full_output = true; break;
             case OPT_STDV: model_stdv() = true; break;
             case OPT_SAMPLES: opt::write_samples = true; break;
+            case OPT_SIGNAL_INDEX: opt::write_signal_index = true; break;
+            case OPT_SIGNAL_DUMP: arg >> opt::signal_dump_file; break;
             case 'v': opt::verbose++; break;
             case OPT_MODELS_FOFN: arg >> opt::models_fofn; break;
             case OPT_SCALE_EVENTS: opt::scale_events = true; break;
             case OPT_SUMMARY: arg >> opt::summary_file; break;
             case OPT_SAM: opt::output_sam = true; break;
+            case OPT_FORMAT: arg >> opt::output_format; break;
+            case OPT_COMPRESS: opt::compress = true; break;
+            case OPT_AGGREGATE: arg >> opt::aggregate; break;
+            case OPT_AGGREGATE_SAMPLES: arg >> opt::aggregate_samples; break;
             case OPT_PROGRESS: opt::progress = true; break;
             case OPT_HELP:
                 std::cout << EVENTALIGN_USAGE_MESSAGE;
@@ -827,6 +1111,43 @@ void parse_eventalign_options(int argc, char** argv)
         die = true;
     }
 
+    if(opt::output_format != "tsv" && opt::output_format != "binary") {
+        std::cerr << SUBPROGRAM ": unknown --format " << opt::output_format << ", expected tsv or binary\n";
+        die = true;
+    }
+
+    if(opt::output_sam && opt::output_format != "tsv") {
+        std::cerr << SUBPROGRAM ": --sam and --format cannot be used together\n";
+        die = true;
+    }
+
+    if(opt::compress && (opt::output_sam || opt::output_format != "tsv")) {
+        std::cerr << SUBPROGRAM ": --compress only applies to the tsv output\n";
+        die = true;
+    }
+
+    if(!opt::aggregate.empty()) {
+        if(opt::aggregate != "position" && opt::aggregate != "kmer") {
+            std::cerr << SUBPROGRAM ": unknown --aggregate " << opt::aggregate << ", expected position or kmer\n";
+            die = true;
+        }
+
+        if(opt::output_sam || opt::output_format != "tsv" || opt::write_samples) {
+            std::cerr << SUBPROGRAM ": --aggregate cannot be used with --sam, --format or --samples\n";
+            die = true;
+        }
+    }
+
+    if(opt::write_signal_index && (opt::output_sam || opt::output_format != "tsv" || !opt::aggregate.empty())) {
+        std::cerr << SUBPROGRAM ": --signal-index only applies to the tsv output\n";
+        die = true;
+    }
+
+    if(opt::aggregate_samples < 0 || (opt::aggregate_samples > 0 && opt::aggregate.empty())) {
+        std::cerr << SUBPROGRAM ": --aggregate-samples requires --aggregate and a non-negative number\n";
+        die = true;
+    }
+
     if(!opt::models_fofn.empty()) {
         // initialize the model set from the fofn
         PoreModelSet::initialize(opt::models_fofn);
@@ -843,129 +1164,127 @@ int eventalign_main(int argc, char** argv)
 {
     parse_eventalign_options(argc, argv);
     omp_set_num_threads(opt::num_threads);
+    init_hts_thread_pool(opt::num_threads);
 
     ReadDB read_db;
     read_db.load(opt::reads_file);
     
-    // Open the BAM and iterate over reads
-
-    // load bam file
-    htsFile* bam_fh = sam_open(opt::bam_file.c_str(), "r");
-    assert(bam_fh != NULL);
-
-    // load bam index file
-    std::string index_filename = opt::bam_file + ".bai";
-    hts_idx_t* bam_idx = bam_index_load(index_filename.c_str());
-    if(bam_idx == NULL) {
-        bam_index_error_exit(opt::bam_file);
-    }
-
-    // read the bam header
-    bam_hdr_t* hdr = sam_hdr_read(bam_fh);
-    
-    // load reference fai file
-    faidx_t *fai = fai_load(opt::genome_file.c_str());
+    // load the reference
+    PackedReference reference(opt::genome_file);
+
+    // the BamProcessor framework iterates over the reads in the bam
+    // and schedules them across the worker threads
+    BamProcessor processor(opt::bam_file, opt::region, opt::num_threads);
+    processor.set_verbose(opt::verbose);
+    processor.set_prefetch_function([&read_db](const bam_hdr_t*, const bam1_t* record) {
+        read_db.prefetch_signal_data(bam_get_qname(record));
+    });
+    const bam_hdr_t* hdr = processor.get_bam_header();
 
-    hts_itr_t* itr;
-
-    // If processing a region of the genome, only emit events aligned to this window
-    int clip_start = -1;
-    int clip_end = -1;
+    // Initialize output
+    EventalignWriter writer = { NULL, NULL, NULL, NULL, NULL, NULL };
 
-    if(opt::region.empty()) {
-        // TODO: is this valid?
-        itr = sam_itr_queryi(bam_idx, HTS_IDX_START, 0, 0);
+    if(opt::output_sam) {
+        writer.sam_fp = hts_open("-", "wb");
+        attach_hts_thread_pool(writer.sam_fp);
+        emit_sam_header(writer.sam_fp, hdr);
+    } else if(opt::output_format == "binary") {
+        // contig ids in the binary output are the target ids of the bam
+        std::vector<std::string> contig_names(hdr->target_name, hdr->target_name + hdr->n_targets);
+        uint32_t flags = (opt::scale_events ? EVENTALIGN_BINARY_SCALE_EVENTS : 0) |
+                         (opt::write_samples ? EVENTALIGN_BINARY_SAMPLES : 0);
+        writer.binary_writer = new EventalignBinaryWriter(stdout, contig_names, flags);
     } else {
-
-        fprintf(stderr, "Region: %s\n", opt::region.c_str());
-        itr = sam_itr_querys(bam_idx, hdr, opt::region.c_str());
-        hts_parse_reg(opt::region.c_str(), &clip_start, &clip_end);
+        writer.tsv_out = new TextOutputFile("-", opt::compress);
+        std::string header;
+        if(!opt::aggregate.empty()) {
+            // the statistics are accumulated per thread and written after all reads are aligned
+            EventalignAggregateMode mode = opt::aggregate == "position" ? AGGREGATE_POSITION : AGGREGATE_KMER;
+            writer.aggregator = new EventalignAggregator(mode, opt::aggregate_samples, opt::num_threads);
+            writer.aggregator->write_header(header);
+        } else {
+            emit_tsv_header(header, opt::print_read_names, opt::write_samples, opt::write_signal_index);
+        }
+        writer.tsv_out->write(header);
     }
 
-#ifndef H5_HAVE_THREADSAFE
-    if(opt::num_threads > 1) {
-        fprintf(stderr, "You enabled multi-threading but you do not have a threadsafe HDF5\n");
-        fprintf(stderr, "Please recompile nanopolish's built-in libhdf5 or run with -t 1\n");
-        exit(1);
+    if(!opt::signal_dump_file.empty()) {
+        writer.signal_dump = new SignalDumpWriter(opt::signal_dump_file);
     }
-#endif
 
-    // Initialize output
-    EventalignWriter writer = { NULL, NULL, NULL };
+    if(!opt::summary_file.empty()) {
+        writer.summary_out = new TextOutputFile(opt::summary_file, opt::compress);
+        writer.summary_out->write("read_index\tread_name\tfast5_path\tmodel_name\tstrand\tnum_events\t"
+                                  "num_steps\tnum_skips\tnum_stays\ttotal_duration\tshift\tscale\tdrift\tvar\n");
+    }
 
-    if(opt::output_sam) {
-        writer.sam_fp = hts_open("-", "w");
-        emit_sam_header(writer.sam_fp, hdr);
+    // Output is formatted by the worker threads and written in read order
+    // by the writer thread. The summary is the second text stream.
+    OutputWriter output(true);
+    if(writer.tsv_out != NULL) {
+        output.add_text_stream(writer.tsv_out);
     } else {
-        writer.tsv_fp = stdout;
-        emit_tsv_header(writer.tsv_fp);
+        output.add_text_stream(stdout);
     }
 
-    if(!opt::summary_file.empty()) {
-        writer.summary_fp = fopen(opt::summary_file.c_str(), "w");
-        // header
-        fprintf(writer.summary_fp, "read_index\tread_name\tfast5_path\tmodel_name\tstrand\tnum_events\t");
-        fprintf(writer.summary_fp, "num_steps\tnum_skips\tnum_stays\ttotal_duration\tshift\tscale\tdrift\tvar\n");
+    if(writer.summary_out != NULL) {
+        output.add_text_stream(writer.summary_out);
     }
-    
-    // Initialize iteration
-    std::vector<bam1_t*> records(opt::batch_size, NULL);
-    for(size_t i = 0; i < records.size(); ++i) {
-        records[i] = bam_init1();
+
+    if(writer.sam_fp != NULL) {
+        output.set_bam_stream(writer.sam_fp, hdr);
     }
+    processor.set_output_writer(&output);
 
-    int result;
     size_t num_reads_realigned = 0;
-    size_t num_records_buffered = 0;
     Progress progress("[eventalign]");
 
-    do {
-        assert(num_records_buffered < records.size());
-        
-        // read a record into the next slot in the buffer
-        result = sam_itr_next(bam_fh, itr, records[num_records_buffered]);
-        
-        num_records_buffered += result >= 0;
-        // realign if we've hit the max buffer size or reached the end of file
-        if(num_records_buffered == records.size() || result < 0) {
-            #pragma omp parallel for            
-            for(size_t i = 0; i < num_records_buffered; ++i) {
-                bam1_t* record = records[i];
-                size_t read_idx = num_reads_realigned + i;
-                if( (record->core.flag & BAM_FUNMAP) == 0) {
-                    realign_read(writer, read_db, fai, hdr, record, read_idx, clip_start, clip_end);
-                }
-            }
-
-            num_reads_realigned += num_records_buffered;
-            num_records_buffered = 0;
-        }
+    auto f = [&](const bam_hdr_t* hdr, const bam1_t* record, size_t read_idx, int region_start, int region_end) {
+        OutputBuffer buffer(read_idx);
+        realign_read(writer, buffer, read_db, &reference, hdr, record, read_idx, region_start, region_end);
+        output.submit(std::move(buffer));
 
         if(opt::progress) {
-            fprintf(stderr, "Realigned %zu reads in %.1lfs\r", num_reads_realigned, progress.get_elapsed_seconds());
+            #pragma omp critical (eventalign_progress)
+            {
+                num_reads_realigned += 1;
+                fprintf(stderr, "Realigned %zu reads in %.1lfs\r", num_reads_realigned, progress.get_elapsed_seconds());
+            }
         }
-    } while(result >= 0);
- 
-    assert(num_records_buffered == 0);
-
-    // cleanup records
-    for(size_t i = 0; i < records.size(); ++i) {
-        bam_destroy1(records[i]);
-    }
+    };
+    processor.parallel_run(f);
+    output.close();
 
     // cleanup
-    sam_itr_destroy(itr);
-    bam_hdr_destroy(hdr);
-    fai_destroy(fai);
-    sam_close(bam_fh);
-    hts_idx_destroy(bam_idx);
 
     if(writer.sam_fp != NULL) {
         hts_close(writer.sam_fp);
     }
 
-    if(writer.summary_fp != NULL) {
-        fclose(writer.summary_fp);
+    if(writer.binary_writer != NULL) {
+        writer.binary_writer->close();
+        delete writer.binary_writer;
+    }
+
+    if(writer.signal_dump != NULL) {
+        writer.signal_dump->close();
+        delete writer.signal_dump;
+    }
+
+    if(writer.aggregator != NULL) {
+        std::vector<std::string> contig_names(hdr->target_name, hdr->target_name + hdr->n_targets);
+        writer.aggregator->write(*writer.tsv_out, contig_names, &gDNAAlphabet);
+        delete writer.aggregator;
+    }
+
+    if(writer.tsv_out != NULL) {
+        writer.tsv_out->close();
+        delete writer.tsv_out;
+    }
+
+    if(writer.summary_out != NULL) {
+        writer.summary_out->close();
+        delete writer.summary_out;
     }
     return EXIT_SUCCESS;
 }
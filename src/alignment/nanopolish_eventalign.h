@@ -10,6 +10,7 @@
 #define NANOPOLISH_EVENTALIGN_H
 
 #include "htslib/faidx.h"
+#include "nanopolish_packed_reference.h"
 #include "htslib/sam.h"
 #include "nanopolish_alphabet.h"
 #include "nanopolish_common.h"
@@ -22,7 +23,7 @@ struct EventAlignmentParameters
     EventAlignmentParameters()
     {
         sr = NULL;
-        fai = NULL;
+        reference = NULL;
         hdr = NULL;
         record = NULL;
         strand_idx = NUM_STRANDS;
@@ -35,7 +36,7 @@ struct EventAlignmentParameters
 
     // Mandatory
     SquiggleRead* sr;
-    const faidx_t* fai;
+    const PackedReference* reference;
     const bam_hdr_t* hdr;
     const bam1_t* record;
     size_t strand_idx;
@@ -47,38 +48,103 @@ struct EventAlignmentParameters
     int region_end;
 };
 
+// The model k-mer rank of events that were not assigned to the reference (hmm_state B)
+#define EVENT_ALIGNMENT_NO_KMER UINT32_MAX
+
+// One event aligned to the reference. The k-mers are stored as their rank
+// in the alphabet the read was aligned with and the contig as its id in the
+// bam header, use the functions below to format them for output.
 struct EventAlignment
 {
     // ref data
-    std::string ref_name;
-    std::string ref_kmer;
-    int ref_position;
+    int32_t ref_contig_id;
+    int32_t ref_position;
+    uint32_t ref_kmer_rank;
+
+    // hmm data
+    uint32_t model_kmer_rank;
 
     // event data
-    size_t read_idx;
-    int strand_idx;
-    int event_idx;
+    uint32_t read_idx;
+    int32_t event_idx;
+    uint8_t k;
+    uint8_t strand_idx;
     bool rc;
-
-    // hmm data
-    std::string model_kmer;
     char hmm_state;
 };
 
+// write the reference or model k-mer of an aligned event to out, which must hold ea.k
+// characters. The model k-mer of events not assigned to the reference is all Ns.
+inline void get_event_alignment_kmer(const EventAlignment& ea, const Alphabet* alphabet, bool model, char* out)
+{
+    uint32_t rank = model ? ea.model_kmer_rank : ea.ref_kmer_rank;
+    if(rank == EVENT_ALIGNMENT_NO_KMER) {
+        std::fill(out, out + ea.k, 'N');
+    } else {
+        alphabet->kmer_from_rank(rank, ea.k, out);
+    }
+}
+
+inline std::string get_event_alignment_kmer(const EventAlignment& ea, const Alphabet* alphabet, bool model)
+{
+    std::string str(ea.k, 'N');
+    get_event_alignment_kmer(ea, alphabet, model, &str[0]);
+    return str;
+}
+
 // Entry point from nanopolish.cpp
 int eventalign_main(int argc, char** argv);
 
-// print the alignment as a tab-separated table
-void emit_event_alignment_tsv(FILE* fp,
+// The levels written for each aligned event
+struct EventalignLevels
+{
+    float event_mean;
+    float event_stdv;
+    float event_length;
+    float model_mean;
+    float model_stdv;
+    float standardized_level;
+};
+
+// format the header of the tab-separated table
+void emit_tsv_header(std::string& out, bool print_read_names, bool write_samples, bool write_signal_index = false);
+
+// format one row of the tab-separated table. read_label is the read index or name
+// and the samples column is only written when samples is not NULL. The raw sample
+// range of the event is written when start_idx is not negative.
+void emit_event_tsv_row(std::string& out,
+                        const char* contig,
+                        int position,
+                        const char* ref_kmer,
+                        const char* read_label,
+                        int strand_idx,
+                        int event_idx,
+                        const EventalignLevels& levels,
+                        const char* model_kmer,
+                        const float* samples,
+                        size_t num_samples,
+                        int64_t start_idx = -1,
+                        int64_t end_idx = -1);
+
+// format the alignment as a tab-separated table
+void emit_event_alignment_tsv(std::string& out,
                               const SquiggleRead& sr,
                               uint32_t strand_idx,
                               const EventAlignmentParameters& params,
                               const std::vector<EventAlignment>& alignments);
 
+// add the events to the summary statistics of the calling thread
+class EventalignAggregator;
+void aggregate_event_alignment(EventalignAggregator* aggregator,
+                               const SquiggleRead& sr,
+                               uint32_t strand_idx,
+                               const EventAlignmentParameters& params,
+                               const std::vector<EventAlignment>& alignments);
+
 // The main function to realign a read
 std::vector<EventAlignment> align_read_to_ref(const EventAlignmentParameters& params);
 
 // get the specified reference region, threadsafe
-std::string get_reference_region_ts(const faidx_t* fai, const char* ref_name, int start, int end, int* fetched_len);
+std::string get_reference_region_ts(const PackedReference* reference, const char* ref_name, int start, int end, int* fetched_len);
 
 #endif
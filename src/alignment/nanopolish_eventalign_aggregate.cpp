@@ -0,0 +1,215 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_eventalign_aggregate -- summary statistics
+// of the aligned events per reference position or per k-mer
+//
+#include <math.h>
+#include <assert.h>
+#include <map>
+#include <algorithm>
+#include "nanopolish_eventalign_aggregate.h"
+#include "nanopolish_fast_format.h"
+
+//
+// EventStatsAccumulator
+//
+void EventStatsAccumulator::add(float level, float duration, size_t read_key, size_t reservoir_size, std::mt19937& rng)
+{
+    num_events += 1;
+    double delta = level - mean;
+    mean += delta / num_events;
+    m2 += delta * (level - mean);
+    sum_duration += duration;
+
+    // all events of a read strand at a position are consecutive
+    if(read_key != last_read_key) {
+        num_reads += 1;
+        last_read_key = read_key;
+    }
+
+    // reservoir sampling, each event is kept with probability reservoir_size / num_events
+    if(reservoir_size > 0) {
+        if(reservoir.size() < reservoir_size) {
+            reservoir.push_back(level);
+        } else {
+            uint64_t j = std::uniform_int_distribution<uint64_t>(0, num_events - 1)(rng);
+            if(j < reservoir_size) {
+                reservoir[j] = level;
+            }
+        }
+    }
+}
+
+void EventStatsAccumulator::merge(const EventStatsAccumulator& other, size_t reservoir_size, std::mt19937& rng)
+{
+    if(other.num_events == 0) {
+        return;
+    }
+
+    if(num_events == 0) {
+        *this = other;
+        return;
+    }
+
+    // combine the reservoirs by drawing from each in proportion to the
+    // number of events it represents that have not been drawn yet
+    if(reservoir_size > 0) {
+        std::vector<float> a = reservoir;
+        std::vector<float> b = other.reservoir;
+        std::shuffle(a.begin(), a.end(), rng);
+        std::shuffle(b.begin(), b.end(), rng);
+
+        double weight_a = num_events;
+        double weight_b = other.num_events;
+        double step_a = a.empty() ? 0.0 : weight_a / a.size();
+        double step_b = b.empty() ? 0.0 : weight_b / b.size();
+
+        reservoir.clear();
+        size_t ia = 0;
+        size_t ib = 0;
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        while(reservoir.size() < reservoir_size && (ia < a.size() || ib < b.size())) {
+            bool take_a = ib == b.size() ||
+                          (ia < a.size() && uniform(rng) * (weight_a + weight_b) < weight_a);
+            if(take_a) {
+                reservoir.push_back(a[ia++]);
+                weight_a = std::max(weight_a - step_a, 0.0);
+            } else {
+                reservoir.push_back(b[ib++]);
+                weight_b = std::max(weight_b - step_b, 0.0);
+            }
+        }
+    }
+
+    // Chan et al.'s formula for combining the variance of two sets
+    uint64_t n = num_events + other.num_events;
+    double delta = other.mean - mean;
+    mean += delta * other.num_events / n;
+    m2 += other.m2 + delta * delta * ((double)num_events * other.num_events / n);
+    num_events = n;
+    sum_duration += other.sum_duration;
+
+    // a read is processed by a single thread so the read counts can be added
+    num_reads += other.num_reads;
+}
+
+//
+// EventalignAggregator
+//
+EventalignAggregator::EventalignAggregator(EventalignAggregateMode mode, size_t reservoir_size, int num_threads) :
+                                                                             m_mode(mode),
+                                                                             m_reservoir_size(reservoir_size),
+                                                                             m_tables(num_threads)
+{
+    for(int i = 0; i < num_threads; ++i) {
+        m_rngs.push_back(std::mt19937(i));
+    }
+}
+
+void EventalignAggregator::add(int thread_idx,
+                               int contig_id,
+                               int position,
+                               uint32_t k,
+                               uint32_t ref_kmer_rank,
+                               uint32_t model_kmer_rank,
+                               size_t read_idx,
+                               int strand_idx,
+                               float level,
+                               float duration)
+{
+    assert(thread_idx >= 0 && thread_idx < (int)m_tables.size());
+
+    EventAggregateKey key;
+    key.contig_id = m_mode == AGGREGATE_POSITION ? contig_id : -1;
+    key.position = m_mode == AGGREGATE_POSITION ? position : 0;
+    key.model_kmer_rank = model_kmer_rank;
+
+    EventStatsAccumulator& acc = m_tables[thread_idx][key];
+    if(acc.num_events == 0) {
+        acc.ref_kmer_rank = ref_kmer_rank;
+        acc.k = k;
+    }
+    acc.add(level, duration, read_idx * 2 + strand_idx, m_reservoir_size, m_rngs[thread_idx]);
+}
+
+void EventalignAggregator::write_header(std::string& out) const
+{
+    if(m_mode == AGGREGATE_POSITION) {
+        out.append("contig\tposition\treference_kmer\tmodel_kmer\tnum_reads\t");
+    } else {
+        out.append("model_kmer\t");
+    }
+    out.append("num_events\tevent_level_mean\tevent_level_stdv\tevent_length_mean");
+
+    if(m_reservoir_size > 0) {
+        out.append("\tevent_level_samples");
+    }
+    out.append("\n");
+}
+
+void EventalignAggregator::write(TextOutputFile& out, const std::vector<std::string>& contig_names, const Alphabet* alphabet)
+{
+    // merge the thread tables into one sorted table, releasing each as it is merged
+    std::map<EventAggregateKey, EventStatsAccumulator> merged;
+    for(size_t i = 0; i < m_tables.size(); ++i) {
+        for(auto& entry : m_tables[i]) {
+            auto itr = merged.find(entry.first);
+            if(itr == merged.end()) {
+                merged.insert(std::make_pair(entry.first, std::move(entry.second)));
+            } else {
+                itr->second.merge(entry.second, m_reservoir_size, m_rngs[0]);
+            }
+        }
+        AccumulatorTable().swap(m_tables[i]);
+    }
+
+    std::string buffer;
+    for(const auto& entry : merged) {
+        const EventAggregateKey& key = entry.first;
+        const EventStatsAccumulator& acc = entry.second;
+
+        if(m_mode == AGGREGATE_POSITION) {
+            assert(key.contig_id >= 0 && key.contig_id < (int)contig_names.size());
+            buffer.append(contig_names[key.contig_id]);
+            buffer.push_back('\t');
+            append_int(buffer, key.position);
+            buffer.push_back('\t');
+            buffer.append(alphabet->kmer_from_rank(acc.ref_kmer_rank, acc.k));
+            buffer.push_back('\t');
+            buffer.append(alphabet->kmer_from_rank(key.model_kmer_rank, acc.k));
+            buffer.push_back('\t');
+            append_uint(buffer, acc.num_reads);
+        } else {
+            buffer.append(alphabet->kmer_from_rank(key.model_kmer_rank, acc.k));
+        }
+
+        buffer.push_back('\t');
+        append_uint(buffer, acc.num_events);
+        buffer.push_back('\t');
+        append_fixed(buffer, acc.mean, 2);
+        buffer.push_back('\t');
+        append_fixed(buffer, acc.get_stdv(), 3);
+        buffer.push_back('\t');
+        append_fixed(buffer, acc.sum_duration / acc.num_events, 5);
+
+        if(m_reservoir_size > 0) {
+            buffer.push_back('\t');
+            for(size_t i = 0; i < acc.reservoir.size(); ++i) {
+                if(i > 0) {
+                    buffer.push_back(',');
+                }
+                append_fixed(buffer, acc.reservoir[i], 2);
+            }
+        }
+        buffer.push_back('\n');
+
+        if(buffer.size() >= 1024 * 1024) {
+            out.write(buffer);
+            buffer.clear();
+        }
+    }
+    out.write(buffer);
+}
@@ -0,0 +1,130 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_eventalign_aggregate -- summary statistics
+// of the aligned events per reference position or per k-mer
+//
+// Each worker thread adds events to its own table so no
+// locking is needed. The accumulators are mergeable and
+// the tables are combined once all reads are aligned.
+//
+#ifndef NANOPOLISH_EVENTALIGN_AGGREGATE_H
+#define NANOPOLISH_EVENTALIGN_AGGREGATE_H
+
+#include <stdint.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <random>
+#include <unordered_map>
+#include "nanopolish_alphabet.h"
+#include "nanopolish_text_output.h"
+
+enum EventalignAggregateMode
+{
+    AGGREGATE_POSITION,
+    AGGREGATE_KMER
+};
+
+// Running statistics of the event levels and durations for one key.
+// The mean and variance are calculated with Welford's method so
+// accumulators from different threads can be merged exactly.
+struct EventStatsAccumulator
+{
+    // add one event
+    void add(float level, float duration, size_t read_key, size_t reservoir_size, std::mt19937& rng);
+
+    // add the events of other, which must not share reads with this accumulator
+    void merge(const EventStatsAccumulator& other, size_t reservoir_size, std::mt19937& rng);
+
+    double get_stdv() const { return num_events > 0 ? sqrt(m2 / num_events) : 0.0; }
+
+    uint64_t num_events = 0;
+    uint32_t num_reads = 0;
+    double mean = 0.0;
+    double m2 = 0.0;
+    double sum_duration = 0.0;
+
+    // the rank of the reference k-mer, only set when aggregating by position
+    uint32_t ref_kmer_rank = 0;
+    uint8_t k = 0;
+
+    // the last read strand added, to count the reads
+    size_t last_read_key = (size_t)-1;
+
+    // a uniform sample of the event levels
+    std::vector<float> reservoir;
+};
+
+// The key of an accumulator. When aggregating by k-mer the contig and position are not used.
+struct EventAggregateKey
+{
+    int32_t contig_id;
+    int32_t position;
+    uint32_t model_kmer_rank;
+
+    bool operator==(const EventAggregateKey& other) const
+    {
+        return contig_id == other.contig_id && position == other.position && model_kmer_rank == other.model_kmer_rank;
+    }
+
+    bool operator<(const EventAggregateKey& other) const
+    {
+        if(contig_id != other.contig_id) {
+            return contig_id < other.contig_id;
+        }
+        if(position != other.position) {
+            return position < other.position;
+        }
+        return model_kmer_rank < other.model_kmer_rank;
+    }
+};
+
+struct EventAggregateKeyHash
+{
+    size_t operator()(const EventAggregateKey& key) const
+    {
+        size_t h = key.model_kmer_rank;
+        h ^= ((size_t)(uint32_t)key.contig_id << 32 | (uint32_t)key.position) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        return h;
+    }
+};
+
+class EventalignAggregator
+{
+    public:
+        // reservoir_size is the number of event levels to sample for each key, 0 to disable
+        EventalignAggregator(EventalignAggregateMode mode, size_t reservoir_size, int num_threads);
+
+        // add an event from the worker thread thread_idx
+        void add(int thread_idx,
+                 int contig_id,
+                 int position,
+                 uint32_t k,
+                 uint32_t ref_kmer_rank,
+                 uint32_t model_kmer_rank,
+                 size_t read_idx,
+                 int strand_idx,
+                 float level,
+                 float duration);
+
+        // format the header of the output table
+        void write_header(std::string& out) const;
+
+        // merge the tables of all threads and write the summaries, sorted by key.
+        // contig_names maps the contig ids to names and the k-mers are formatted
+        // with the alphabet the reads were aligned with.
+        void write(TextOutputFile& out, const std::vector<std::string>& contig_names, const Alphabet* alphabet);
+
+    private:
+        typedef std::unordered_map<EventAggregateKey, EventStatsAccumulator, EventAggregateKeyHash> AccumulatorTable;
+
+        EventalignAggregateMode m_mode;
+        size_t m_reservoir_size;
+        std::vector<AccumulatorTable> m_tables;
+        std::vector<std::mt19937> m_rngs;
+};
+
+#endif
@@ -0,0 +1,643 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_eventalign_binary -- a compact columnar
+// format for eventalign output, and a reader for it
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <getopt.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "nanopolish_common.h"
+#include "nanopolish_alphabet.h"
+#include "nanopolish_eventalign.h"
+#include "nanopolish_eventalign_binary.h"
+
+#define EVENTALIGN_BINARY_MAGIC "NPEA\x02\x00\x00\x00"
+#define EVENTALIGN_BINARY_MAGIC_PREFIX_LENGTH 4
+#define EVENTALIGN_BINARY_END_MAGIC "NPEAEND\x00"
+
+//
+// Column (de)serialization
+//
+template<typename T>
+static void append_column(std::vector<char>& buffer, const std::vector<T>& column)
+{
+    const char* data = (const char*)column.data();
+    buffer.insert(buffer.end(), data, data + column.size() * sizeof(T));
+}
+
+template<typename T>
+static const char* read_column(const char* ptr, const char* end, size_t n, std::vector<T>& column)
+{
+    if(ptr == NULL || (size_t)(end - ptr) < n * sizeof(T)) {
+        return NULL;
+    }
+    column.resize(n);
+    memcpy(column.data(), ptr, n * sizeof(T));
+    return ptr + n * sizeof(T);
+}
+
+static void append_string(std::vector<char>& buffer, const std::string& str)
+{
+    uint32_t length = str.size();
+    buffer.insert(buffer.end(), (const char*)&length, (const char*)&length + sizeof(length));
+    buffer.insert(buffer.end(), str.begin(), str.end());
+}
+
+template<typename T>
+static void append_value(std::vector<char>& buffer, T value)
+{
+    buffer.insert(buffer.end(), (const char*)&value, (const char*)&value + sizeof(T));
+}
+
+//
+// Writer
+//
+EventalignBinaryWriter::EventalignBinaryWriter(FILE* fp,
+                                               const std::vector<std::string>& contig_names,
+                                               uint32_t flags) : m_fp(fp),
+                                                                 m_offset(0),
+                                                                 m_flags(flags),
+                                                                 m_closed(false),
+                                                                 m_contig_names(contig_names)
+{
+    EventalignBinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVENTALIGN_BINARY_MAGIC, sizeof(header.magic));
+    header.flags = m_flags;
+    write(&header, sizeof(header));
+    m_chunk.sample_offsets.push_back(0);
+}
+
+EventalignBinaryWriter::~EventalignBinaryWriter()
+{
+    close();
+}
+
+void EventalignBinaryWriter::write(const void* data, size_t count)
+{
+    if(fwrite(data, 1, count, m_fp) != count) {
+        fprintf(stderr, "Error: could not write binary eventalign output\n");
+        exit(EXIT_FAILURE);
+    }
+    m_offset += count;
+}
+
+uint32_t EventalignBinaryWriter::add_read(size_t read_idx, const std::string& read_name)
+{
+    auto itr = m_read_ids.find(read_idx);
+    if(itr != m_read_ids.end()) {
+        return itr->second;
+    }
+
+    uint32_t read_id = m_read_names.size();
+    m_read_indices.push_back(read_idx);
+    m_read_names.push_back(read_name);
+    m_read_ids[read_idx] = read_id;
+    return read_id;
+}
+
+uint32_t EventalignBinaryWriter::encode_kmer(const std::string& kmer)
+{
+    // only use the rank if it decodes back to the same k-mer
+    bool rankable = kmer.size() < 16 && gDNAAlphabet.contains_all(kmer.c_str());
+    if(rankable) {
+        return gDNAAlphabet.kmer_rank(kmer.c_str(), kmer.size());
+    }
+
+    auto itr = m_kmer_ids.find(kmer);
+    if(itr != m_kmer_ids.end()) {
+        return itr->second;
+    }
+
+    uint32_t code = m_kmers.size() | EVENTALIGN_KMER_DICTIONARY_BIT;
+    m_kmers.push_back(kmer);
+    m_kmer_ids[kmer] = code;
+    return code;
+}
+
+void EventalignBinaryWriter::append(const EventalignBinaryRecord& record, const std::vector<float>* samples)
+{
+    m_chunk.contig_id.push_back(record.contig_id);
+    m_chunk.position.push_back(record.position);
+    m_chunk.ref_kmer.push_back(record.ref_kmer);
+    m_chunk.read_id.push_back(record.read_id);
+    m_chunk.strand_idx.push_back(record.strand_idx);
+    m_chunk.k.push_back(record.k);
+    m_chunk.event_idx.push_back(record.event_idx);
+    m_chunk.event_mean.push_back(record.event_mean);
+    m_chunk.event_stdv.push_back(record.event_stdv);
+    m_chunk.event_length.push_back(record.event_length);
+    m_chunk.model_kmer.push_back(record.model_kmer);
+    m_chunk.model_mean.push_back(record.model_mean);
+    m_chunk.model_stdv.push_back(record.model_stdv);
+    m_chunk.standardized_level.push_back(record.standardized_level);
+
+    if(m_flags & EVENTALIGN_BINARY_SAMPLES) {
+        assert(samples != NULL);
+        m_chunk.samples.insert(m_chunk.samples.end(), samples->begin(), samples->end());
+        m_chunk.sample_offsets.push_back(m_chunk.samples.size());
+    }
+
+    if(m_chunk.size() == EVENTALIGN_BINARY_CHUNK_ROWS) {
+        flush_chunk();
+    }
+}
+
+void EventalignBinaryWriter::flush_chunk()
+{
+    if(m_chunk.size() == 0) {
+        return;
+    }
+
+    EventalignChunkIndex index;
+    memset(&index, 0, sizeof(index));
+    index.offset = m_offset;
+    index.num_rows = m_chunk.size();
+    index.num_samples = m_chunk.samples.size();
+    index.min_contig_id = *std::min_element(m_chunk.contig_id.begin(), m_chunk.contig_id.end());
+    index.max_contig_id = *std::max_element(m_chunk.contig_id.begin(), m_chunk.contig_id.end());
+    index.min_position = *std::min_element(m_chunk.position.begin(), m_chunk.position.end());
+    index.max_position = *std::max_element(m_chunk.position.begin(), m_chunk.position.end());
+
+    std::vector<char> buffer;
+    append_column(buffer, m_chunk.contig_id);
+    append_column(buffer, m_chunk.position);
+    append_column(buffer, m_chunk.ref_kmer);
+    append_column(buffer, m_chunk.read_id);
+    append_column(buffer, m_chunk.strand_idx);
+    append_column(buffer, m_chunk.k);
+    append_column(buffer, m_chunk.event_idx);
+    append_column(buffer, m_chunk.event_mean);
+    append_column(buffer, m_chunk.event_stdv);
+    append_column(buffer, m_chunk.event_length);
+    append_column(buffer, m_chunk.model_kmer);
+    append_column(buffer, m_chunk.model_mean);
+    append_column(buffer, m_chunk.model_stdv);
+    append_column(buffer, m_chunk.standardized_level);
+    if(m_flags & EVENTALIGN_BINARY_SAMPLES) {
+        append_column(buffer, m_chunk.sample_offsets);
+        append_column(buffer, m_chunk.samples);
+    }
+
+    uLongf compressed_size = compressBound(buffer.size());
+    std::vector<char> compressed(compressed_size);
+    int ret = compress2((Bytef*)compressed.data(), &compressed_size,
+                        (const Bytef*)buffer.data(), buffer.size(), Z_DEFAULT_COMPRESSION);
+    if(ret != Z_OK) {
+        fprintf(stderr, "Error: could not compress binary eventalign chunk (zlib error %d)\n", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    index.compressed_size = compressed_size;
+    index.uncompressed_size = buffer.size();
+    write(compressed.data(), compressed_size);
+    m_chunk_index.push_back(index);
+
+    m_chunk = EventalignChunk();
+    m_chunk.sample_offsets.push_back(0);
+}
+
+void EventalignBinaryWriter::close()
+{
+    if(m_closed) {
+        return;
+    }
+    flush_chunk();
+
+    // the dictionaries are only complete once every read has been written
+    std::vector<char> footer;
+    append_value<uint64_t>(footer, m_contig_names.size());
+    for(const std::string& name : m_contig_names) {
+        append_string(footer, name);
+    }
+
+    append_value<uint64_t>(footer, m_read_names.size());
+    for(size_t i = 0; i < m_read_names.size(); ++i) {
+        append_value<uint64_t>(footer, m_read_indices[i]);
+        append_string(footer, m_read_names[i]);
+    }
+
+    append_value<uint64_t>(footer, m_kmers.size());
+    for(const std::string& kmer : m_kmers) {
+        append_string(footer, kmer);
+    }
+
+    append_value<uint64_t>(footer, m_chunk_index.size());
+    append_column(footer, m_chunk_index);
+
+    EventalignBinaryTrailer trailer;
+    trailer.footer_offset = m_offset;
+    memcpy(trailer.magic, EVENTALIGN_BINARY_END_MAGIC, sizeof(trailer.magic));
+
+    write(footer.data(), footer.size());
+    write(&trailer, sizeof(trailer));
+    fflush(m_fp);
+    m_closed = true;
+}
+
+//
+// Reader
+//
+static void read_error(const std::string& filename, const char* reason)
+{
+    fprintf(stderr, "Error: %s is not a valid binary eventalign file (%s)\n", filename.c_str(), reason);
+    exit(EXIT_FAILURE);
+}
+
+static const char* read_string(const char* ptr, const char* end, std::string& out)
+{
+    uint32_t length;
+    if(ptr == NULL || (size_t)(end - ptr) < sizeof(length)) {
+        return NULL;
+    }
+    memcpy(&length, ptr, sizeof(length));
+    ptr += sizeof(length);
+
+    if((size_t)(end - ptr) < length) {
+        return NULL;
+    }
+    out.assign(ptr, length);
+    return ptr + length;
+}
+
+static const char* read_count(const char* ptr, const char* end, uint64_t& count)
+{
+    if(ptr == NULL || (size_t)(end - ptr) < sizeof(count)) {
+        return NULL;
+    }
+    memcpy(&count, ptr, sizeof(count));
+    return ptr + sizeof(count);
+}
+
+EventalignBinaryReader::EventalignBinaryReader(const std::string& filename) : m_filename(filename)
+{
+    m_fp = fopen(filename.c_str(), "rb");
+    if(m_fp == NULL) {
+        fprintf(stderr, "Error: could not open %s for read\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    EventalignBinaryHeader header;
+    if(fread(&header, sizeof(header), 1, m_fp) != 1 ||
+       memcmp(header.magic, EVENTALIGN_BINARY_MAGIC, EVENTALIGN_BINARY_MAGIC_PREFIX_LENGTH) != 0) {
+        read_error(m_filename, "bad header");
+    }
+
+    // earlier versions wrote windowed event indices and did not mark unassigned events
+    if(memcmp(header.magic, EVENTALIGN_BINARY_MAGIC, sizeof(header.magic)) != 0) {
+        read_error(m_filename, "written by an earlier version, rerun eventalign");
+    }
+    m_flags = header.flags;
+
+    // the trailer points at the footer
+    EventalignBinaryTrailer trailer;
+    if(fseeko(m_fp, -(off_t)sizeof(trailer), SEEK_END) != 0 ||
+       fread(&trailer, sizeof(trailer), 1, m_fp) != 1 ||
+       memcmp(trailer.magic, EVENTALIGN_BINARY_END_MAGIC, sizeof(trailer.magic)) != 0) {
+        read_error(m_filename, "truncated file");
+    }
+
+    off_t trailer_offset = ftello(m_fp) - sizeof(trailer);
+    if((off_t)trailer.footer_offset > trailer_offset) {
+        read_error(m_filename, "bad footer offset");
+    }
+
+    std::vector<char> footer(trailer_offset - trailer.footer_offset);
+    if(fseeko(m_fp, trailer.footer_offset, SEEK_SET) != 0 ||
+       fread(footer.data(), 1, footer.size(), m_fp) != footer.size()) {
+        read_error(m_filename, "could not read footer");
+    }
+
+    const char* ptr = footer.data();
+    const char* end = ptr + footer.size();
+    uint64_t count = 0;
+
+    ptr = read_count(ptr, end, count);
+    m_contig_names.resize(ptr != NULL ? count : 0);
+    for(size_t i = 0; i < m_contig_names.size(); ++i) {
+        ptr = read_string(ptr, end, m_contig_names[i]);
+    }
+
+    ptr = read_count(ptr, end, count);
+    m_read_indices.resize(ptr != NULL ? count : 0);
+    m_read_names.resize(ptr != NULL ? count : 0);
+    for(size_t i = 0; i < m_read_names.size(); ++i) {
+        uint64_t read_idx = 0;
+        ptr = read_count(ptr, end, read_idx);
+        m_read_indices[i] = read_idx;
+        ptr = read_string(ptr, end, m_read_names[i]);
+    }
+
+    ptr = read_count(ptr, end, count);
+    m_kmers.resize(ptr != NULL ? count : 0);
+    for(size_t i = 0; i < m_kmers.size(); ++i) {
+        ptr = read_string(ptr, end, m_kmers[i]);
+    }
+
+    ptr = read_count(ptr, end, count);
+    ptr = read_column(ptr, end, ptr != NULL ? count : 0, m_chunk_index);
+    if(ptr == NULL) {
+        read_error(m_filename, "bad footer");
+    }
+}
+
+EventalignBinaryReader::~EventalignBinaryReader()
+{
+    fclose(m_fp);
+}
+
+int EventalignBinaryReader::get_contig_id(const std::string& name) const
+{
+    auto itr = std::find(m_contig_names.begin(), m_contig_names.end(), name);
+    return itr != m_contig_names.end() ? itr - m_contig_names.begin() : -1;
+}
+
+std::string EventalignBinaryReader::get_kmer(uint32_t code, uint32_t k) const
+{
+    if(code == EVENTALIGN_KMER_NONE) {
+        return std::string(k, 'N');
+    }
+
+    if(code & EVENTALIGN_KMER_DICTIONARY_BIT) {
+        return m_kmers[code & ~EVENTALIGN_KMER_DICTIONARY_BIT];
+    }
+
+    // unrank, from the last base to the first
+    std::string kmer(k, 'A');
+    for(uint32_t i = 0; i < k; ++i) {
+        kmer[k - i - 1] = gDNAAlphabet.base(code % gDNAAlphabet.size());
+        code /= gDNAAlphabet.size();
+    }
+    return kmer;
+}
+
+bool EventalignBinaryReader::is_binary_file(const std::string& filename)
+{
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if(fp == NULL) {
+        return false;
+    }
+
+    EventalignBinaryHeader header;
+    // any version of the format is accepted here so the reader can report old versions
+    bool is_binary = fread(&header, sizeof(header), 1, fp) == 1 &&
+                     memcmp(header.magic, EVENTALIGN_BINARY_MAGIC, EVENTALIGN_BINARY_MAGIC_PREFIX_LENGTH) == 0;
+    fclose(fp);
+    return is_binary;
+}
+
+void EventalignBinaryReader::read_chunk(size_t chunk_idx, EventalignChunk& chunk)
+{
+    read_chunk(chunk_idx, chunk, m_compressed, m_uncompressed);
+}
+
+void EventalignBinaryReader::read_chunk(size_t chunk_idx,
+                                        EventalignChunk& chunk,
+                                        std::vector<char>& compressed,
+                                        std::vector<char>& uncompressed) const
+{
+    const EventalignChunkIndex& index = m_chunk_index[chunk_idx];
+    compressed.resize(index.compressed_size);
+    uncompressed.resize(index.uncompressed_size);
+
+    // pread does not move the file position so concurrent reads do not interfere
+    if(pread(fileno(m_fp), compressed.data(), compressed.size(), index.offset) != (ssize_t)compressed.size()) {
+        read_error(m_filename, "could not read chunk");
+    }
+
+    uLongf uncompressed_size = uncompressed.size();
+    int ret = uncompress((Bytef*)uncompressed.data(), &uncompressed_size,
+                         (const Bytef*)compressed.data(), compressed.size());
+    if(ret != Z_OK || uncompressed_size != uncompressed.size()) {
+        read_error(m_filename, "could not decompress chunk");
+    }
+
+    size_t n = index.num_rows;
+    const char* ptr = uncompressed.data();
+    const char* end = ptr + uncompressed.size();
+    ptr = read_column(ptr, end, n, chunk.contig_id);
+    ptr = read_column(ptr, end, n, chunk.position);
+    ptr = read_column(ptr, end, n, chunk.ref_kmer);
+    ptr = read_column(ptr, end, n, chunk.read_id);
+    ptr = read_column(ptr, end, n, chunk.strand_idx);
+    ptr = read_column(ptr, end, n, chunk.k);
+    ptr = read_column(ptr, end, n, chunk.event_idx);
+    ptr = read_column(ptr, end, n, chunk.event_mean);
+    ptr = read_column(ptr, end, n, chunk.event_stdv);
+    ptr = read_column(ptr, end, n, chunk.event_length);
+    ptr = read_column(ptr, end, n, chunk.model_kmer);
+    ptr = read_column(ptr, end, n, chunk.model_mean);
+    ptr = read_column(ptr, end, n, chunk.model_stdv);
+    ptr = read_column(ptr, end, n, chunk.standardized_level);
+
+    if(m_flags & EVENTALIGN_BINARY_SAMPLES) {
+        ptr = read_column(ptr, end, n + 1, chunk.sample_offsets);
+        ptr = read_column(ptr, end, index.num_samples, chunk.samples);
+    } else {
+        chunk.sample_offsets.clear();
+        chunk.samples.clear();
+    }
+
+    if(ptr == NULL) {
+        read_error(m_filename, "bad chunk");
+    }
+
+    // the ids index the dictionaries in the footer, check them once here
+    // so that callers can use them directly
+    for(size_t i = 0; i < n; ++i) {
+        if(chunk.contig_id[i] >= m_contig_names.size()) {
+            read_error(m_filename, "bad contig id");
+        }
+
+        if(chunk.read_id[i] >= m_read_names.size()) {
+            read_error(m_filename, "bad read id");
+        }
+
+        if(((chunk.ref_kmer[i] & EVENTALIGN_KMER_DICTIONARY_BIT) &&
+            (chunk.ref_kmer[i] & ~EVENTALIGN_KMER_DICTIONARY_BIT) >= m_kmers.size()) ||
+           ((chunk.model_kmer[i] & EVENTALIGN_KMER_DICTIONARY_BIT) && chunk.model_kmer[i] != EVENTALIGN_KMER_NONE &&
+            (chunk.model_kmer[i] & ~EVENTALIGN_KMER_DICTIONARY_BIT) >= m_kmers.size())) {
+            read_error(m_filename, "bad k-mer code");
+        }
+    }
+
+    // the samples of each row must be inside the sample column
+    if(m_flags & EVENTALIGN_BINARY_SAMPLES) {
+        for(size_t i = 0; i < n; ++i) {
+            if(chunk.sample_offsets[i] > chunk.sample_offsets[i + 1]) {
+                read_error(m_filename, "bad sample offsets");
+            }
+        }
+
+        if(chunk.sample_offsets[n] > chunk.samples.size()) {
+            read_error(m_filename, "bad sample offsets");
+        }
+    }
+}
+
+//
+// eventalign-view: convert the binary format back to tsv
+//
+#define SUBPROGRAM "eventalign-view"
+
+static const char *EVENTALIGN_VIEW_VERSION_MESSAGE =
+SUBPROGRAM " Version " PACKAGE_VERSION "\n"
+"Written by agent.\n"
+"\n"
+"Copyright 2026 agent\n";
+
+static const char *EVENTALIGN_VIEW_USAGE_MESSAGE =
+"Usage: " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] eventalign.bin\n"
+"Print the output of eventalign --format=binary as tsv\n"
+"\n"
+"      --version                        display version\n"
+"      --help                           display this help and exit\n"
+"  -w, --window=STR                     only print events aligned to window STR (format: ctg:start_id-end_id)\n"
+"  -n, --print-read-names               print read names instead of indexes\n"
+"\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
+
+namespace opt
+{
+    static std::string input_file;
+    static std::string region;
+    static bool print_read_names;
+}
+
+static const char* shortopts = "w:n";
+
+enum { OPT_HELP = 1, OPT_VERSION };
+
+static const struct option longopts[] = {
+    { "window",           required_argument, NULL, 'w' },
+    { "print-read-names", no_argument,       NULL, 'n' },
+    { "help",             no_argument,       NULL, OPT_HELP },
+    { "version",          no_argument,       NULL, OPT_VERSION },
+    { NULL, 0, NULL, 0 }
+};
+
+void parse_eventalign_view_options(int argc, char** argv)
+{
+    bool die = false;
+    for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+        std::istringstream arg(optarg != NULL ? optarg : "");
+        switch (c) {
+            case 'w': arg >> opt::region; break;
+            case 'n': opt::print_read_names = true; break;
+            case '?': die = true; break;
+            case OPT_HELP:
+                std::cout << EVENTALIGN_VIEW_USAGE_MESSAGE;
+                exit(EXIT_SUCCESS);
+            case OPT_VERSION:
+                std::cout << EVENTALIGN_VIEW_VERSION_MESSAGE;
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    if(argc - optind > 0) {
+        opt::input_file = argv[optind++];
+    } else {
+        std::cerr << SUBPROGRAM ": an input file must be provided\n";
+        die = true;
+    }
+
+    if (argc - optind > 0) {
+        std::cerr << SUBPROGRAM ": too many arguments\n";
+        die = true;
+    }
+
+    if (die)
+    {
+        std::cout << "\n" << EVENTALIGN_VIEW_USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+    }
+}
+
+int eventalign_view_main(int argc, char** argv)
+{
+    parse_eventalign_view_options(argc, argv);
+
+    EventalignBinaryReader reader(opt::input_file);
+    bool has_samples = reader.get_flags() & EVENTALIGN_BINARY_SAMPLES;
+
+    // restrict the output to a window of the reference
+    int region_contig_id = -1;
+    int region_start = 0;
+    int region_end = 0;
+    if(!opt::region.empty()) {
+        std::string contig;
+        parse_region_string(opt::region, contig, region_start, region_end);
+        region_contig_id = reader.get_contig_id(contig);
+        if(region_contig_id == -1) {
+            fprintf(stderr, "Error: contig %s is not in %s\n", contig.c_str(), opt::input_file.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    EventalignChunk chunk;
+    std::string out;
+    emit_tsv_header(out, opt::print_read_names, has_samples);
+    fwrite(out.data(), 1, out.size(), stdout);
+    out.clear();
+
+    std::vector<std::string> read_labels(reader.get_num_reads());
+    for(size_t ci = 0; ci < reader.get_num_chunks(); ++ci) {
+
+        // skip chunks that cannot overlap the window
+        const EventalignChunkIndex& index = reader.get_chunk_index(ci);
+        if(region_contig_id != -1 &&
+           ((int)index.min_contig_id > region_contig_id || (int)index.max_contig_id < region_contig_id ||
+            index.min_position > region_end || index.max_position < region_start)) {
+            continue;
+        }
+
+        reader.read_chunk(ci, chunk);
+        for(size_t i = 0; i < chunk.size(); ++i) {
+            if(region_contig_id != -1 &&
+               ((int)chunk.contig_id[i] != region_contig_id || chunk.position[i] < region_start || chunk.position[i] > region_end)) {
+                continue;
+            }
+
+            std::string& read_label = read_labels[chunk.read_id[i]];
+            if(read_label.empty()) {
+                read_label = opt::print_read_names ? reader.get_read_name(chunk.read_id[i])
+                                                   : std::to_string(reader.get_read_index(chunk.read_id[i]));
+            }
+
+            EventalignLevels levels;
+            levels.event_mean = chunk.event_mean[i];
+            levels.event_stdv = chunk.event_stdv[i];
+            levels.event_length = chunk.event_length[i];
+            levels.model_mean = chunk.model_mean[i];
+            levels.model_stdv = chunk.model_stdv[i];
+            levels.standardized_level = chunk.standardized_level[i];
+
+            std::string ref_kmer = reader.get_kmer(chunk.ref_kmer[i], chunk.k[i]);
+            std::string model_kmer = reader.get_kmer(chunk.model_kmer[i], chunk.k[i]);
+            emit_event_tsv_row(out,
+                               reader.get_contig_name(chunk.contig_id[i]).c_str(),
+                               chunk.position[i],
+                               ref_kmer.c_str(),
+                               read_label.c_str(),
+                               chunk.strand_idx[i],
+                               chunk.event_idx[i],
+                               levels,
+                               model_kmer.c_str(),
+                               has_samples ? chunk.samples.data() + chunk.sample_offsets[i] : NULL,
+                               has_samples ? chunk.sample_offsets[i + 1] - chunk.sample_offsets[i] : 0);
+        }
+
+        fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+    }
+    return EXIT_SUCCESS;
+}
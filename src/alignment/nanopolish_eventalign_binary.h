@@ -0,0 +1,208 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_eventalign_binary -- a compact columnar
+// format for eventalign output, and a reader for it
+//
+// The file is a header, a sequence of zlib-compressed chunks
+// and a footer holding the contig, read and k-mer dictionaries
+// and an index of the chunks. Each chunk holds up to
+// EVENTALIGN_BINARY_CHUNK_ROWS rows stored column by column.
+// K-mers are stored as their rank in the DNA alphabet; k-mers
+// that cannot be ranked (N, lower case) are stored as an index
+// into the k-mer dictionary with EVENTALIGN_KMER_DICTIONARY_BIT set.
+// The model k-mer of events that were not assigned to a k-mer
+// (hmm state B) is EVENTALIGN_KMER_NONE.
+//
+#ifndef NANOPOLISH_EVENTALIGN_BINARY_H
+#define NANOPOLISH_EVENTALIGN_BINARY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#define EVENTALIGN_BINARY_CHUNK_ROWS 65536
+#define EVENTALIGN_KMER_DICTIONARY_BIT 0x80000000u
+#define EVENTALIGN_KMER_NONE 0xFFFFFFFFu
+
+// header flags
+#define EVENTALIGN_BINARY_SCALE_EVENTS 1
+#define EVENTALIGN_BINARY_SAMPLES 2
+
+struct EventalignBinaryHeader
+{
+    char magic[8];
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+// the last bytes of the file, pointing at the footer
+struct EventalignBinaryTrailer
+{
+    uint64_t footer_offset;
+    char magic[8];
+};
+
+// Index entry for one chunk. The bounds allow a reader
+// to skip chunks that do not overlap a region of interest.
+struct EventalignChunkIndex
+{
+    uint64_t offset;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint32_t num_rows;
+    uint32_t num_samples;
+    uint32_t min_contig_id;
+    uint32_t max_contig_id;
+    int32_t min_position;
+    int32_t max_position;
+};
+
+// One row of output, as written
+struct EventalignBinaryRecord
+{
+    uint32_t contig_id;
+    int32_t position;
+    uint32_t ref_kmer;
+    uint32_t read_id;
+    uint8_t strand_idx;
+    uint8_t k;
+    int32_t event_idx;
+    float event_mean;
+    float event_stdv;
+    float event_length;
+    uint32_t model_kmer;
+    float model_mean;
+    float model_stdv;
+    float standardized_level;
+};
+
+// A decoded chunk, one vector per column. The samples for
+// row i are samples[sample_offsets[i]] to samples[sample_offsets[i + 1]].
+struct EventalignChunk
+{
+    size_t size() const { return position.size(); }
+
+    std::vector<uint32_t> contig_id;
+    std::vector<int32_t> position;
+    std::vector<uint32_t> ref_kmer;
+    std::vector<uint32_t> read_id;
+    std::vector<uint8_t> strand_idx;
+    std::vector<uint8_t> k;
+    std::vector<int32_t> event_idx;
+    std::vector<float> event_mean;
+    std::vector<float> event_stdv;
+    std::vector<float> event_length;
+    std::vector<uint32_t> model_kmer;
+    std::vector<float> model_mean;
+    std::vector<float> model_stdv;
+    std::vector<float> standardized_level;
+    std::vector<uint32_t> sample_offsets;
+    std::vector<float> samples;
+};
+
+class EventalignBinaryWriter
+{
+    public:
+        // the contig ids of the records index contig_names
+        EventalignBinaryWriter(FILE* fp, const std::vector<std::string>& contig_names, uint32_t flags);
+        ~EventalignBinaryWriter();
+
+        // Return the id of a read, adding it to the dictionary if this is the first time it is seen
+        uint32_t add_read(size_t read_idx, const std::string& read_name);
+
+        // Encode a k-mer as its rank or a dictionary entry
+        uint32_t encode_kmer(const std::string& kmer);
+
+        // Append a row. samples must be provided if the file was opened with EVENTALIGN_BINARY_SAMPLES.
+        void append(const EventalignBinaryRecord& record, const std::vector<float>* samples);
+
+        // write the remaining rows and the footer
+        void close();
+
+    private:
+
+        EventalignBinaryWriter(const EventalignBinaryWriter&) = delete;
+        EventalignBinaryWriter& operator=(const EventalignBinaryWriter&) = delete;
+
+        void write(const void* data, size_t count);
+        void flush_chunk();
+
+        FILE* m_fp;
+        uint64_t m_offset;
+        uint32_t m_flags;
+        bool m_closed;
+
+        std::vector<std::string> m_contig_names;
+        std::vector<size_t> m_read_indices;
+        std::vector<std::string> m_read_names;
+        std::unordered_map<size_t, uint32_t> m_read_ids;
+        std::vector<std::string> m_kmers;
+        std::unordered_map<std::string, uint32_t> m_kmer_ids;
+
+        EventalignChunk m_chunk;
+        std::vector<EventalignChunkIndex> m_chunk_index;
+};
+
+class EventalignBinaryReader
+{
+    public:
+        EventalignBinaryReader(const std::string& filename);
+        ~EventalignBinaryReader();
+
+        uint32_t get_flags() const { return m_flags; }
+
+        size_t get_num_chunks() const { return m_chunk_index.size(); }
+        const EventalignChunkIndex& get_chunk_index(size_t chunk_idx) const { return m_chunk_index[chunk_idx]; }
+
+        // Decompress a chunk into its columns
+        void read_chunk(size_t chunk_idx, EventalignChunk& chunk);
+
+        // As above but using caller-provided buffers, so chunks can be read by many threads at once
+        void read_chunk(size_t chunk_idx,
+                        EventalignChunk& chunk,
+                        std::vector<char>& compressed,
+                        std::vector<char>& uncompressed) const;
+
+        // returns true if the file starts with the header of any version of this format
+        static bool is_binary_file(const std::string& filename);
+
+        size_t get_num_contigs() const { return m_contig_names.size(); }
+        const std::string& get_contig_name(uint32_t contig_id) const { return m_contig_names[contig_id]; }
+
+        // returns -1 if there is no contig with this name
+        int get_contig_id(const std::string& name) const;
+
+        size_t get_num_reads() const { return m_read_names.size(); }
+        const std::string& get_read_name(uint32_t read_id) const { return m_read_names[read_id]; }
+        size_t get_read_index(uint32_t read_id) const { return m_read_indices[read_id]; }
+
+        // Decode a k-mer of length k, EVENTALIGN_KMER_NONE decodes to all Ns
+        std::string get_kmer(uint32_t code, uint32_t k) const;
+
+    private:
+
+        EventalignBinaryReader(const EventalignBinaryReader&) = delete;
+        EventalignBinaryReader& operator=(const EventalignBinaryReader&) = delete;
+
+        FILE* m_fp;
+        std::string m_filename;
+        uint32_t m_flags;
+
+        std::vector<std::string> m_contig_names;
+        std::vector<size_t> m_read_indices;
+        std::vector<std::string> m_read_names;
+        std::vector<std::string> m_kmers;
+        std::vector<EventalignChunkIndex> m_chunk_index;
+        std::vector<char> m_compressed;
+        std::vector<char> m_uncompressed;
+};
+
+// Entry point from nanopolish.cpp
+int eventalign_view_main(int argc, char** argv);
+
+#endif
@@ -0,0 +1,334 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_saved_event_alignments -- look up the event
+// alignments of a read that were saved by eventalign, so
+// they do not have to be recomputed
+//
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+#include <algorithm>
+#include "nanopolish_common.h"
+#include "nanopolish_saved_event_alignments.h"
+
+SavedEventAlignments::SavedEventAlignments(const std::string& filename, int num_threads) :
+                                                                     m_filename(filename),
+                                                                     m_thread_state(num_threads),
+                                                                     m_binary_reader(NULL)
+{
+    if(!EventalignBinaryReader::is_binary_file(filename)) {
+        // the event bam is opened by each thread when it is first used
+        return;
+    }
+
+    m_binary_reader = new EventalignBinaryReader(filename);
+
+    // The rows of a read are written together so they span a small range of chunks.
+    // Find the range for each read by decoding the read id column of every chunk once.
+    size_t num_chunks = m_binary_reader->get_num_chunks();
+    std::vector<std::vector<uint32_t>> chunk_read_ids(num_chunks);
+
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for(size_t ci = 0; ci < num_chunks; ++ci) {
+        ThreadState& state = m_thread_state[omp_get_thread_num()];
+        m_binary_reader->read_chunk(ci, state.chunk, state.compressed, state.uncompressed);
+
+        std::vector<uint32_t>& ids = chunk_read_ids[ci];
+        ids = state.chunk.read_id;
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+
+    // read_chunk rejects ids that are not in the read dictionary, check again
+    // here as the ranges are indexed by them
+    std::vector<ChunkRange> ranges(m_binary_reader->get_num_reads(), { 0, (uint32_t)-1, 0 });
+    for(size_t ci = 0; ci < num_chunks; ++ci) {
+        for(uint32_t read_id : chunk_read_ids[ci]) {
+            if(read_id >= ranges.size()) {
+                fprintf(stderr, "Error: %s has an alignment for read id %u but only %zu reads\n",
+                        filename.c_str(), read_id, ranges.size());
+                exit(EXIT_FAILURE);
+            }
+            ChunkRange& range = ranges[read_id];
+            range.first_chunk = std::min(range.first_chunk, (uint32_t)ci);
+            range.last_chunk = ci;
+        }
+    }
+
+    for(uint32_t read_id = 0; read_id < ranges.size(); ++read_id) {
+        if(ranges[read_id].first_chunk != (uint32_t)-1) {
+            ranges[read_id].read_id = read_id;
+            m_chunks_by_read[m_binary_reader->get_read_name(read_id)].push_back(ranges[read_id]);
+        }
+    }
+
+    for(size_t ci = 0; ci < m_binary_reader->get_num_contigs(); ++ci) {
+        m_contig_ids[m_binary_reader->get_contig_name(ci)] = ci;
+    }
+}
+
+SavedEventAlignments::~SavedEventAlignments()
+{
+    for(ThreadState& state : m_thread_state) {
+        if(state.bam_record != NULL) {
+            bam_destroy1(state.bam_record);
+        }
+        if(state.bam_idx != NULL) {
+            hts_idx_destroy(state.bam_idx);
+        }
+        if(state.bam_hdr != NULL) {
+            bam_hdr_destroy(state.bam_hdr);
+        }
+        if(state.bam_fh != NULL) {
+            sam_close(state.bam_fh);
+        }
+    }
+    delete m_binary_reader;
+}
+
+bool SavedEventAlignments::get(const bam_hdr_t* hdr,
+                               const bam1_t* base_record,
+                               int strand_idx,
+                               SavedStrandAlignment& out)
+{
+    out.events.clear();
+    out.ref_name = hdr->target_name[base_record->core.tid];
+    out.contig_id = base_record->core.tid;
+
+    std::string read_name = bam_get_qname(base_record);
+    int ref_start = base_record->core.pos;
+    int ref_end = bam_endpos(base_record);
+
+    if(m_binary_reader != NULL) {
+        return get_from_binary(read_name, out.ref_name, ref_start, ref_end, strand_idx, bam_is_rev(base_record), out);
+    } else {
+        return get_from_bam(read_name, out.ref_name, ref_start, ref_end, strand_idx, out);
+    }
+}
+
+bool SavedEventAlignments::get_from_bam(const std::string& read_name,
+                                        const std::string& ref_name,
+                                        int ref_start,
+                                        int ref_end,
+                                        int strand_idx,
+                                        SavedStrandAlignment& out)
+{
+    int tid = omp_get_thread_num();
+    assert(tid < (int)m_thread_state.size());
+    ThreadState& state = m_thread_state[tid];
+
+    if(state.bam_fh == NULL) {
+        state.bam_fh = sam_open(m_filename.c_str(), "r");
+        if(state.bam_fh == NULL) {
+            fprintf(stderr, "Error: could not open %s\n", m_filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        state.bam_idx = sam_index_load(state.bam_fh, m_filename.c_str());
+        if(state.bam_idx == NULL) {
+            bam_index_error_exit(m_filename);
+        }
+        state.bam_hdr = sam_hdr_read(state.bam_fh);
+        state.bam_record = bam_init1();
+    }
+
+    int contig_id = bam_name2id(state.bam_hdr, ref_name.c_str());
+    if(contig_id < 0) {
+        return false;
+    }
+
+    // eventalign names the records of each strand <read>.template and <read>.complement
+    std::string qname = read_name + (strand_idx == T_IDX ? ".template" : ".complement");
+
+    hts_itr_t* itr = sam_itr_queryi(state.bam_idx, contig_id, ref_start, ref_end);
+    bool found = false;
+    while(!found && sam_itr_next(state.bam_fh, itr, state.bam_record) >= 0) {
+        found = qname == bam_get_qname(state.bam_record);
+    }
+    sam_itr_destroy(itr);
+
+    if(!found) {
+        return false;
+    }
+
+    const bam1_t* record = state.bam_record;
+    uint8_t* stride_tag = bam_aux_get(record, "ES");
+    if(stride_tag == NULL) {
+        fprintf(stderr, "Error: the record for %s in %s does not have an ES tag, is it an event bam?\n",
+                        qname.c_str(), m_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+    int event_stride = bam_aux2i(stride_tag);
+    out.rc = bam_is_rev(record);
+
+    // Walk the cigar like get_aligned_pairs, but also keep the events that
+    // were inserted, as these are the additional events at a reference position
+    const uint32_t* cigar = bam_get_cigar(record);
+    int ref_pos = record->core.pos;
+    int event_idx = 0;
+    for(uint32_t ci = 0; ci < record->core.n_cigar; ++ci) {
+        int cigar_len = bam_cigar_oplen(cigar[ci]);
+        int cigar_op = bam_cigar_op(cigar[ci]);
+
+        if(cigar_op == BAM_CMATCH) {
+            for(int j = 0; j < cigar_len; ++j) {
+                out.events.push_back({ ref_pos, event_idx, 'M' });
+                ref_pos += 1;
+                event_idx += event_stride;
+            }
+        } else if(cigar_op == BAM_CINS) {
+            assert(!out.events.empty());
+            for(int j = 0; j < cigar_len; ++j) {
+                out.events.push_back({ ref_pos - 1, event_idx, 'E' });
+                event_idx += event_stride;
+            }
+        } else if(cigar_op == BAM_CDEL) {
+            ref_pos += cigar_len;
+        } else if(cigar_op == BAM_CSOFT_CLIP) {
+            // the clip is the index of the first aligned event
+            event_idx += cigar_len;
+        }
+    }
+    return !out.events.empty();
+}
+
+bool SavedEventAlignments::get_from_binary(const std::string& read_name,
+                                           const std::string& ref_name,
+                                           int ref_start,
+                                           int ref_end,
+                                           int strand_idx,
+                                           bool base_rc,
+                                           SavedStrandAlignment& out)
+{
+    int tid = omp_get_thread_num();
+    assert(tid < (int)m_thread_state.size());
+    ThreadState& state = m_thread_state[tid];
+
+    auto read_itr = m_chunks_by_read.find(read_name);
+    auto contig_itr = m_contig_ids.find(ref_name);
+    if(read_itr == m_chunks_by_read.end() || contig_itr == m_contig_ids.end()) {
+        return false;
+    }
+    uint32_t contig_id = contig_itr->second;
+
+    // a read has one id for each of its alignments, use the one that overlaps the base alignment
+    for(const ChunkRange& range : read_itr->second) {
+        for(uint32_t ci = range.first_chunk; ci <= range.last_chunk; ++ci) {
+
+            // consecutive reads are usually in the same chunk so the last chunk is kept
+            if(state.cached_chunk != (int64_t)ci) {
+                m_binary_reader->read_chunk(ci, state.chunk, state.compressed, state.uncompressed);
+                state.cached_chunk = ci;
+            }
+
+            const EventalignChunk& chunk = state.chunk;
+            for(size_t i = 0; i < chunk.size(); ++i) {
+                if(chunk.read_id[i] != range.read_id ||
+                   chunk.strand_idx[i] != strand_idx ||
+                   chunk.contig_id[i] != contig_id ||
+                   chunk.position[i] < ref_start ||
+                   chunk.position[i] > ref_end) {
+                    continue;
+                }
+
+                // events that were not assigned to a k-mer are written without a model k-mer
+                char hmm_state = 'M';
+                if(chunk.model_kmer[i] == EVENTALIGN_KMER_NONE) {
+                    hmm_state = 'B';
+                } else if(!out.events.empty() && out.events.back().ref_position == chunk.position[i]) {
+                    hmm_state = 'E';
+                }
+                out.events.push_back({ chunk.position[i], chunk.event_idx[i], hmm_state });
+            }
+        }
+
+        if(!out.events.empty()) {
+            break;
+        }
+    }
+
+    // the binary format does not store the strand of the alignment, it follows from the base alignment
+    out.rc = strand_idx == T_IDX ? base_rc : !base_rc;
+    return !out.events.empty();
+}
+
+EventAlignmentRecord saved_alignment_to_event_record(SquiggleRead* sr,
+                                                     int strand_idx,
+                                                     const SavedStrandAlignment& saved)
+{
+    EventAlignmentRecord record;
+    record.sr = sr;
+    record.rc = saved.rc;
+    record.strand = strand_idx;
+
+    for(const SavedAlignedEvent& e : saved.events) {
+        if(e.hmm_state == 'B' || e.event_idx < 0 || e.event_idx >= (int)sr->events[strand_idx].size()) {
+            continue;
+        }
+
+        if(record.aligned_events.empty() || record.aligned_events.back().ref_pos != e.ref_position) {
+            record.aligned_events.push_back({ e.ref_position, e.event_idx });
+        }
+    }
+
+    record.stride = record.aligned_events.empty() ||
+                    record.aligned_events.front().read_pos < record.aligned_events.back().read_pos ? 1 : -1;
+    return record;
+}
+
+std::vector<EventAlignment> saved_alignment_to_event_alignment(const SavedStrandAlignment& saved,
+                                                               const PackedReference* reference,
+                                                               const Alphabet* alphabet,
+                                                               size_t k,
+                                                               size_t read_idx,
+                                                               int strand_idx)
+{
+    std::vector<EventAlignment> alignment;
+    if(saved.events.empty()) {
+        return alignment;
+    }
+
+    // the events are in reference order
+    int ref_offset = saved.events.front().ref_position;
+    int ref_last = saved.events.back().ref_position;
+    assert(ref_last >= ref_offset);
+
+    int fetched_len = 0;
+    std::string ref_seq = get_reference_region_ts(reference, saved.ref_name.c_str(), ref_offset,
+                                                  ref_last + k - 1, &fetched_len);
+    ref_seq = alphabet->disambiguate(ref_seq);
+
+    alignment.reserve(saved.events.size());
+    for(const SavedAlignedEvent& e : saved.events) {
+        size_t kmer_start = e.ref_position - ref_offset;
+        if(kmer_start + k > ref_seq.size()) {
+            continue;
+        }
+
+        EventAlignment ea;
+        ea.ref_contig_id = saved.contig_id;
+        ea.ref_position = e.ref_position;
+        ea.ref_kmer_rank = alphabet->kmer_rank(ref_seq.c_str() + kmer_start, k);
+        ea.k = k;
+        ea.read_idx = read_idx;
+        ea.strand_idx = strand_idx;
+        ea.event_idx = e.event_idx;
+        ea.rc = saved.rc;
+        ea.hmm_state = e.hmm_state;
+
+        if(ea.hmm_state == 'B') {
+            ea.model_kmer_rank = EVENT_ALIGNMENT_NO_KMER;
+        } else if(ea.rc) {
+            std::string rc_kmer = alphabet->reverse_complement(ref_seq.substr(kmer_start, k));
+            ea.model_kmer_rank = alphabet->kmer_rank(rc_kmer.c_str(), k);
+        } else {
+            ea.model_kmer_rank = ea.ref_kmer_rank;
+        }
+        alignment.push_back(ea);
+    }
+    return alignment;
+}
@@ -0,0 +1,129 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_saved_event_alignments -- look up the event
+// alignments of a read that were saved by eventalign, so
+// they do not have to be recomputed
+//
+// Either the bam written by eventalign --sam (which must be
+// indexed) or the output of eventalign --format=binary can be
+// used. The event indices refer to the full event table of the
+// read so the alignments must be made without a window, and
+// the reads must be loaded without slicing their signal.
+//
+#ifndef NANOPOLISH_SAVED_EVENT_ALIGNMENTS_H
+#define NANOPOLISH_SAVED_EVENT_ALIGNMENTS_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "htslib/sam.h"
+#include "nanopolish_alphabet.h"
+#include "nanopolish_alignment_db.h"
+#include "nanopolish_eventalign.h"
+#include "nanopolish_eventalign_binary.h"
+
+// One aligned event. hmm_state is M for the first event aligned to a
+// reference position, E for the following events at the same position
+// and B for events that were not assigned to the reference (binary only).
+struct SavedAlignedEvent
+{
+    int ref_position;
+    int event_idx;
+    char hmm_state;
+};
+
+// The saved alignment of one strand of a read, in the order eventalign emitted it
+struct SavedStrandAlignment
+{
+    std::string ref_name;
+    int32_t contig_id; // in the header of the bam the read was looked up with
+    uint8_t rc;
+    std::vector<SavedAlignedEvent> events;
+};
+
+class SavedEventAlignments
+{
+    public:
+        // filename is an event bam or binary eventalign file, num_threads
+        // is the number of worker threads that will look up alignments
+        SavedEventAlignments(const std::string& filename, int num_threads);
+        ~SavedEventAlignments();
+
+        // Find the saved alignment of a strand of the read aligned by base_record.
+        // Returns false if the file has no alignment for this read strand.
+        // Must be called from an omp thread with index less than num_threads.
+        bool get(const bam_hdr_t* hdr,
+                 const bam1_t* base_record,
+                 int strand_idx,
+                 SavedStrandAlignment& out);
+
+    private:
+        SavedEventAlignments(const SavedEventAlignments&) = delete;
+        SavedEventAlignments& operator=(const SavedEventAlignments&) = delete;
+
+        bool get_from_bam(const std::string& read_name,
+                          const std::string& ref_name,
+                          int ref_start,
+                          int ref_end,
+                          int strand_idx,
+                          SavedStrandAlignment& out);
+
+        bool get_from_binary(const std::string& read_name,
+                             const std::string& ref_name,
+                             int ref_start,
+                             int ref_end,
+                             int strand_idx,
+                             bool base_rc,
+                             SavedStrandAlignment& out);
+
+        // the handles and buffers of one worker thread
+        struct ThreadState
+        {
+            htsFile* bam_fh = NULL;
+            bam_hdr_t* bam_hdr = NULL;
+            hts_idx_t* bam_idx = NULL;
+            bam1_t* bam_record = NULL;
+
+            int64_t cached_chunk = -1;
+            EventalignChunk chunk;
+            std::vector<char> compressed;
+            std::vector<char> uncompressed;
+        };
+
+        // the range of chunks that hold the rows of a read in the binary file
+        struct ChunkRange
+        {
+            uint32_t read_id;
+            uint32_t first_chunk;
+            uint32_t last_chunk;
+        };
+
+        std::string m_filename;
+        std::vector<ThreadState> m_thread_state;
+
+        // binary input
+        EventalignBinaryReader* m_binary_reader;
+        std::unordered_map<std::string, std::vector<ChunkRange>> m_chunks_by_read;
+        std::unordered_map<std::string, uint32_t> m_contig_ids;
+};
+
+// Convert a saved alignment to the event-to-reference map used by the
+// methylation caller and phasing. Only the first event aligned to each
+// reference position is used, as when reading an event bam in AlignmentDB.
+EventAlignmentRecord saved_alignment_to_event_record(SquiggleRead* sr,
+                                                     int strand_idx,
+                                                     const SavedStrandAlignment& saved);
+
+// Expand a saved alignment into the output of align_read_to_ref. The k-mers
+// are taken from the reference and read with the given alphabet.
+std::vector<EventAlignment> saved_alignment_to_event_alignment(const SavedStrandAlignment& saved,
+                                                               const PackedReference* reference,
+                                                               const Alphabet* alphabet,
+                                                               size_t k,
+                                                               size_t read_idx,
+                                                               int strand_idx);
+
+#endif
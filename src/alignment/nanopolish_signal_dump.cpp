@@ -0,0 +1,100 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_signal_dump -- the scaled signal of each read
+// strand in a flat binary file that can be memory mapped
+//
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nanopolish_signal_dump.h"
+
+#define SIGNAL_DUMP_MAGIC "NPSIG\x01\x00\x00"
+#define SIGNAL_DUMP_END_MAGIC "NPSIGEND"
+
+//
+// SignalDumpWriter
+//
+SignalDumpWriter::SignalDumpWriter(const std::string& filename) : m_filename(filename), m_offset(0)
+{
+    m_fp = fopen(filename.c_str(), "wb");
+    if(m_fp == NULL) {
+        fprintf(stderr, "Error: could not open %s for writing\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    SignalDumpHeader header;
+    memcpy(header.magic, SIGNAL_DUMP_MAGIC, sizeof(header.magic));
+    header.flags = 0;
+    header.reserved = 0;
+    write(&header, sizeof(header));
+}
+
+SignalDumpWriter::~SignalDumpWriter()
+{
+    close();
+}
+
+void SignalDumpWriter::write(const void* data, size_t count)
+{
+    if(fwrite(data, 1, count, m_fp) != count) {
+        fprintf(stderr, "Error: could not write to %s\n", m_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+    m_offset += count;
+}
+
+void SignalDumpWriter::add(size_t read_idx,
+                           const std::string& read_name,
+                           uint32_t strand_idx,
+                           size_t sample_start,
+                           const std::vector<float>& samples)
+{
+    assert(m_fp != NULL);
+
+    SignalDumpBlock block;
+    block.read_idx = read_idx;
+    block.data_offset = m_offset;
+    block.sample_start = sample_start;
+    block.num_samples = samples.size();
+    block.name_offset = m_names.size();
+    block.name_length = read_name.size();
+    block.strand_idx = strand_idx;
+    m_blocks.push_back(block);
+    m_names.append(read_name);
+
+    write(samples.data(), samples.size() * sizeof(float));
+}
+
+void SignalDumpWriter::close()
+{
+    if(m_fp == NULL) {
+        return;
+    }
+
+    // the samples are 4 byte aligned, pad so the footer is 8 byte aligned
+    static const char padding[8] = { 0 };
+    write(padding, (8 - m_offset % 8) % 8);
+
+    SignalDumpFooter footer;
+    footer.num_blocks = m_blocks.size();
+    footer.names_size = m_names.size();
+
+    SignalDumpTrailer trailer;
+    trailer.footer_offset = m_offset;
+    memcpy(trailer.magic, SIGNAL_DUMP_END_MAGIC, sizeof(trailer.magic));
+
+    write(&footer, sizeof(footer));
+    write(m_blocks.data(), m_blocks.size() * sizeof(SignalDumpBlock));
+    write(m_names.data(), m_names.size());
+    write(padding, (8 - m_offset % 8) % 8);
+    write(&trailer, sizeof(trailer));
+
+    if(fclose(m_fp) != 0) {
+        fprintf(stderr, "Error: could not write to %s\n", m_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+    m_fp = NULL;
+}
@@ -0,0 +1,87 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_signal_dump -- the scaled signal of each read
+// strand in a flat binary file that can be memory mapped
+//
+// The file is a header, the samples of each block stored as
+// contiguous float arrays, and a footer holding the block
+// index and the read names. A block holds the samples of one
+// read strand scaled to its pore model (shift, scale and drift
+// removed). sample_start is the index of the first sample in
+// the raw signal of the read, which is what the start_idx and
+// end_idx columns of eventalign --signal-index refer to.
+//
+#ifndef NANOPOLISH_SIGNAL_DUMP_H
+#define NANOPOLISH_SIGNAL_DUMP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct SignalDumpHeader
+{
+    char magic[8];
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+// index entry for the samples of one read strand
+struct SignalDumpBlock
+{
+    uint64_t read_idx;
+    uint64_t data_offset;
+    uint64_t sample_start;
+    uint64_t num_samples;
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t strand_idx;
+};
+
+// the start of the footer: the block index and then the names follow
+struct SignalDumpFooter
+{
+    uint64_t num_blocks;
+    uint64_t names_size;
+};
+
+// the last bytes of the file, pointing at the footer
+struct SignalDumpTrailer
+{
+    uint64_t footer_offset;
+    char magic[8];
+};
+
+class SignalDumpWriter
+{
+    public:
+        SignalDumpWriter(const std::string& filename);
+        ~SignalDumpWriter();
+
+        // append the scaled samples of a read strand
+        void add(size_t read_idx,
+                 const std::string& read_name,
+                 uint32_t strand_idx,
+                 size_t sample_start,
+                 const std::vector<float>& samples);
+
+        // write the footer and close the file
+        void close();
+
+    private:
+        SignalDumpWriter(const SignalDumpWriter&) = delete;
+        SignalDumpWriter& operator=(const SignalDumpWriter&) = delete;
+
+        void write(const void* data, size_t count);
+
+        std::string m_filename;
+        FILE* m_fp;
+        uint64_t m_offset;
+        std::vector<SignalDumpBlock> m_blocks;
+        std::string m_names;
+};
+
+#endif
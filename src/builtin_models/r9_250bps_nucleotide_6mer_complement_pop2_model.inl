@@ -4113,15 +4113,16 @@ PoreModel initialize_r9_250bps_nucleotide_6mer_complement_pop2_model_builtin()
 	tmp.shift_offset = 0.0;
 	tmp.scale_offset = 0.0;
 	tmp.is_scaled = false;
-	tmp.states.resize(4096);
+	std::vector<PoreModelStateParams> states(4096);
 	for(size_t i = 0; i < 4096; ++i) {
-		tmp.states[i].level_mean = initialize_r9_250bps_nucleotide_6mer_complement_pop2_model_builtin_data[4*i + 0];
-		tmp.states[i].level_stdv = initialize_r9_250bps_nucleotide_6mer_complement_pop2_model_builtin_data[4*i + 1];
-		tmp.states[i].sd_mean = initialize_r9_250bps_nucleotide_6mer_complement_pop2_model_builtin_data[4*i + 2];
-		tmp.states[i].sd_stdv = initialize_r9_250bps_nucleotide_6mer_complement_pop2_model_builtin_data[4*i + 3];
-		tmp.states[i].update_sd_lambda();
-		tmp.states[i].update_logs();
+		states[i].level_mean = initialize_r9_250bps_nucleotide_6mer_complement_pop2_model_builtin_data[4*i + 0];
+		states[i].level_stdv = initialize_r9_250bps_nucleotide_6mer_complement_pop2_model_builtin_data[4*i + 1];
+		states[i].sd_mean = initialize_r9_250bps_nucleotide_6mer_complement_pop2_model_builtin_data[4*i + 2];
+		states[i].sd_stdv = initialize_r9_250bps_nucleotide_6mer_complement_pop2_model_builtin_data[4*i + 3];
+		states[i].update_sd_lambda();
+		states[i].update_logs();
 	}
+	tmp.set_states(states);
 	tmp.pmalphabet = best_alphabet("ACTG");
 	tmp.set_metadata("r9_250bps", "complement.pop2");
 	return tmp;
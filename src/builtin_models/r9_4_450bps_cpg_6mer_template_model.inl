@@ -15642,15 +15642,16 @@ PoreModel initialize_r9_4_450bps_cpg_6mer_template_model_builtin()
 	tmp.shift_offset = 0.0;
 	tmp.scale_offset = 0.0;
 	tmp.is_scaled = false;
-	tmp.states.resize(15625);
+	std::vector<PoreModelStateParams> states(15625);
 	for(size_t i = 0; i < 15625; ++i) {
-		tmp.states[i].level_mean = initialize_r9_4_450bps_cpg_6mer_template_model_builtin_data[4*i + 0];
-		tmp.states[i].level_stdv = initialize_r9_4_450bps_cpg_6mer_template_model_builtin_data[4*i + 1];
-		tmp.states[i].sd_mean = initialize_r9_4_450bps_cpg_6mer_template_model_builtin_data[4*i + 2];
-		tmp.states[i].sd_stdv = initialize_r9_4_450bps_cpg_6mer_template_model_builtin_data[4*i + 3];
-		tmp.states[i].update_sd_lambda();
-		tmp.states[i].update_logs();
+		states[i].level_mean = initialize_r9_4_450bps_cpg_6mer_template_model_builtin_data[4*i + 0];
+		states[i].level_stdv = initialize_r9_4_450bps_cpg_6mer_template_model_builtin_data[4*i + 1];
+		states[i].sd_mean = initialize_r9_4_450bps_cpg_6mer_template_model_builtin_data[4*i + 2];
+		states[i].sd_stdv = initialize_r9_4_450bps_cpg_6mer_template_model_builtin_data[4*i + 3];
+		states[i].update_sd_lambda();
+		states[i].update_logs();
 	}
+	tmp.set_states(states);
 	tmp.pmalphabet = best_alphabet("ACMTG");
 	tmp.set_metadata("r9.4_450bps", "template");
 	return tmp;
@@ -87,7 +87,24 @@ class Alphabet
             }
             return r;
         }
-        
+
+        // write the kmer of length k with the given lexicographic rank to out,
+        // the inverse of kmer_rank
+        inline void kmer_from_rank(uint32_t rank, uint32_t k, char* out) const
+        {
+            for(uint32_t i = 0; i < k; ++i) {
+                out[k - i - 1] = base(rank % size());
+                rank /= size();
+            }
+        }
+
+        inline std::string kmer_from_rank(uint32_t rank, uint32_t k) const
+        {
+            std::string str(k, 'A');
+            kmer_from_rank(rank, k, &str[0]);
+            return str;
+        }
+
         // Increment the input string to be the next sequence in lexicographic order
         inline void lexicographic_next(std::string& str) const
         {
@@ -9,10 +9,95 @@
 //
 #include "nanopolish_bam_processor.h"
 #include "nanopolish_common.h"
+#include "nanopolish_bam_utils.h"
 #include <assert.h>
 #include <omp.h>
 #include <vector>
+#include <algorithm>
+#include <thread>
 #include <hdf5.h>
+#include "nanopolish_bounded_queue.h"
+#include "nanopolish_output_writer.h"
+
+// a record waiting to be processed
+struct ScheduledRecord
+{
+    bam1_t* record;
+    size_t read_idx;
+    double cost;
+};
+
+// The records that are ready to be processed. Up to capacity records wait
+// here and pop() returns the most expensive one, so long reads start early
+// rather than holding up the end of the run. A record that has been passed
+// over until max_age later records have arrived is returned regardless of
+// cost, so cheap reads are not held back indefinitely.
+class RecordSchedule
+{
+    public:
+        RecordSchedule(size_t capacity, size_t max_age) : m_capacity(capacity),
+                                                          m_max_age(max_age),
+                                                          m_newest_idx(0),
+                                                          m_closed(false) {}
+
+        void push(const ScheduledRecord& sr)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_full.wait(lock, [this] { return m_records.size() < m_capacity; });
+            m_records.push_back(sr);
+            m_newest_idx = std::max(m_newest_idx, sr.read_idx);
+            m_not_empty.notify_one();
+        }
+
+        // returns false once the schedule is closed and empty
+        bool pop(ScheduledRecord& sr)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_empty.wait(lock, [this] { return !m_records.empty() || m_closed; });
+            if(m_records.empty()) {
+                return false;
+            }
+
+            size_t best_idx = 0;
+            size_t oldest_idx = 0;
+            for(size_t i = 1; i < m_records.size(); ++i) {
+                if(m_records[i].cost > m_records[best_idx].cost) {
+                    best_idx = i;
+                }
+                if(m_records[i].read_idx < m_records[oldest_idx].read_idx) {
+                    oldest_idx = i;
+                }
+            }
+
+            if(m_newest_idx - m_records[oldest_idx].read_idx > m_max_age) {
+                best_idx = oldest_idx;
+            }
+
+            sr = m_records[best_idx];
+            m_records[best_idx] = m_records.back();
+            m_records.pop_back();
+            m_not_full.notify_one();
+            return true;
+        }
+
+        void close()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_closed = true;
+            m_not_empty.notify_all();
+        }
+
+    private:
+        std::vector<ScheduledRecord> m_records;
+        size_t m_capacity;
+        size_t m_max_age;
+        size_t m_newest_idx;
+        bool m_closed;
+
+        std::mutex m_mutex;
+        std::condition_variable m_not_full;
+        std::condition_variable m_not_empty;
+};
 
 BamProcessor::BamProcessor(const std::string& bam_file,
                            const std::string& region,
@@ -22,15 +107,31 @@ BamProcessor::BamProcessor(const std::string& bam_file,
                             m_num_threads(num_threads)
 
 {
-    // load bam file
+    // load bam file, "-" reads from stdin
     m_bam_fh = sam_open(m_bam_file.c_str(), "r");
-    assert(m_bam_fh != NULL);
+    if(m_bam_fh == NULL) {
+        fprintf(stderr, "Error: could not open %s for read\n", m_bam_file.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    // decompress the bam using the shared htslib thread pool
+    attach_hts_thread_pool(m_bam_fh);
+
+    // The index is only needed to jump to a region. Without a region the
+    // input is streamed from start to end, so it can be an unsorted,
+    // unindexed sam/bam file or a pipe.
+    m_bam_idx = NULL;
+    if(!m_region.empty()) {
+        if(m_bam_file == "-") {
+            fprintf(stderr, "Error: a window cannot be used when reading alignments from stdin\n");
+            exit(EXIT_FAILURE);
+        }
 
-    // load bam index file
-    std::string index_filename = m_bam_file + ".bai";
-    m_bam_idx = bam_index_load(index_filename.c_str());
-    if(m_bam_idx == NULL) {
-        bam_index_error_exit(m_bam_file);
+        std::string index_filename = m_bam_file + ".bai";
+        m_bam_idx = bam_index_load(index_filename.c_str());
+        if(m_bam_idx == NULL) {
+            bam_index_error_exit(m_bam_file);
+        }
     }
 
     // read the bam header
@@ -42,7 +143,26 @@ BamProcessor::~BamProcessor()
 {
     bam_hdr_destroy(m_hdr);
     sam_close(m_bam_fh);
-    hts_idx_destroy(m_bam_idx);
+    if(m_bam_idx != NULL) {
+        hts_idx_destroy(m_bam_idx);
+    }
+}
+
+double BamProcessor::aligned_length_cost(const bam_hdr_t* hdr,
+                                         const bam1_t* record,
+                                         int region_start,
+                                         int region_end)
+{
+    int start = record->core.pos;
+    int end = bam_endpos(record);
+    if(region_start != -1) {
+        start = std::max(start, region_start);
+    }
+
+    if(region_end != -1) {
+        end = std::min(end, region_end);
+    }
+    return std::max(end - start, 1);
 }
 
 void BamProcessor::parallel_run( std::function<void(const bam_hdr_t* hdr, 
@@ -52,17 +172,21 @@ void BamProcessor::parallel_run( std::function<void(const bam_hdr_t* hdr,
                                            int region_end)> func)
 {
     assert(m_bam_fh != NULL);
-    assert(m_bam_idx != NULL);
     assert(m_hdr != NULL);
-    hts_itr_t* itr;
+
+    // the input can only be read once when streaming
+    assert(!m_has_run || m_bam_idx != NULL);
+    m_has_run = true;
+
+    // without a region the records are read sequentially and itr is NULL
+    hts_itr_t* itr = NULL;
 
     // If processing a region of the genome, pass clipping coordinates to the work function
     int clip_start = -1;
     int clip_end = -1;
 
-    if(m_region.empty()) {
-        itr = sam_itr_queryi(m_bam_idx, HTS_IDX_START, 0, 0);
-    } else {
+    if(!m_region.empty()) {
+        assert(m_bam_idx != NULL);
         fprintf(stderr, "[bam process] iterating over region: %s\n", m_region.c_str());
         itr = sam_itr_querys(m_bam_idx, m_hdr, m_region.c_str());
         hts_parse_reg(m_region.c_str(), &clip_start, &clip_end);
@@ -80,48 +204,125 @@ void BamProcessor::parallel_run( std::function<void(const bam_hdr_t* hdr,
     int prev_num_threads = omp_get_num_threads();
     omp_set_num_threads(m_num_threads);
 
-    // Initialize iteration
-    std::vector<bam1_t*> records(m_batch_size, NULL);
-    for(size_t i = 0; i < records.size(); ++i) {
-        records[i] = bam_init1();
+    // Processing is split into three stages connected by bounded queues:
+    //  1) a decoder thread reads records from the bam file, with the
+    //     decompression done by the shared htslib thread pool
+    //  2) a prefetch thread runs the prefetch function on each record, so
+    //     the signal data for the read is being loaded before it is needed
+    //  3) the worker threads run the work function, each taking the most
+    //     expensive record waiting in the schedule when it becomes free
+    // Records are recycled through a fixed pool so the number held in
+    // memory at once is bounded by the queue sizes.
+    size_t pool_size = m_prefetch_size + m_batch_size + m_num_threads;
+    BoundedQueue<bam1_t*> free_records(pool_size);
+    std::vector<bam1_t*> all_records(pool_size, NULL);
+    for(size_t i = 0; i < all_records.size(); ++i) {
+        all_records[i] = bam_init1();
+        free_records.push(all_records[i]);
     }
 
-    int result;
-    size_t num_reads_realigned = 0;
-    size_t num_records_buffered = 0;
-
-    do {
-        assert(num_records_buffered < records.size());
-
-        // read a record into the next slot in the buffer
-        result = sam_itr_next(m_bam_fh, itr, records[num_records_buffered]);
-        num_records_buffered += result >= 0;
-
-        // realign if we've hit the max buffer size or reached the end of file
-        if(num_records_buffered == records.size() || result < 0 || (num_records_buffered + num_reads_realigned == m_max_reads)) {
-            #pragma omp parallel for
-            for(size_t i = 0; i < num_records_buffered; ++i) {
-                bam1_t* record = records[i];
-                size_t read_idx = num_reads_realigned + i;
-                if( (record->core.flag & BAM_FUNMAP) == 0) {
-                    func(m_hdr, record, read_idx, clip_start, clip_end);
+    BoundedQueue<ScheduledRecord> prefetch_queue(m_prefetch_size);
+    RecordSchedule schedule(m_batch_size, 2 * m_batch_size);
+
+    // stage 1: decode
+    size_t num_records_read = 0;
+    std::thread decoder([&] {
+        while(num_records_read < m_max_reads) {
+
+            // apply backpressure from the output, the workers are never
+            // blocked so the reads the output is waiting on can finish
+            if(m_output_writer != NULL) {
+                m_output_writer->wait_for_space();
+            }
+
+            bam1_t* record;
+            free_records.pop(record);
+            int result = itr != NULL ? sam_itr_next(m_bam_fh, itr, record) : sam_read1(m_bam_fh, m_hdr, record);
+            if(result < 0) {
+                free_records.push(record);
+                break;
+            }
+
+            size_t read_idx = num_records_read++;
+            if( (record->core.flag & BAM_FUNMAP) == 0) {
+                prefetch_queue.push({ record, read_idx, m_cost_func(m_hdr, record, clip_start, clip_end) });
+            } else {
+                if(m_output_writer != NULL) {
+                    m_output_writer->skip(read_idx);
                 }
+                free_records.push(record);
             }
+        }
+        prefetch_queue.close();
+    });
 
-            num_reads_realigned += num_records_buffered;
-            num_records_buffered = 0;
+    // stage 2: prefetch
+    std::thread prefetcher([&] {
+        ScheduledRecord sr;
+        while(prefetch_queue.pop(sr)) {
+            if(m_prefetch_func) {
+                m_prefetch_func(m_hdr, sr.record);
+            }
+            schedule.push(sr);
         }
-    } while(result >= 0 && num_reads_realigned < m_max_reads);
+        schedule.close();
+    });
 
-    assert(num_records_buffered == 0);
+    // stage 3: process, with per-thread accounting for the utilization statistics
+    std::vector<double> busy_time(m_num_threads, 0.0);
+    std::vector<size_t> thread_records(m_num_threads, 0);
+    double start_time = omp_get_wtime();
+
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        ScheduledRecord work;
+        while(schedule.pop(work)) {
+            double t0 = omp_get_wtime();
+            func(m_hdr, work.record, work.read_idx, clip_start, clip_end);
+            busy_time[tid] += omp_get_wtime() - t0;
+            thread_records[tid] += 1;
+            free_records.push(work.record);
+        }
+    }
+
+    decoder.join();
+    prefetcher.join();
+
+    if(m_verbose > 0) {
+        double elapsed = omp_get_wtime() - start_time;
+        double total_busy = 0.0;
+        double min_busy = busy_time.empty() ? 0.0 : busy_time[0];
+        double max_busy = 0.0;
+        size_t num_records_processed = 0;
+        for(size_t i = 0; i < busy_time.size(); ++i) {
+            total_busy += busy_time[i];
+            min_busy = std::min(min_busy, busy_time[i]);
+            max_busy = std::max(max_busy, busy_time[i]);
+            num_records_processed += thread_records[i];
+        }
+
+        double denom = elapsed > 0.0 ? elapsed : 1.0;
+        fprintf(stderr, "[bam process] processed %zu of %zu records in %.1lfs with %d threads\n", 
+            num_records_processed, num_records_read, elapsed, m_num_threads);
+        fprintf(stderr, "[bam process] thread utilization %.1lf%% (min %.1lf%% max %.1lf%%)\n",
+            100.0 * total_busy / (denom * m_num_threads), 100.0 * min_busy / denom, 100.0 * max_busy / denom);
+        if(m_verbose > 1) {
+            for(size_t i = 0; i < busy_time.size(); ++i) {
+                fprintf(stderr, "[bam process]   thread %zu: %zu records, busy %.1lfs\n", i, thread_records[i], busy_time[i]);
+            }
+        }
+    }
 
     // restore number of threads
     omp_set_num_threads(prev_num_threads);
  
     // cleanup   
-    for(size_t i = 0; i < records.size(); ++i) {
-        bam_destroy1(records[i]);
+    for(size_t i = 0; i < all_records.size(); ++i) {
+        bam_destroy1(all_records[i]);
     }
 
-    sam_itr_destroy(itr);
+    if(itr != NULL) {
+        sam_itr_destroy(itr);
+    }
 }
@@ -15,10 +15,15 @@
 #include "htslib/hts.h"
 #include "htslib/sam.h"
 
+class OutputWriter;
+
 class BamProcessor
 {
 
     public:
+        // bam_filename can be "-" to read from stdin. When region is empty
+        // the records are streamed in file order and no index is required,
+        // so the input does not need to be sorted.
         BamProcessor(const std::string& bam_filename, 
                      const std::string& region,
                      const int num_threads);
@@ -30,6 +35,34 @@ class BamProcessor
         // place a limit on the number of reads to process before stopping
         void set_max_reads(size_t max) { m_max_reads = max; }
 
+        // print thread utilization statistics after processing
+        void set_verbose(int verbose) { m_verbose = verbose; }
+
+        // set the function used to estimate the work required for a record.
+        // Records with the highest cost are processed first.
+        void set_cost_function(std::function<double(const bam_hdr_t* hdr,
+                                                    const bam1_t* record,
+                                                    int region_start,
+                                                    int region_end)> func) { m_cost_func = func; }
+
+        // set a function that is called for each record, on a separate thread, before
+        // the record is processed. This is used to start reading the signal data
+        // for the read so it is available by the time the work function needs it.
+        void set_prefetch_function(std::function<void(const bam_hdr_t* hdr,
+                                                      const bam1_t* record)> func) { m_prefetch_func = func; }
+
+        // Set the writer that the work function submits its output to. The reads that
+        // are not passed to the work function are skipped in the writer and no more
+        // records are read while the writer has too much output waiting to be written.
+        void set_output_writer(OutputWriter* writer) { m_output_writer = writer; }
+
+        // the default cost estimate, the number of reference bases the record
+        // is aligned to within the region being processed
+        static double aligned_length_cost(const bam_hdr_t* hdr,
+                                          const bam1_t* record,
+                                          int region_start,
+                                          int region_end);
+
         // process each record in parallel, using the input function
         void parallel_run( std::function<void(const bam_hdr_t* hdr, 
                                      const bam1_t* record,
@@ -45,8 +78,17 @@ class BamProcessor
         hts_idx_t* m_bam_idx;
         bam_hdr_t* m_hdr;
 
+        std::function<double(const bam_hdr_t*, const bam1_t*, int, int)> m_cost_func = aligned_length_cost;
+        std::function<void(const bam_hdr_t*, const bam1_t*)> m_prefetch_func;
+        OutputWriter* m_output_writer = NULL;
+
+        // number of records waiting to be prefetched, and
+        // number of records buffered ahead of the worker threads
+        int m_prefetch_size = 32;
         int m_batch_size = 128;
         int m_num_threads = 1;
+        int m_verbose = 0;
+        bool m_has_run = false;
         size_t m_max_reads = -1;
 };
 
@@ -9,8 +9,14 @@
 //
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "htslib/thread_pool.h"
 #include "nanopolish_bam_utils.h"
 
+// the shared htslib thread pool, pool is NULL until initialized
+static htsThreadPool g_hts_thread_pool = { NULL, 0 };
+
 void write_bam_vardata(bam1_t* record,
                       const std::string& qname,
                       const std::vector<uint32_t> cigar,
@@ -79,3 +85,39 @@ void write_bam_vardata(bam1_t* record,
     }
     assert(record->l_data <= record->m_data);
 }
+
+void init_hts_thread_pool(int num_threads)
+{
+    // the pool is only worth having with more than one thread
+    if(g_hts_thread_pool.pool != NULL || num_threads <= 1) {
+        return;
+    }
+
+    g_hts_thread_pool.pool = hts_tpool_init(num_threads);
+    if(g_hts_thread_pool.pool == NULL) {
+        fprintf(stderr, "Error: could not create a thread pool with %d threads\n", num_threads);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void destroy_hts_thread_pool()
+{
+    if(g_hts_thread_pool.pool != NULL) {
+        hts_tpool_destroy(g_hts_thread_pool.pool);
+        g_hts_thread_pool.pool = NULL;
+    }
+}
+
+void attach_hts_thread_pool(htsFile* fp)
+{
+    if(g_hts_thread_pool.pool != NULL && fp != NULL) {
+        hts_set_thread_pool(fp, &g_hts_thread_pool);
+    }
+}
+
+void attach_hts_thread_pool(BGZF* fp)
+{
+    if(g_hts_thread_pool.pool != NULL && fp != NULL) {
+        bgzf_thread_pool(fp, g_hts_thread_pool.pool, g_hts_thread_pool.qsize);
+    }
+}
@@ -14,6 +14,7 @@
 #include <vector>
 #include "htslib/hts.h"
 #include "htslib/sam.h"
+#include "htslib/bgzf.h"
 
 // Allocate space for the variable-length fields
 // in the bam record, and write them. If aux
@@ -26,4 +27,16 @@ void write_bam_vardata(bam1_t* record,
                        const std::string& qual,
                        size_t aux_reserve = 0);
 
+// A single htslib thread pool is shared by every bam/sam file
+// the program opens, so (de)compression of all inputs and outputs
+// runs in parallel without creating threads per file.
+// init_hts_thread_pool should be called once, after parsing -t,
+// and destroy_hts_thread_pool after all files are closed.
+void init_hts_thread_pool(int num_threads);
+void destroy_hts_thread_pool();
+
+// attach the shared thread pool to an open file, if it has been initialized
+void attach_hts_thread_pool(htsFile* fp);
+void attach_hts_thread_pool(BGZF* fp);
+
 #endif
@@ -0,0 +1,71 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_bounded_queue -- a fixed-capacity queue
+// for passing work between threads. push() blocks
+// while the queue is full and pop() blocks while
+// it is empty, which bounds the memory used by a
+// pipeline of threads.
+//
+#ifndef NANOPOLISH_BOUNDED_QUEUE_H
+#define NANOPOLISH_BOUNDED_QUEUE_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <assert.h>
+
+template<typename T>
+class BoundedQueue
+{
+    public:
+        BoundedQueue(size_t capacity) : m_capacity(capacity), m_closed(false) { assert(capacity > 0); }
+
+        // add an item to the back of the queue, waiting for space if needed
+        void push(const T& item)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_full.wait(lock, [this] { return m_items.size() < m_capacity; });
+            m_items.push_back(item);
+            m_not_empty.notify_one();
+        }
+
+        // take the item at the front of the queue, waiting for one if needed
+        // returns false when the queue is closed and no items remain
+        bool pop(T& item)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_not_empty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+            if(m_items.empty()) {
+                return false;
+            }
+
+            item = m_items.front();
+            m_items.pop_front();
+            m_not_full.notify_one();
+            return true;
+        }
+
+        // signal that no more items will be pushed
+        void close()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_closed = true;
+            m_not_empty.notify_all();
+        }
+
+        size_t capacity() const { return m_capacity; }
+
+    private:
+        std::deque<T> m_items;
+        size_t m_capacity;
+        bool m_closed;
+
+        std::mutex m_mutex;
+        std::condition_variable m_not_full;
+        std::condition_variable m_not_empty;
+};
+
+#endif
@@ -75,6 +75,7 @@ struct GaussianParameters
 {
     GaussianParameters() : mean(0.0f), stdv(1.0f) { log_stdv = log(stdv); }
     GaussianParameters(float m, float s) : mean(m), stdv(s) { log_stdv = log(stdv); }
+    GaussianParameters(float m, float s, float ls) : mean(m), stdv(s), log_stdv(ls) {}
 
     float mean;
     float stdv;
@@ -0,0 +1,69 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_faidx_pool -- thread-safe access to an
+// indexed fasta file
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include "nanopolish_faidx_pool.h"
+
+FaidxPool::FaidxPool(const std::string& filename) : m_filename(filename)
+{
+    // load one handle up front so a missing index is reported immediately
+    release(acquire());
+}
+
+FaidxPool::~FaidxPool()
+{
+    for(faidx_t* fai : m_all) {
+        fai_destroy(fai);
+    }
+}
+
+faidx_t* FaidxPool::acquire() const
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(!m_free.empty()) {
+            faidx_t* fai = m_free.back();
+            m_free.pop_back();
+            return fai;
+        }
+    }
+
+    // no idle handle, open a new one outside of the lock
+    faidx_t* fai = fai_load(m_filename.c_str());
+    if(fai == NULL) {
+        fprintf(stderr, "Error: could not load the fasta index for %s\n", m_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_all.push_back(fai);
+    return fai;
+}
+
+void FaidxPool::release(faidx_t* fai) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free.push_back(fai);
+}
+
+char* FaidxPool::fetch_seq(const char* name, int start, int end, int* fetched_len) const
+{
+    faidx_t* fai = acquire();
+    char* seq = faidx_fetch_seq(fai, name, start, end, fetched_len);
+    release(fai);
+    return seq;
+}
+
+char* FaidxPool::fetch(const char* region, int* fetched_len) const
+{
+    faidx_t* fai = acquire();
+    char* seq = fai_fetch(fai, region, fetched_len);
+    release(fai);
+    return seq;
+}
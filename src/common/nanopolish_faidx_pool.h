@@ -0,0 +1,47 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_faidx_pool -- thread-safe access to an
+// indexed fasta file. A faidx_t cannot be used by two
+// threads at once, so each fetch borrows a handle from
+// a pool that grows to the number of concurrent callers.
+// Only taking and returning a handle is synchronized,
+// the fetch itself runs in parallel.
+//
+#ifndef NANOPOLISH_FAIDX_POOL_H
+#define NANOPOLISH_FAIDX_POOL_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include "htslib/faidx.h"
+
+class FaidxPool
+{
+    public:
+        // load the index for filename, exits if it cannot be loaded
+        FaidxPool(const std::string& filename);
+        ~FaidxPool();
+
+        // these match faidx_fetch_seq and fai_fetch, the returned string must be freed
+        char* fetch_seq(const char* name, int start, int end, int* fetched_len) const;
+        char* fetch(const char* region, int* fetched_len) const;
+
+    private:
+
+        FaidxPool(const FaidxPool&) = delete;
+        FaidxPool& operator=(const FaidxPool&) = delete;
+
+        faidx_t* acquire() const;
+        void release(faidx_t* fai) const;
+
+        std::string m_filename;
+
+        mutable std::mutex m_mutex;
+        mutable std::vector<faidx_t*> m_free;
+        mutable std::vector<faidx_t*> m_all;
+};
+
+#endif
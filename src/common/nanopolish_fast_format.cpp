@@ -0,0 +1,219 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_fast_format -- number formatting for the
+// tab-separated outputs
+//
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <assert.h>
+#include "nanopolish_fast_format.h"
+
+static const uint64_t POWERS_OF_TEN[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull,
+    1000000ull, 10000000ull, 100000000ull, 1000000000ull
+};
+
+// write the digits of value to the end of buf, returning a pointer to the first digit
+static inline char* write_digits(char* end, uint64_t value)
+{
+    char* p = end;
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while(value != 0);
+    return p;
+}
+
+void append_uint(std::string& out, uint64_t value)
+{
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* p = write_digits(end, value);
+    out.append(p, end - p);
+}
+
+void append_int(std::string& out, int64_t value)
+{
+    if(value < 0) {
+        out.push_back('-');
+        append_uint(out, -(uint64_t)value);
+    } else {
+        append_uint(out, value);
+    }
+}
+
+// Calculate |value| * 10^precision rounded to the nearest integer with ties
+// to even. The product is calculated exactly from the bits of the double so
+// the rounding matches printf. Returns false if the result does not fit.
+static bool scale_and_round(double value, int precision, uint64_t& result)
+{
+    value = fabs(value);
+    if(value * POWERS_OF_TEN[precision] >= 9.0e18) {
+        return false;
+    }
+
+    if(value == 0.0) {
+        result = 0;
+        return true;
+    }
+
+    // value = mantissa * 2^exponent
+    int exponent;
+    double fraction = frexp(value, &exponent);
+    uint64_t mantissa = (uint64_t)ldexp(fraction, 53);
+    exponent -= 53;
+
+    // less than 2^53 * 10^9 so it fits in 128 bits
+    unsigned __int128 scaled = (unsigned __int128)mantissa * POWERS_OF_TEN[precision];
+    if(exponent >= 0) {
+        result = (uint64_t)(scaled << exponent);
+        return true;
+    }
+
+    int shift = -exponent;
+    if(shift >= 127) {
+        // scaled is less than 2^83 so the value is below one half
+        result = 0;
+        return true;
+    }
+
+    unsigned __int128 one = 1;
+    unsigned __int128 quotient = scaled >> shift;
+    unsigned __int128 remainder = scaled & ((one << shift) - 1);
+    unsigned __int128 half = one << (shift - 1);
+    if(remainder > half || (remainder == half && (quotient & 1))) {
+        quotient += 1;
+    }
+    result = (uint64_t)quotient;
+    return true;
+}
+
+// write integer / 10^precision with exactly precision decimals to the end of buf
+static inline char* write_fixed(char* end, uint64_t scaled, int precision)
+{
+    char* p = end;
+    if(precision > 0) {
+        uint64_t decimals = scaled % POWERS_OF_TEN[precision];
+        for(int i = 0; i < precision; ++i) {
+            *--p = '0' + decimals % 10;
+            decimals /= 10;
+        }
+        *--p = '.';
+    }
+    return write_digits(p, scaled / POWERS_OF_TEN[precision]);
+}
+
+void append_fixed(std::string& out, double value, int precision)
+{
+    assert(precision >= 0 && precision <= 9);
+
+    uint64_t scaled;
+    if(!isfinite(value) || !scale_and_round(value, precision, scaled)) {
+        char buf[512];
+        int n = snprintf(buf, sizeof(buf), "%.*f", precision, value);
+        out.append(buf, n);
+        return;
+    }
+
+    char buf[48];
+    char* end = buf + sizeof(buf);
+    char* p = write_fixed(end, scaled, precision);
+    if(signbit(value)) {
+        *--p = '-';
+    }
+    out.append(p, end - p);
+}
+
+void append_general(std::string& out, double value)
+{
+    const int SIGNIFICANT_DIGITS = 6;
+
+    if(value == 0.0) {
+        out.append(signbit(value) ? "-0" : "0");
+        return;
+    }
+
+    // %g uses fixed notation when the decimal exponent of the value, after
+    // rounding to 6 significant digits, is in [-4, 6). Find the number of
+    // decimals that leaves 6 significant digits, adjusting the estimate
+    // when rounding carries into another digit.
+    bool fixed_notation = false;
+    uint64_t scaled = 0;
+    int decimals = 0;
+    if(isfinite(value)) {
+        decimals = SIGNIFICANT_DIGITS - 1 - (int)floor(log10(fabs(value)));
+        for(int attempt = 0; attempt < 4 && decimals >= 0 && decimals <= 9; ++attempt) {
+            if(!scale_and_round(value, decimals, scaled)) {
+                break;
+            }
+
+            if(scaled >= POWERS_OF_TEN[SIGNIFICANT_DIGITS]) {
+                decimals -= 1;
+            } else if(scaled < POWERS_OF_TEN[SIGNIFICANT_DIGITS - 1]) {
+                decimals += 1;
+            } else {
+                fixed_notation = true;
+                break;
+            }
+        }
+    }
+
+    if(!fixed_notation) {
+        char buf[64];
+        int n = snprintf(buf, sizeof(buf), "%g", value);
+        out.append(buf, n);
+        return;
+    }
+
+    char buf[48];
+    char* end = buf + sizeof(buf);
+    char* p = write_fixed(end, scaled, decimals);
+
+    // %g removes trailing zeros, and the decimal point if nothing follows it
+    if(decimals > 0) {
+        while(end[-1] == '0') {
+            end -= 1;
+        }
+        if(end[-1] == '.') {
+            end -= 1;
+        }
+    }
+
+    if(signbit(value)) {
+        *--p = '-';
+    }
+    out.append(p, end - p);
+}
+
+void append_vprintf(std::string& out, const char* format, va_list args)
+{
+    char stack_buffer[1024];
+
+    va_list args_copy;
+    va_copy(args_copy, args);
+    int n = vsnprintf(stack_buffer, sizeof(stack_buffer), format, args_copy);
+    va_end(args_copy);
+
+    if(n < (int)sizeof(stack_buffer)) {
+        out.append(stack_buffer, n);
+        return;
+    }
+
+    // too long for the stack buffer, format directly into the string
+    size_t offset = out.size();
+    out.resize(offset + n + 1);
+    vsnprintf(&out[offset], n + 1, format, args);
+    out.resize(offset + n);
+}
+
+void append_printf(std::string& out, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    append_vprintf(out, format, args);
+    va_end(args);
+}
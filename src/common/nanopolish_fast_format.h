@@ -0,0 +1,34 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_fast_format -- number formatting for the
+// tab-separated outputs. These append to a string without
+// parsing a format or allocating temporary buffers and
+// produce exactly the same text as printf.
+//
+#ifndef NANOPOLISH_FAST_FORMAT_H
+#define NANOPOLISH_FAST_FORMAT_H
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <string>
+
+// append value, same as printf("%d") or printf("%zu")
+void append_int(std::string& out, int64_t value);
+void append_uint(std::string& out, uint64_t value);
+
+// append value with precision digits after the decimal point, same as printf("%.*f").
+// precision must be at most 9.
+void append_fixed(std::string& out, double value, int precision);
+
+// append value with 6 significant digits, same as printf("%g") and
+// the default formatting of an std::ostream
+void append_general(std::string& out, double value);
+
+// append printf-formatted text to out, for rows that mix strings and numbers
+void append_printf(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void append_vprintf(std::string& out, const char* format, va_list args);
+
+#endif
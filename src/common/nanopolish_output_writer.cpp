@@ -0,0 +1,231 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_output_writer -- ordered, asynchronous output
+// for the tools that process reads in parallel
+//
+#include <stdarg.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "nanopolish_output_writer.h"
+
+//
+// OutputBuffer
+//
+OutputBuffer::~OutputBuffer()
+{
+    for(size_t i = 0; i < m_records.size(); ++i) {
+        bam_destroy1(m_records[i]);
+    }
+}
+
+OutputBuffer::OutputBuffer(OutputBuffer&& other) : m_read_idx(other.m_read_idx),
+                                                   m_text(std::move(other.m_text)),
+                                                   m_records(std::move(other.m_records)),
+                                                   m_deferred(std::move(other.m_deferred)),
+                                                   m_deferred_bytes(other.m_deferred_bytes)
+{
+    other.m_records.clear();
+    other.m_deferred_bytes = 0;
+}
+
+OutputBuffer& OutputBuffer::operator=(OutputBuffer&& other)
+{
+    if(this != &other) {
+        for(size_t i = 0; i < m_records.size(); ++i) {
+            bam_destroy1(m_records[i]);
+        }
+        m_read_idx = other.m_read_idx;
+        m_text = std::move(other.m_text);
+        m_records = std::move(other.m_records);
+        m_deferred = std::move(other.m_deferred);
+        m_deferred_bytes = other.m_deferred_bytes;
+        other.m_records.clear();
+        other.m_deferred_bytes = 0;
+    }
+    return *this;
+}
+
+std::string& OutputBuffer::text(size_t stream_idx)
+{
+    if(stream_idx >= m_text.size()) {
+        m_text.resize(stream_idx + 1);
+    }
+    return m_text[stream_idx];
+}
+
+void OutputBuffer::printf(size_t stream_idx, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    append_vprintf(text(stream_idx), format, args);
+    va_end(args);
+}
+
+void OutputBuffer::add_deferred(const std::function<void()>& func, size_t bytes)
+{
+    m_deferred.push_back(func);
+    m_deferred_bytes += bytes;
+}
+
+size_t OutputBuffer::get_bytes() const
+{
+    size_t bytes = m_deferred_bytes;
+    for(size_t i = 0; i < m_text.size(); ++i) {
+        bytes += m_text[i].size();
+    }
+
+    for(size_t i = 0; i < m_records.size(); ++i) {
+        bytes += sizeof(bam1_t) + m_records[i]->l_data;
+    }
+    return bytes;
+}
+
+//
+// OutputWriter
+//
+OutputWriter::OutputWriter(bool ordered, size_t max_pending_bytes) : m_ordered(ordered),
+                                                                     m_max_pending_bytes(max_pending_bytes)
+{
+    m_thread = std::thread(&OutputWriter::run, this);
+}
+
+OutputWriter::~OutputWriter()
+{
+    close();
+}
+
+size_t OutputWriter::add_text_stream(TextOutputFile* out)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_text_streams.push_back(out);
+    return m_text_streams.size() - 1;
+}
+
+size_t OutputWriter::add_text_stream(FILE* fp)
+{
+    m_wrapped_files.emplace_back(new TextOutputFile(fp));
+    return add_text_stream(m_wrapped_files.back().get());
+}
+
+void OutputWriter::set_bam_stream(htsFile* fp, const bam_hdr_t* hdr)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_bam_fp = fp;
+    m_bam_hdr = hdr;
+}
+
+void OutputWriter::submit(OutputBuffer&& buffer)
+{
+    size_t bytes = buffer.get_bytes();
+    size_t read_idx = buffer.get_read_idx();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    assert(!m_closed);
+    assert(!m_ordered || (read_idx >= m_next_idx && m_pending.count(read_idx) == 0));
+    m_pending.insert(std::make_pair(read_idx, std::move(buffer)));
+    m_pending_bytes += bytes;
+    m_ready.notify_one();
+}
+
+void OutputWriter::skip(size_t read_idx)
+{
+    if(m_ordered) {
+        submit(OutputBuffer(read_idx));
+    }
+}
+
+void OutputWriter::wait_for_space()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_space.wait(lock, [this] { return m_pending_bytes <= m_max_pending_bytes || m_closed; });
+}
+
+bool OutputWriter::has_ready() const
+{
+    if(m_pending.empty()) {
+        return false;
+    }
+    return !m_ordered || m_pending.begin()->first == m_next_idx;
+}
+
+void OutputWriter::run()
+{
+    std::vector<OutputBuffer> batch;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true) {
+        m_ready.wait(lock, [this] { return has_ready() || m_closed; });
+
+        // On close, anything still pending is written in read_idx order even if
+        // there are gaps, so output is not lost if a read was never submitted
+        bool finishing = !has_ready() && m_closed;
+        if(finishing && m_pending.empty()) {
+            break;
+        }
+
+        // take every buffer that can be written now
+        while(!m_pending.empty() && (finishing || has_ready())) {
+            auto itr = m_pending.begin();
+            m_next_idx = itr->first + 1;
+            batch.push_back(std::move(itr->second));
+            m_pending.erase(itr);
+        }
+
+        lock.unlock();
+        size_t bytes = 0;
+        for(size_t i = 0; i < batch.size(); ++i) {
+            bytes += batch[i].get_bytes();
+            write_buffer(batch[i]);
+        }
+        batch.clear();
+        lock.lock();
+
+        m_pending_bytes -= bytes;
+        m_space.notify_all();
+    }
+}
+
+void OutputWriter::write_buffer(OutputBuffer& buffer)
+{
+    for(size_t i = 0; i < buffer.m_text.size(); ++i) {
+        const std::string& text = buffer.m_text[i];
+        if(text.empty()) {
+            continue;
+        }
+
+        assert(i < m_text_streams.size());
+        m_text_streams[i]->write(text);
+    }
+
+    for(size_t i = 0; i < buffer.m_records.size(); ++i) {
+        assert(m_bam_fp != NULL);
+        if(sam_write1(m_bam_fp, m_bam_hdr, buffer.m_records[i]) < 0) {
+            fprintf(stderr, "Error: could not write bam output\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(size_t i = 0; i < buffer.m_deferred.size(); ++i) {
+        buffer.m_deferred[i]();
+    }
+}
+
+void OutputWriter::close()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if(m_closed) {
+            return;
+        }
+        m_closed = true;
+        m_ready.notify_one();
+        m_space.notify_all();
+    }
+    m_thread.join();
+
+    for(size_t i = 0; i < m_text_streams.size(); ++i) {
+        m_text_streams[i]->flush();
+    }
+}
@@ -0,0 +1,135 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_output_writer -- ordered, asynchronous output
+// for the tools that process reads in parallel. Worker
+// threads format the output for a read into an OutputBuffer
+// without holding any lock, and a dedicated writer thread
+// writes the buffers to the output files. The writer can
+// put the buffers back into read_idx order so the output
+// does not depend on the number of threads.
+//
+#ifndef NANOPOLISH_OUTPUT_WRITER_H
+#define NANOPOLISH_OUTPUT_WRITER_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "htslib/sam.h"
+#include "nanopolish_text_output.h"
+#include "nanopolish_fast_format.h"
+
+// The output for one read
+class OutputBuffer
+{
+    public:
+        OutputBuffer(size_t read_idx) : m_read_idx(read_idx) {}
+        ~OutputBuffer();
+
+        OutputBuffer(OutputBuffer&& other);
+        OutputBuffer& operator=(OutputBuffer&& other);
+
+        size_t get_read_idx() const { return m_read_idx; }
+
+        // the text that will be written to a text stream of the writer
+        std::string& text(size_t stream_idx);
+
+        // append formatted text to a text stream
+        void printf(size_t stream_idx, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+        // add a record for the bam output, the buffer takes ownership of it
+        void add_record(bam1_t* record) { m_records.push_back(record); }
+
+        // run a function on the writer thread when this buffer is written. This is
+        // for outputs that are not text or bam, bytes is the memory held by the function.
+        void add_deferred(const std::function<void()>& func, size_t bytes);
+
+        // the memory held by this buffer
+        size_t get_bytes() const;
+
+    private:
+        friend class OutputWriter;
+
+        OutputBuffer(const OutputBuffer&) = delete;
+        OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+        size_t m_read_idx;
+        std::vector<std::string> m_text;
+        std::vector<bam1_t*> m_records;
+        std::vector<std::function<void()>> m_deferred;
+        size_t m_deferred_bytes = 0;
+};
+
+class OutputWriter
+{
+    public:
+        // When ordered is true the buffers are written in read_idx order, starting from 0, so
+        // every read_idx must either be submitted or skipped. max_pending_bytes is the amount of
+        // output that can wait to be written before wait_for_space() blocks.
+        OutputWriter(bool ordered, size_t max_pending_bytes = 64 * 1024 * 1024);
+        ~OutputWriter();
+
+        // Add a text stream and return its index. Streams must be added before output is submitted.
+        // The caller keeps ownership of the stream.
+        size_t add_text_stream(TextOutputFile* out);
+        size_t add_text_stream(FILE* fp);
+
+        // set the bam file that records are written to
+        void set_bam_stream(htsFile* fp, const bam_hdr_t* hdr);
+
+        // Hand a buffer to the writer thread. This does not block.
+        void submit(OutputBuffer&& buffer);
+
+        // record that read_idx has no output
+        void skip(size_t read_idx);
+
+        // Block while more than max_pending_bytes is waiting to be written. This is called
+        // by the producer of the reads, not the workers, so the read that the pending output
+        // is waiting on is never held up.
+        void wait_for_space();
+
+        // write all remaining output and stop the writer thread
+        void close();
+
+    private:
+
+        OutputWriter(const OutputWriter&) = delete;
+        OutputWriter& operator=(const OutputWriter&) = delete;
+
+        // main loop of the writer thread
+        void run();
+
+        // write one buffer, called on the writer thread without the lock held
+        void write_buffer(OutputBuffer& buffer);
+
+        // true if the writer thread has a buffer it can write
+        bool has_ready() const;
+
+        bool m_ordered;
+        size_t m_max_pending_bytes;
+
+        std::vector<TextOutputFile*> m_text_streams;
+        std::vector<std::unique_ptr<TextOutputFile>> m_wrapped_files;
+        htsFile* m_bam_fp = NULL;
+        const bam_hdr_t* m_bam_hdr = NULL;
+
+        std::map<size_t, OutputBuffer> m_pending;
+        size_t m_pending_bytes = 0;
+        size_t m_next_idx = 0;
+        bool m_closed = false;
+
+        std::mutex m_mutex;
+        std::condition_variable m_ready;
+        std::condition_variable m_space;
+        std::thread m_thread;
+};
+
+#endif
@@ -0,0 +1,288 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_packed_reference -- a reference genome stored
+// with 2 bits per base in a memory mapped file
+//
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "htslib/faidx.h"
+#include "nanopolish_packed_reference.h"
+
+#define PACKED_REFERENCE_SUFFIX ".npref"
+#define PACKED_REFERENCE_MAGIC "NPREF\x01\x00\x00"
+
+static const char PACKED_BASES[] = "ACGT";
+
+static inline int8_t base_code(char b)
+{
+    switch(b) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+    }
+}
+
+PackedReference::PackedReference(const std::string& fasta_filename) : m_data(NULL),
+                                                                     m_data_size(0),
+                                                                     m_mapped(false),
+                                                                     m_num_contigs(0),
+                                                                     m_contigs(NULL)
+{
+    struct stat fasta_stat;
+    if(stat(fasta_filename.c_str(), &fasta_stat) != 0) {
+        fprintf(stderr, "Error: could not open reference %s\n", fasta_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    std::string packed_filename = fasta_filename + PACKED_REFERENCE_SUFFIX;
+    if(!open_packed(packed_filename, fasta_stat.st_size, fasta_stat.st_mtime)) {
+        fprintf(stderr, "[reference] building %s\n", packed_filename.c_str());
+        std::vector<char> buffer = build(fasta_filename, fasta_stat.st_size, fasta_stat.st_mtime);
+
+        // Write to a temporary file first so that other processes
+        // never map a partially written reference
+        std::string tmp_filename = packed_filename + ".tmp." + std::to_string(getpid());
+        FILE* fp = fopen(tmp_filename.c_str(), "wb");
+        bool written = fp != NULL && fwrite(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+        written = fp != NULL && fclose(fp) == 0 && written;
+        written = written && rename(tmp_filename.c_str(), packed_filename.c_str()) == 0;
+
+        if(!written || !open_packed(packed_filename, fasta_stat.st_size, fasta_stat.st_mtime)) {
+            // the directory may not be writable, use the packed reference from memory
+            unlink(tmp_filename.c_str());
+            fprintf(stderr, "[reference] warning: could not write %s, the reference will not be shared\n", packed_filename.c_str());
+            m_buffer.swap(buffer);
+            m_data = m_buffer.data();
+            m_data_size = m_buffer.size();
+        }
+    }
+
+    const PackedReferenceHeader* header = (const PackedReferenceHeader*)m_data;
+    m_num_contigs = header->num_contigs;
+    m_contigs = (const PackedContig*)(m_data + sizeof(PackedReferenceHeader));
+    for(size_t i = 0; i < m_num_contigs; ++i) {
+        m_contig_ids[get_contig_name(i)] = i;
+    }
+}
+
+PackedReference::~PackedReference()
+{
+    if(m_mapped) {
+        munmap((void*)m_data, m_data_size);
+    }
+}
+
+bool PackedReference::open_packed(const std::string& filename, uint64_t fasta_size, int64_t fasta_mtime)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PackedReferenceHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        return false;
+    }
+
+    // rebuild if the fasta changed since the packed file was written
+    size_t size = st.st_size;
+    const PackedReferenceHeader* header = (const PackedReferenceHeader*)data;
+    bool valid = memcmp(header->magic, PACKED_REFERENCE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->fasta_size == fasta_size &&
+                 header->fasta_mtime == fasta_mtime &&
+                 header->num_contigs <= (size - sizeof(PackedReferenceHeader)) / sizeof(PackedContig);
+
+    // or if anything a contig points to is outside of the file
+    const PackedContig* contigs = (const PackedContig*)((const char*)data + sizeof(PackedReferenceHeader));
+    for(size_t i = 0; valid && i < header->num_contigs; ++i) {
+        const PackedContig& c = contigs[i];
+        uint64_t packed_bytes = c.length / 4 + (c.length % 4 != 0);
+        valid = c.length <= INT64_MAX &&
+                c.name_offset <= size && c.name_length <= size - c.name_offset &&
+                c.sequence_offset <= size && packed_bytes <= size - c.sequence_offset &&
+                c.mask_offset <= size && c.num_mask_runs <= (size - c.mask_offset) / sizeof(PackedMaskRun);
+    }
+
+    if(!valid) {
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    m_data = (const char*)data;
+    m_data_size = st.st_size;
+    m_mapped = true;
+    return true;
+}
+
+// append count bytes to the buffer, padded to 8 bytes, and return their offset
+static uint64_t append_aligned(std::vector<char>& buffer, const void* data, size_t count)
+{
+    uint64_t offset = buffer.size();
+    buffer.insert(buffer.end(), (const char*)data, (const char*)data + count);
+    buffer.resize((buffer.size() + 7) & ~(size_t)7, 0);
+    return offset;
+}
+
+std::vector<char> PackedReference::build(const std::string& fasta_filename, uint64_t fasta_size, int64_t fasta_mtime)
+{
+    faidx_t* fai = fai_load(fasta_filename.c_str());
+    if(fai == NULL) {
+        fprintf(stderr, "Error: could not load the index for %s\n", fasta_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    size_t num_contigs = faidx_nseq(fai);
+    std::vector<PackedContig> contigs(num_contigs);
+
+    // reserve space for the header and contig table, they are filled in at the end
+    std::vector<char> buffer(sizeof(PackedReferenceHeader) + num_contigs * sizeof(PackedContig), 0);
+
+    std::vector<uint8_t> packed;
+    std::vector<PackedMaskRun> mask;
+    for(size_t ci = 0; ci < num_contigs; ++ci) {
+        const char* name = faidx_iseq(fai, ci);
+        int length = faidx_seq_len(fai, name);
+        int fetched_len = 0;
+        char* seq = faidx_fetch_seq(fai, name, 0, length - 1, &fetched_len);
+        if(seq == NULL || fetched_len != length) {
+            fprintf(stderr, "Error: could not read contig %s from %s\n", name, fasta_filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+
+        packed.assign((length + 3) / 4, 0);
+        mask.clear();
+        for(int i = 0; i < length; ++i) {
+            char b = seq[i];
+            int8_t code = base_code(toupper(b));
+
+            // 0 marks a lower case run of packed bases
+            char mask_base = 0;
+            bool masked = code < 0 || b != toupper(b);
+            if(code < 0) {
+                code = 0;
+                mask_base = b;
+            }
+            packed[i >> 2] |= code << ((i & 3) * 2);
+
+            if(masked) {
+                if(!mask.empty() && mask.back().base == mask_base &&
+                   mask.back().start + mask.back().length == (uint64_t)i &&
+                   mask.back().length < UINT32_MAX) {
+                    mask.back().length += 1;
+                } else {
+                    PackedMaskRun run;
+                    memset(&run, 0, sizeof(run));
+                    run.start = i;
+                    run.length = 1;
+                    run.base = mask_base;
+                    mask.push_back(run);
+                }
+            }
+        }
+        free(seq);
+
+        PackedContig& contig = contigs[ci];
+        contig.name_offset = append_aligned(buffer, name, strlen(name));
+        contig.name_length = strlen(name);
+        contig.length = length;
+        contig.sequence_offset = append_aligned(buffer, packed.data(), packed.size());
+        contig.mask_offset = append_aligned(buffer, mask.data(), mask.size() * sizeof(PackedMaskRun));
+        contig.num_mask_runs = mask.size();
+    }
+    fai_destroy(fai);
+
+    PackedReferenceHeader header;
+    memcpy(header.magic, PACKED_REFERENCE_MAGIC, sizeof(header.magic));
+    header.num_contigs = num_contigs;
+    header.fasta_size = fasta_size;
+    header.fasta_mtime = fasta_mtime;
+    memcpy(buffer.data(), &header, sizeof(header));
+    memcpy(buffer.data() + sizeof(header), contigs.data(), num_contigs * sizeof(PackedContig));
+    return buffer;
+}
+
+int PackedReference::get_contig_id(const std::string& name) const
+{
+    auto itr = m_contig_ids.find(name);
+    return itr != m_contig_ids.end() ? itr->second : -1;
+}
+
+std::string PackedReference::get_contig_name(int contig_id) const
+{
+    const PackedContig& contig = m_contigs[contig_id];
+    return std::string(m_data + contig.name_offset, contig.name_length);
+}
+
+const PackedMaskRun* PackedReference::find_mask_run(const PackedContig& contig, int64_t pos) const
+{
+    const PackedMaskRun* begin = (const PackedMaskRun*)(m_data + contig.mask_offset);
+    const PackedMaskRun* end = begin + contig.num_mask_runs;
+    return std::upper_bound(begin, end, pos,
+        [](int64_t p, const PackedMaskRun& run) { return p < (int64_t)(run.start + run.length); });
+}
+
+size_t PackedReference::copy_substring(int contig_id, int64_t start, int64_t end, char* out) const
+{
+    assert(contig_id >= 0 && (size_t)contig_id < m_num_contigs);
+    const PackedContig& contig = m_contigs[contig_id];
+    start = std::max(start, (int64_t)0);
+    end = std::min(end, (int64_t)contig.length - 1);
+    if(end < start) {
+        return 0;
+    }
+
+    for(int64_t i = start; i <= end; ++i) {
+        out[i - start] = PACKED_BASES[get_code(contig, i)];
+    }
+
+    // restore the masked bases
+    const PackedMaskRun* mask_end = (const PackedMaskRun*)(m_data + contig.mask_offset) + contig.num_mask_runs;
+    for(const PackedMaskRun* run = find_mask_run(contig, start); run != mask_end && (int64_t)run->start <= end; ++run) {
+        int64_t run_start = std::max((int64_t)run->start, start);
+        int64_t run_end = std::min((int64_t)(run->start + run->length) - 1, end);
+        for(int64_t i = run_start; i <= run_end; ++i) {
+            char& b = out[i - start];
+            b = run->base != 0 ? run->base : tolower(b);
+        }
+    }
+    return end - start + 1;
+}
+
+std::string PackedReference::get_substring(int contig_id, int64_t start, int64_t end) const
+{
+    std::string out;
+    copy_substring(contig_id, start, end, out);
+    return out;
+}
+
+void PackedReference::copy_substring(int contig_id, int64_t start, int64_t end, std::string& out) const
+{
+    // clip first so the string is never larger than the contig
+    assert(contig_id >= 0 && (size_t)contig_id < m_num_contigs);
+    start = std::max(start, (int64_t)0);
+    end = std::min(end, get_contig_length(contig_id) - 1);
+    out.resize(std::max(end - start + 1, (int64_t)0));
+    if(!out.empty()) {
+        copy_substring(contig_id, start, end, &out[0]);
+    }
+}
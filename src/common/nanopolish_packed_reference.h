@@ -0,0 +1,119 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_packed_reference -- a reference genome stored
+// with 2 bits per base in a file that is memory mapped, so
+// that it is loaded once and shared by every thread and
+// process using the same reference. Bases that are not
+// upper case A, C, G or T (N, IUPAC codes, soft masking)
+// are recorded in a mask so the sequence returned is
+// exactly what faidx would return.
+//
+#ifndef NANOPOLISH_PACKED_REFERENCE_H
+#define NANOPOLISH_PACKED_REFERENCE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+// On-disk layout: a header, one PackedContig per contig, then the
+// contig names, packed sequences and masks they point to. Offsets
+// are from the start of the file.
+struct PackedReferenceHeader
+{
+    char magic[8];
+    uint64_t num_contigs;
+
+    // size and modification time of the fasta this was built from
+    uint64_t fasta_size;
+    int64_t fasta_mtime;
+};
+
+struct PackedContig
+{
+    uint64_t name_offset;
+    uint64_t name_length;
+    uint64_t length;
+
+    // 4 bases per byte, the first base in the low bits
+    uint64_t sequence_offset;
+
+    // the PackedMaskRun records, sorted by start
+    uint64_t mask_offset;
+    uint64_t num_mask_runs;
+};
+
+// a run of bases that differ from the packed bases
+struct PackedMaskRun
+{
+    uint64_t start;
+    uint32_t length;
+
+    // every base in the run is this character, or if it is 0
+    // the run is the packed bases in lower case
+    char base;
+    char padding[3];
+};
+
+class PackedReference
+{
+    public:
+        // Open the packed form of fasta_filename, building it next to
+        // the fasta if it does not exist or is out of date
+        PackedReference(const std::string& fasta_filename);
+        ~PackedReference();
+
+        // returns -1 if there is no contig with this name
+        int get_contig_id(const std::string& name) const;
+        size_t get_num_contigs() const { return m_num_contigs; }
+        std::string get_contig_name(int contig_id) const;
+        int64_t get_contig_length(int contig_id) const { return m_contigs[contig_id].length; }
+
+        // Return the sequence from start to end, inclusive and 0-based like
+        // faidx_fetch_seq. The interval is clipped to the contig.
+        std::string get_substring(int contig_id, int64_t start, int64_t end) const;
+
+        // Decode the same sequence into a buffer owned by the caller, which must
+        // hold end - start + 1 bases. Returns the number of bases written.
+        size_t copy_substring(int contig_id, int64_t start, int64_t end, char* out) const;
+
+        // Decode the sequence into out, reusing its memory
+        void copy_substring(int contig_id, int64_t start, int64_t end, std::string& out) const;
+
+    private:
+
+        PackedReference(const PackedReference&) = delete;
+        PackedReference& operator=(const PackedReference&) = delete;
+
+        // the 2-bit code of the base at pos
+        inline uint8_t get_code(const PackedContig& contig, int64_t pos) const
+        {
+            const uint8_t* packed = (const uint8_t*)m_data + contig.sequence_offset;
+            return (packed[pos >> 2] >> ((pos & 3) * 2)) & 3;
+        }
+
+        // returns a pointer to the first mask run of the contig that ends after pos
+        const PackedMaskRun* find_mask_run(const PackedContig& contig, int64_t pos) const;
+
+        // write the packed form of the fasta to a buffer
+        static std::vector<char> build(const std::string& fasta_filename, uint64_t fasta_size, int64_t fasta_mtime);
+
+        // map an existing packed file, returns false if it cannot be used
+        bool open_packed(const std::string& filename, uint64_t fasta_size, int64_t fasta_mtime);
+
+        const char* m_data;
+        size_t m_data_size;
+        bool m_mapped;
+
+        // used instead of a mapping when the packed file could not be written
+        std::vector<char> m_buffer;
+
+        size_t m_num_contigs;
+        const PackedContig* m_contigs;
+        std::unordered_map<std::string, int> m_contig_ids;
+};
+
+#endif
@@ -0,0 +1,122 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_text_output -- a text output file that is
+// either plain or BGZF compressed
+//
+#include <stdlib.h>
+#include <unistd.h>
+#include "htslib/tbx.h"
+#include "nanopolish_bam_utils.h"
+#include "nanopolish_text_output.h"
+
+TextOutputFile::TextOutputFile(const std::string& filename, bool compress) : m_filename(filename)
+{
+    if(compress) {
+        if(is_stdout()) {
+            m_bgzf = bgzf_dopen(STDOUT_FILENO, "w");
+        } else {
+            m_bgzf = bgzf_open(filename.c_str(), "w");
+        }
+
+        if(m_bgzf == NULL) {
+            fprintf(stderr, "Error: could not open %s for writing\n", filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+        attach_hts_thread_pool(m_bgzf);
+    } else if(is_stdout()) {
+        m_fp = stdout;
+    } else {
+        m_fp = fopen(filename.c_str(), "w");
+        if(m_fp == NULL) {
+            fprintf(stderr, "Error: could not open %s for writing\n", filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+        m_owns_file = true;
+    }
+}
+
+TextOutputFile::TextOutputFile(FILE* fp) : m_filename(fp == stdout ? "-" : ""),
+                                           m_fp(fp)
+{
+
+}
+
+TextOutputFile::~TextOutputFile()
+{
+    close();
+}
+
+void TextOutputFile::write(const char* data, size_t length)
+{
+    if(length == 0) {
+        return;
+    }
+
+    bool success;
+    if(m_bgzf != NULL) {
+        success = bgzf_write(m_bgzf, data, length) == (ssize_t)length;
+    } else {
+        success = m_fp != NULL && fwrite(data, 1, length, m_fp) == length;
+    }
+
+    if(!success) {
+        fprintf(stderr, "Error: could not write to %s\n", m_filename.empty() ? "output" : m_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+void TextOutputFile::flush()
+{
+    if(m_bgzf != NULL) {
+        bgzf_flush(m_bgzf);
+    } else if(m_fp != NULL) {
+        fflush(m_fp);
+    }
+}
+
+void TextOutputFile::close()
+{
+    if(m_bgzf != NULL) {
+        // this also writes the BGZF end-of-file marker
+        if(bgzf_close(m_bgzf) < 0) {
+            fprintf(stderr, "Error: could not close %s\n", m_filename.c_str());
+            exit(EXIT_FAILURE);
+        }
+        m_bgzf = NULL;
+    } else if(m_fp != NULL) {
+        if(m_owns_file) {
+            fclose(m_fp);
+        } else {
+            fflush(m_fp);
+        }
+        m_fp = NULL;
+    }
+}
+
+void build_tabix_index(const std::string& filename, int seq_col, int begin_col, int end_col,
+                       bool zero_based, int skip_lines)
+{
+    tbx_conf_t conf;
+    conf.preset = TBX_GENERIC | (zero_based ? TBX_UCSC : 0);
+    conf.sc = seq_col;
+    conf.bc = begin_col;
+    conf.ec = end_col;
+    conf.meta_char = '#';
+    conf.line_skip = skip_lines;
+
+    if(tbx_index_build(filename.c_str(), 0, &conf) != 0) {
+        fprintf(stderr, "Error: could not build the tabix index for %s, is it sorted?\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+void build_vcf_index(const std::string& filename)
+{
+    if(tbx_index_build(filename.c_str(), 0, &tbx_conf_vcf) != 0) {
+        fprintf(stderr, "Error: could not build the tabix index for %s\n", filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
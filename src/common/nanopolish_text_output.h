@@ -0,0 +1,61 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_text_output -- a text output file that is
+// either plain or BGZF compressed. Compressed output is
+// written using the shared htslib thread pool and can be
+// indexed with tabix when the records are sorted.
+//
+#ifndef NANOPOLISH_TEXT_OUTPUT_H
+#define NANOPOLISH_TEXT_OUTPUT_H
+
+#include <stdio.h>
+#include <string>
+#include "htslib/bgzf.h"
+
+class TextOutputFile
+{
+    public:
+        // Open filename for writing, "-" is stdout. When compress is true the output is BGZF.
+        TextOutputFile(const std::string& filename, bool compress);
+
+        // Write to an already open file. The file is not closed by this object.
+        TextOutputFile(FILE* fp);
+
+        ~TextOutputFile();
+
+        void write(const char* data, size_t length);
+        void write(const std::string& data) { write(data.data(), data.size()); }
+
+        // flush buffered output to the file
+        void flush();
+
+        // flush and close the file, called by the destructor if needed
+        void close();
+
+        bool is_compressed() const { return m_bgzf != NULL; }
+        bool is_stdout() const { return m_filename == "-"; }
+        const std::string& get_filename() const { return m_filename; }
+
+    private:
+        TextOutputFile(const TextOutputFile&) = delete;
+        TextOutputFile& operator=(const TextOutputFile&) = delete;
+
+        std::string m_filename;
+        FILE* m_fp = NULL;
+        BGZF* m_bgzf = NULL;
+        bool m_owns_file = false;
+};
+
+// Build a tabix index for a BGZF compressed, position-sorted file. seq_col, begin_col and end_col
+// are 1-based column numbers (end_col may be 0 if there is no end column). Lines starting with
+// '#' and the first skip_lines lines are treated as the header.
+void build_tabix_index(const std::string& filename, int seq_col, int begin_col, int end_col,
+                       bool zero_based, int skip_lines);
+
+// build a tabix index for a sorted, BGZF compressed vcf file
+void build_vcf_index(const std::string& filename);
+
+#endif
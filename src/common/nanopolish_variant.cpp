@@ -15,6 +15,7 @@
 #include "nanopolish_model_names.h"
 #include "nanopolish_alignment_db.h"
 #include "nanopolish_variant_db.h"
+#include "nanopolish_fast_format.h"
 
 //#define DEBUG_HAPLOTYPE_SELECTION 1
 
@@ -33,12 +34,30 @@ std::string Variant::make_vcf_tag_string(const std::string& tag,
 void Variant::write_vcf_header(FILE* fp,
                                const std::vector<std::string>& tag_lines)
 {
+    std::string out;
+    write_vcf_header(out, tag_lines);
+    fputs(out.c_str(), fp);
+}
 
-    fprintf(fp, "##fileformat=VCFv4.2\n");
+void Variant::write_vcf_header(std::string& out,
+                               const std::vector<std::string>& tag_lines)
+{
+    out.append("##fileformat=VCFv4.2\n");
     for(const std::string& line : tag_lines) {
-        fprintf(fp, "%s\n", line.c_str());
+        out.append(line);
+        out.append("\n");
     }
-    fprintf(fp, "#CHROM	POS	ID	REF	ALT	QUAL	FILTER	INFO	FORMAT	sample\n");
+    out.append("#CHROM	POS	ID	REF	ALT	QUAL	FILTER	INFO	FORMAT	sample\n");
+}
+
+void Variant::write_vcf(std::string& out) const
+{
+    const char* gt_def = genotype.empty() ? NULL : "GT";
+    const char* gt_str = genotype.empty() ? NULL : genotype.c_str();
+
+    append_printf(out, "%s\t%zu\t%s\t", ref_name.c_str(), ref_position + 1, ".");
+    append_printf(out, "%s\t%s\t%.1lf\t", ref_seq.c_str(), alt_seq.c_str(), quality);
+    append_printf(out, "%s\t%s\t%s\t%s\n", "PASS", info.c_str(), gt_def, gt_str);
 }
 
 // return a new copy of the string with gap symbols removed
@@ -206,32 +225,33 @@ void score_variant_group(VariantGroup& variant_group,
         read_ids.push_back(ss.str());
     }
 
-/*
-    // Score each haplotype
-    DoubleMatrix read_haplotype_scores;
-    allocate_matrix(read_haplotype_scores, input.size(), haplotypes.size());
+    // Map each input to its row in the score matrix. If a read/strand
+    // appears more than once only the first is scored.
+    variant_group.set_reads(read_ids);
+    std::vector<size_t> read_rows(input.size(), VariantGroup::npos);
+    std::vector<bool> row_used(variant_group.get_num_reads(), false);
+    for(size_t ri = 0; ri < input.size(); ++ri) {
+        size_t row = variant_group.find_read(read_ids[ri]);
+        if(!row_used[row]) {
+            read_rows[ri] = row;
+            row_used[row] = true;
+        }
+    }
 
-    // Score all reads against all haplotypes
-    std::vector<double> read_sum(input.size(), -INFINITY);
-*/
-  
+    // Score all reads against all haplotypes. Each (read, haplotype) pair
+    // has its own cell so no synchronization is needed.
     #pragma omp parallel for
     for(size_t ri = 0; ri < input.size(); ++ri) {
+        if(read_rows[ri] == VariantGroup::npos) {
+            continue;
+        }
+
         for(size_t hi = 0; hi < haplotypes.size(); ++hi) {
             const auto& current = haplotypes[hi];
             double score = profile_hmm_score(current.first.get_sequence(), input[ri], alignment_flags);
-            
-            #pragma omp critical
-            {
-                variant_group.set_combination_read_score(current.second, read_ids[ri], score);
-//                set(read_haplotype_scores, ri, hi, score);
-//                read_sum[ri] = add_logs(read_sum[ri], score);
-            }
+            variant_group.set_combination_read_score(current.second, read_rows[ri], score);
         }
     }
-
-#if 0
-#endif
 }
 
 std::vector<Variant> simple_call(VariantGroup& variant_group,
@@ -251,7 +271,8 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
 #endif
     
     // Get read data for this group
-    const std::vector< std::pair<std::string, double>> group_reads = variant_group.get_read_sum_scores();
+    const std::vector<double> read_sum_scores = variant_group.get_read_sum_scores();
+    size_t num_reads = read_sum_scores.size();
 
     // Skip groups that only have one possibility (these are typically malformed VCF records)
     size_t variant_combos_in_group = variant_group.get_num_combinations();
@@ -275,24 +296,22 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
         double set_score = 0.0f;
         std::vector<double> read_support(current_set.size(), 0.0f);
 
-        for(size_t ri = 0; ri < group_reads.size(); ++ri) {
-            const std::string& read_id = group_reads[ri].first;
-
+        for(size_t ri = 0; ri < num_reads; ++ri) {
             double set_sum = -INFINITY;
             for(size_t j = 0; j < current_set.size(); ++j) {
                 size_t vc_id = current_set[j];
-                double rhs = variant_group.get_combination_read_score(vc_id, read_id);
+                double rhs = variant_group.get_combination_read_score(vc_id, ri);
                 /*
-                fprintf(stderr, "\t\tread-haplotype: %s %zu %s %.2lf\n", read_id.c_str(), 
+                fprintf(stderr, "\t\tread-haplotype: %s %zu %s %.2lf\n", variant_group.get_read_id(ri).c_str(), 
                                                                          variant_group.get(0).ref_position, // hack
                                                                          variant_group.get_vc_allele_string(vc_id).c_str(), rhs); 
                 */
                 set_sum = add_logs(set_sum, rhs - log_2);
-                read_support[j] += exp(rhs - group_reads[ri].second);
+                read_support[j] += exp(rhs - read_sum_scores[ri]);
             }
 
             /*
-            fprintf(stderr, "\t\tread-genotype: %s %zu %.2lf\n", read_id.c_str(), 
+            fprintf(stderr, "\t\tread-genotype: %s %zu %.2lf\n", variant_group.get_read_id(ri).c_str(), 
                                                                          variant_group.get(0).ref_position, // hack
                                                                          set_sum); 
             */
@@ -330,10 +349,9 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
 
         const VariantCombination& vc = variant_group.get_combination(vc_id);
         
-        for(size_t ri = 0; ri < group_reads.size(); ++ri) {
-            const std::string& read_id = group_reads[ri].first;
-            double read_sum = group_reads[ri].second;
-            double read_haplotype_score = variant_group.get_combination_read_score(vc_id, read_id);
+        for(size_t ri = 0; ri < num_reads; ++ri) {
+            double read_sum = read_sum_scores[ri];
+            double read_haplotype_score = variant_group.get_combination_read_score(vc_id, ri);
             double posterior_read_from_haplotype = exp(read_haplotype_score - read_sum);
 
             for(size_t var_idx = 0; var_idx < vc.get_num_variants(); ++var_idx) {
@@ -364,9 +382,9 @@ std::vector<Variant> simple_call(VariantGroup& variant_group,
         } else {
             v.quality = 0.0;
         }
-        v.add_info("TotalReads", group_reads.size());
+        v.add_info("TotalReads", num_reads);
         v.add_info("AlleleCount", var_count);
-        v.add_info("SupportFraction", read_variant_support[vi] / group_reads.size());
+        v.add_info("SupportFraction", read_variant_support[vi] / num_reads);
         v.genotype = make_genotype(var_count, ploidy);
         output_variants.push_back(v);
     }
@@ -461,15 +479,25 @@ std::vector<Variant> multi_call(VariantGroup& variant_group,
     SizeTVecVec haplotypes = cartesian_product(variant_combinations_by_group);
     
     // get the read data for the variant group that we are genotyping
-    const std::vector< std::pair<std::string, double>> group_reads = variant_group.get_read_sum_scores();
+    const std::vector<double> read_sum_scores = variant_group.get_read_sum_scores();
+    size_t num_reads = read_sum_scores.size();
+
+    // Look up the row of each read in every group once, rather than per score
+    SizeTVecVec read_rows_by_group(all_groups.size(), std::vector<size_t>(num_reads));
+    for(size_t gi = 0; gi < all_groups.size(); ++gi) {
+        for(size_t ri = 0; ri < num_reads; ++ri) {
+            size_t row = all_groups[gi]->find_read(variant_group.get_read_id(ri));
+            assert(row != VariantGroup::npos);
+            read_rows_by_group[gi][ri] = row;
+        }
+    }
 
     // Score each haplotype
     DoubleMatrix read_haplotype_scores;
-    allocate_matrix(read_haplotype_scores, group_reads.size(), haplotypes.size());
+    allocate_matrix(read_haplotype_scores, num_reads, haplotypes.size());
     
     // Calculate and store read-haplotype scores
-    for(size_t ri = 0; ri < group_reads.size(); ++ri) {
-        auto read_id = group_reads[ri].first;
+    for(size_t ri = 0; ri < num_reads; ++ri) {
         for(size_t hi = 0; hi < haplotypes.size(); ++hi) {
 
             const auto& haplotype = haplotypes[hi];
@@ -479,7 +507,7 @@ std::vector<Variant> multi_call(VariantGroup& variant_group,
             double hap_sum = 0.0f;
             for(size_t group_idx = 0; group_idx < haplotype.size(); ++group_idx) {
                 const auto& vc_idx = haplotype[group_idx];
-                hap_sum += all_groups[group_idx]->get_combination_read_score(vc_idx, read_id);
+                hap_sum += all_groups[group_idx]->get_combination_read_score(vc_idx, read_rows_by_group[group_idx][ri]);
             }
 
             set(read_haplotype_scores, ri, hi, hap_sum);
@@ -491,8 +519,8 @@ std::vector<Variant> multi_call(VariantGroup& variant_group,
     // Dindel EM model
     // Calculate expectation of read-haplotype indicator variables
     DoubleMatrix z;
-    allocate_matrix(z, group_reads.size(), haplotypes.size());
-    for(size_t ri = 0; ri < group_reads.size(); ++ri) {
+    allocate_matrix(z, num_reads, haplotypes.size());
+    for(size_t ri = 0; ri < num_reads; ++ri) {
         for(size_t hi = 0; hi < haplotypes.size(); ++hi) {
             set(z, ri, hi, 0.5); // doEM initializes to 0.5, should be 1/haplotypes.size()?
         }
@@ -512,7 +540,7 @@ std::vector<Variant> multi_call(VariantGroup& variant_group,
             nk[i] = 0.0;
         }
 
-        for(size_t ri = 0; ri < group_reads.size(); ++ri) {
+        for(size_t ri = 0; ri < num_reads; ++ri) {
 
             // responsibility
             double lognorm = -INFINITY;
@@ -541,8 +569,8 @@ std::vector<Variant> multi_call(VariantGroup& variant_group,
         }
 
         // debug output
-        for(size_t ri = 0; ri < group_reads.size(); ++ri) {
-            fprintf(stderr, "read-haplotype indicator - %s\t", group_reads[ri].first.c_str());
+        for(size_t ri = 0; ri < num_reads; ++ri) {
+            fprintf(stderr, "read-haplotype indicator - %s\t", variant_group.get_read_id(ri).c_str());
             for(size_t hi = 0; hi < haplotypes.size(); ++hi) {
                 std::string hap_str = prettyprint_haplotype(haplotypes[hi], all_groups);
                 fprintf(stderr, "%s: %.3lf ", hap_str.c_str(), get(z, ri, hi));
@@ -582,7 +610,7 @@ std::vector<Variant> multi_call(VariantGroup& variant_group,
         const auto& genotype = genotypes[i];
 
         // Score all reads against this genotype
-        for(size_t ri = 0; ri < group_reads.size(); ++ri) {
+        for(size_t ri = 0; ri < num_reads; ++ri) {
             
             double read_sum = -INFINITY;
 
@@ -591,7 +619,7 @@ std::vector<Variant> multi_call(VariantGroup& variant_group,
                 double read_hap_score = get(read_haplotype_scores, ri, hi);
                 const auto& haplotype = haplotypes[genotype[gt_idx]];
                 std::string hap_str = prettyprint_haplotype(haplotype, all_groups);
-                fprintf(stderr, "\t\t%s %s %.2lf\n", group_reads[ri].first.c_str(), hap_str.c_str(), read_hap_score);
+                fprintf(stderr, "\t\t%s %s %.2lf\n", variant_group.get_read_id(ri).c_str(), hap_str.c_str(), read_hap_score);
                 read_sum = add_logs(read_sum, read_hap_score - log_2);
             }
             scores[i] += read_sum;
@@ -631,7 +659,7 @@ std::vector<Variant> multi_call(VariantGroup& variant_group,
         } else {
             v.quality = 0.0;
         }
-        v.add_info("TotalReads", group_reads.size());
+        v.add_info("TotalReads", num_reads);
         v.add_info("AlleleCount", var_count);
         v.genotype = make_genotype(var_count, ploidy);
         output_variants.push_back(v);
@@ -22,6 +22,9 @@ struct Variant
     static void write_vcf_header(FILE* fp, 
                                  const std::vector<std::string>& tag_lines = std::vector<std::string>());
 
+    static void write_vcf_header(std::string& out,
+                                 const std::vector<std::string>& tag_lines = std::vector<std::string>());
+
     static std::string make_vcf_tag_string(const std::string& tag,
                                            const std::string& id,
                                            int count,
@@ -50,6 +53,9 @@ struct Variant
         fprintf(fp, "%s\t%s\t%s\t%s\n", "PASS", info.c_str(), gt_def, gt_str);
     }
 
+    // append the vcf record to out
+    void write_vcf(std::string& out) const;
+
     void read_vcf(const std::string& line)
     {
         std::stringstream ss(line);
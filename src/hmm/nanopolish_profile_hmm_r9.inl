@@ -298,7 +298,7 @@ inline float profile_hmm_fill_generic_r9(const HMMInputSequence& _sequence,
     uint32_t k = data.read->pore_model[data.strand].k;
 
     // Make sure the HMMInputSequence's alphabet matches the state space of the read
-    assert( data.read->pore_model[data.strand].states.size() == sequence.get_num_kmer_ranks(k) );
+    assert( data.read->pore_model[data.strand].get_num_states() == sequence.get_num_kmer_ranks(k) );
 
     std::vector<uint32_t> kmer_ranks(num_kmers);
     for(size_t ki = 0; ki < num_kmers; ++ki)
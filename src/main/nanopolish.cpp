@@ -13,12 +13,16 @@
 #include "nanopolish_extract.h"
 #include "nanopolish_call_variants.h"
 #include "nanopolish_eventalign.h"
+#include "nanopolish_eventalign_binary.h"
 #include "nanopolish_getmodel.h"
 #include "nanopolish_methyltrain.h"
 #include "nanopolish_call_methylation.h"
 #include "nanopolish_scorereads.h"
 #include "nanopolish_phase_reads.h"
+#include "nanopolish_sort_tsv.h"
+#include "nanopolish_analyze.h"
 #include "nanopolish_train_poremodel_from_basecalls.h"
+#include "nanopolish_bam_utils.h"
 
 int print_usage(int argc, char **argv);
 int print_version(int argc, char **argv);
@@ -30,11 +34,14 @@ static std::map< std::string, std::function<int(int, char**)> > programs = {
     {"index",       index_main},
     {"extract",     extract_main},
     {"eventalign",  eventalign_main},
+    {"eventalign-view",  eventalign_view_main},
     {"getmodel",    getmodel_main},
     {"variants",    call_variants_main},
     {"methyltrain", methyltrain_main},
     {"scorereads",  scorereads_main} ,
     {"phase-reads",  phase_reads_main} ,
+    {"sort-tsv",    sort_tsv_main} ,
+    {"analyze",     analyze_main} ,
     {"call-methylation",  call_methylation_main}
 };
 
@@ -76,6 +83,9 @@ int main(int argc, char** argv)
             ret = print_usage( argc - 1, argv + 1);
     }
 
+    // all bam files have been closed by the subprogram
+    destroy_hts_thread_pool();
+
     // Emit a warning when some reads had to be skipped
     extern int g_total_reads;
     extern int g_unparseable_reads;
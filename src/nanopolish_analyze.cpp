@@ -0,0 +1,406 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_analyze -- run several analyses over one
+// pass of the reads, sharing the signal and the event
+// alignment of each read
+//
+// The bam is decoded once and each read is loaded and
+// aligned to the reference in event space once. The
+// alignment is then handed to each of the requested
+// analyses in turn, which format their output into the
+// read's OutputBuffer. Every analysis has its own output
+// file and all are written in read order by one writer.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <omp.h>
+#include <getopt.h>
+#include "nanopolish_common.h"
+#include "nanopolish_analyze.h"
+#include "nanopolish_eventalign.h"
+#include "nanopolish_eventalign_aggregate.h"
+#include "nanopolish_call_methylation.h"
+#include "nanopolish_phase_reads.h"
+#include "nanopolish_alignment_db.h"
+#include "nanopolish_bam_processor.h"
+#include "nanopolish_bam_utils.h"
+#include "nanopolish_output_writer.h"
+#include "nanopolish_text_output.h"
+#include "nanopolish_read_db.h"
+#include "H5pubconf.h"
+#include "progress.h"
+
+//
+// Getopt
+//
+#define SUBPROGRAM "analyze"
+
+static const char *ANALYZE_VERSION_MESSAGE =
+SUBPROGRAM " Version " PACKAGE_VERSION "\n"
+"Written by agent.\n"
+"\n"
+"Copyright 2026 agent\n";
+
+static const char *ANALYZE_USAGE_MESSAGE =
+"Usage: " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] --reads reads.fa --bam alignments.bam --genome genome.fa\n"
+"Align the events of each read to the reference once and run several analyses on the alignment.\n"
+"At least one output must be requested.\n"
+"\n"
+"  -v, --verbose                        display verbose output\n"
+"      --version                        display version\n"
+"      --help                           display this help and exit\n"
+"  -r, --reads=FILE                     the ONT reads are in fasta FILE\n"
+"  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
+"                                       use - to stream sam/bam from stdin (unsorted input is fine without --window)\n"
+"  -g, --genome=FILE                    the genome we are analyzing is in FILE\n"
+"  -w, --window=STR                     only analyze the window STR (format: ctg:start-end)\n"
+"  -t, --threads=NUM                    use NUM threads (default: 1)\n"
+"      --progress                       print out a progress message\n"
+"      --compress                       write the tab-separated outputs as BGZF\n"
+"      --eventalign=FILE                write the event alignments to FILE, as eventalign\n"
+"      --kmer-stats=FILE                write the statistics of the events aligned to each k-mer to FILE,\n"
+"                                       as eventalign --aggregate=kmer\n"
+"      --methylation=FILE               write the CpG methylation calls to FILE, as call-methylation\n"
+"      --phase=FILE                     write the reads with the variants of --variants phased onto them\n"
+"                                       to the bam FILE, as phase-reads\n"
+"      --variants=FILE                  the variants to phase are in the vcf FILE\n"
+"\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
+
+namespace opt
+{
+    static unsigned int verbose;
+    static std::string reads_file;
+    static std::string bam_file;
+    static std::string genome_file;
+    static std::string region;
+    static std::string eventalign_file;
+    static std::string kmer_stats_file;
+    static std::string methylation_file;
+    static std::string phase_file;
+    static std::string variants_file;
+    static int progress = 0;
+    static int compress = 0;
+    static int num_threads = 1;
+}
+
+static const char* shortopts = "r:b:g:t:w:v";
+
+enum { OPT_HELP = 1,
+       OPT_VERSION,
+       OPT_PROGRESS,
+       OPT_COMPRESS,
+       OPT_EVENTALIGN,
+       OPT_KMER_STATS,
+       OPT_METHYLATION,
+       OPT_PHASE,
+       OPT_VARIANTS
+     };
+
+static const struct option longopts[] = {
+    { "verbose",          no_argument,       NULL, 'v' },
+    { "reads",            required_argument, NULL, 'r' },
+    { "bam",              required_argument, NULL, 'b' },
+    { "genome",           required_argument, NULL, 'g' },
+    { "window",           required_argument, NULL, 'w' },
+    { "threads",          required_argument, NULL, 't' },
+    { "progress",         no_argument,       NULL, OPT_PROGRESS },
+    { "compress",         no_argument,       NULL, OPT_COMPRESS },
+    { "eventalign",       required_argument, NULL, OPT_EVENTALIGN },
+    { "kmer-stats",       required_argument, NULL, OPT_KMER_STATS },
+    { "methylation",      required_argument, NULL, OPT_METHYLATION },
+    { "phase",            required_argument, NULL, OPT_PHASE },
+    { "variants",         required_argument, NULL, OPT_VARIANTS },
+    { "help",             no_argument,       NULL, OPT_HELP },
+    { "version",          no_argument,       NULL, OPT_VERSION },
+    { NULL, 0, NULL, 0 }
+};
+
+// A read that has been loaded and aligned to the reference in event space.
+// Strands that were not sequenced have no alignment.
+struct AnalyzedRead
+{
+    SquiggleRead* sr;
+    const bam_hdr_t* hdr;
+    const bam1_t* record;
+    size_t read_idx;
+    EventAlignmentParameters params[NUM_STRANDS];
+    std::vector<EventAlignment> alignments[NUM_STRANDS];
+    EventAlignmentRecord event_records[NUM_STRANDS];
+};
+
+// An analysis run on each aligned read by the worker threads. It formats its output into the buffer.
+typedef std::function<void(OutputBuffer& buffer, AnalyzedRead& read)> ReadAnalysis;
+
+// Load and align one read, then run each of the analyses on it
+void analyze_read(OutputBuffer& buffer,
+                  const std::vector<ReadAnalysis>& analyses,
+                  const ReadDB& read_db,
+                  const PackedReference* reference,
+                  const bam_hdr_t* hdr,
+                  const bam1_t* record,
+                  size_t read_idx,
+                  int region_start,
+                  int region_end)
+{
+    std::string read_name = bam_get_qname(record);
+
+    // When analyzing a window, only load the part of the signal that is aligned to it.
+    // Event indices from a sliced read do not match a whole-read load, so the
+    // whole read is loaded when --eventalign output is requested
+    IndexPair base_range;
+    if(region_start != -1 && region_end != -1 && opt::eventalign_file.empty()) {
+        get_read_range_for_ref_region(record, region_start, region_end, base_range.start, base_range.stop);
+    }
+    SquiggleRead sr(read_name, read_db, 0, base_range);
+
+    AnalyzedRead read;
+    read.sr = &sr;
+    read.hdr = hdr;
+    read.record = record;
+    read.read_idx = read_idx;
+
+    for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
+        EventAlignmentParameters& params = read.params[strand_idx];
+        params.sr = &sr;
+        params.reference = reference;
+        params.hdr = hdr;
+        params.record = record;
+        params.strand_idx = strand_idx;
+        params.read_idx = read_idx;
+        params.region_start = region_start;
+        params.region_end = region_end;
+
+        if(sr.has_events_for_strand(strand_idx)) {
+            read.alignments[strand_idx] = align_read_to_ref(params);
+        }
+        read.event_records[strand_idx] = EventAlignmentRecord(&sr, strand_idx, read.alignments[strand_idx]);
+    }
+
+    for(const ReadAnalysis& analysis : analyses) {
+        analysis(buffer, read);
+    }
+}
+
+void parse_analyze_options(int argc, char** argv)
+{
+    bool die = false;
+    for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+        std::istringstream arg(optarg != NULL ? optarg : "");
+        switch (c) {
+            case 'r': arg >> opt::reads_file; break;
+            case 'g': arg >> opt::genome_file; break;
+            case 'b': arg >> opt::bam_file; break;
+            case 'w': arg >> opt::region; break;
+            case '?': die = true; break;
+            case 't': arg >> opt::num_threads; break;
+            case 'v': opt::verbose++; break;
+            case OPT_PROGRESS: opt::progress = true; break;
+            case OPT_COMPRESS: opt::compress = true; break;
+            case OPT_EVENTALIGN: arg >> opt::eventalign_file; break;
+            case OPT_KMER_STATS: arg >> opt::kmer_stats_file; break;
+            case OPT_METHYLATION: arg >> opt::methylation_file; break;
+            case OPT_PHASE: arg >> opt::phase_file; break;
+            case OPT_VARIANTS: arg >> opt::variants_file; break;
+            case OPT_HELP:
+                std::cout << ANALYZE_USAGE_MESSAGE;
+                exit(EXIT_SUCCESS);
+            case OPT_VERSION:
+                std::cout << ANALYZE_VERSION_MESSAGE;
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    if (argc - optind > 0) {
+        std::cerr << SUBPROGRAM ": too many arguments\n";
+        die = true;
+    }
+
+    if(opt::num_threads <= 0) {
+        std::cerr << SUBPROGRAM ": invalid number of threads: " << opt::num_threads << "\n";
+        die = true;
+    }
+
+    if(opt::reads_file.empty()) {
+        std::cerr << SUBPROGRAM ": a --reads file must be provided\n";
+        die = true;
+    }
+
+    if(opt::genome_file.empty()) {
+        std::cerr << SUBPROGRAM ": a --genome file must be provided\n";
+        die = true;
+    }
+
+    if(opt::bam_file.empty()) {
+        std::cerr << SUBPROGRAM ": a --bam file must be provided\n";
+        die = true;
+    }
+
+    if(opt::eventalign_file.empty() && opt::kmer_stats_file.empty() &&
+       opt::methylation_file.empty() && opt::phase_file.empty()) {
+        std::cerr << SUBPROGRAM ": at least one of --eventalign, --kmer-stats, --methylation or --phase must be provided\n";
+        die = true;
+    }
+
+    if(opt::phase_file.empty() != opt::variants_file.empty()) {
+        std::cerr << SUBPROGRAM ": --phase and --variants must be used together\n";
+        die = true;
+    }
+
+    if (die) {
+        std::cout << "\n" << ANALYZE_USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+    }
+}
+
+int analyze_main(int argc, char** argv)
+{
+    parse_analyze_options(argc, argv);
+    omp_set_num_threads(opt::num_threads);
+    init_hts_thread_pool(opt::num_threads);
+
+    ReadDB read_db;
+    read_db.load(opt::reads_file);
+
+    // load the reference
+    PackedReference reference(opt::genome_file);
+
+#ifndef H5_HAVE_THREADSAFE
+    if(opt::num_threads > 1) {
+        fprintf(stderr, "You enabled multi-threading but you do not have a threadsafe HDF5\n");
+        fprintf(stderr, "Please recompile nanopolish's built-in libhdf5 or run with -t 1\n");
+        exit(1);
+    }
+#endif
+
+    BamProcessor processor(opt::bam_file, opt::region, opt::num_threads);
+    processor.set_verbose(opt::verbose);
+    processor.set_prefetch_function([&read_db](const bam_hdr_t*, const bam1_t* record) {
+        read_db.prefetch_signal_data(bam_get_qname(record));
+    });
+    const bam_hdr_t* hdr = processor.get_bam_header();
+
+    // Each analysis formats its output into its own stream of the writer, which
+    // writes all of them in read order
+    OutputWriter output(true);
+    std::vector<ReadAnalysis> analyses;
+
+    TextOutputFile* eventalign_out = NULL;
+    if(!opt::eventalign_file.empty()) {
+        eventalign_out = new TextOutputFile(opt::eventalign_file, opt::compress);
+        std::string header;
+        emit_tsv_header(header, false, false);
+        eventalign_out->write(header);
+
+        size_t stream_idx = output.add_text_stream(eventalign_out);
+        analyses.push_back([stream_idx](OutputBuffer& buffer, AnalyzedRead& read) {
+            for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
+                emit_event_alignment_tsv(buffer.text(stream_idx), *read.sr, strand_idx,
+                                         read.params[strand_idx], read.alignments[strand_idx]);
+            }
+        });
+    }
+
+    // the statistics are accumulated per thread and written after all reads are analyzed
+    TextOutputFile* kmer_stats_out = NULL;
+    EventalignAggregator* aggregator = NULL;
+    if(!opt::kmer_stats_file.empty()) {
+        kmer_stats_out = new TextOutputFile(opt::kmer_stats_file, opt::compress);
+        aggregator = new EventalignAggregator(AGGREGATE_KMER, 0, opt::num_threads);
+        std::string header;
+        aggregator->write_header(header);
+        kmer_stats_out->write(header);
+
+        analyses.push_back([aggregator](OutputBuffer&, AnalyzedRead& read) {
+            for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
+                aggregate_event_alignment(aggregator, *read.sr, strand_idx,
+                                          read.params[strand_idx], read.alignments[strand_idx]);
+            }
+        });
+    }
+
+    htsFile* phase_out = NULL;
+    std::vector<Variant> variants;
+    if(!opt::phase_file.empty()) {
+        variants = load_variants_for_phasing(opt::variants_file, opt::region);
+        phase_out = hts_open(opt::phase_file.c_str(), "wb");
+        if(phase_out == NULL) {
+            fprintf(stderr, "Error: could not open %s for writing\n", opt::phase_file.c_str());
+            exit(EXIT_FAILURE);
+        }
+        attach_hts_thread_pool(phase_out);
+        if(sam_hdr_write(phase_out, hdr) < 0) {
+            fprintf(stderr, "Error: could not write to %s\n", opt::phase_file.c_str());
+            exit(EXIT_FAILURE);
+        }
+        output.set_bam_stream(phase_out, hdr);
+
+        analyses.push_back([&reference, &variants](OutputBuffer& buffer, AnalyzedRead& read) {
+            phase_aligned_read(buffer, *read.sr, &reference, variants, read.hdr, read.record, read.event_records);
+        });
+    }
+
+    // the methylation calls replace the pore models of the read, so they must be the last analysis
+    TextOutputFile* methylation_out = NULL;
+    if(!opt::methylation_file.empty()) {
+        methylation_out = new TextOutputFile(opt::methylation_file, opt::compress);
+        methylation_out->write(CALL_METHYLATION_TSV_HEADER);
+
+        size_t stream_idx = output.add_text_stream(methylation_out);
+        analyses.push_back([&reference, stream_idx](OutputBuffer& buffer, AnalyzedRead& read) {
+            score_aligned_read_methylation(buffer.text(stream_idx), *read.sr, &reference,
+                                           read.hdr, read.record, read.event_records);
+        });
+    }
+    processor.set_output_writer(&output);
+
+    size_t num_reads_analyzed = 0;
+    Progress progress("[analyze]");
+
+    auto f = [&](const bam_hdr_t* hdr, const bam1_t* record, size_t read_idx, int region_start, int region_end) {
+        OutputBuffer buffer(read_idx);
+        analyze_read(buffer, analyses, read_db, &reference, hdr, record, read_idx, region_start, region_end);
+        output.submit(std::move(buffer));
+
+        if(opt::progress) {
+            #pragma omp critical (analyze_progress)
+            {
+                num_reads_analyzed += 1;
+                fprintf(stderr, "Analyzed %zu reads in %.1lfs\r", num_reads_analyzed, progress.get_elapsed_seconds());
+            }
+        }
+    };
+    processor.parallel_run(f);
+    output.close();
+
+    // cleanup
+    if(eventalign_out != NULL) {
+        eventalign_out->close();
+        delete eventalign_out;
+    }
+
+    if(aggregator != NULL) {
+        std::vector<std::string> contig_names(hdr->target_name, hdr->target_name + hdr->n_targets);
+        aggregator->write(*kmer_stats_out, contig_names, &gDNAAlphabet);
+        delete aggregator;
+        kmer_stats_out->close();
+        delete kmer_stats_out;
+    }
+
+    if(phase_out != NULL) {
+        hts_close(phase_out);
+    }
+
+    if(methylation_out != NULL) {
+        methylation_out->close();
+        delete methylation_out;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,15 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_analyze -- run several analyses over one
+// pass of the reads, sharing the signal and the event
+// alignment of each read
+//
+#ifndef NANOPOLISH_ANALYZE_H
+#define NANOPOLISH_ANALYZE_H
+
+int analyze_main(int argc, char** argv);
+
+#endif
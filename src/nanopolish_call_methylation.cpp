@@ -29,9 +29,14 @@
 #include "nanopolish_profile_hmm.h"
 #include "nanopolish_anchor.h"
 #include "nanopolish_methyltrain.h"
+#include "nanopolish_call_methylation.h"
 #include "nanopolish_pore_model_set.h"
 #include "nanopolish_bam_processor.h"
+#include "nanopolish_bam_utils.h"
+#include "nanopolish_output_writer.h"
+#include "nanopolish_fast_format.h"
 #include "nanopolish_alignment_db.h"
+#include "nanopolish_saved_event_alignments.h"
 #include "nanopolish_read_db.h"
 #include "H5pubconf.h"
 #include "profiler.h"
@@ -44,7 +49,7 @@ using namespace std::placeholders;
 //
 struct OutputHandles
 {
-    FILE* site_writer;
+    TextOutputFile* site_writer;
 };
 
 struct ScoredSite
@@ -77,6 +82,10 @@ struct ScoredSite
 //
 Alphabet* mtest_alphabet = &gMCpGAlphabet;
 
+const char* CALL_METHYLATION_TSV_HEADER = "chromosome\tstart\tend\tread_name\t"
+                                          "log_lik_ratio\tlog_lik_methylated\tlog_lik_unmethylated\t"
+                                          "num_calling_strands\tnum_cpgs\tsequence\n";
+
 //
 // Getopt
 //
@@ -97,9 +106,15 @@ static const char *CALL_METHYLATION_USAGE_MESSAGE =
 "      --help                           display this help and exit\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
+"                                       use - to stream sam/bam from stdin (unsorted input is fine without --window)\n"
 "  -g, --genome=FILE                    the genome we are computing a consensus for is in FILE\n"
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
 "      --progress                       print out a progress message\n"
+"      --compress                       write the output as BGZF. Use nanopolish sort-tsv to sort and\n"
+"                                       tabix index it\n"
+"      --event-alignments=FILE          use the event alignments saved in FILE instead of aligning the\n"
+"                                       events to the reference. FILE is the indexed output of eventalign\n"
+"                                       --sam or the output of eventalign --format=binary, run without a window\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
@@ -110,15 +125,17 @@ namespace opt
     static std::string genome_file;
     static std::string models_fofn;
     static std::string region;
+    static std::string event_alignments_file;
     static std::string cpg_methylation_model_type = "reftrained";
     static int progress = 0;
+    static int compress = 0;
     static int num_threads = 1;
     static int batch_size = 128;
 }
 
 static const char* shortopts = "r:b:g:t:w:m:vn";
 
-enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS };
+enum { OPT_HELP = 1, OPT_VERSION, OPT_PROGRESS, OPT_COMPRESS, OPT_EVENT_ALIGNMENTS };
 
 static const struct option longopts[] = {
     { "verbose",          no_argument,       NULL, 'v' },
@@ -129,30 +146,26 @@ static const struct option longopts[] = {
     { "threads",          required_argument, NULL, 't' },
     { "models-fofn",      required_argument, NULL, 'm' },
     { "progress",         no_argument,       NULL, OPT_PROGRESS },
+    { "compress",         no_argument,       NULL, OPT_COMPRESS },
+    { "event-alignments", required_argument, NULL, OPT_EVENT_ALIGNMENTS },
     { "help",             no_argument,       NULL, OPT_HELP },
     { "version",          no_argument,       NULL, OPT_VERSION },
     { NULL, 0, NULL, 0 }
 };
 
-// Test CpG sites in this read for methylation
-void calculate_methylation_for_read(const OutputHandles& handles,
-                                    const ReadDB& read_db,
-                                    const faidx_t* fai,
+// Test CpG sites in a read that has been loaded and aligned for methylation
+void score_aligned_read_methylation(std::string& out,
+                                    SquiggleRead& sr,
+                                    const PackedReference* reference,
                                     const bam_hdr_t* hdr,
                                     const bam1_t* record,
-                                    size_t read_idx,
-                                    int region_start,
-                                    int region_end)
+                                    const EventAlignmentRecord* event_records)
 {
-    // Load a squiggle read for the mapped read
-    std::string read_name = bam_get_qname(record);
-    SquiggleRead sr(read_name, read_db);
-
     // An output map from reference positions to scored CpG sites
     std::map<int, ScoredSite> site_score_map;
 
     for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
-        if(!sr.has_events_for_strand(strand_idx)) {
+        if(!sr.has_events_for_strand(strand_idx) || event_records[strand_idx].aligned_events.empty()) {
             continue;
         }
 
@@ -173,9 +186,7 @@ void calculate_methylation_for_read(const OutputHandles& handles,
                                 "cpg",
                                 curr_model.k);
 
-        // Build the event-to-reference map for this read from the bam record
-        SequenceAlignmentRecord seq_align_record(record);
-        EventAlignmentRecord event_align_record(&sr, strand_idx, seq_align_record);
+        const EventAlignmentRecord& event_align_record = event_records[strand_idx];
 
         std::vector<double> site_scores;
         std::vector<int> site_starts;
@@ -192,7 +203,7 @@ void calculate_methylation_for_read(const OutputHandles& handles,
         // Extract the reference sequence for this region
         int fetched_len = 0;
         assert(ref_end_pos >= ref_start_pos);
-        std::string ref_seq = get_reference_region_ts(fai, contig.c_str(), ref_start_pos, 
+        std::string ref_seq = get_reference_region_ts(reference, contig.c_str(), ref_start_pos, 
                                                       ref_end_pos, &fetched_len);
         
         // Remove non-ACGT bases from this reference segment
@@ -314,22 +325,77 @@ void calculate_methylation_for_read(const OutputHandles& handles,
         } // for group
     } // for strands
     
-    #pragma omp critical(call_methylation_write)
-    {
-        // write all sites for this read
-        for(auto iter = site_score_map.begin(); iter != site_score_map.end(); ++iter) {
-
-            const ScoredSite& ss = iter->second;
-            double sum_ll_m = ss.ll_methylated[0] + ss.ll_methylated[1];
-            double sum_ll_u = ss.ll_unmethylated[0] + ss.ll_unmethylated[1];
-            double diff = sum_ll_m - sum_ll_u;
-
-            fprintf(handles.site_writer, "%s\t%d\t%d\t", ss.chromosome.c_str(), ss.start_position, ss.end_position);
-            fprintf(handles.site_writer, "%s\t%.2lf\t", sr.read_name.c_str(), diff);
-            fprintf(handles.site_writer, "%.2lf\t%.2lf\t", sum_ll_m, sum_ll_u);
-            fprintf(handles.site_writer, "%d\t%d\t%s\n", ss.strands_scored, ss.n_cpg, ss.sequence.c_str());
+    // format all sites for this read, the output writer thread writes them
+    for(auto iter = site_score_map.begin(); iter != site_score_map.end(); ++iter) {
+
+        const ScoredSite& ss = iter->second;
+        double sum_ll_m = ss.ll_methylated[0] + ss.ll_methylated[1];
+        double sum_ll_u = ss.ll_unmethylated[0] + ss.ll_unmethylated[1];
+        double diff = sum_ll_m - sum_ll_u;
+
+        out.append(ss.chromosome);
+        out.push_back('\t');
+        append_int(out, ss.start_position);
+        out.push_back('\t');
+        append_int(out, ss.end_position);
+        out.push_back('\t');
+        out.append(sr.read_name);
+        out.push_back('\t');
+        append_fixed(out, diff, 2);
+        out.push_back('\t');
+        append_fixed(out, sum_ll_m, 2);
+        out.push_back('\t');
+        append_fixed(out, sum_ll_u, 2);
+        out.push_back('\t');
+        append_int(out, ss.strands_scored);
+        out.push_back('\t');
+        append_int(out, ss.n_cpg);
+        out.push_back('\t');
+        out.append(ss.sequence);
+        out.push_back('\n');
+    }
+}
+
+// Test CpG sites in this read for methylation
+void calculate_methylation_for_read(OutputBuffer& buffer,
+                                    const ReadDB& read_db,
+                                    const PackedReference* reference,
+                                    const bam_hdr_t* hdr,
+                                    const bam1_t* record,
+                                    int region_start,
+                                    int region_end,
+                                    SavedEventAlignments* saved_alignments)
+{
+    // Load a squiggle read for the mapped read
+    std::string read_name = bam_get_qname(record);
+
+    // When processing a region, only load the part of the signal aligned to it.
+    // Saved alignments index the full event table so the whole read is loaded for them.
+    IndexPair base_range;
+    if(region_start != -1 && region_end != -1 && saved_alignments == NULL) {
+        get_read_range_for_ref_region(record, region_start, region_end, base_range.start, base_range.stop);
+    }
+    SquiggleRead sr(read_name, read_db, 0, base_range);
+
+    // Build the event-to-reference map of each strand from the bam record,
+    // or from the saved event alignments
+    EventAlignmentRecord event_records[NUM_STRANDS];
+    for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
+        if(!sr.has_events_for_strand(strand_idx)) {
+            continue;
+        }
+
+        if(saved_alignments != NULL) {
+            SavedStrandAlignment saved;
+            if(saved_alignments->get(hdr, record, strand_idx, saved)) {
+                event_records[strand_idx] = saved_alignment_to_event_record(&sr, strand_idx, saved);
+            }
+        } else {
+            SequenceAlignmentRecord seq_align_record(record);
+            event_records[strand_idx] = EventAlignmentRecord(&sr, strand_idx, seq_align_record);
         }
     }
+    score_aligned_read_methylation(buffer.text(0), sr, reference, hdr, record, event_records);
 }
 
 void parse_call_methylation_options(int argc, char** argv)
@@ -347,6 +413,8 @@ void parse_call_methylation_options(int argc, char** argv)
             case 'w': arg >> opt::region; break;
             case 'v': opt::verbose++; break;
             case OPT_PROGRESS: opt::progress = true; break;
+            case OPT_COMPRESS: opt::compress = true; break;
+            case OPT_EVENT_ALIGNMENTS: arg >> opt::event_alignments_file; break;
             case OPT_HELP:
                 std::cout << CALL_METHYLATION_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -400,11 +468,12 @@ void parse_call_methylation_options(int argc, char** argv)
 int call_methylation_main(int argc, char** argv)
 {
     parse_call_methylation_options(argc, argv);
+    init_hts_thread_pool(opt::num_threads);
     ReadDB read_db;
     read_db.load(opt::reads_file);
 
-    // load reference fai file
-    faidx_t *fai = fai_load(opt::genome_file.c_str());
+    // load the reference
+    PackedReference reference(opt::genome_file);
 
 #ifndef H5_HAVE_THREADSAFE
     if(opt::num_threads > 1) {
@@ -416,26 +485,43 @@ int call_methylation_main(int argc, char** argv)
 
     // Initialize writers
     OutputHandles handles;
-    handles.site_writer = stdout;
+    handles.site_writer = new TextOutputFile("-", opt::compress);
     
     // Write header
-    fprintf(handles.site_writer, "chromosome\tstart\tend\tread_name\t"
-                                 "log_lik_ratio\tlog_lik_methylated\tlog_lik_unmethylated\t"
-                                 "num_calling_strands\tnum_cpgs\tsequence\n");
+    handles.site_writer->write(CALL_METHYLATION_TSV_HEADER);
+
+    // the calls are written in read order by a separate writer thread
+    OutputWriter output(true);
+    output.add_text_stream(handles.site_writer);
+
+    // optionally reuse the event alignments made by eventalign
+    SavedEventAlignments* saved_alignments = NULL;
+    if(!opt::event_alignments_file.empty()) {
+        saved_alignments = new SavedEventAlignments(opt::event_alignments_file, opt::num_threads);
+    }
 
     // the BamProcessor framework calls the input function with the 
     // bam record, read index, etc passed as parameters
-    // bind the other parameters the worker function needs here
-    auto f = std::bind(calculate_methylation_for_read, std::ref(handles), std::ref(read_db), fai, _1, _2, _3, _4, _5);
+    auto f = [&](const bam_hdr_t* hdr, const bam1_t* record, size_t read_idx, int region_start, int region_end) {
+        OutputBuffer buffer(read_idx);
+        calculate_methylation_for_read(buffer, read_db, &reference, hdr, record, region_start, region_end,
+                                       saved_alignments);
+        output.submit(std::move(buffer));
+    };
     BamProcessor processor(opt::bam_file, opt::region, opt::num_threads);
+    processor.set_output_writer(&output);
+    processor.set_verbose(opt::verbose);
+    processor.set_prefetch_function([&read_db](const bam_hdr_t*, const bam1_t* record) {
+        read_db.prefetch_signal_data(bam_get_qname(record));
+    });
     processor.parallel_run(f);
+    output.close();
 
     // cleanup
-    if(handles.site_writer != stdout) {
-        fclose(handles.site_writer);
-    }
+    delete saved_alignments;
+    handles.site_writer->close();
+    delete handles.site_writer;
 
-    fai_destroy(fai);
 
     return EXIT_SUCCESS;
 }
@@ -8,6 +8,22 @@
 #ifndef NANOPOLISH_CALL_METHYLATION_H
 #define NANOPOLISH_CALL_METHYLATION_H
 
+#include <string>
+#include "nanopolish_alignment_db.h"
+
 int call_methylation_main(int argc, char** argv);
 
+// the header of the methylation calls table
+extern const char* CALL_METHYLATION_TSV_HEADER;
+
+// Score the CpG sites of a read that has been loaded and aligned, appending the calls to out.
+// event_records holds the event-to-reference map of each strand, strands without aligned
+// events are not scored. The pore models of sr are replaced with the CpG models.
+void score_aligned_read_methylation(std::string& out,
+                                    SquiggleRead& sr,
+                                    const PackedReference* reference,
+                                    const bam_hdr_t* hdr,
+                                    const bam1_t* record,
+                                    const EventAlignmentRecord* event_records);
+
 #endif
@@ -19,6 +19,9 @@
 #include <sstream>
 #include <fstream>
 #include <set>
+#include <map>
+#include <memory>
+#include <limits>
 #include <omp.h>
 #include <getopt.h>
 #include <iterator>
@@ -29,12 +32,16 @@
 #include "nanopolish_klcs.h"
 #include "nanopolish_profile_hmm.h"
 #include "nanopolish_alignment_db.h"
+#include "nanopolish_squiggle_read_cache.h"
 #include "nanopolish_anchor.h"
 #include "nanopolish_variant.h"
 #include "nanopolish_haplotype.h"
 #include "nanopolish_pore_model_set.h"
 #include "nanopolish_duration_model.h"
 #include "nanopolish_variant_db.h"
+#include "H5pubconf.h"
+#include "nanopolish_bam_utils.h"
+#include "nanopolish_text_output.h"
 #include "profiler.h"
 #include "progress.h"
 #include "stdaln.h"
@@ -56,6 +63,13 @@
 // Hack hack hack
 float g_p_skip, g_p_skip_self, g_p_bad, g_p_bad_self;
 
+// Reads loaded for one window are kept for the overlapping windows and later rounds
+SquiggleReadCache* g_squiggle_read_cache = NULL;
+
+// The read database and reference are loaded once and shared by all windows
+std::shared_ptr<const ReadDB> g_read_db;
+std::shared_ptr<const PackedReference> g_reference;
+
 //
 // Getopt
 //
@@ -79,6 +93,11 @@ static const char *CONSENSUS_USAGE_MESSAGE =
 "      --fix-homopolymers               run the experimental homopolymer caller\n"
 "      --faster                         minimize compute time while slightly reducing consensus accuracy\n"
 "  -w, --window=STR                     find variants in window STR (format: <chromsome_name>:<start>-<end>)\n"
+"                                       if STR is only a contig name, or -w is not given, the whole contig or genome\n"
+"                                       is split into overlapping segments that are processed in parallel and merged\n"
+"      --segment-length=NUM             when processing a whole contig or genome, use segments of NUM bases (default: 50000)\n"
+"      --overlap-length=NUM             when processing a whole contig or genome, overlap segments by NUM bases (default: 200)\n"
+"      --read-cache-size=NUM            keep up to NUM megabytes of loaded reads for reuse by other windows (default: 1024, 0 disables)\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the reference genome are in bam FILE\n"
 "  -e, --event-bam=FILE                 the events aligned to the reference genome are in bam FILE\n"
@@ -86,6 +105,7 @@ static const char *CONSENSUS_USAGE_MESSAGE =
 "  -p, --ploidy=NUM                     the ploidy level of the sequenced genome\n"
 "      --genotype=FILE                  call genotypes for the variants in the vcf FILE\n"
 "  -o, --outfile=FILE                   write result to FILE [default: stdout]\n"
+"      --compress                       write the vcf as BGZF, and build a tabix index when writing to a file\n"
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
 "  -m, --min-candidate-frequency=F      extract candidate variants from the aligned reads when the variant frequency is at least F (default 0.2)\n"
 "  -d, --min-candidate-depth=D          extract candidate variants from the aligned reads when the depth is at least D (default: 20)\n"
@@ -130,6 +150,10 @@ namespace opt
     static int screen_score_threshold = 100;
     static int screen_flanking_sequence = 10;
     static int debug_alignments = 0;
+    static int segment_length = 50000;
+    static int overlap_length = 200;
+    static int read_cache_size = 1024;
+    static int compress = 0;
 }
 
 static const char* shortopts = "r:b:g:t:w:o:e:m:c:d:a:x:v";
@@ -150,7 +174,11 @@ enum { OPT_HELP = 1,
        OPT_P_SKIP,
        OPT_P_SKIP_SELF,
        OPT_P_BAD,
-       OPT_P_BAD_SELF };
+       OPT_P_BAD_SELF,
+       OPT_SEGMENT_LENGTH,
+       OPT_OVERLAP_LENGTH,
+       OPT_READ_CACHE_SIZE,
+       OPT_COMPRESS };
 
 static const struct option longopts[] = {
     { "verbose",                   no_argument,       NULL, 'v' },
@@ -176,6 +204,10 @@ static const struct option longopts[] = {
     { "p-bad",                     required_argument, NULL, OPT_P_BAD },
     { "p-bad-self",                required_argument, NULL, OPT_P_BAD_SELF },
     { "consensus",                 required_argument, NULL, OPT_CONSENSUS },
+    { "segment-length",            required_argument, NULL, OPT_SEGMENT_LENGTH },
+    { "overlap-length",            required_argument, NULL, OPT_OVERLAP_LENGTH },
+    { "read-cache-size",           required_argument, NULL, OPT_READ_CACHE_SIZE },
+    { "compress",                  no_argument,       NULL, OPT_COMPRESS },
     { "faster",                    no_argument,       NULL, OPT_FASTER },
     { "fix-homopolymers",          no_argument,       NULL, OPT_FIX_HOMOPOLYMERS },
     { "calculate-all-support",     no_argument,       NULL, OPT_CALC_ALL_SUPPORT },
@@ -186,21 +218,6 @@ static const struct option longopts[] = {
     { NULL, 0, NULL, 0 }
 };
 
-// If there is a single contig in the .fai file, return its name
-// otherwise print an error message and exit
-std::string get_single_contig_or_fail()
-{
-    faidx_t *fai = fai_load(opt::genome_file.c_str());
-    size_t n_contigs = faidx_nseq(fai);
-    if(n_contigs > 1) {
-        fprintf(stderr, "Error: genome has multiple contigs, please use -w to specify input region\n");
-        exit(EXIT_FAILURE);
-    }
-
-    const char* name = faidx_iseq(fai, 0);
-    return std::string(name);
-}
-
 int get_contig_length(const std::string& contig)
 {
     faidx_t *fai = fai_load(opt::genome_file.c_str());
@@ -461,8 +478,8 @@ void print_debug_stats(const std::string& contig,
                 called_kmer = gDNAAlphabet.reverse_complement(called_kmer);
             }
 
-            PoreModelStateParams base_model = pm.states[pm.pmalphabet->kmer_rank(base_kmer.c_str(), k)];
-            PoreModelStateParams called_model = pm.states[pm.pmalphabet->kmer_rank(called_kmer.c_str(), k)];
+            PoreModelStateParams base_model = pm.get_parameters(pm.pmalphabet->kmer_rank(base_kmer.c_str(), k));
+            PoreModelStateParams called_model = pm.get_parameters(pm.pmalphabet->kmer_rank(called_kmer.c_str(), k));
 
             float base_standard_level = (event_mean - base_model.level_mean) / (sqrt(pm.var) * base_model.level_stdv);
             float called_standard_level = (event_mean - called_model.level_mean) / (sqrt(pm.var) * called_model.level_stdv);
@@ -728,7 +745,7 @@ Haplotype fix_homopolymers(const Haplotype& input_haplotype,
 Haplotype call_haplotype_from_candidates(const AlignmentDB& alignments,
                                          const std::vector<Variant>& candidate_variants,
                                          uint32_t alignment_flags,
-                                         FILE* vcf_out)
+                                         std::vector<Variant>& called_variants_out)
 {
     Haplotype derived_haplotype(alignments.get_region_contig(), alignments.get_region_start(), alignments.get_reference());
     VariantDB variant_db;
@@ -818,7 +835,7 @@ Haplotype call_haplotype_from_candidates(const AlignmentDB& alignments,
             // Apply them to the final haplotype
             for(size_t vi = 0; vi < called_variants.size(); vi++) {
                 derived_haplotype.apply_variant(called_variants[vi]);
-                called_variants[vi].write_vcf(vcf_out);
+                called_variants_out.push_back(called_variants[vi]);
             }
         }
     }
@@ -826,7 +843,10 @@ Haplotype call_haplotype_from_candidates(const AlignmentDB& alignments,
 }
 
 
-Haplotype call_variants_for_region(const std::string& contig, int region_start, int region_end, FILE* out_fp)
+// Call variants, or the consensus sequence, for the given region. The returned haplotype
+// covers the region plus flanking reference sequence. The variants that should be written
+// to the VCF are appended to called_variants_out.
+Haplotype call_variants_for_region(const std::string& contig, int region_start, int region_end, std::vector<Variant>& called_variants_out)
 {
     const int BUFFER = opt::min_flanking_sequence + 10;
     uint32_t alignment_flags = HAF_ALLOW_PRE_CLIP | HAF_ALLOW_POST_CLIP;
@@ -834,12 +854,16 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
     // load the region, accounting for the buffering
     if(region_start < BUFFER)
         region_start = BUFFER;
-    AlignmentDB alignments(opt::reads_file, opt::genome_file, opt::bam_file, opt::event_bam_file, opt::calibrate);
+    AlignmentDB alignments(g_read_db, g_reference, opt::bam_file, opt::event_bam_file, opt::calibrate);
 
     if(!opt::alternative_basecalls_bam.empty()) {
         alignments.set_alternative_basecalls_bam(opt::alternative_basecalls_bam);
     }
 
+    if(g_squiggle_read_cache != NULL) {
+        alignments.set_squiggle_read_cache(g_squiggle_read_cache);
+    }
+
     alignments.load_region(contig, region_start - BUFFER, region_end + BUFFER);
 
     // if the end of the region plus the buffer sequence goes past
@@ -906,7 +930,7 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
             called_haplotype = call_haplotype_from_candidates(alignments,
                                                               filtered_variants,
                                                               alignment_flags,
-                                                              out_fp);
+                                                              called_variants_out);
 
             // Expand the called variant set by adding nearby variants
             std::vector<Variant> called_variants = called_haplotype.get_variants();
@@ -942,13 +966,6 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
             called_haplotype = fix_homopolymers(called_haplotype, alignments);
         }
 
-        // write consensus result
-        FILE* consensus_fp = fopen(opt::consensus_output.c_str(), "w");
-        fprintf(consensus_fp, ">%s:%d-%d\n%s\n", contig.c_str(),
-                                  alignments.get_region_start(),
-                                  alignments.get_region_end(),
-                                  called_haplotype.get_sequence().c_str());
-        fclose(consensus_fp);
     } else {
         //
         // Calling strategy in reference-based variant calling mode
@@ -956,12 +973,262 @@ Haplotype call_variants_for_region(const std::string& contig, int region_start,
         called_haplotype = call_haplotype_from_candidates(alignments,
                                                           candidate_variants,
                                                           alignment_flags,
-                                                          out_fp);
+                                                          called_variants_out);
     }
 
     return called_haplotype;
 }
 
+//
+// Whole contig/genome processing
+//
+
+// A segment of a contig to polish. Segments of the same contig
+// are consecutive and overlap by opt::overlap_length bases.
+struct PolishingSegment
+{
+    std::string contig;
+    int start;
+    int end; // inclusive
+    bool first_in_contig;
+    bool last_in_contig;
+    bool copy_reference; // the contig is too short to polish, output it as-is
+};
+
+// Split every contig of the genome (or only the contig named by target_contig)
+// into overlapping segments. This mirrors scripts/nanopolish_makerange.py.
+std::vector<PolishingSegment> make_polishing_segments(const std::string& target_contig)
+{
+    const int MIN_SEGMENT_LENGTH = 5 * opt::overlap_length;
+    const int MIN_POLISH_LENGTH = 200;
+    std::vector<PolishingSegment> segments;
+
+    faidx_t *fai = fai_load(opt::genome_file.c_str());
+    if(fai == NULL) {
+        fprintf(stderr, "Error: could not load the index for %s\n", opt::genome_file.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    bool found = false;
+    for(int i = 0; i < faidx_nseq(fai); ++i) {
+        std::string contig = faidx_iseq(fai, i);
+        if(!target_contig.empty() && contig != target_contig) {
+            continue;
+        }
+        found = true;
+
+        int length = faidx_seq_len(fai, contig.c_str());
+        if(length < MIN_POLISH_LENGTH) {
+            segments.push_back({ contig, 0, length - 1, true, true, true });
+            continue;
+        }
+
+        size_t first_idx = segments.size();
+        int start = 0;
+        while(start < length) {
+            int end = start + opt::segment_length;
+
+            // If this segment will end near the end of the contig, extend it to the end
+            if(length - end < MIN_SEGMENT_LENGTH) {
+                segments.push_back({ contig, start, length - 1, false, false, false });
+                start = length;
+            } else {
+                segments.push_back({ contig, start, end + opt::overlap_length, false, false, false });
+                start = end;
+            }
+        }
+        segments[first_idx].first_in_contig = true;
+        segments.back().last_in_contig = true;
+    }
+    fai_destroy(fai);
+
+    if(!found) {
+        fprintf(stderr, "Error: contig %s is not in the genome\n", target_contig.c_str());
+        exit(EXIT_FAILURE);
+    }
+    return segments;
+}
+
+// return the index of the haplotype base that is the unchanged
+// reference base at ref_pos, or std::string::npos if there is none
+size_t get_haplotype_base_for_reference(const Haplotype& haplotype, size_t ref_pos)
+{
+    if(ref_pos < haplotype.get_reference_position() || ref_pos >= haplotype.get_reference_end()) {
+        return std::string::npos;
+    }
+
+    for(size_t i = 0; i < haplotype.get_sequence().size(); ++i) {
+        size_t p = haplotype.get_reference_position_for_haplotype_base(i);
+        if(p == ref_pos) {
+            return i;
+        } else if(p != std::string::npos && p > ref_pos) {
+            break;
+        }
+    }
+    return std::string::npos;
+}
+
+// Stitches the polished segments of each contig together and writes
+// the merged sequence and variants. Segments must be added in order.
+// Consecutive segments are joined at a reference base near the middle
+// of their overlap that is unchanged in both; the sequence and variants
+// before this base come from the first segment and the rest from the second.
+class SegmentMerger
+{
+    public:
+        SegmentMerger(FILE* fasta_fp, TextOutputFile* vcf_out) : m_fasta_fp(fasta_fp), m_vcf_out(vcf_out) {}
+
+        void add(const PolishingSegment& segment,
+                 const Haplotype& haplotype,
+                 const std::vector<Variant>& variants)
+        {
+            if(segment.first_in_contig) {
+                assert(m_prev_haplotype == NULL);
+                if(m_fasta_fp != NULL) {
+                    fprintf(m_fasta_fp, ">%s\n", segment.contig.c_str());
+                }
+                m_prev_sequence_start = 0;
+                m_prev_variant_start = 0;
+            } else {
+                assert(m_prev_haplotype != NULL);
+
+                // search outwards from the middle of the overlap for a join point
+                int overlap_start = segment.start;
+                int overlap_end = m_prev_segment.end;
+                int mid = (overlap_start + overlap_end) / 2;
+                size_t prev_idx = std::string::npos;
+                size_t curr_idx = std::string::npos;
+                int join = -1;
+                for(int d = 0; d <= (overlap_end - overlap_start) / 2 && join == -1; ++d) {
+                    for(int c : { mid - d, mid + d }) {
+                        prev_idx = get_haplotype_base_for_reference(*m_prev_haplotype, c);
+                        curr_idx = get_haplotype_base_for_reference(haplotype, c);
+                        if(prev_idx != std::string::npos && curr_idx != std::string::npos) {
+                            join = c;
+                            break;
+                        }
+                    }
+                }
+
+                if(join == -1) {
+                    fprintf(stderr, "Error: could not merge segments %s:%d-%d and %s:%d-%d, no shared reference base in the overlap\n",
+                        m_prev_segment.contig.c_str(), m_prev_segment.start, m_prev_segment.end,
+                        segment.contig.c_str(), segment.start, segment.end);
+                    exit(EXIT_FAILURE);
+                }
+
+                write_previous(prev_idx, join);
+                m_prev_sequence_start = curr_idx;
+                m_prev_variant_start = join;
+            }
+
+            m_prev_haplotype.reset(new Haplotype(haplotype));
+            m_prev_variants = variants;
+            std::sort(m_prev_variants.begin(), m_prev_variants.end(), sortByPosition);
+            m_prev_segment = segment;
+
+            if(segment.last_in_contig) {
+                write_previous(m_prev_haplotype->get_sequence().size(), std::numeric_limits<int>::max());
+                if(m_fasta_fp != NULL) {
+                    fprintf(m_fasta_fp, "\n");
+                }
+                m_prev_haplotype.reset();
+                m_prev_variants.clear();
+            }
+        }
+
+    private:
+
+        // write the part of the previous segment up to (not including) the given haplotype base
+        // and the variants up to the given reference position
+        void write_previous(size_t sequence_end, int variant_end)
+        {
+            if(m_fasta_fp != NULL) {
+                const std::string& sequence = m_prev_haplotype->get_sequence();
+                fwrite(sequence.data() + m_prev_sequence_start, 1, sequence_end - m_prev_sequence_start, m_fasta_fp);
+            }
+
+            std::string out;
+            for(const auto& v : m_prev_variants) {
+                if(v.ref_position >= m_prev_variant_start && v.ref_position < variant_end) {
+                    v.write_vcf(out);
+                }
+            }
+            m_vcf_out->write(out);
+        }
+
+        FILE* m_fasta_fp;
+        TextOutputFile* m_vcf_out;
+
+        std::unique_ptr<Haplotype> m_prev_haplotype;
+        std::vector<Variant> m_prev_variants;
+        PolishingSegment m_prev_segment;
+        size_t m_prev_sequence_start = 0;
+        int m_prev_variant_start = 0;
+};
+
+// Polish or call variants on every segment in parallel. Segments are handed
+// to threads dynamically; when there are fewer segments than threads the
+// remaining threads are used by the parallel loops within each segment.
+// Results are merged in order as soon as all earlier segments are done, so
+// only segments that finished out of order are held in memory.
+void process_segments(const std::vector<PolishingSegment>& segments, SegmentMerger& merger)
+{
+    int num_segment_threads = std::min(opt::num_threads, (int)segments.size());
+
+#ifndef H5_HAVE_THREADSAFE
+    // reads are loaded by each segment so segments cannot run concurrently
+    num_segment_threads = 1;
+#endif
+
+    int threads_per_segment = std::max(1, opt::num_threads / std::max(num_segment_threads, 1));
+    omp_set_max_active_levels(2);
+
+    // results waiting for an earlier segment to finish
+    std::map<size_t, std::pair<Haplotype, std::vector<Variant>>> finished;
+    size_t next_to_merge = 0;
+
+    Progress progress("[variants]");
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_segment_threads)
+    for(size_t si = 0; si < segments.size(); ++si) {
+        omp_set_num_threads(threads_per_segment);
+        const PolishingSegment& segment = segments[si];
+
+        std::vector<Variant> variants;
+        Haplotype haplotype(segment.contig, segment.start, "");
+        if(segment.copy_reference) {
+            faidx_t *fai = fai_load(opt::genome_file.c_str());
+            int length;
+            char* seq = faidx_fetch_seq(fai, segment.contig.c_str(), segment.start, segment.end, &length);
+            haplotype = Haplotype(segment.contig, segment.start, seq != NULL ? seq : "");
+            free(seq);
+            fai_destroy(fai);
+        } else {
+            haplotype = call_variants_for_region(segment.contig, segment.start, segment.end, variants);
+        }
+
+        #pragma omp critical (merge_segments)
+        {
+            finished.insert(std::make_pair(si, std::make_pair(haplotype, variants)));
+            while(!finished.empty() && finished.begin()->first == next_to_merge) {
+                const auto& result = finished.begin()->second;
+                merger.add(segments[next_to_merge], result.first, result.second);
+                finished.erase(finished.begin());
+                next_to_merge += 1;
+            }
+
+            if(opt::show_progress) {
+                fprintf(stderr, "[variants] processed %zu of %zu segments in %.1lfs\r", 
+                    next_to_merge, segments.size(), progress.get_elapsed_seconds());
+            }
+        }
+    }
+
+    assert(next_to_merge == segments.size());
+    omp_set_num_threads(opt::num_threads);
+}
+
 void parse_call_variants_options(int argc, char** argv)
 {
     bool die = false;
@@ -997,6 +1264,10 @@ void parse_call_variants_options(int argc, char** argv)
             case OPT_P_SKIP_SELF: arg >> g_p_skip_self; break;
             case OPT_P_BAD: arg >> g_p_bad; break;
             case OPT_P_BAD_SELF: arg >> g_p_bad_self; break;
+            case OPT_SEGMENT_LENGTH: arg >> opt::segment_length; break;
+            case OPT_OVERLAP_LENGTH: arg >> opt::overlap_length; break;
+            case OPT_READ_CACHE_SIZE: arg >> opt::read_cache_size; break;
+            case OPT_COMPRESS: opt::compress = 1; break;
             case OPT_HELP:
                 std::cout << CONSENSUS_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -1041,6 +1312,11 @@ void parse_call_variants_options(int argc, char** argv)
         die = true;
     }
 
+    if(opt::overlap_length <= 0 || opt::segment_length <= opt::overlap_length) {
+        std::cerr << SUBPROGRAM ": --segment-length must be larger than --overlap-length, and both must be positive\n";
+        die = true;
+    }
+
     if(!opt::models_fofn.empty()) {
         // initialize the model set from the fofn
         PoreModelSet::initialize(opt::models_fofn);
@@ -1057,39 +1333,19 @@ int call_variants_main(int argc, char** argv)
 {
     parse_call_variants_options(argc, argv);
     omp_set_num_threads(opt::num_threads);
+    init_hts_thread_pool(opt::num_threads);
 
-    std::string contig;
-    int start_base;
-    int end_base;
-    int contig_length = -1;
+    std::shared_ptr<ReadDB> read_db = std::make_shared<ReadDB>();
+    read_db->load(opt::reads_file);
+    g_read_db = read_db;
+    g_reference = std::make_shared<PackedReference>(opt::genome_file);
 
-    // If a window has been specified, only call variants/polish in that range
-    if(!opt::window.empty()) {
-        // Parse the window string
-        parse_region_string(opt::window, contig, start_base, end_base);
-        contig_length = get_contig_length(contig);
-        end_base = std::min(end_base, contig_length - 1);
-    } else {
-        // otherwise, run on the whole genome
-        contig = get_single_contig_or_fail();
-        contig_length = get_contig_length(contig);
-        start_base = 0;
-        end_base = contig_length - 1;
+    if(opt::read_cache_size > 0) {
+        g_squiggle_read_cache = new SquiggleReadCache((size_t)opt::read_cache_size * 1024 * 1024);
     }
 
-    int MIN_DISTANCE_TO_END = 40;
-    if(contig_length - start_base < MIN_DISTANCE_TO_END) {
-        fprintf(stderr, "Invalid polishing window: [%d %d] - please adjust -w parameter.\n", start_base, end_base);
-        fprintf(stderr, "The starting coordinate of the polishing window must be at least %dbp from the contig end\n", MIN_DISTANCE_TO_END);
-        exit(EXIT_FAILURE);
-    }
-
-    FILE* out_fp;
-    if(!opt::output_file.empty()) {
-        out_fp = fopen(opt::output_file.c_str(), "w");
-    } else {
-        out_fp = stdout;
-    }
+    // The variants are written in reference order so a compressed vcf can be indexed
+    TextOutputFile vcf_out(opt::output_file.empty() ? "-" : opt::output_file, opt::compress);
 
     // Build the VCF header
     std::vector<std::string> tag_fields;
@@ -1125,12 +1381,79 @@ int call_variants_main(int argc, char** argv)
             Variant::make_vcf_tag_string("FORMAT", "GT", 1, "String",
                 "Genotype"));
 
-    Variant::write_vcf_header(out_fp, tag_fields);
+    std::string vcf_header;
+    Variant::write_vcf_header(vcf_header, tag_fields);
+    vcf_out.write(vcf_header);
+
+    // A window with coordinates is processed as a single region. Otherwise the
+    // named contig, or the entire genome, is split into segments that are
+    // processed in parallel and merged into one sequence per contig.
+    if(!opt::window.empty() && opt::window.find(':') != std::string::npos) {
+        std::string contig;
+        int start_base;
+        int end_base;
+        parse_region_string(opt::window, contig, start_base, end_base);
+        int contig_length = get_contig_length(contig);
+        end_base = std::min(end_base, contig_length - 1);
 
-    Haplotype haplotype = call_variants_for_region(contig, start_base, end_base, out_fp);
+        int MIN_DISTANCE_TO_END = 40;
+        if(contig_length - start_base < MIN_DISTANCE_TO_END) {
+            fprintf(stderr, "Invalid polishing window: [%d %d] - please adjust -w parameter.\n", start_base, end_base);
+            fprintf(stderr, "The starting coordinate of the polishing window must be at least %dbp from the contig end\n", MIN_DISTANCE_TO_END);
+            exit(EXIT_FAILURE);
+        }
+
+        std::vector<Variant> called_variants;
+        Haplotype haplotype = call_variants_for_region(contig, start_base, end_base, called_variants);
+        std::sort(called_variants.begin(), called_variants.end(), sortByPosition);
+        std::string vcf_records;
+        for(const auto& v : called_variants) {
+            v.write_vcf(vcf_records);
+        }
+        vcf_out.write(vcf_records);
 
-    if(out_fp != stdout) {
-        fclose(out_fp);
+        // write consensus result
+        if(opt::consensus_mode) {
+            FILE* consensus_fp = fopen(opt::consensus_output.c_str(), "w");
+            fprintf(consensus_fp, ">%s:%zu-%zu\n%s\n", contig.c_str(),
+                                      haplotype.get_reference_position(),
+                                      haplotype.get_reference_end() - 1,
+                                      haplotype.get_sequence().c_str());
+            fclose(consensus_fp);
+        }
+    } else {
+        std::vector<PolishingSegment> segments = make_polishing_segments(opt::window);
+        FILE* consensus_fp = NULL;
+        if(opt::consensus_mode) {
+            consensus_fp = fopen(opt::consensus_output.c_str(), "w");
+            if(consensus_fp == NULL) {
+                fprintf(stderr, "Error: could not open %s for write\n", opt::consensus_output.c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        SegmentMerger merger(consensus_fp, &vcf_out);
+        process_segments(segments, merger);
+
+        if(consensus_fp != NULL) {
+            fclose(consensus_fp);
+        }
+    }
+
+    vcf_out.close();
+    if(vcf_out.is_compressed() && !vcf_out.is_stdout()) {
+        build_vcf_index(vcf_out.get_filename());
     }
+
+    if(g_squiggle_read_cache != NULL) {
+        if(opt::verbose > 0) {
+            g_squiggle_read_cache->print_stats(stderr);
+        }
+        delete g_squiggle_read_cache;
+        g_squiggle_read_cache = NULL;
+    }
+    g_read_db.reset();
+    g_reference.reset();
+
     return 0;
 }
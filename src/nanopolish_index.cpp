@@ -15,7 +15,13 @@
 
 #include <iostream>
 #include <sstream>
+#include <algorithm>
+#include <unordered_set>
+#include <thread>
 #include <getopt.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "nanopolish_index.h"
 #include "nanopolish_common.h"
@@ -40,6 +46,9 @@ static const char *INDEX_USAGE_MESSAGE =
 "  -v, --verbose                        display verbose output\n"
 "  -d, --directory                      path to the directory containing the raw ONT signal files\n"
 "  -f, --fast5-fofn                     file containing the paths to each fast5 file for the run\n"
+"  -t, --threads=NUM                    use NUM threads to find and read the fast5 files (default: 1)\n"
+"      --update                         only read fast5 files that are not in the existing index for reads.fastq,\n"
+"                                       for example to update the index while a run is in progress\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
@@ -48,44 +57,200 @@ namespace opt
     static std::string raw_file_directory;
     static std::string fast5_fofn;
     static std::string reads_file;
+    static int num_threads = 1;
+    static int update = 0;
 }
 static std::ostream* os_p;
 
-void index_file(ReadDB& read_db, const std::string& fn)
+// read the ID of the read stored in a fast5 file, returns false if the file could not be read
+bool read_fast5_read_id(const std::string& fn, std::string& read_id)
 {
-    PROFILE_FUNC("index_file")
+    PROFILE_FUNC("read_fast5_read_id")
+    if(!fast5::File::is_valid_file(fn)) {
+        return false;
+    }
+
     fast5::File* fp = new fast5::File(fn);
-    if(fp->is_open()) {
+    bool ok = fp->is_open();
+    if(ok) {
         fast5::Raw_Samples_Params params = fp->get_raw_samples_params();
-        std::string read_id = params.read_id;
-        read_db.add_signal_path(read_id, fn);
+        read_id = params.read_id;
     }
     delete fp;
-} // process_file
+    return ok;
+}
 
-void index_path(ReadDB& read_db, const std::string& path)
+// Recursively find the fast5 files below path. Each subdirectory is listed in
+// its own OpenMP task so large run directories are walked in parallel.
+void find_fast5_files(const std::string& path, std::vector<std::string>& files)
 {
-    fprintf(stderr, "Indexing %s\n", path.c_str());
-    if (is_directory(path)) {
-        auto dir_list = list_directory(path);
-        for (const auto& fn : dir_list) {
-            if(fn == "." or fn == "..") {
-                continue;
+    DIR* dir = opendir(path.c_str());
+    if(dir == NULL) {
+        return;
+    }
+
+    std::vector<std::string> local_files;
+    struct dirent* ent;
+    while((ent = readdir(dir)) != NULL) {
+        std::string fn = ent->d_name;
+        if(fn == "." or fn == "..") {
+            continue;
+        }
+
+        // use the type from the directory entry when the filesystem provides it, to avoid a syscall per file
+        std::string full_fn = path + "/" + fn;
+        bool is_dir = ent->d_type == DT_DIR ||
+                      ((ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) && is_directory(full_fn));
+        if(is_dir) {
+            #pragma omp task firstprivate(full_fn) shared(files)
+            find_fast5_files(full_fn, files);
+        } else if(full_fn.find(".fast5") != std::string::npos) {
+            local_files.push_back(full_fn);
+        }
+    }
+    closedir(dir);
+
+    #pragma omp critical(find_fast5_files)
+    files.insert(files.end(), local_files.begin(), local_files.end());
+}
+
+// read the fast5 files of worker_idx's share of files and write "read_id<tab>path" lines to fp
+void index_files_worker(const std::vector<std::string>& files, size_t worker_idx, size_t num_workers, FILE* fp)
+{
+    std::string read_id;
+    for(size_t i = worker_idx; i < files.size(); i += num_workers) {
+        if(read_fast5_read_id(files[i], read_id)) {
+            fprintf(fp, "%s\t%s\n", read_id.c_str(), files[i].c_str());
+        }
+    }
+}
+
+// Add the reads stored in the given fast5 files to the database.
+// HDF5 only lets one thread into the library at a time, so rather than
+// threads the files are split between worker processes. Each worker
+// writes what it finds to a pipe that is read by a thread in this process.
+void index_files(ReadDB& read_db, const std::vector<std::string>& files)
+{
+    size_t num_workers = std::min((size_t)opt::num_threads, files.size());
+    if(num_workers <= 1) {
+        std::string read_id;
+        for(size_t i = 0; i < files.size(); ++i) {
+            if(read_fast5_read_id(files[i], read_id)) {
+                read_db.add_signal_path(read_id, files[i]);
+            }
+
+            if(opt::verbose > 0 && (i + 1) % 10000 == 0) {
+                fprintf(stderr, "[index] read %zu of %zu fast5 files\n", i + 1, files.size());
+            }
+        }
+        return;
+    }
+
+    // make sure buffered output is not written twice by the workers
+    fflush(stdout);
+    fflush(stderr);
+
+    std::vector<pid_t> pids;
+    std::vector<int> fds;
+    for(size_t wi = 0; wi < num_workers; ++wi) {
+        int pipe_fds[2];
+        if(pipe(pipe_fds) != 0) {
+            fprintf(stderr, "Error: could not create a pipe for index worker %zu\n", wi);
+            exit(EXIT_FAILURE);
+        }
+
+        pid_t pid = fork();
+        if(pid < 0) {
+            fprintf(stderr, "Error: could not start index worker %zu\n", wi);
+            exit(EXIT_FAILURE);
+        }
+
+        if(pid == 0) {
+            // worker, close the read ends of this and the earlier pipes
+            for(int fd : fds) {
+                close(fd);
             }
+            close(pipe_fds[0]);
+            FILE* out_fp = fdopen(pipe_fds[1], "w");
+            index_files_worker(files, wi, num_workers, out_fp);
+            int ret = fclose(out_fp) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+            _exit(ret);
+        }
+
+        close(pipe_fds[1]);
+        pids.push_back(pid);
+        fds.push_back(pipe_fds[0]);
+    }
 
-            std::string full_fn = path + "/" + fn;
-            if(is_directory(full_fn)) {
-                // recurse
-                index_path(read_db, full_fn);
-                read_db.print_stats();
-            } else if (full_fn.find(".fast5") != -1 && fast5::File::is_valid_file(full_fn)) {
-                index_file(read_db, full_fn);
+    // drain every pipe concurrently so no worker waits on a full pipe
+    std::vector<std::vector<std::pair<std::string, std::string>>> results(num_workers);
+    std::vector<std::thread> readers;
+    for(size_t wi = 0; wi < num_workers; ++wi) {
+        readers.push_back(std::thread([&results, &fds, wi]() {
+            FILE* in_fp = fdopen(fds[wi], "r");
+            char* line = NULL;
+            size_t line_size = 0;
+            ssize_t len;
+            while((len = getline(&line, &line_size, in_fp)) > 0) {
+                std::string record(line, line[len - 1] == '\n' ? len - 1 : len);
+                size_t tab = record.find('\t');
+                if(tab != std::string::npos) {
+                    results[wi].push_back(std::make_pair(record.substr(0, tab), record.substr(tab + 1)));
+                }
             }
+            free(line);
+            fclose(in_fp);
+        }));
+    }
+
+    for(size_t wi = 0; wi < num_workers; ++wi) {
+        readers[wi].join();
+
+        int status;
+        if(waitpid(pids[wi], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            fprintf(stderr, "Error: index worker %zu failed\n", wi);
+            exit(EXIT_FAILURE);
         }
+
+        for(const auto& r : results[wi]) {
+            read_db.add_signal_path(r.first, r.second);
+        }
+    }
+}
+
+// remove the files that are already in the index
+std::vector<std::string> remove_indexed_files(const std::vector<std::string>& files,
+                                              const std::unordered_set<std::string>& indexed_files)
+{
+    std::vector<std::string> out;
+    for(const auto& fn : files) {
+        if(indexed_files.find(fn) == indexed_files.end()) {
+            out.push_back(fn);
+        }
+    }
+    return out;
+}
+
+void index_path(ReadDB& read_db, const std::string& path, const std::unordered_set<std::string>& indexed_files)
+{
+    fprintf(stderr, "Indexing %s\n", path.c_str());
+    std::vector<std::string> files;
+    if (is_directory(path)) {
+        #pragma omp parallel num_threads(opt::num_threads)
+        #pragma omp single
+        find_fast5_files(path, files);
     }
+
+    // the walk finishes in any order, sort so the index does not depend on it
+    std::sort(files.begin(), files.end());
+    size_t num_found = files.size();
+    files = remove_indexed_files(files, indexed_files);
+    fprintf(stderr, "[index] found %zu fast5 files, %zu not yet indexed\n", num_found, files.size());
+
+    index_files(read_db, files);
 } // process_path
 
-void process_fast5_fofn(ReadDB& read_db, const std::string& fast5_fofn)
+void process_fast5_fofn(ReadDB& read_db, const std::string& fast5_fofn, const std::unordered_set<std::string>& indexed_files)
 {
     //
     std::ifstream in_file(fast5_fofn.c_str());
@@ -95,22 +260,25 @@ void process_fast5_fofn(ReadDB& read_db, const std::string& fast5_fofn)
     }
 
     // read
-    size_t count = 0;
+    std::vector<std::string> files;
     std::string filename;
     while(getline(in_file, filename)) {
-        if(count++ % 1000 == 0) {
-            fprintf(stderr, "Loaded %zu from fofn\n", count);
-        }
-        index_file(read_db, filename);
+        files.push_back(filename);
     }
+
+    size_t num_listed = files.size();
+    files = remove_indexed_files(files, indexed_files);
+    fprintf(stderr, "[index] loaded %zu files from fofn, %zu not yet indexed\n", num_listed, files.size());
+    index_files(read_db, files);
 }
 
-static const char* shortopts = "vd:f:";
+static const char* shortopts = "vd:f:t:";
 
 enum {
     OPT_HELP = 1,
     OPT_VERSION,
     OPT_LOG_LEVEL,
+    OPT_UPDATE,
 };
 
 static const struct option longopts[] = {
@@ -120,6 +288,8 @@ static const struct option longopts[] = {
     { "verbose",            no_argument,       NULL, 'v' },
     { "directory",          required_argument, NULL, 'd' },
     { "fast5-fofn",         required_argument, NULL, 'f' },
+    { "threads",            required_argument, NULL, 't' },
+    { "update",             no_argument,       NULL, OPT_UPDATE },
     { NULL, 0, NULL, 0 }
 };
 
@@ -142,6 +312,8 @@ void parse_index_options(int argc, char** argv)
             case 'v': opt::verbose++; break;
             case 'd': arg >> opt::raw_file_directory; break;
             case 'f': arg >> opt::fast5_fofn; break;
+            case 't': arg >> opt::num_threads; break;
+            case OPT_UPDATE: opt::update = 1; break;
         }
     }
 
@@ -159,6 +331,11 @@ void parse_index_options(int argc, char** argv)
         std::cerr << SUBPROGRAM ": too many arguments\n";
         die = true;
     }
+
+    if(opt::num_threads <= 0) {
+        std::cerr << SUBPROGRAM ": invalid number of threads: " << opt::num_threads << "\n";
+        die = true;
+    }
     
     if (die) 
     {
@@ -177,17 +354,27 @@ int index_main(int argc, char** argv)
     ReadDB read_db;
     read_db.build(opt::reads_file);
 
+    // keep the paths found by the previous run and skip the files they came from
+    std::unordered_set<std::string> indexed_files;
+    if(opt::update) {
+        size_t num_saved = read_db.add_saved_signal_paths(opt::reads_file);
+        for(const auto& path : read_db.get_signal_paths()) {
+            indexed_files.insert(path);
+        }
+        fprintf(stderr, "[index] kept %zu signal paths from the existing index\n", num_saved);
+    }
+
     bool all_reads_have_paths = read_db.check_signal_paths();
 
     // if the input fastq did not contain a complete set of paths
     // use the fofn/directory provided to augment the index
     if(!all_reads_have_paths) {
         if(!opt::raw_file_directory.empty()) {
-            index_path(read_db, opt::raw_file_directory);
+            index_path(read_db, opt::raw_file_directory, indexed_files);
         }
 
         if(!opt::fast5_fofn.empty()) {
-            process_fast5_fofn(read_db, opt::fast5_fofn);
+            process_fast5_fofn(read_db, opt::fast5_fofn, indexed_files);
         }
     }
 
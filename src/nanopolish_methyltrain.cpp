@@ -35,6 +35,9 @@
 #include "nanopolish_model_names.h"
 #include "nanopolish_pore_model_set.h"
 #include "nanopolish_read_db.h"
+#include "nanopolish_bam_processor.h"
+#include "nanopolish_bam_utils.h"
+#include "nanopolish_saved_event_alignments.h"
 #include "training_core.hpp"
 #include "H5pubconf.h"
 #include "profiler.h"
@@ -103,6 +106,7 @@ static const char *METHYLTRAIN_USAGE_MESSAGE =
 "      --output-scores                  optionally output read scores during training\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
+"                                       use - to stream sam/bam from stdin (unsorted input is fine without --window)\n"
 "  -g, --genome=FILE                    the reference genome is in FILE\n"
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
 "      --filter-policy=STR              filter reads for [R7] or [R9] project\n"
@@ -112,6 +116,9 @@ static const char *METHYLTRAIN_USAGE_MESSAGE =
 "      --max-reads=NUM                  stop after processing NUM reads in each round\n"
 "      --progress                       print out a progress message\n"
 "      --stdv                           enable stdv modelling\n"
+"      --event-alignments=FILE          train on the event alignments saved in FILE instead of aligning\n"
+"                                       the events in each round. FILE is the indexed output of eventalign\n"
+"                                       --sam or the output of eventalign --format=binary, run without a window\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
@@ -123,6 +130,7 @@ namespace opt
     static std::string genome_file;
     static std::string models_fofn;
     static std::string region;
+    static std::string event_alignments_file;
     static std::string out_suffix = ".trained";
     static std::string out_fofn = "trained.fofn";
     static std::string initial_model_type = "ONT";
@@ -133,7 +141,6 @@ namespace opt
     static bool output_scores = false;
     static unsigned progress = 0;
     static unsigned num_threads = 1;
-    static unsigned batch_size = 128;
     static unsigned max_reads = -1;
 
     // Constants that determine which events to use for training
@@ -160,7 +167,8 @@ enum { OPT_HELP = 1,
        OPT_P_SKIP_SELF,
        OPT_P_BAD,
        OPT_P_BAD_SELF,
-       OPT_MAX_READS
+       OPT_MAX_READS,
+       OPT_EVENT_ALIGNMENTS
      };
 
 static const struct option longopts[] = {
@@ -188,6 +196,7 @@ static const struct option longopts[] = {
     { "filter-policy",      required_argument, NULL, OPT_FILTER_POLICY },
     { "rounds",             required_argument, NULL, OPT_NUM_ROUNDS },
     { "max-reads",          required_argument, NULL, OPT_MAX_READS },
+    { "event-alignments",   required_argument, NULL, OPT_EVENT_ALIGNMENTS },
     { NULL, 0, NULL, 0 }
 };
 
@@ -197,12 +206,10 @@ static const struct option longopts[] = {
 bool recalibrate_model(SquiggleRead &sr,
                        const int strand_idx,
                        const std::vector<EventAlignment> &alignment_output,
-                       const Alphabet* alphabet,
                        const bool scale_var,
                        const bool scale_drift)
 {
     std::vector<double> raw_events, times, level_means, level_stdvs;
-    uint32_t k = sr.pore_model[strand_idx].k;
     const uint32_t num_equations = scale_drift ? 3 : 2;
 
     //std::cout << "Previous pore model parameters: " << sr.pore_model[strand_idx].shift << ", "
@@ -214,19 +221,19 @@ bool recalibrate_model(SquiggleRead &sr,
     for(size_t ei = 0; ei < alignment_output.size(); ++ei) {
         const auto& ea = alignment_output[ei];
         if(ea.hmm_state == 'M') {
-            std::string model_kmer = ea.rc ? alphabet->reverse_complement(ea.ref_kmer) : ea.ref_kmer;
-            uint32_t rank = alphabet->kmer_rank(model_kmer.c_str(), k);
+            uint32_t rank = ea.model_kmer_rank;
 
             raw_events.push_back ( sr.get_uncorrected_level(ea.event_idx, strand_idx) );
-            level_means.push_back( sr.pore_model[strand_idx].states[rank].level_mean );
-            level_stdvs.push_back( sr.pore_model[strand_idx].states[rank].level_stdv );
+            PoreModelStateParams state = sr.pore_model[strand_idx].get_parameters(rank);
+            level_means.push_back( state.level_mean );
+            level_stdvs.push_back( state.level_stdv );
             if (scale_drift)
                 times.push_back  ( sr.get_time(ea.event_idx, strand_idx) );
 
             /*
             fprintf(stdout, "recalibrate ei: %zu level: %.2lf kmer: %s model: %.2lf\n", 
                     ei, sr.get_uncorrected_level(ea.event_idx, strand_idx), model_kmer.c_str(), 
-                    sr.pore_model[strand_idx].states[rank].level_mean);
+                    state.level_mean);
             */
         }
     }
@@ -311,7 +318,7 @@ bool recalibrate_model(SquiggleRead &sr,
 
 // Update the training data with aligned events from a read
 void add_aligned_events(const ReadDB& read_db,
-                        const faidx_t* fai,
+                        const PackedReference* reference,
                         const bam_hdr_t* hdr,
                         const bam1_t* record,
                         size_t read_idx,
@@ -321,13 +328,21 @@ void add_aligned_events(const ReadDB& read_db,
                         const std::string& training_alphabet,
                         size_t training_k,
                         size_t round,
+                        SavedEventAlignments* saved_alignments,
                         ModelTrainingMap& training)
 {
     // Load a squiggle read for the mapped read
     std::string read_name = bam_get_qname(record);
 
+    // only load the part of the signal that is aligned to the region being trained on,
+    // unless the alignments are saved as their event indices refer to the whole read
+    IndexPair base_range;
+    if(region_start != -1 && region_end != -1 && saved_alignments == NULL) {
+        get_read_range_for_ref_region(record, region_start, region_end, base_range.start, base_range.stop);
+    }
+
     // load read
-    SquiggleRead sr(read_name, read_db);
+    SquiggleRead sr(read_name, read_db, 0, base_range);
 
     // replace the models that are built into the read with the model we are training
     sr.replace_models(training_kit, training_alphabet, training_k);
@@ -342,20 +357,39 @@ void add_aligned_events(const ReadDB& read_db,
         // set k
         uint32_t k = sr.pore_model[strand_idx].k;
 
-        // Align to the new model
-        EventAlignmentParameters params;
-        params.sr = &sr;
-        params.fai = fai;
-        params.hdr = hdr;
-        params.record = record;
-        params.strand_idx = strand_idx;
+        std::vector<EventAlignment> alignment_output;
+        if(saved_alignments != NULL) {
+            // Use the saved alignment, which is the same in every round
+            SavedStrandAlignment saved;
+            if(saved_alignments->get(hdr, record, strand_idx, saved)) {
+                alignment_output = saved_alignment_to_event_alignment(saved, reference, mtrain_alphabet,
+                                                                      k, read_idx, strand_idx);
+            }
 
-        params.alphabet = mtrain_alphabet;
-        params.read_idx = read_idx;
-        params.region_start = region_start;
-        params.region_end = region_end;
+            if(region_start != -1 && region_end != -1) {
+                auto outside = [&](const EventAlignment& ea) {
+                    return ea.ref_position < region_start || ea.ref_position > region_end;
+                };
+                alignment_output.erase(std::remove_if(alignment_output.begin(), alignment_output.end(), outside),
+                                       alignment_output.end());
+            }
+        } else {
+            // Align to the new model
+            EventAlignmentParameters params;
+            params.sr = &sr;
+            params.reference = reference;
+            params.hdr = hdr;
+            params.record = record;
+            params.strand_idx = strand_idx;
+
+            params.alphabet = mtrain_alphabet;
+            params.read_idx = read_idx;
+            params.region_start = region_start;
+            params.region_end = region_end;
+
+            alignment_output = align_read_to_ref(params);
+        }
 
-        std::vector<EventAlignment> alignment_output = align_read_to_ref(params);
         if (alignment_output.size() == 0)
             return;
 
@@ -367,7 +401,7 @@ void add_aligned_events(const ReadDB& read_db,
         //
         double orig_score = -INFINITY;
         if (opt::output_scores) {
-            orig_score = model_score(sr, strand_idx, fai, alignment_output, 500, NULL);
+            orig_score = model_score(sr, strand_idx, reference, hdr, alignment_output, 500, NULL);
 
             #pragma omp critical(print)
             std::cout << round << " " << model_key << " " << read_idx << " " << strand_idx << " Original " << orig_score << std::endl;
@@ -375,10 +409,10 @@ void add_aligned_events(const ReadDB& read_db,
 
         if ( opt::calibrate ) {
             double resid = 0.;
-            recalibrate_model(sr, strand_idx, alignment_output, mtrain_alphabet, resid, true);
+            recalibrate_model(sr, strand_idx, alignment_output, resid, true);
 
             if (opt::output_scores) {
-                double rescaled_score = model_score(sr, strand_idx, fai, alignment_output, 500, NULL);
+                double rescaled_score = model_score(sr, strand_idx, reference, hdr, alignment_output, 500, NULL);
                 #pragma omp critical(print)
                 {
                     std::cout << round << " " << model_key << " " << read_idx << " " << strand_idx << " Rescaled " << rescaled_score << std::endl;
@@ -396,7 +430,11 @@ void add_aligned_events(const ReadDB& read_db,
 
         for(size_t i = 0; i < alignment_output.size(); ++i) {
             const EventAlignment& ea = alignment_output[i];
-            std::string model_kmer = ea.model_kmer;
+
+            // events that were not assigned to the reference have no k-mer to train
+            if(ea.model_kmer_rank == EVENT_ALIGNMENT_NO_KMER) {
+                continue;
+            }
 
             // Grab the previous/next model kmer from the alignment_output table.
             // If the read is from the same strand as the reference
@@ -404,8 +442,8 @@ void add_aligned_events(const ReadDB& read_db,
             // other the indices are swapped
             int next_stride = ea.rc ? -1 : 1;
 
-            std::string prev_kmer = "";
-            std::string next_kmer = "";
+            uint32_t prev_kmer_rank = EVENT_ALIGNMENT_NO_KMER;
+            uint32_t next_kmer_rank = EVENT_ALIGNMENT_NO_KMER;
 
             if(i > 0 && i < alignment_output.size() - 1) {
 
@@ -415,16 +453,16 @@ void add_aligned_events(const ReadDB& read_db,
 
                 // only set the previous/next when there was exactly one base of movement along the referenc
                 if( std::abs(alignment_output[i + next_stride].ref_position - ea.ref_position) == 1) {
-                    next_kmer = alignment_output[i + next_stride].model_kmer;
+                    next_kmer_rank = alignment_output[i + next_stride].model_kmer_rank;
                 }
 
                 if( std::abs(alignment_output[i - next_stride].ref_position - ea.ref_position) == 1) {
-                    prev_kmer = alignment_output[i - next_stride].model_kmer;
+                    prev_kmer_rank = alignment_output[i - next_stride].model_kmer_rank;
                 }
             }
 
             // Get the rank of the kmer that we aligned to (on the sequencing strand, = model_kmer)
-            uint32_t rank = mtrain_alphabet->kmer_rank(model_kmer.c_str(), k);
+            uint32_t rank = ea.model_kmer_rank;
             assert(rank < emission_map.size());
             auto& kmer_summary = emission_map[rank];
 
@@ -438,7 +476,7 @@ void add_aligned_events(const ReadDB& read_db,
                 sr.get_fully_scaled_level(alignment_output[i].event_idx, strand_idx) >= 1.0;
 
             if(use_for_training) {
-                StateTrainingData std(sr, ea, rank, prev_kmer, next_kmer);
+                StateTrainingData std(sr, ea, rank, prev_kmer_rank, next_kmer_rank, mtrain_alphabet);
                 #pragma omp critical(kmer)
                 kmer_summary.events.push_back(std);
             }
@@ -484,6 +522,7 @@ void parse_methyltrain_options(int argc, char** argv)
             case OPT_P_BAD: arg >> g_p_bad; break;
             case OPT_P_BAD_SELF: arg >> g_p_bad_self; break;
             case OPT_MAX_READS: arg >> opt::max_reads; break;
+            case OPT_EVENT_ALIGNMENTS: arg >> opt::event_alignments_file; break;
             case OPT_HELP:
                 std::cout << METHYLTRAIN_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -525,6 +564,12 @@ void parse_methyltrain_options(int argc, char** argv)
         die = true;
     }
 
+    // each training round reads the alignments again
+    if(opt::bam_file == "-" && opt::num_training_rounds > 1) {
+        std::cerr << SUBPROGRAM ": alignments can only be read from stdin with --rounds=1\n";
+        die = true;
+    }
+
     // Parse the training target string
     if(training_target_str != "") {
         if(training_target_str == "unmethylated") {
@@ -592,6 +637,10 @@ TrainingResult retrain_model_from_events(const PoreModel& current_model,
     assert(all_kmers.front() == std::string(k, 'A'));
     assert(all_kmers.back() == std::string(k, 'T'));
 
+    // The trained states are collected here and the shared
+    // state table of the new model is built once at the end
+    std::vector<PoreModelStateParams> trained_states = current_model.get_states();
+
     // Update means for each kmer
     #pragma omp parallel for
     for(size_t ki = 0; ki < summaries.size(); ++ki) {
@@ -651,7 +700,7 @@ TrainingResult retrain_model_from_events(const PoreModel& current_model,
             }
 
             #pragma omp critical
-            result.trained_model.states[ki] = trained_mixture.params[0];
+            trained_states[ki] = trained_mixture.params[0];
 
             if (model_stdv()) {
                 ParamMixture ig_mixture;
@@ -677,7 +726,7 @@ TrainingResult retrain_model_from_events(const PoreModel& current_model,
                 // update state
                 #pragma omp critical
                 {
-                    result.trained_model.states[ki] = trained_ig_mixture.params[0];
+                    trained_states[ki] = trained_ig_mixture.params[0];
                 }
             }
 
@@ -690,9 +739,10 @@ TrainingResult retrain_model_from_events(const PoreModel& current_model,
             fprintf(summary_fp, "%s\t%s\t%d\t%d\t%d\t%zu\t%d\t%.2lf\t%.2lf\n",
                                     model_short_name.c_str(), kmer.c_str(),
                                     summaries[ki].num_matches, summaries[ki].num_skips, summaries[ki].num_stays,
-                                    summaries[ki].events.size(), trained, result.trained_model.states[ki].level_mean, result.trained_model.states[ki].level_stdv);
+                                    summaries[ki].events.size(), trained, trained_states[ki].level_mean, trained_states[ki].level_stdv);
         }
     }
+    result.trained_model.set_states(trained_states);
 
     return result;
 }
@@ -701,7 +751,8 @@ void train_one_round(const ReadDB& read_db,
                      const std::string& kit_name,
                      const std::string& alphabet,
                      size_t k,
-                     size_t round)
+                     size_t round,
+                     SavedEventAlignments* saved_alignments)
 {
 
     // Get a copy of the models for each strand for this datatype
@@ -715,88 +766,36 @@ void train_one_round(const ReadDB& read_db,
         model_training_data[current_model_iter->first] = summaries;
     }
 
-    // Open the BAM and iterate over reads
-
-    // load bam file
-    htsFile* bam_fh = sam_open(opt::bam_file.c_str(), "r");
-    assert(bam_fh != NULL);
-
-    // load bam index file
-    std::string index_filename = opt::bam_file + ".bai";
-    hts_idx_t* bam_idx = bam_index_load(index_filename.c_str());
-    assert(bam_idx != NULL);
-
-    // read the bam header
-    bam_hdr_t* hdr = sam_hdr_read(bam_fh);
-
-    // load reference fai file
-    faidx_t *fai = fai_load(opt::genome_file.c_str());
-
-    hts_itr_t* itr;
+    // load the reference
+    PackedReference reference(opt::genome_file);
 
-    // If processing a region of the genome, only emit events aligned to this window
-    int clip_start = -1;
-    int clip_end = -1;
+    // the BamProcessor framework calls the input function with the
+    // bam record, read index, etc passed as parameters
+    BamProcessor processor(opt::bam_file, opt::region, opt::num_threads);
+    processor.set_max_reads(opt::max_reads);
+    processor.set_verbose(opt::verbose);
+    processor.set_prefetch_function([&read_db](const bam_hdr_t*, const bam1_t* record) {
+        read_db.prefetch_signal_data(bam_get_qname(record));
+    });
 
-    if(opt::region.empty()) {
-        // TODO: is this valid?
-        itr = sam_itr_queryi(bam_idx, HTS_IDX_START, 0, 0);
-    } else {
-        fprintf(stderr, "Region: %s\n", opt::region.c_str());
-        itr = sam_itr_querys(bam_idx, hdr, opt::region.c_str());
-        hts_parse_reg(opt::region.c_str(), &clip_start, &clip_end);
-    }
-
-#ifndef H5_HAVE_THREADSAFE
-    if(opt::num_threads > 1) {
-        fprintf(stderr, "You enabled multi-threading but you do not have a threadsafe HDF5\n");
-        fprintf(stderr, "Please recompile nanopolish's built-in libhdf5 or run with -t 1\n");
-        exit(1);
-    }
-#endif
-
-    // Initialize iteration
-    std::vector<bam1_t*> records(opt::batch_size, NULL);
-    for(size_t i = 0; i < records.size(); ++i) {
-        records[i] = bam_init1();
-    }
-
-    int result;
     size_t num_reads_realigned = 0;
-    size_t num_records_buffered = 0;
     Progress progress("[methyltrain]");
 
-    do {
-        assert(num_records_buffered < records.size());
-
-        // read a record into the next slot in the buffer
-        result = sam_itr_next(bam_fh, itr, records[num_records_buffered]);
-        num_records_buffered += result >= 0;
-
-        // realign if we've hit the max buffer size or reached the end of file
-        if(num_records_buffered == records.size() || result < 0 || (num_records_buffered + num_reads_realigned == opt::max_reads)) {
-            #pragma omp parallel for
-            for(size_t i = 0; i < num_records_buffered; ++i) {
-                bam1_t* record = records[i];
-                size_t read_idx = num_reads_realigned + i;
-                if( (record->core.flag & BAM_FUNMAP) == 0) {
-                    add_aligned_events(read_db, fai, hdr, record, read_idx,
-                                       clip_start, clip_end,
-                                       kit_name, alphabet, k,
-                                       round, model_training_data);
-                }
-            }
-
-            num_reads_realigned += num_records_buffered;
-            num_records_buffered = 0;
-        }
+    auto f = [&](const bam_hdr_t* hdr, const bam1_t* record, size_t read_idx, int region_start, int region_end) {
+        add_aligned_events(read_db, &reference, hdr, record, read_idx,
+                           region_start, region_end,
+                           kit_name, alphabet, k,
+                           round, saved_alignments, model_training_data);
 
         if(opt::progress) {
-            fprintf(stderr, "Realigned %zu reads in %.1lfs\r", num_reads_realigned, progress.get_elapsed_seconds());
+            #pragma omp critical (methyltrain_progress)
+            {
+                num_reads_realigned += 1;
+                fprintf(stderr, "Realigned %zu reads in %.1lfs\r", num_reads_realigned, progress.get_elapsed_seconds());
+            }
         }
-    } while(result >= 0 && num_reads_realigned < opt::max_reads);
-
-    assert(num_records_buffered == 0);
+    };
+    processor.parallel_run(f);
     progress.end();
 
     // open the summary file
@@ -836,17 +835,7 @@ void train_one_round(const ReadDB& read_db,
         }
     }
 
-    // cleanup records
-    for(size_t i = 0; i < records.size(); ++i) {
-        bam_destroy1(records[i]);
-    }
-
     // cleanup
-    sam_itr_destroy(itr);
-    bam_hdr_destroy(hdr);
-    fai_destroy(fai);
-    sam_close(bam_fh);
-    hts_idx_destroy(bam_idx);
     fclose(summary_fp);
 }
 
@@ -871,6 +860,7 @@ int methyltrain_main(int argc, char** argv)
 {
     parse_methyltrain_options(argc, argv);
     omp_set_num_threads(opt::num_threads);
+    init_hts_thread_pool(opt::num_threads);
 
     ReadDB read_db;
     read_db.load(opt::reads_file);
@@ -888,15 +878,22 @@ int methyltrain_main(int argc, char** argv)
     size_t training_k = tmp_model.k;
     fprintf(stderr, "Training %s for alphabet %s for %zu-mers\n", training_kit.c_str(), mtrain_alphabet->get_name().c_str(), training_k);
 
+    // the saved alignments are loaded once and used in every round
+    SavedEventAlignments* saved_alignments = NULL;
+    if(!opt::event_alignments_file.empty()) {
+        saved_alignments = new SavedEventAlignments(opt::event_alignments_file, opt::num_threads);
+    }
+
     for(size_t round = 0; round < opt::num_training_rounds; round++) {
         fprintf(stderr, "Starting round %zu\n", round);
-        train_one_round(read_db, training_kit, mtrain_alphabet->get_name(), training_k, round);
+        train_one_round(read_db, training_kit, mtrain_alphabet->get_name(), training_k, round, saved_alignments);
         /*
         if(opt::write_models) {
             write_models(training_kit, mtrain_alphabet->get_name(), training_k, round);
         }
         */
     }
+    delete saved_alignments;
     return EXIT_SUCCESS;
 }
 
@@ -21,7 +21,6 @@
 bool recalibrate_model(SquiggleRead &sr,
                        const int strand_idx,
                        const std::vector<EventAlignment> &alignment_output,
-                       const Alphabet* alphabet,
                        bool scale_var=true,
                        bool scale_drift=true);
 
@@ -31,9 +31,12 @@
 #include "nanopolish_pore_model_set.h"
 #include "nanopolish_variant.h"
 #include "nanopolish_haplotype.h"
+#include "nanopolish_phase_reads.h"
 #include "nanopolish_alignment_db.h"
+#include "nanopolish_saved_event_alignments.h"
 #include "nanopolish_bam_processor.h"
 #include "nanopolish_bam_utils.h"
+#include "nanopolish_output_writer.h"
 #include "nanopolish_index.h"
 #include "H5pubconf.h"
 #include "profiler.h"
@@ -59,17 +62,21 @@ SUBPROGRAM " Version " PACKAGE_VERSION "\n"
 
 static const char *PHASE_READS_USAGE_MESSAGE =
 "Usage: " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] --reads reads.fa --bam alignments.bam --genome genome.fa variants.vcf\n"
-"Train a duration model\n"
+"Phase the reads using the variants in variants.vcf. The phased reads are written to stdout in BAM format\n"
 "\n"
 "  -v, --verbose                        display verbose output\n"
 "      --version                        display version\n"
 "      --help                           display this help and exit\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
+"                                       use - to stream sam/bam from stdin (unsorted input is fine without --window)\n"
 "  -g, --genome=FILE                    the reference genome is in FILE\n"
 "  -w, --window=STR                     only phase reads in the window STR (format: ctg:start-end)\n"
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
 "      --progress                       print out a progress message\n"
+"      --event-alignments=FILE          use the event alignments saved in FILE instead of aligning the\n"
+"                                       events to the reference. FILE is the indexed output of eventalign\n"
+"                                       --sam or the output of eventalign --format=binary, run without a window\n"
 "\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
 
 namespace opt
@@ -80,6 +87,7 @@ namespace opt
     static std::string genome_file;
     static std::string variants_file;
     static std::string region;
+    static std::string event_alignments_file;
     
     static unsigned progress = 0;
     static unsigned num_threads = 1;
@@ -92,7 +100,8 @@ static const char* shortopts = "r:b:g:t:w:v";
 enum { OPT_HELP = 1,
        OPT_VERSION,
        OPT_PROGRESS,
-       OPT_LOG_LEVEL
+       OPT_LOG_LEVEL,
+       OPT_EVENT_ALIGNMENTS
      };
 
 static const struct option longopts[] = {
@@ -103,6 +112,7 @@ static const struct option longopts[] = {
     { "threads",            required_argument, NULL, 't' },
     { "window",             required_argument, NULL, 'w' },
     { "progress",           no_argument,       NULL, OPT_PROGRESS },
+    { "event-alignments",   required_argument, NULL, OPT_EVENT_ALIGNMENTS },
     { "help",               no_argument,       NULL, OPT_HELP },
     { "version",            no_argument,       NULL, OPT_VERSION },
     { "log-level",          required_argument, NULL, OPT_LOG_LEVEL },
@@ -123,6 +133,7 @@ void parse_phase_reads_options(int argc, char** argv)
             case 't': arg >> opt::num_threads; break;
             case 'v': opt::verbose++; break;
             case OPT_PROGRESS: opt::progress = true; break;
+            case OPT_EVENT_ALIGNMENTS: arg >> opt::event_alignments_file; break;
             case OPT_HELP:
                 std::cout << PHASE_READS_USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -173,27 +184,43 @@ void parse_phase_reads_options(int argc, char** argv)
     }
 }
 
-void phase_single_read(const ReadDB& read_db,
-                       const faidx_t* fai,
-                       const std::vector<Variant>& variants,
-                       samFile* sam_fp,
-                       const bam_hdr_t* hdr,
-                       const bam1_t* record,
-                       size_t read_idx,
-                       int region_start,
-                       int region_end)
+std::vector<Variant> load_variants_for_phasing(const std::string& variants_file, const std::string& region)
+{
+    std::vector<Variant> variants;  
+    if(!region.empty()) {
+        std::string contig;
+        int start_base;
+        int end_base;
+        parse_region_string(region, contig, start_base, end_base);
+
+        // Read the variants for this region
+        variants = read_variants_for_region(variants_file, contig, start_base, end_base);
+    } else {
+         variants = read_variants_from_file(variants_file);
+    }
+
+    // Sort variants by reference coordinate
+    std::sort(variants.begin(), variants.end(), sortByPosition);
+    
+    // remove hom reference
+    auto new_end = std::remove_if(variants.begin(), variants.end(), [](Variant v) { return v.genotype == "0/0"; });
+    variants.erase( new_end, variants.end());
+    return variants;
+}
+
+void phase_aligned_read(OutputBuffer& buffer,
+                        const SquiggleRead& sr,
+                        const PackedReference* reference,
+                        const std::vector<Variant>& variants,
+                        const bam_hdr_t* hdr,
+                        const bam1_t* record,
+                        const EventAlignmentRecord* event_records)
 {
     const double MAX_Q_SCORE = 30;
     const double BAM_Q_OFFSET = 0;
-    int tid = omp_get_thread_num();
     uint32_t alignment_flags = HAF_ALLOW_PRE_CLIP | HAF_ALLOW_POST_CLIP;
     
-    // Load a squiggle read for the mapped read
-    std::string read_name = bam_get_qname(record);
-
-    // load read
-    SquiggleRead sr(read_name, read_db);
-    
+    const std::string& read_name = sr.read_name;
     std::string ref_name = hdr->target_name[record->core.tid];
     int alignment_start_pos = record->core.pos;
     int alignment_end_pos = bam_endpos(record);
@@ -217,7 +244,7 @@ void phase_single_read(const ReadDB& read_db,
     }
 
     int fetched_len;
-    std::string reference_seq = get_reference_region_ts(fai, 
+    std::string reference_seq = get_reference_region_ts(reference, 
                                                         ref_name.c_str(), 
                                                         alignment_start_pos, 
                                                         alignment_end_pos, 
@@ -229,8 +256,9 @@ void phase_single_read(const ReadDB& read_db,
     Haplotype reference_haplotype(ref_name, alignment_start_pos, reference_seq);
     for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
 
-        // skip if 1D reads and this is the wrong strand
-        if(!sr.has_events_for_strand(strand_idx)) {
+        // skip if 1D reads and this is the wrong strand, or if the strand
+        // could not be aligned, which would write the reference as a call
+        if(!sr.has_events_for_strand(strand_idx) || event_records[strand_idx].aligned_events.empty()) {
             continue;
         }
 
@@ -239,8 +267,7 @@ void phase_single_read(const ReadDB& read_db,
             continue;
         }
 
-        SequenceAlignmentRecord seq_align_record(record);
-        EventAlignmentRecord event_align_record(&sr, strand_idx, seq_align_record);
+        const EventAlignmentRecord& event_align_record = event_records[strand_idx];
 
         // 
         for(; lower_iter < upper_iter; ++lower_iter) {
@@ -326,60 +353,93 @@ void phase_single_read(const ReadDB& read_db,
         cigar.push_back(cigar_op);
         write_bam_vardata(out_record, read_name, cigar, read_outseq, read_outqual);
 
-        #pragma omp critical
-        {
-            sam_write1(sam_fp, hdr, out_record);
-        }
-        bam_destroy1(out_record); // automatically frees malloc'd segment
+        // the record is written and freed by the output writer thread
+        buffer.add_record(out_record);
 
     } // for strand
 }
 
+void phase_single_read(OutputBuffer& buffer,
+                       const ReadDB& read_db,
+                       const PackedReference* reference,
+                       const std::vector<Variant>& variants,
+                       const bam_hdr_t* hdr,
+                       const bam1_t* record,
+                       SavedEventAlignments* saved_alignments)
+{
+    // Load a squiggle read for the mapped read
+    std::string read_name = bam_get_qname(record);
+    SquiggleRead sr(read_name, read_db);
+
+    // Build the event-to-reference map of each strand from the bam record or the saved alignments
+    EventAlignmentRecord event_records[NUM_STRANDS];
+    for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
+        event_records[strand_idx].sr = &sr;
+        event_records[strand_idx].strand = strand_idx;
+        if(!sr.has_events_for_strand(strand_idx)) {
+            continue;
+        }
+
+        if(saved_alignments != NULL) {
+            SavedStrandAlignment saved;
+            if(saved_alignments->get(hdr, record, strand_idx, saved)) {
+                event_records[strand_idx] = saved_alignment_to_event_record(&sr, strand_idx, saved);
+            }
+        } else {
+            SequenceAlignmentRecord seq_align_record(record);
+            event_records[strand_idx] = EventAlignmentRecord(&sr, strand_idx, seq_align_record);
+        }
+    }
+    phase_aligned_read(buffer, sr, reference, variants, hdr, record, event_records);
+}
+
 int phase_reads_main(int argc, char** argv)
 {
     parse_phase_reads_options(argc, argv);
     omp_set_num_threads(opt::num_threads);
+    init_hts_thread_pool(opt::num_threads);
 
     ReadDB read_db;
     read_db.load(opt::reads_file);
     
-    // load reference fai file
-    faidx_t *fai = fai_load(opt::genome_file.c_str());
+    // load the reference
+    PackedReference reference(opt::genome_file);
   
-    std::vector<Variant> variants;  
-    if(!opt::region.empty()) {
-        std::string contig;
-        int start_base;
-        int end_base;
-        parse_region_string(opt::region, contig, start_base, end_base);
+    std::vector<Variant> variants = load_variants_for_phasing(opt::variants_file, opt::region);
+    
+    samFile* sam_out = sam_open("-", "wb");
+    attach_hts_thread_pool(sam_out);
 
-        // Read the variants for this region
-        variants = read_variants_for_region(opt::variants_file, contig, start_base, end_base);
-    } else {
-         variants = read_variants_from_file(opt::variants_file);
+    // optionally reuse the event alignments made by eventalign
+    SavedEventAlignments* saved_alignments = NULL;
+    if(!opt::event_alignments_file.empty()) {
+        saved_alignments = new SavedEventAlignments(opt::event_alignments_file, opt::num_threads);
     }
 
-    // Sort variants by reference coordinate
-    std::sort(variants.begin(), variants.end(), sortByPosition);
-    
-    // remove hom reference
-    auto new_end = std::remove_if(variants.begin(), variants.end(), [](Variant v) { return v.genotype == "0/0"; });
-    variants.erase( new_end, variants.end());
-    
-    samFile* sam_out = sam_open("-", "w");
-
     // the BamProcessor framework calls the input function with the 
     // bam record, read index, etc passed as parameters
-    // bind the other parameters the worker function needs here
-    auto f = std::bind(phase_single_read, std::ref(read_db), std::ref(fai), std::ref(variants), sam_out, _1, _2, _3, _4, _5);
+    // the phased records are written in read order by a separate writer thread
+    OutputWriter output(true);
+    auto f = [&](const bam_hdr_t* hdr, const bam1_t* record, size_t read_idx, int region_start, int region_end) {
+        OutputBuffer buffer(read_idx);
+        phase_single_read(buffer, read_db, &reference, variants, hdr, record, saved_alignments);
+        output.submit(std::move(buffer));
+    };
     BamProcessor processor(opt::bam_file, opt::region, opt::num_threads);
+    processor.set_output_writer(&output);
+    processor.set_verbose(opt::verbose);
+    processor.set_prefetch_function([&read_db](const bam_hdr_t*, const bam1_t* record) {
+        read_db.prefetch_signal_data(bam_get_qname(record));
+    });
     
     // Copy the bam header to std
     sam_hdr_write(sam_out, processor.get_bam_header());
+    output.set_bam_stream(sam_out, processor.get_bam_header());
     
     processor.parallel_run(f);
+    output.close();
+    delete saved_alignments;
     
-    fai_destroy(fai);
     sam_close(sam_out);
     
     return EXIT_SUCCESS;
@@ -8,6 +8,26 @@
 #ifndef NANOPOLISH_PHASE_READS_H
 #define NANOPOLISH_PHASE_READS_H
 
+#include <string>
+#include <vector>
+#include "nanopolish_variant.h"
+#include "nanopolish_alignment_db.h"
+#include "nanopolish_output_writer.h"
+
 int phase_reads_main(int argc, char** argv);
 
+// Read the variants to phase, sorted by position and without homozygous reference calls
+std::vector<Variant> load_variants_for_phasing(const std::string& variants_file, const std::string& region);
+
+// Phase the variants onto a read that has been loaded and aligned. event_records holds the
+// event-to-reference map of each strand, strands with no aligned events are skipped.
+// The phased record is added to the bam output of buffer.
+void phase_aligned_read(OutputBuffer& buffer,
+                        const SquiggleRead& sr,
+                        const PackedReference* reference,
+                        const std::vector<Variant>& variants,
+                        const bam_hdr_t* hdr,
+                        const bam1_t* record,
+                        const EventAlignmentRecord* event_records);
+
 #endif
@@ -13,29 +13,53 @@
 #include <bits/stl_algo.h>
 #include <fast5.hpp>
 
-void PoreModel::bake_gaussian_parameters()
+PoreModelStateTable::PoreModelStateTable(const std::vector<PoreModelStateParams>& states)
 {
-    scaled_params.resize(states.size());
-    scaled_states.resize(states.size());
-
-    for(unsigned i = 0; i < states.size(); ++i) {
-
-        // as per ONT documents
-        scaled_states[i].level_mean = states[i].level_mean * scale + shift;
-        scaled_states[i].level_stdv = states[i].level_stdv * var;
-        scaled_states[i].sd_mean = states[i].sd_mean * scale_sd;
-        scaled_states[i].sd_lambda = states[i].sd_lambda * var_sd;
-        scaled_states[i].update_sd_stdv();
+    size_t n = states.size();
+    level_mean.resize(n);
+    level_stdv.resize(n);
+    level_log_stdv.resize(n);
+    sd_mean.resize(n);
+    sd_stdv.resize(n);
+    sd_lambda.resize(n);
+    sd_log_lambda.resize(n);
+
+    for(size_t i = 0; i < n; ++i) {
+        level_mean[i] = states[i].level_mean;
+        level_stdv[i] = states[i].level_stdv;
+        sd_mean[i] = states[i].sd_mean;
+        sd_stdv[i] = states[i].sd_stdv;
+        sd_lambda[i] = states[i].sd_lambda;
+
+        // not all sources of states set the logs
+        level_log_stdv[i] = log(states[i].level_stdv);
+        sd_log_lambda[i] = log(states[i].sd_lambda);
+    }
+}
 
-        // for efficiency
-        scaled_states[i].update_logs();
+void PoreModel::bake_gaussian_parameters()
+{
+    // the scaled state is level_mean * scale + shift, level_stdv * var,
+    // sd_mean * scale_sd and sd_lambda * var_sd. The logs and the implied
+    // scaling of sd_stdv are the same for every state.
+    m_log_var = log(var);
+    m_log_var_sd = log(var_sd);
+    m_sd_stdv_factor = sqrt(pow(scale_sd, 3.0) / var_sd);
+    is_scaled = true;
+}
 
-        // for compatibility
-        scaled_params[i].mean = scaled_states[i].level_mean;
-        scaled_params[i].stdv = scaled_states[i].level_stdv;
-        scaled_params[i].log_stdv = scaled_states[i].level_log_stdv;
+std::vector<PoreModelStateParams> PoreModel::get_states() const
+{
+    std::vector<PoreModelStateParams> states(get_num_states());
+    for(size_t i = 0; i < states.size(); ++i) {
+        states[i] = get_parameters(i);
     }
-    is_scaled = true;
+    return states;
+}
+
+void PoreModel::set_states(const std::vector<PoreModelStateParams>& states)
+{
+    m_states = std::make_shared<const PoreModelStateTable>(states);
 }
 
 void add_found_bases(char *known, const char *kmer) {
@@ -50,7 +74,8 @@ void add_found_bases(char *known, const char *kmer) {
     return;
 }
 
-PoreModel::PoreModel(const std::string filename, const Alphabet *alphabet) : is_scaled(false), pmalphabet(alphabet)
+PoreModel::PoreModel(const std::string filename, const Alphabet *alphabet) : is_scaled(false), pmalphabet(alphabet),
+                                                                              m_log_var(0.0), m_log_var_sd(0.0), m_sd_stdv_factor(1.0)
 {
     model_filename = filename;
     std::ifstream model_reader(filename);
@@ -160,17 +185,19 @@ PoreModel::PoreModel(const std::string filename, const Alphabet *alphabet) : is_
 
     assert( pmalphabet != nullptr );
 
-    states.resize(pmalphabet->get_num_strings(k));
+    std::vector<PoreModelStateParams> states(pmalphabet->get_num_strings(k));
     for (const auto &iter : kmers ) {
         ninserted++;
         states[ pmalphabet->kmer_rank(iter.first.c_str(), k) ] = iter.second;
     }
     assert( ninserted == states.size() );
+    set_states(states);
 
     is_scaled = false;
 }
 
-PoreModel::PoreModel(fast5::File *f_p, const size_t strand, const std::string& bc_gr, const Alphabet *alphabet) : pmalphabet(alphabet)
+PoreModel::PoreModel(fast5::File *f_p, const size_t strand, const std::string& bc_gr, const Alphabet *alphabet) : pmalphabet(alphabet),
+                                                                                                                  m_log_var(0.0), m_log_var_sd(0.0), m_sd_stdv_factor(1.0)
 {
     const size_t maxNucleotides=50;
     char bases[maxNucleotides+1]="";
@@ -195,12 +222,13 @@ PoreModel::PoreModel(fast5::File *f_p, const size_t strand, const std::string& b
         pmalphabet = best_alphabet(bases);
     assert( pmalphabet != nullptr );
 
-    states.resize( pmalphabet->get_num_strings(k) );
+    std::vector<PoreModelStateParams> states( pmalphabet->get_num_strings(k) );
     assert(states.size() == model.size());
 
     for (const auto &iter : kmers ) {
         states[ pmalphabet->kmer_rank(iter.first.c_str(), k) ] = iter.second;
     }
+    set_states(states);
 
     // Load the scaling parameters for the pore model
     auto params = f_p->get_basecall_model_params(strand, bc_gr);
@@ -249,9 +277,10 @@ void PoreModel::write(const std::string filename, const std::string modelname) c
     writer << "#scale_offset\t" << this->scale_offset << std::endl;
 
     std::string curr_kmer(k, this->pmalphabet->base(0));
-    for(size_t ki = 0; ki < this->states.size(); ++ki) {
-        writer << curr_kmer << "\t" << this->states[ki].level_mean << "\t" << this->states[ki].level_stdv << "\t"
-               << this->states[ki].sd_mean << "\t" << this->states[ki].sd_stdv << std::endl;
+    for(size_t ki = 0; ki < get_num_states(); ++ki) {
+        PoreModelStateParams state = get_parameters(ki);
+        writer << curr_kmer << "\t" << state.level_mean << "\t" << state.level_stdv << "\t"
+               << state.sd_mean << "\t" << state.sd_stdv << std::endl;
         this->pmalphabet->lexicographic_next(curr_kmer);
     }
     writer.close();
@@ -263,12 +292,15 @@ void PoreModel::update_states( const PoreModel &other )
     pmalphabet = other.pmalphabet;
     shift += other.shift_offset;
     scale += other.scale_offset;
-    update_states( other.states );
+    m_states = other.m_states;
+    if (is_scaled) {
+        bake_gaussian_parameters();
+    }
 }
 
 void PoreModel::update_states( const std::vector<PoreModelStateParams> &otherstates )
 {
-    states = otherstates;
+    set_states(otherstates);
     if (is_scaled) {
         bake_gaussian_parameters();
     }
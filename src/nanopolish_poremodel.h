@@ -14,6 +14,7 @@
 #include <inttypes.h>
 #include <string>
 #include <map>
+#include <memory>
 #include "nanopolish_model_names.h"
 #include <fast5.hpp>
 
@@ -77,11 +78,30 @@ struct PoreModelStateParams
     }
 };
 
+// The state parameters of a pore model in single precision, with one array
+// per field. The table is immutable once built and is shared by all copies
+// of a model so each read only holds its own scaling parameters.
+struct PoreModelStateTable
+{
+    PoreModelStateTable(const std::vector<PoreModelStateParams>& states);
+
+    size_t size() const { return level_mean.size(); }
+
+    std::vector<float> level_mean;
+    std::vector<float> level_stdv;
+    std::vector<float> level_log_stdv;
+    std::vector<float> sd_mean;
+    std::vector<float> sd_stdv;
+    std::vector<float> sd_lambda;
+    std::vector<float> sd_log_lambda;
+};
+
 //
 class PoreModel
 {
     public:
-        PoreModel(uint32_t _k=5) : k(_k), is_scaled(false), pmalphabet(&gDNAAlphabet) {}
+        PoreModel(uint32_t _k=5) : k(_k), is_scaled(false), pmalphabet(&gDNAAlphabet),
+                                   m_log_var(0.0), m_log_var_sd(0.0), m_sd_stdv_factor(1.0) {}
 
         // These constructors and the output routine take an alphabet 
         // so that kmers are inserted/written in order
@@ -94,30 +114,64 @@ class PoreModel
 
         void write(const std::string filename, const std::string modelname="") const;
 
+        // The scaled parameters are calculated from the shared states when requested,
+        // using the logs of the scaling parameters cached by bake_gaussian_parameters
         inline GaussianParameters get_scaled_parameters(const uint32_t kmer_rank) const
         {
             assert(is_scaled);
-            return scaled_params[kmer_rank];
+            const PoreModelStateTable& t = *m_states;
+            return GaussianParameters(t.level_mean[kmer_rank] * scale + shift,
+                                      t.level_stdv[kmer_rank] * var,
+                                      t.level_log_stdv[kmer_rank] + m_log_var);
         }
 
         inline PoreModelStateParams get_scaled_state(const uint32_t kmer_rank) const
         {
             assert(is_scaled);
-            return scaled_states[kmer_rank];
+            const PoreModelStateTable& t = *m_states;
+
+            // as per ONT documents
+            PoreModelStateParams s;
+            s.level_mean = t.level_mean[kmer_rank] * scale + shift;
+            s.level_stdv = t.level_stdv[kmer_rank] * var;
+            s.sd_mean = t.sd_mean[kmer_rank] * scale_sd;
+            s.sd_lambda = t.sd_lambda[kmer_rank] * var_sd;
+            s.sd_stdv = t.sd_stdv[kmer_rank] * m_sd_stdv_factor;
+            s.level_log_stdv = t.level_log_stdv[kmer_rank] + m_log_var;
+            s.sd_log_lambda = t.sd_log_lambda[kmer_rank] + m_log_var_sd;
+            return s;
         }
 
         inline PoreModelStateParams get_parameters(const uint32_t kmer_rank) const
         {
-            return states[kmer_rank];
+            const PoreModelStateTable& t = *m_states;
+            PoreModelStateParams s;
+            s.level_mean = t.level_mean[kmer_rank];
+            s.level_stdv = t.level_stdv[kmer_rank];
+            s.sd_mean = t.sd_mean[kmer_rank];
+            s.sd_stdv = t.sd_stdv[kmer_rank];
+            s.sd_lambda = t.sd_lambda[kmer_rank];
+            s.level_log_stdv = t.level_log_stdv[kmer_rank];
+            s.sd_log_lambda = t.sd_log_lambda[kmer_rank];
+            return s;
         }
         
-        inline size_t get_num_states() const { return states.size(); }
+        inline size_t get_num_states() const { return m_states ? m_states->size() : 0; }
 
-        // Pre-compute the GaussianParameters to avoid
-        // taking numerous logs in the emission calculations
+        // copy the unscaled states out of the shared table, to modify them
+        std::vector<PoreModelStateParams> get_states() const;
+
+        // replace the states of this model with a new shared table,
+        // other copies of the model keep the previous states
+        void set_states(const std::vector<PoreModelStateParams>& states);
+
+        // Pre-compute the logs of the scaling parameters to avoid
+        // taking numerous logs in the emission calculations. This must
+        // be called after the scaling parameters are changed.
         void bake_gaussian_parameters();
 
-        // update states with those given, or from another model
+        // update states with those given, or from another model.
+        // The states of another model are shared, not copied.
         void update_states( const PoreModel &other );
         void update_states( const std::vector<PoreModelStateParams> &otherstates );
 
@@ -153,9 +207,14 @@ class PoreModel
 
         const Alphabet *pmalphabet; 
 
-        std::vector<PoreModelStateParams> states;
-        std::vector<PoreModelStateParams> scaled_states;
-        std::vector<GaussianParameters> scaled_params;
+    private:
+
+        std::shared_ptr<const PoreModelStateTable> m_states;
+
+        // calculated from the scaling parameters by bake_gaussian_parameters
+        double m_log_var;
+        double m_log_var_sd;
+        double m_sd_stdv_factor;
 };
 
 #endif
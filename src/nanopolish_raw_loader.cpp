@@ -12,7 +12,7 @@
 //
 void estimate_scalings_using_mom(const std::string& sequence,
                                  const PoreModel& pore_model,
-                                 const event_table& et,
+                                 const std::vector<SquiggleEvent>& events,
                                  double& out_shift,
                                  double& out_scale)
 {
@@ -22,9 +22,10 @@ void estimate_scalings_using_mom(const std::string& sequence,
 
     // Calculate summary statistics over the events and
     // the model implied by the read
+    size_t n_events = events.size();
     double event_level_sum = 0.0f;
-    for(size_t i = 0; i < et.n; ++i) {
-        event_level_sum += et.event[i].mean;
+    for(size_t i = 0; i < n_events; ++i) {
+        event_level_sum += events[i].mean;
     }
 
     double kmer_level_sum = 0.0f;
@@ -35,19 +36,19 @@ void estimate_scalings_using_mom(const std::string& sequence,
         kmer_level_sum += l;
         kmer_level_sq_sum += pow(l, 2.0f);
     }
-    out_shift = event_level_sum / et.n - kmer_level_sum / n_kmers;
+    out_shift = event_level_sum / n_events - kmer_level_sum / n_kmers;
 
     // estimate scale
     double event_level_sq_sum = 0.0f;
-    for(size_t i = 0; i < et.n; ++i) {
-        event_level_sq_sum += pow(et.event[i].mean - out_shift, 2.0);
+    for(size_t i = 0; i < n_events; ++i) {
+        event_level_sq_sum += pow(events[i].mean - out_shift, 2.0);
     }
 
-    out_scale = (event_level_sq_sum / et.n) / (kmer_level_sq_sum / n_kmers);
+    out_scale = (event_level_sq_sum / n_events) / (kmer_level_sq_sum / n_kmers);
 
 #if DEBUG_PRINT_STATS
-    fprintf(stderr, "event mean: %.2lf kmer mean: %.2lf shift: %.2lf\n", event_level_sum / et.n, kmer_level_sum / n_kmers, out_shift);
-    fprintf(stderr, "event sq-mean: %.2lf kmer sq-mean: %.2lf scale: %.2lf\n", event_level_sq_sum / et.n, kmer_level_sq_sum / n_kmers, out_scale);
+    fprintf(stderr, "event mean: %.2lf kmer mean: %.2lf shift: %.2lf\n", event_level_sum / n_events, kmer_level_sum / n_kmers, out_shift);
+    fprintf(stderr, "event sq-mean: %.2lf kmer sq-mean: %.2lf scale: %.2lf\n", event_level_sq_sum / n_events, kmer_level_sq_sum / n_kmers, out_scale);
     fprintf(stderr, "truth shift: %.2lf scale: %.2lf\n", pore_model.shift, pore_model.scale);
 #endif
 }
@@ -11,11 +11,10 @@
 
 #include "nanopolish_squiggle_read.h"
 #include "nanopolish_anchor.h"
-#include "scrappie_structures.h"
 
 void estimate_scalings_using_mom(const std::string& sequence,
                                  const PoreModel& pore_model,
-                                 const event_table& et,
+                                 const std::vector<SquiggleEvent>& events,
                                  double& out_shift,
                                  double& out_scale);
 
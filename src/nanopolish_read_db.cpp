@@ -10,20 +10,29 @@
 #include <fstream>
 #include <ostream>
 #include <iostream>
+#include <algorithm>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "nanopolish_common.h"
 #include "htslib/kseq.h"
 #include "htslib/bgzf.h"
 #include "nanopolish_read_db.h"
 
 #define READ_DB_SUFFIX ".readdb"
+#define READ_DB_BINARY_SUFFIX ".readdb.bin"
+#define READ_DB_BINARY_MAGIC "NPRDB\x02\x00\x00"
 #define GZIPPED_READS_SUFFIX ".fa.gz"
 
 // Tell KSEQ what functions to use to open/read files
 KSEQ_INIT(gzFile, gzread)
 
 //
-ReadDB::ReadDB() : m_fai(NULL)
+ReadDB::ReadDB() : m_index_data(NULL),
+                   m_index_size(0),
+                   m_index_num_reads(0),
+                   m_index_entries(NULL)
 {
 
 }
@@ -45,7 +54,7 @@ void ReadDB::build(const std::string& input_reads_filename)
         exit(EXIT_FAILURE);
     }
 
-    m_fai = NULL;
+    m_fai.reset();
 }
 
 //
@@ -54,6 +63,15 @@ void ReadDB::load(const std::string& input_reads_filename)
     // generate input filenames
     m_indexed_reads_filename = input_reads_filename + GZIPPED_READS_SUFFIX;
     std::string in_filename = m_indexed_reads_filename + READ_DB_SUFFIX;
+    std::string binary_filename = m_indexed_reads_filename + READ_DB_BINARY_SUFFIX;
+
+    // use the binary database if it was written with the current text one
+    struct stat text_stat;
+    if(stat(in_filename.c_str(), &text_stat) == 0 &&
+       load_binary(binary_filename, text_stat.st_size, text_stat.st_mtime)) {
+        m_fai.reset(new FaidxPool(m_indexed_reads_filename));
+        return;
+    }
     
     //
     std::ifstream in_file(in_filename.c_str());
@@ -77,14 +95,136 @@ void ReadDB::load(const std::string& input_reads_filename)
     }
 
     // load faidx
-    m_fai = fai_load(m_indexed_reads_filename.c_str());
+    m_fai.reset(new FaidxPool(m_indexed_reads_filename));
 }
 
 ReadDB::~ReadDB()
 {
-    if(m_fai != NULL) {
-        fai_destroy(m_fai);
+    if(m_index_data != NULL) {
+        munmap((void*)m_index_data, m_index_size);
+    }
+}
+
+//
+bool ReadDB::load_binary(const std::string& filename, uint64_t text_size, int64_t text_mtime)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ReadDBIndexHeader)) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        return false;
+    }
+
+    // a database written by an older version, or for a text database
+    // that has changed since, is silently ignored
+    const ReadDBIndexHeader* header = (const ReadDBIndexHeader*)data;
+    if(memcmp(header->magic, READ_DB_BINARY_MAGIC, sizeof(header->magic)) != 0 ||
+       header->text_size != text_size ||
+       header->text_mtime != text_mtime) {
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    // only the size of the entry table is checked here so that loading does not
+    // depend on the number of reads, the entries are checked when they are used
+    size_t max_entries = (st.st_size - sizeof(ReadDBIndexHeader)) / sizeof(ReadDBIndexEntry);
+    if(header->num_reads > max_entries) {
+        fprintf(stderr, "warning: ignoring malformed read database %s\n", filename.c_str());
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    m_index_data = (const char*)data;
+    m_index_size = st.st_size;
+    m_index_num_reads = header->num_reads;
+    m_index_entries = (const ReadDBIndexEntry*)(m_index_data + sizeof(ReadDBIndexHeader));
+    return true;
+}
+
+//
+const char* ReadDB::get_index_string(uint64_t offset, uint32_t length) const
+{
+    if(offset > m_index_size || length > m_index_size - offset) {
+        fprintf(stderr, "Error: the read database %s%s is malformed, rerun nanopolish index\n",
+                m_indexed_reads_filename.c_str(), READ_DB_BINARY_SUFFIX);
+        exit(EXIT_FAILURE);
+    }
+    return m_index_data + offset;
+}
+
+//
+bool ReadDB::save_binary(const std::string& filename, uint64_t text_size, int64_t text_mtime) const
+{
+    FILE* fp = fopen(filename.c_str(), "wb");
+    if(fp == NULL) {
+        return false;
+    }
+
+    // m_data is a std::map so the entries are written in sorted order
+    ReadDBIndexHeader header;
+    memcpy(header.magic, READ_DB_BINARY_MAGIC, sizeof(header.magic));
+    header.num_reads = m_data.size();
+    header.text_size = text_size;
+    header.text_mtime = text_mtime;
+
+    std::vector<ReadDBIndexEntry> entries;
+    entries.reserve(m_data.size());
+    uint64_t offset = sizeof(ReadDBIndexHeader) + m_data.size() * sizeof(ReadDBIndexEntry);
+    for(const auto& iter : m_data) {
+        ReadDBIndexEntry entry;
+        entry.name_offset = offset;
+        entry.name_length = iter.first.size();
+        offset += entry.name_length;
+        entry.path_offset = offset;
+        entry.path_length = iter.second.signal_data_path.size();
+        offset += entry.path_length;
+        entries.push_back(entry);
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(entries.data(), sizeof(ReadDBIndexEntry), entries.size(), fp) == entries.size();
+    for(const auto& iter : m_data) {
+        ok = ok && fwrite(iter.first.data(), 1, iter.first.size(), fp) == iter.first.size();
+        const std::string& path = iter.second.signal_data_path;
+        ok = ok && fwrite(path.data(), 1, path.size(), fp) == path.size();
+    }
+    ok = fclose(fp) == 0 && ok;
+    return ok;
+}
+
+//
+size_t ReadDB::add_saved_signal_paths(const std::string& input_reads_filename)
+{
+    std::string in_filename = input_reads_filename + GZIPPED_READS_SUFFIX + READ_DB_SUFFIX;
+    std::ifstream in_file(in_filename.c_str());
+    if(!in_file.good()) {
+        return 0;
     }
+
+    size_t count = 0;
+    std::string line;
+    while(getline(in_file, line)) {
+        std::vector<std::string> fields = split(line, '\t');
+        if(fields.size() == 2 && !fields[1].empty()) {
+            // reads that are no longer in the reads file are not carried over
+            auto iter = m_data.find(fields[0]);
+            if(iter != m_data.end() && iter->second.signal_data_path.empty()) {
+                iter->second.signal_data_path = fields[1];
+                count += 1;
+            }
+        }
+    }
+    return count;
 }
 
 //
@@ -166,11 +306,58 @@ void ReadDB::add_signal_path(const std::string& read_id, const std::string& path
 std::string ReadDB::get_signal_path(const std::string& read_id) const
 {
     const auto& iter = m_data.find(read_id);
-    if(iter == m_data.end()) {
-        return "";
-    } else {
+    if(iter != m_data.end()) {
         return iter->second.signal_data_path;
     }
+
+    // binary search the mapped index, which is sorted by name
+    const ReadDBIndexEntry* entry = std::lower_bound(m_index_entries, m_index_entries + m_index_num_reads, read_id,
+        [this](const ReadDBIndexEntry& e, const std::string& name) {
+            return name.compare(0, name.size(), get_index_string(e.name_offset, e.name_length), e.name_length) > 0;
+        });
+
+    if(entry != m_index_entries + m_index_num_reads &&
+       read_id.compare(0, read_id.size(), get_index_string(entry->name_offset, entry->name_length), entry->name_length) == 0) {
+        return std::string(get_index_string(entry->path_offset, entry->path_length), entry->path_length);
+    }
+    return "";
+}
+
+//
+std::vector<std::string> ReadDB::get_signal_paths() const
+{
+    std::vector<std::string> out;
+    for(const auto& iter : m_data) {
+        if(!iter.second.signal_data_path.empty()) {
+            out.push_back(iter.second.signal_data_path);
+        }
+    }
+
+    for(size_t i = 0; i < m_index_num_reads; ++i) {
+        const ReadDBIndexEntry& entry = m_index_entries[i];
+        if(entry.path_length > 0) {
+            out.push_back(std::string(get_index_string(entry.path_offset, entry.path_length), entry.path_length));
+        }
+    }
+    return out;
+}
+
+//
+void ReadDB::prefetch_signal_data(const std::string& read_id) const
+{
+    std::string path = get_signal_path(read_id);
+    if(path.empty()) {
+        return;
+    }
+
+    // ask the kernel to start reading the file into the page cache
+    // this returns immediately, the file is read in the background
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
 }
 
 //
@@ -179,11 +366,7 @@ std::string ReadDB::get_read_sequence(const std::string& read_id) const
     assert(m_fai != NULL);
     
     int length;
-    char* seq;
-
-    // this call is not threadsafe
-    #pragma omp critical
-    seq = fai_fetch(m_fai, read_id.c_str(), &length);
+    char* seq = m_fai->fetch(read_id.c_str(), &length);
 
     if(seq == NULL) {
         return "";
@@ -205,6 +388,25 @@ void ReadDB::save() const
         const ReadDBData& entry = iter.second;
         out_file << iter.first << "\t" << entry.signal_data_path << "\n";
     }
+    out_file.close();
+
+    // write the binary form after the text form, recording which text file it matches.
+    // It is written under a temporary name first so that runs that have the old one
+    // memory mapped, or start while it is being written, never see a partial file.
+    struct stat text_stat;
+    if(stat(out_filename.c_str(), &text_stat) != 0) {
+        fprintf(stderr, "error: could not write %s\n", out_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    std::string binary_filename = m_indexed_reads_filename + READ_DB_BINARY_SUFFIX;
+    std::string tmp_filename = binary_filename + ".tmp." + std::to_string(getpid());
+    if(!save_binary(tmp_filename, text_stat.st_size, text_stat.st_mtime) ||
+       rename(tmp_filename.c_str(), binary_filename.c_str()) != 0) {
+        unlink(tmp_filename.c_str());
+        fprintf(stderr, "error: could not write %s\n", binary_filename.c_str());
+        exit(EXIT_FAILURE);
+    }
 }
 
 
@@ -217,6 +419,12 @@ bool ReadDB::check_signal_paths() const
             return false;
         }
     }
+
+    for(size_t i = 0; i < m_index_num_reads; ++i) {
+        if(m_index_entries[i].path_length == 0) {
+            return false;
+        }
+    }
     return true;
 }
 
@@ -227,5 +435,9 @@ void ReadDB::print_stats() const
     for(const auto& iter : m_data) {
         num_reads_with_path += iter.second.signal_data_path != "";
     }
-    fprintf(stderr, "[readdb] num reads: %zu, num reads with path: %zu\n", m_data.size(), num_reads_with_path);
+
+    for(size_t i = 0; i < m_index_num_reads; ++i) {
+        num_reads_with_path += m_index_entries[i].path_length > 0;
+    }
+    fprintf(stderr, "[readdb] num reads: %zu, num reads with path: %zu\n", get_num_reads(), num_reads_with_path);
 }
@@ -10,7 +10,11 @@
 #define NANOPOLISH_READ_DB
 
 #include <map>
-#include "htslib/faidx.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include "nanopolish_faidx_pool.h"
 
 struct ReadDBData
 {
@@ -18,6 +22,30 @@ struct ReadDBData
     std::string signal_data_path;
 };
 
+// The binary form of the database is a header, followed by one
+// entry per read sorted by read name, followed by the strings.
+// The file is memory mapped and searched in place so loading
+// it does not depend on the number of reads. It is only used
+// while the text database it was written with is unchanged.
+struct ReadDBIndexHeader
+{
+    char magic[8];
+    uint64_t num_reads;
+
+    // size and modification time of the text database
+    uint64_t text_size;
+    int64_t text_mtime;
+};
+
+struct ReadDBIndexEntry
+{
+    // offsets are from the start of the file
+    uint64_t name_offset;
+    uint64_t path_offset;
+    uint32_t name_length;
+    uint32_t path_length;
+};
+
 class ReadDB
 {
     public:
@@ -37,6 +65,11 @@ class ReadDB
         // restore the database from disk
         void load(const std::string& reads_filename);
 
+        // add the signal paths saved in an earlier database for this reads file,
+        // to reads that do not have one. Reads in the earlier database that were
+        // not added by build() are ignored. Returns the number of paths added.
+        size_t add_saved_signal_paths(const std::string& reads_filename);
+
         //
         // Data Access
         // 
@@ -47,11 +80,18 @@ class ReadDB
         // returns the path to the signal data for the given read
         std::string get_signal_path(const std::string& read_id) const;
 
-        // returns the basecalled sequence for the given read
+        // returns the paths to the signal data of all reads
+        std::vector<std::string> get_signal_paths() const;
+
+        // start loading the signal data for the given read in the background,
+        // so that a later SquiggleRead for this read does not wait on disk
+        void prefetch_signal_data(const std::string& read_id) const;
+
+        // returns the basecalled sequence for the given read, threadsafe
         std::string get_read_sequence(const std::string& read_id) const;
 
         // returns the number of reads in the database
-        size_t get_num_reads() const { return m_data.size(); }
+        size_t get_num_reads() const { return m_data.size() + m_index_num_reads; }
  
         //
         // Summaries and sanity checks
@@ -64,18 +104,38 @@ class ReadDB
         void print_stats() const;
 
     private:
+
+        // a ReadDB may own a memory map and a faidx, so it is shared rather than copied
+        ReadDB(const ReadDB&) = delete;
+        ReadDB& operator=(const ReadDB&) = delete;
         
         //
         void import_reads(const std::string& input_filename, const std::string& output_fasta_filename);
 
+        // write the entries of m_data in the binary format
+        bool save_binary(const std::string& filename, uint64_t text_size, int64_t text_mtime) const;
+
+        // memory map a binary database, returns false if it is malformed
+        // or was not written with the given text database
+        bool load_binary(const std::string& filename, uint64_t text_size, int64_t text_mtime);
+
+        // returns a pointer to a string in the mapped database, exits if it is outside of the file
+        const char* get_index_string(uint64_t offset, uint32_t length) const;
+
         // the filename of the indexed data, after converting to fasta
         std::string m_indexed_reads_filename;
 
-        //
+        // reads added by build() or loaded from a text database
         std::map<std::string, ReadDBData> m_data;
 
-        //
-        faidx_t* m_fai;
+        // reads in the memory mapped binary database
+        const char* m_index_data;
+        size_t m_index_size;
+        size_t m_index_num_reads;
+        const ReadDBIndexEntry* m_index_entries;
+
+        // handles to the indexed fasta of basecalls
+        std::unique_ptr<FaidxPool> m_fai;
 };
 
 #endif
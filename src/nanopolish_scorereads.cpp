@@ -33,6 +33,9 @@
 #include "nanopolish_profile_hmm.h"
 #include "nanopolish_anchor.h"
 #include "nanopolish_read_db.h"
+#include "nanopolish_bam_processor.h"
+#include "nanopolish_bam_utils.h"
+#include "nanopolish_output_writer.h"
 #include "nanopolish_pore_model_set.h"
 #include "H5pubconf.h"
 
@@ -60,6 +63,7 @@ static const char *SCOREREADS_USAGE_MESSAGE =
 "  -i  --individual-reads=READ,READ     optional comma-delimited list of readnames to score\n"
 "  -r, --reads=FILE                     the 2D ONT reads are in fasta FILE\n"
 "  -b, --bam=FILE                       the reads aligned to the genome assembly are in bam FILE\n"
+"                                       use - to stream sam/bam from stdin (unsorted input is fine without --window)\n"
 "  -g, --genome=FILE                    the genome we are computing a consensus for is in FILE\n"
 "  -w, --window=STR                     score reads in the window STR (format: ctg:start-end)\n"
 "  -t, --threads=NUM                    use NUM threads (default: 1)\n"
@@ -80,7 +84,6 @@ namespace opt
     static std::string alternative_model_type = "ONT";
     static int train_transitions = 0;
     static int num_threads = 1;
-    static int batch_size = 128;
 
     // Offset calculating parameters
     static int learn_model_offset = 0;
@@ -119,10 +122,12 @@ static const struct option longopts[] = {
 
 double model_score(SquiggleRead &sr,
                    const size_t strand_idx,
-                   const faidx_t *fai, 
+                   const PackedReference *reference, 
+                   const bam_hdr_t* hdr,
                    const std::vector<EventAlignment> &alignment_output,
                    const size_t events_per_segment,
-                   TransitionParameters* transition_training)
+                   TransitionParameters* transition_training,
+                   std::string* segment_out)
 {
     double curr_score = 0;
     size_t nevents = 0;
@@ -133,7 +138,7 @@ double model_score(SquiggleRead &sr,
 
         const EventAlignment& align_start = alignment_output[align_start_idx];
         const EventAlignment& align_end = alignment_output[align_start_idx + events_per_segment];
-        std::string contig = alignment_output.front().ref_name.c_str();
+        std::string contig = hdr->target_name[alignment_output.front().ref_contig_id];
 
         // Set up event data
         HMMInputData data;
@@ -153,7 +158,7 @@ double model_score(SquiggleRead &sr,
         assert(ref_end_pos >= ref_start_pos);
 
         // Extract the reference sequence for this region
-        std::string ref_seq = get_reference_region_ts(fai, contig.c_str(), ref_start_pos, 
+        std::string ref_seq = get_reference_region_ts(reference, contig.c_str(), ref_start_pos, 
                                                       ref_end_pos, &fetched_len);
 
         if (fetched_len <= (int)sr.pore_model[strand_idx].k)
@@ -177,17 +182,25 @@ double model_score(SquiggleRead &sr,
         double curr_drift = sr.pore_model[strand_idx].drift;
         double curr_var = sr.pore_model[strand_idx].var;
             
-        recalibrate_model(sr, strand_idx, event_alignment_sub, &gDNAAlphabet, true, opt::scale_drift);
-
-        fprintf(stdout, "SEGMENT\t%s\t%zu\t%.3lf\t%d\t%.2lf\t%.2lf\t%.2lf\t%.2lf\n", 
-                    sr.read_name.c_str(), 
-                    nevents, 
-                    segment_score / events_in_segment, 
-                    events_in_segment,
-                    sr.pore_model[strand_idx].shift,
-                    sr.pore_model[strand_idx].scale,
-                    sr.pore_model[strand_idx].drift,
-                    sr.pore_model[strand_idx].var);
+        recalibrate_model(sr, strand_idx, event_alignment_sub, true, opt::scale_drift);
+
+        std::string segment_line;
+        append_printf(segment_line, "SEGMENT\t%s\t%zu\t%.3lf\t%d\t%.2lf\t%.2lf\t%.2lf\t%.2lf\n", 
+                      sr.read_name.c_str(), 
+                      nevents, 
+                      segment_score / events_in_segment, 
+                      events_in_segment,
+                      sr.pore_model[strand_idx].shift,
+                      sr.pore_model[strand_idx].scale,
+                      sr.pore_model[strand_idx].drift,
+                      sr.pore_model[strand_idx].var);
+
+        // buffer the line if the caller is collecting the output for the read
+        if(segment_out != NULL) {
+            segment_out->append(segment_line);
+        } else {
+            fputs(segment_line.c_str(), stdout);
+        }
         
         sr.pore_model[strand_idx].shift = curr_shift;
         sr.pore_model[strand_idx].scale = curr_scale;
@@ -217,11 +230,12 @@ double model_score(SquiggleRead &sr,
 void sweep_offset_parameters(SquiggleRead &sr,
                              const size_t strand_idx,
                              const size_t read_idx,
-                             const faidx_t *fai,
+                             const PackedReference *reference,
+                             const bam_hdr_t* hdr,
                              const std::vector<EventAlignment> &alignment_output,
                              const size_t events_per_segment,
                              const std::string alternative_model_type,
-                             FILE* offset_fp)
+                             std::string& offset_out)
 {
     double curr_score = 0;
     size_t nevents = 0;
@@ -234,7 +248,7 @@ void sweep_offset_parameters(SquiggleRead &sr,
 
     const EventAlignment& align_start = alignment_output[align_start_idx];
     const EventAlignment& align_end = alignment_output[align_start_idx + events_per_segment];
-    std::string contig = alignment_output.front().ref_name.c_str();
+    std::string contig = hdr->target_name[alignment_output.front().ref_contig_id];
 
     // Set up event data
     HMMInputData data;
@@ -258,7 +272,7 @@ void sweep_offset_parameters(SquiggleRead &sr,
     assert(ref_end_pos >= ref_start_pos);
 
     // Extract the reference sequence for this region
-    std::string ref_seq = get_reference_region_ts(fai, contig.c_str(), ref_start_pos,
+    std::string ref_seq = get_reference_region_ts(reference, contig.c_str(), ref_start_pos,
                                                   ref_end_pos, &fetched_len);
 
     if (fetched_len <= (int)sr.pore_model[strand_idx].k)
@@ -294,7 +308,7 @@ void sweep_offset_parameters(SquiggleRead &sr,
             sr.pore_model[strand_idx].bake_gaussian_parameters();
             double offset_score = profile_hmm_score(sequence, data, 0);
             double improvement = offset_score - base_score;
-            fprintf(offset_fp, "%zu\t%zu\t%.2lf\t%.2lf\t%.2lf\n", read_idx, strand_idx, scale_offset, shift_offset, offset_score - base_score);
+            append_printf(offset_out, "%zu\t%zu\t%.2lf\t%.2lf\t%.2lf\n", read_idx, strand_idx, scale_offset, shift_offset, offset_score - base_score);
 
             if(improvement > max_improvement) {
                 max_improvement = improvement;
@@ -317,7 +331,7 @@ std::vector<EventAlignment> alignment_from_read(SquiggleRead& sr,
                                                 const size_t strand_idx,
                                                 const size_t read_idx,
                                                 const std::string& alternative_model_type,
-                                                const faidx_t* fai,
+                                                const PackedReference* reference,
                                                 const bam_hdr_t* hdr,
                                                 const bam1_t* record,
                                                 int region_start,
@@ -330,7 +344,7 @@ std::vector<EventAlignment> alignment_from_read(SquiggleRead& sr,
     // Align to the new model
     EventAlignmentParameters params;
     params.sr = &sr;
-    params.fai = fai;
+    params.reference = reference;
     params.hdr = hdr;
     params.record = record;
     params.strand_idx = strand_idx;
@@ -426,56 +440,13 @@ int scorereads_main(int argc, char** argv)
 {
     parse_scorereads_options(argc, argv);
     omp_set_num_threads(opt::num_threads);
+    init_hts_thread_pool(opt::num_threads);
 
     ReadDB read_db;
     read_db.load(opt::reads_file);
 
-    // Open the BAM and iterate over reads
-
-    // load bam file
-    htsFile* bam_fh = sam_open(opt::bam_file.c_str(), "r");
-    assert(bam_fh != NULL);
-
-    // load bam index file
-    std::string index_filename = opt::bam_file + ".bai";
-    hts_idx_t* bam_idx = bam_index_load(index_filename.c_str());
-    assert(bam_idx != NULL);
-
-    // read the bam header
-    bam_hdr_t* hdr = sam_hdr_read(bam_fh);
-
-    // load reference fai file
-    faidx_t *fai = fai_load(opt::genome_file.c_str());
-
-    hts_itr_t* itr;
-
-    // If processing a region of the genome, only emit events aligned to this window
-    int clip_start = -1;
-    int clip_end = -1;
-
-    if(opt::region.empty()) {
-        // TODO: is this valid?
-        itr = sam_itr_queryi(bam_idx, HTS_IDX_START, 0, 0);
-    } else {
-
-        fprintf(stderr, "Region: %s\n", opt::region.c_str());
-        itr = sam_itr_querys(bam_idx, hdr, opt::region.c_str());
-        hts_parse_reg(opt::region.c_str(), &clip_start, &clip_end);
-    }
-
-#ifndef H5_HAVE_THREADSAFE
-    if(opt::num_threads > 1) {
-        fprintf(stderr, "You enabled multi-threading but you do not have a threadsafe HDF5\n");
-        fprintf(stderr, "Please recompile nanopolish's built-in libhdf5 or run with -t 1\n");
-        exit(1);
-    }
-#endif
-
-    // Initialize iteration
-    std::vector<bam1_t*> records(opt::batch_size, NULL);
-    for(size_t i = 0; i < records.size(); ++i) {
-        records[i] = bam_init1();
-    }
+    // load the reference
+    PackedReference reference(opt::genome_file);
 
     // Initialize transition training
     TransitionParameters* transition_training[NUM_STRANDS];
@@ -495,77 +466,86 @@ int scorereads_main(int argc, char** argv)
         fprintf(offset_fp, "read_idx\tstrand_idx\tscale_offset\tshift_offset\timprovement\n");
     }
 
-    int result;
-    size_t num_reads_realigned = 0;
-    size_t num_records_buffered = 0;
-
-    do {
-        assert(num_records_buffered < records.size());
-
-        // read a record into the next slot in the buffer
-        result = sam_itr_next(bam_fh, itr, records[num_records_buffered]);
-        num_records_buffered += result >= 0;
-
-        // realign if we've hit the max buffer size or reached the end of file
-        if(num_records_buffered == records.size() || result < 0) {
-            #pragma omp parallel for schedule(dynamic)
-            for(size_t i = 0; i < num_records_buffered; ++i) {
-                bam1_t* record = records[i];
-                size_t read_idx = num_reads_realigned + i;
-                if( (record->core.flag & BAM_FUNMAP) == 0) {
-
-                    //load read
-                    std::string read_name = bam_get_qname(record);
-                    SquiggleRead sr(read_name, read_db);
-                    
-                    // TODO: early exit when have processed all of the reads in readnames
-                    if (!opt::readnames.empty() &&
-                         std::find(opt::readnames.begin(), opt::readnames.end(), read_name) == opt::readnames.end() )
-                            continue;
-
-                    for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
-                        
-                        if(!sr.has_events_for_strand(strand_idx)) {
-                            continue;
-                        }
-
-                        // When learning model offsets, don't allow the base model to be swapped out
-                        std::string model_type_for_alignment =
-                            opt::learn_model_offset ? "" : opt::alternative_model_type;
-
-                        std::vector<EventAlignment> ao = alignment_from_read(sr, strand_idx, read_idx,
-                                                                             model_type_for_alignment, fai, hdr,
-                                                                             record, clip_start, clip_end);
-                        if (ao.size() == 0)
-                            continue;
-
-                        // Update pore model based on alignment
-                        if( opt::calibrate ) {
-                            recalibrate_model(sr, strand_idx, ao, &gDNAAlphabet, true, opt::scale_drift);
-                        }
-
-                        if(opt::learn_model_offset) {
-                            sweep_offset_parameters(sr, strand_idx, read_idx, fai, ao, 500, opt::alternative_model_type, offset_fp);
-                        }
-
-                        double score = model_score(sr, strand_idx, fai, ao, 500, transition_training[strand_idx]);
-                        if(score > 0)
-                            continue;
-
-                        #pragma omp critical(print)
-                        std::cout << read_name << " " << ( strand_idx ? "complement" : "template" )
-                                  << " " << sr.pore_model[strand_idx].name << " " << score << 
-                                  " shift " << sr.pore_model[strand_idx].shift << " scale " << sr.pore_model[strand_idx].scale <<
-                                  " drift " << sr.pore_model[strand_idx].drift << " var " << sr.pore_model[strand_idx].var << std::endl;
-                    }
-                }
+    // scores are written in read order by a separate writer thread,
+    // the model offsets are the second text stream
+    enum { SCORE_STREAM = 0, OFFSET_STREAM };
+    OutputWriter output(true);
+    output.add_text_stream(stdout);
+    if(offset_fp != NULL) {
+        output.add_text_stream(offset_fp);
+    }
+
+    auto score_read = [&](OutputBuffer& buffer, const bam_hdr_t* hdr, const bam1_t* record, size_t read_idx, int clip_start, int clip_end) {
+        std::string read_name = bam_get_qname(record);
+
+        // TODO: early exit when have processed all of the reads in readnames
+        if (!opt::readnames.empty() &&
+             std::find(opt::readnames.begin(), opt::readnames.end(), read_name) == opt::readnames.end() )
+                return;
+
+        //load read
+        SquiggleRead sr(read_name, read_db);
+
+        for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
+            
+            if(!sr.has_events_for_strand(strand_idx)) {
+                continue;
             }
 
-            num_reads_realigned += num_records_buffered;
-            num_records_buffered = 0;
-        }
+            // When learning model offsets, don't allow the base model to be swapped out
+            std::string model_type_for_alignment =
+                opt::learn_model_offset ? "" : opt::alternative_model_type;
+
+            std::vector<EventAlignment> ao = alignment_from_read(sr, strand_idx, read_idx,
+                                                                 model_type_for_alignment, &reference, hdr,
+                                                                 record, clip_start, clip_end);
+            if (ao.size() == 0)
+                continue;
 
-    } while(result >= 0);
+            // Update pore model based on alignment
+            if( opt::calibrate ) {
+                recalibrate_model(sr, strand_idx, ao, true, opt::scale_drift);
+            }
+
+            if(opt::learn_model_offset) {
+                sweep_offset_parameters(sr, strand_idx, read_idx, &reference, hdr, ao, 500, opt::alternative_model_type,
+                                        buffer.text(OFFSET_STREAM));
+            }
+
+            double score = model_score(sr, strand_idx, &reference, hdr, ao, 500, transition_training[strand_idx],
+                                       &buffer.text(SCORE_STREAM));
+            if(score > 0)
+                continue;
+
+            std::ostringstream score_ss;
+            score_ss << read_name << " " << ( strand_idx ? "complement" : "template" )
+                     << " " << sr.pore_model[strand_idx].name << " " << score << 
+                     " shift " << sr.pore_model[strand_idx].shift << " scale " << sr.pore_model[strand_idx].scale <<
+                     " drift " << sr.pore_model[strand_idx].drift << " var " << sr.pore_model[strand_idx].var << "\n";
+            buffer.text(SCORE_STREAM).append(score_ss.str());
+        }
+    };
+
+    auto f = [&](const bam_hdr_t* hdr, const bam1_t* record, size_t read_idx, int clip_start, int clip_end) {
+        OutputBuffer buffer(read_idx);
+        score_read(buffer, hdr, record, read_idx, clip_start, clip_end);
+        output.submit(std::move(buffer));
+    };
+
+    // the BamProcessor framework calls the input function with the
+    // bam record, read index, etc passed as parameters
+    BamProcessor processor(opt::bam_file, opt::region, opt::num_threads);
+    processor.set_verbose(opt::verbose);
+    processor.set_prefetch_function([&read_db](const bam_hdr_t*, const bam1_t* record) {
+        read_db.prefetch_signal_data(bam_get_qname(record));
+    });
+    processor.set_output_writer(&output);
+    processor.parallel_run(f);
+    output.close();
+
+    if(offset_fp != NULL) {
+        fclose(offset_fp);
+    }
 
     if(opt::train_transitions) {
         for(size_t strand_idx = 0; strand_idx < NUM_STRANDS; ++strand_idx) {
@@ -577,17 +557,7 @@ int scorereads_main(int argc, char** argv)
         }
     }
 
-    // cleanup records
-    for(size_t i = 0; i < records.size(); ++i) {
-        bam_destroy1(records[i]);
-    }
-
     // cleanup
-    sam_itr_destroy(itr);
-    bam_hdr_destroy(hdr);
-    fai_destroy(fai);
-    sam_close(bam_fh);
-    hts_idx_destroy(bam_idx);
     return 0;
 }
 
@@ -14,7 +14,7 @@ std::vector<EventAlignment> alignment_from_read(SquiggleRead& sr,
                                                 const size_t strand_idx,
                                                 const size_t read_idx,
                                                 const std::string& alternative_model_type,
-                                                const faidx_t* fai,
+                                                const PackedReference* reference,
                                                 const bam_hdr_t* hdr,
                                                 const bam1_t* record,
                                                 int region_start,
@@ -22,10 +22,12 @@ std::vector<EventAlignment> alignment_from_read(SquiggleRead& sr,
 
 double model_score(SquiggleRead &sr,
                    const size_t strand_idx,
-                   const faidx_t *fai, 
+                   const PackedReference *reference, 
+                   const bam_hdr_t* hdr,
                    const std::vector<EventAlignment> &alignment_output,
                    const size_t events_per_segment,
-                   TransitionParameters* transition_training);
+                   TransitionParameters* transition_training,
+                   std::string* segment_out = NULL);
 
 int scorereads_main(int argc, char** argv);
 
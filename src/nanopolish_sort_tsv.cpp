@@ -0,0 +1,459 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//
+// nanopolish sort-tsv - sort a tab-separated output by
+// reference position, write it as BGZF and build a tabix
+// index. The eventalign and call-methylation tables are
+// written in read order so they need this step before
+// they can be queried by region.
+//
+//---------------------------------------------------------
+//
+
+//
+// Getopt
+//
+#define SUBPROGRAM "sort-tsv"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <queue>
+#include <map>
+#include <memory>
+#include <getopt.h>
+
+#include "htslib/bgzf.h"
+#include "nanopolish_sort_tsv.h"
+#include "nanopolish_common.h"
+#include "nanopolish_bam_utils.h"
+#include "nanopolish_text_output.h"
+
+static const char *SORT_TSV_VERSION_MESSAGE =
+SUBPROGRAM " Version " PACKAGE_VERSION "\n"
+"Written by agent.\n"
+"\n"
+"Copyright 2026 agent\n";
+
+static const char *SORT_TSV_USAGE_MESSAGE =
+"Usage: " PACKAGE_NAME " " SUBPROGRAM " [OPTIONS] -o output.tsv.gz input.tsv[.gz]\n"
+"Sort a tab-separated file by reference position, compress it with BGZF and build a tabix index.\n"
+"The eventalign and call-methylation outputs can be sorted with the default options.\n"
+"\n"
+"      --help                           display this help and exit\n"
+"      --version                        display version\n"
+"  -v, --verbose                        display verbose output\n"
+"  -o, --output=FILE                    write the sorted, compressed output to FILE (required)\n"
+"  -s, --sequence-column=NUM            the reference name is in column NUM (default: 1)\n"
+"  -b, --begin-column=NUM               the position is in column NUM (default: 2)\n"
+"  -e, --end-column=NUM                 the end position is in column NUM (default: none)\n"
+"      --header-lines=NUM               the first NUM lines are the header (default: 1). Lines starting\n"
+"                                       with # at the start of the file are also kept as the header\n"
+"      --one-based                      the positions are 1-based (default: 0-based)\n"
+"  -m, --memory=NUM                     sort up to NUM megabytes of input in memory at a time (default: 1024)\n"
+"  -t, --threads=NUM                    use NUM threads for compression (default: 1)\n"
+"      --tmp-prefix=STR                 write temporary files to STR.N (default: the output filename)\n"
+"\nReport bugs to " PACKAGE_BUGREPORT "\n\n";
+
+namespace opt
+{
+    static unsigned int verbose = 0;
+    static std::string input_file;
+    static std::string output_file;
+    static std::string tmp_prefix;
+    static int sequence_column = 1;
+    static int begin_column = 2;
+    static int end_column = 0;
+    static int header_lines = 1;
+    static int one_based = 0;
+    static int memory_mb = 1024;
+    static int num_threads = 1;
+}
+
+static const char* shortopts = "o:s:b:e:m:t:v";
+
+enum { OPT_HELP = 1, OPT_VERSION, OPT_HEADER_LINES, OPT_ONE_BASED, OPT_TMP_PREFIX };
+
+static const struct option longopts[] = {
+    { "verbose",          no_argument,       NULL, 'v' },
+    { "output",           required_argument, NULL, 'o' },
+    { "sequence-column",  required_argument, NULL, 's' },
+    { "begin-column",     required_argument, NULL, 'b' },
+    { "end-column",       required_argument, NULL, 'e' },
+    { "memory",           required_argument, NULL, 'm' },
+    { "threads",          required_argument, NULL, 't' },
+    { "header-lines",     required_argument, NULL, OPT_HEADER_LINES },
+    { "one-based",        no_argument,       NULL, OPT_ONE_BASED },
+    { "tmp-prefix",       required_argument, NULL, OPT_TMP_PREFIX },
+    { "help",             no_argument,       NULL, OPT_HELP },
+    { "version",          no_argument,       NULL, OPT_VERSION },
+    { NULL, 0, NULL, 0 }
+};
+
+// A line of the input and the fields it is sorted on. The reference name
+// is stored as an id into the list of names seen so far.
+struct SortLine
+{
+    uint32_t contig_id;
+    int64_t position;
+    size_t offset;
+    size_t length;
+};
+
+class SortKeyParser
+{
+    public:
+        // parse the sort fields of line, which does not include the newline
+        SortLine parse(const char* line, size_t length, size_t line_number)
+        {
+            const char* contig = NULL;
+            size_t contig_length = 0;
+            const char* position = NULL;
+
+            int column = 1;
+            const char* field = line;
+            const char* end = line + length;
+            while(field <= end && (contig == NULL || position == NULL)) {
+                const char* field_end = (const char*)memchr(field, '\t', end - field);
+                if(field_end == NULL) {
+                    field_end = end;
+                }
+
+                if(column == opt::sequence_column) {
+                    contig = field;
+                    contig_length = field_end - field;
+                }
+
+                if(column == opt::begin_column) {
+                    position = field;
+                }
+
+                field = field_end + 1;
+                column += 1;
+            }
+
+            if(contig == NULL || position == NULL) {
+                fprintf(stderr, "Error: line %zu of %s does not have enough columns\n", line_number, opt::input_file.c_str());
+                exit(EXIT_FAILURE);
+            }
+
+            SortLine out;
+            char* position_end;
+            out.position = strtoll(position, &position_end, 10);
+            if(position_end == position || (position_end != end && *position_end != '\t')) {
+                fprintf(stderr, "Error: line %zu of %s has an invalid position\n", line_number, opt::input_file.c_str());
+                exit(EXIT_FAILURE);
+            }
+
+            out.contig_id = get_contig_id(std::string(contig, contig_length));
+            out.offset = 0;
+            out.length = length;
+            return out;
+        }
+
+        // true if a sorts before b, ties are left to the caller
+        bool less(const SortLine& a, const SortLine& b) const
+        {
+            if(a.contig_id != b.contig_id) {
+                return m_names[a.contig_id] < m_names[b.contig_id];
+            }
+            return a.position < b.position;
+        }
+
+    private:
+        uint32_t get_contig_id(const std::string& name)
+        {
+            auto itr = m_ids.find(name);
+            if(itr != m_ids.end()) {
+                return itr->second;
+            }
+            uint32_t id = m_names.size();
+            m_ids.insert(std::make_pair(name, id));
+            m_names.push_back(name);
+            return id;
+        }
+
+        std::map<std::string, uint32_t> m_ids;
+        std::vector<std::string> m_names;
+};
+
+// write the lines of a chunk in sorted order
+static void write_sorted_chunk(const SortKeyParser& parser,
+                               std::vector<SortLine>& lines,
+                               const std::string& text,
+                               TextOutputFile& out)
+{
+    std::stable_sort(lines.begin(), lines.end(),
+        [&parser](const SortLine& a, const SortLine& b) { return parser.less(a, b); });
+
+    std::string buffer;
+    for(const SortLine& line : lines) {
+        buffer.append(text, line.offset, line.length);
+        buffer.push_back('\n');
+        if(buffer.size() >= 1024 * 1024) {
+            out.write(buffer);
+            buffer.clear();
+        }
+    }
+    out.write(buffer);
+}
+
+// A sorted temporary file that is read back during the merge
+struct SortedRun
+{
+    std::string filename;
+    std::unique_ptr<std::ifstream> stream;
+    std::string line;
+    SortLine key;
+    size_t line_number = 0;
+};
+
+// The temporary files that exist, so the error paths that exit()
+// can remove them as well as the normal path
+static std::vector<std::string> tmp_filenames;
+
+static void remove_tmp_files()
+{
+    for(const std::string& filename : tmp_filenames) {
+        unlink(filename.c_str());
+    }
+    tmp_filenames.clear();
+}
+
+// write a chunk as a new sorted run
+static SortedRun write_sorted_run(const SortKeyParser& parser,
+                                  std::vector<SortLine>& lines,
+                                  const std::string& text,
+                                  size_t run_idx)
+{
+    SortedRun run;
+    run.filename = opt::tmp_prefix + "." + std::to_string(run_idx) + ".tmp";
+    tmp_filenames.push_back(run.filename);
+
+    TextOutputFile tmp_out(run.filename, false);
+    write_sorted_chunk(parser, lines, text, tmp_out);
+    return run;
+}
+
+static bool read_run_line(SortKeyParser& parser, SortedRun& run)
+{
+    if(!std::getline(*run.stream, run.line)) {
+        return false;
+    }
+    run.line_number += 1;
+    run.key = parser.parse(run.line.data(), run.line.size(), run.line_number);
+    return true;
+}
+
+void parse_sort_tsv_options(int argc, char** argv)
+{
+    bool die = false;
+    for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+        std::istringstream arg(optarg != NULL ? optarg : "");
+        switch (c) {
+            case 'o': arg >> opt::output_file; break;
+            case 's': arg >> opt::sequence_column; break;
+            case 'b': arg >> opt::begin_column; break;
+            case 'e': arg >> opt::end_column; break;
+            case 'm': arg >> opt::memory_mb; break;
+            case 't': arg >> opt::num_threads; break;
+            case 'v': opt::verbose++; break;
+            case '?': die = true; break;
+            case OPT_HEADER_LINES: arg >> opt::header_lines; break;
+            case OPT_ONE_BASED: opt::one_based = 1; break;
+            case OPT_TMP_PREFIX: arg >> opt::tmp_prefix; break;
+            case OPT_HELP:
+                std::cout << SORT_TSV_USAGE_MESSAGE;
+                exit(EXIT_SUCCESS);
+            case OPT_VERSION:
+                std::cout << SORT_TSV_VERSION_MESSAGE;
+                exit(EXIT_SUCCESS);
+        }
+    }
+
+    if (argc - optind < 1) {
+        std::cerr << SUBPROGRAM ": not enough arguments\n";
+        die = true;
+    } else {
+        opt::input_file = argv[optind++];
+    }
+
+    if (argc - optind > 0) {
+        std::cerr << SUBPROGRAM ": too many arguments\n";
+        die = true;
+    }
+
+    if(opt::output_file.empty() || opt::output_file == "-") {
+        std::cerr << SUBPROGRAM ": an --output file must be provided so it can be indexed\n";
+        die = true;
+    }
+
+    if(opt::sequence_column <= 0 || opt::begin_column <= 0 || opt::end_column < 0 ||
+       opt::sequence_column == opt::begin_column) {
+        std::cerr << SUBPROGRAM ": invalid column numbers\n";
+        die = true;
+    }
+
+    if(opt::header_lines < 0) {
+        std::cerr << SUBPROGRAM ": invalid number of header lines: " << opt::header_lines << "\n";
+        die = true;
+    }
+
+    if(opt::memory_mb <= 0) {
+        std::cerr << SUBPROGRAM ": invalid memory limit: " << opt::memory_mb << "\n";
+        die = true;
+    }
+
+    if(opt::num_threads <= 0) {
+        std::cerr << SUBPROGRAM ": invalid number of threads: " << opt::num_threads << "\n";
+        die = true;
+    }
+
+    if (die)
+    {
+        std::cout << "\n" << SORT_TSV_USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+    }
+
+    if(opt::tmp_prefix.empty()) {
+        opt::tmp_prefix = opt::output_file;
+    }
+}
+
+int sort_tsv_main(int argc, char** argv)
+{
+    parse_sort_tsv_options(argc, argv);
+    init_hts_thread_pool(opt::num_threads);
+    atexit(remove_tmp_files);
+
+    // bgzf reads both plain and compressed input
+    BGZF* in = bgzf_open(opt::input_file.c_str(), "r");
+    if(in == NULL) {
+        fprintf(stderr, "Error: could not open %s for reading\n", opt::input_file.c_str());
+        exit(EXIT_FAILURE);
+    }
+    attach_hts_thread_pool(in);
+
+    SortKeyParser parser;
+    std::string header;
+    int num_header_lines = 0;
+    bool in_header = true;
+
+    // the current chunk of input
+    std::string text;
+    std::vector<SortLine> lines;
+    size_t max_chunk_bytes = (size_t)opt::memory_mb * 1024 * 1024;
+
+    std::vector<SortedRun> runs;
+    kstring_t str = { 0, 0, NULL };
+    size_t line_number = 0;
+    while(bgzf_getline(in, '\n', &str) >= 0) {
+        line_number += 1;
+
+        // the header is the first header_lines lines and any comment lines directly after them
+        if(in_header) {
+            if(num_header_lines < opt::header_lines || (str.l > 0 && str.s[0] == '#')) {
+                header.append(str.s, str.l);
+                header.push_back('\n');
+                num_header_lines += 1;
+                continue;
+            }
+            in_header = false;
+        }
+
+        if(str.l == 0) {
+            continue;
+        }
+
+        SortLine line = parser.parse(str.s, str.l, line_number);
+        line.offset = text.size();
+        lines.push_back(line);
+        text.append(str.s, str.l);
+
+        // spill the sorted chunk to a temporary file
+        if(text.size() + lines.size() * sizeof(SortLine) >= max_chunk_bytes) {
+            SortedRun run = write_sorted_run(parser, lines, text, runs.size());
+            if(opt::verbose > 0) {
+                fprintf(stderr, "[sort-tsv] wrote %zu lines to %s\n", lines.size(), run.filename.c_str());
+            }
+            runs.push_back(std::move(run));
+            lines.clear();
+            text.clear();
+        }
+    }
+    free(str.s);
+    bgzf_close(in);
+
+    TextOutputFile out(opt::output_file, true);
+    out.write(header);
+
+    if(runs.empty()) {
+        // everything fit in memory
+        write_sorted_chunk(parser, lines, text, out);
+    } else {
+        // write the last chunk as a run too, then merge all runs
+        if(!lines.empty()) {
+            runs.push_back(write_sorted_run(parser, lines, text, runs.size()));
+        }
+        lines.clear();
+        lines.shrink_to_fit();
+        text.clear();
+        text.shrink_to_fit();
+
+        // runs hold consecutive parts of the input so equal keys are taken from the earliest run
+        auto greater = [&parser, &runs](size_t a, size_t b) {
+            if(parser.less(runs[b].key, runs[a].key)) {
+                return true;
+            }
+            return !parser.less(runs[a].key, runs[b].key) && a > b;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> queue(greater);
+
+        for(size_t i = 0; i < runs.size(); ++i) {
+            runs[i].stream.reset(new std::ifstream(runs[i].filename));
+            if(!runs[i].stream->good()) {
+                fprintf(stderr, "Error: could not read temporary file %s\n", runs[i].filename.c_str());
+                exit(EXIT_FAILURE);
+            }
+
+            if(read_run_line(parser, runs[i])) {
+                queue.push(i);
+            }
+        }
+
+        std::string buffer;
+        while(!queue.empty()) {
+            size_t i = queue.top();
+            queue.pop();
+
+            buffer.append(runs[i].line);
+            buffer.push_back('\n');
+            if(buffer.size() >= 1024 * 1024) {
+                out.write(buffer);
+                buffer.clear();
+            }
+
+            if(read_run_line(parser, runs[i])) {
+                queue.push(i);
+            }
+        }
+        out.write(buffer);
+
+        for(size_t i = 0; i < runs.size(); ++i) {
+            runs[i].stream.reset();
+        }
+        remove_tmp_files();
+    }
+    out.close();
+
+    build_tabix_index(opt::output_file, opt::sequence_column, opt::begin_column, opt::end_column,
+                      !opt::one_based, num_header_lines);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,11 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+#ifndef NANOPOLISH_SORT_TSV_H
+#define NANOPOLISH_SORT_TSV_H
+
+int sort_tsv_main(int argc, char** argv);
+
+#endif
@@ -33,8 +33,41 @@ int g_failed_calibration_reads = 0;
 
 const double MIN_CALIBRATION_VAR = 2.5;
 
+// When loading a slice of a raw read the requested bases are padded by
+// RAW_SLICE_BASE_MARGIN on both sides and the estimated signal range is padded
+// by RAW_SLICE_SAMPLE_MARGIN samples. The extra events are trimmed by the banded
+// aligner, which absorbs errors in the uniform-speed estimate of the slice boundaries.
+// If the slice covers most of the read, the whole read is loaded instead.
+const int RAW_SLICE_BASE_MARGIN = 1000;
+const int RAW_SLICE_SAMPLE_MARGIN = 1000;
+const double RAW_SLICE_MAX_FRACTION = 0.5;
+
+// Scrappie event sink that writes events straight into the
+// event storage of a SquiggleRead
+struct RawEventSink
+{
+    std::vector<SquiggleEvent>* events;
+    double sample_rate;
+    int64_t first_sample_time; // in samples since the start of the experiment
+};
+
+static void emit_raw_event(void* data, size_t n_events, size_t event_idx, const event_t* event)
+{
+    RawEventSink* sink = static_cast<RawEventSink*>(data);
+    if(event_idx == 0) {
+        sink->events->resize(n_events);
+    }
+
+    double start_time = (sink->first_sample_time + event->start) / sink->sample_rate;
+    float length_in_seconds = event->length / sink->sample_rate;
+    (*sink->events)[event_idx] = { event->mean, event->stdv, start_time, length_in_seconds, logf(event->stdv) };
+}
+
 //
-SquiggleRead::SquiggleRead(const std::string& name, const ReadDB& read_db, const uint32_t flags) :
+SquiggleRead::SquiggleRead(const std::string& name,
+                           const ReadDB& read_db,
+                           const uint32_t flags,
+                           const IndexPair& base_range) :
     read_name(name),
     pore_type(PT_UNKNOWN),
     drift_correction_performed(false),
@@ -43,14 +76,19 @@ SquiggleRead::SquiggleRead(const std::string& name, const ReadDB& read_db, const
     this->events_per_base[0] = events_per_base[1] = 0.0f;
     this->fast5_path = read_db.get_signal_path(this->read_name);
 
+    // the basecalls come from the faidx pool, which is threadsafe on its own,
+    // so fetch them before taking the HDF5 lock
+    bool is_event_read = is_extract_read_name(this->read_name);
+    if(!is_event_read) {
+        this->read_sequence = read_db.get_read_sequence(read_name);
+    }
+
     #pragma omp critical(sr_load_fast5)
     {
-        bool is_event_read = is_extract_read_name(this->read_name);
         if(is_event_read) {
             load_from_events(flags);
         } else {
-            this->read_sequence = read_db.get_read_sequence(read_name);
-            load_from_raw(flags);
+            load_from_raw(flags, base_range);
         }
         
         // perform drift correction and other scalings
@@ -63,6 +101,18 @@ SquiggleRead::~SquiggleRead()
 
 }
 
+size_t SquiggleRead::get_memory_usage() const
+{
+    size_t bytes = sizeof(SquiggleRead);
+    bytes += read_name.capacity() + fast5_path.capacity() + read_sequence.capacity() + basecall_group.capacity();
+    bytes += samples.capacity() * sizeof(float);
+    bytes += base_to_event_map.capacity() * sizeof(EventRangeForBase);
+    for(size_t si = 0; si < 2; ++si) {
+        bytes += events[si].capacity() * sizeof(SquiggleEvent);
+    }
+    return bytes;
+}
+
 // helper for get_closest_event_to
 int SquiggleRead::get_next_event(int start, int stop, int stride, uint32_t strand) const
 {
@@ -190,7 +240,7 @@ void SquiggleRead::load_from_events(const uint32_t flags)
     }
 
     // Load raw samples if requested
-    if(flags & SRF_LOAD_RAW_SAMPLES) {
+    if(flags & (SRF_LOAD_RAW_SAMPLES | SRF_LOAD_SAMPLE_TIMES)) {
 
         auto& sample_read_names = f_p->get_raw_samples_read_name_list();
         if(sample_read_names.empty()) {
@@ -201,7 +251,9 @@ void SquiggleRead::load_from_events(const uint32_t flags)
         // we assume the first raw sample read is the one we're after
         std::string sample_read_name = sample_read_names.front();
 
-        samples = f_p->get_raw_samples(sample_read_name);
+        if(flags & SRF_LOAD_RAW_SAMPLES) {
+            samples = f_p->get_raw_samples(sample_read_name);
+        }
         sample_start_time = f_p->get_raw_samples_params(sample_read_name).start_time;
 
         // retreive parameters
@@ -221,7 +273,7 @@ void SquiggleRead::load_from_events(const uint32_t flags)
 }
 
 //
-void SquiggleRead::load_from_raw(const uint32_t flags)
+void SquiggleRead::load_from_raw(const uint32_t flags, const IndexPair& base_range)
 {
     // File not in db, can't load
     if(this->fast5_path == "" || this->read_sequence == "") {
@@ -251,29 +303,62 @@ void SquiggleRead::load_from_raw(const uint32_t flags)
     }
 
     // we assume the first raw sample read is the one we're after
+    // the samples are read directly into the member buffer, which scrappie's event
+    // detector reads in place. The buffer is released after event detection unless
+    // the caller asked to keep the raw samples.
     std::string sample_read_name = sample_read_names.front();
-    std::vector<float> samples = f_p->get_raw_samples(sample_read_name);
-    
-    // convert samples to scrappie's format (for event detection)
-    raw_table rt;
-    rt.n = samples.size();
-    rt.start = 0;
-    rt.end = samples.size() - 1;
-    rt.raw = (float*)malloc(sizeof(float) * samples.size());
-    for(size_t i = 0; i < samples.size(); ++i) {
-        rt.raw[i] = samples[i];
+    this->samples = f_p->get_raw_samples(sample_read_name);
+    this->sample_start_time = f_p->get_raw_samples_params(sample_read_name).start_time;
+
+    // Determine which part of the signal to segment into events. By default this is
+    // the entire read. If only a range of bases is needed we estimate the signal that
+    // covers them by assuming the read moved through the pore at a uniform speed.
+    size_t slice_sample_start = 0;
+    size_t slice_sample_end = this->samples.size();
+    size_t slice_base_start = 0;
+    size_t slice_base_end = this->read_sequence.size();
+
+    bool is_slice = false;
+    if(base_range.start != -1 && base_range.stop != -1) {
+        int read_length = this->read_sequence.size();
+        int b0 = std::max(base_range.start - RAW_SLICE_BASE_MARGIN, 0);
+        int b1 = std::min(base_range.stop + 1 + RAW_SLICE_BASE_MARGIN, read_length);
+
+        if(b1 - b0 >= 2 * (int)k && b1 - b0 < RAW_SLICE_MAX_FRACTION * read_length) {
+            double samples_per_base = (double)this->samples.size() / read_length;
+            int64_t s0 = (int64_t)(b0 * samples_per_base) - RAW_SLICE_SAMPLE_MARGIN;
+            int64_t s1 = (int64_t)(b1 * samples_per_base) + RAW_SLICE_SAMPLE_MARGIN;
+
+            slice_sample_start = std::max(s0, (int64_t)0);
+            slice_sample_end = std::min(s1, (int64_t)this->samples.size());
+            slice_base_start = b0;
+            slice_base_end = b1;
+            is_slice = true;
+        }
     }
 
-    // trim using scrappie's internal method
-    // parameters taken directly from scrappie defaults
-    int trim_start = 200;
-    int trim_end = 10;
-    int varseg_chunk = 100;
-    float varseg_thresh = 0.0;
-    trim_and_segment_raw(rt, trim_start, trim_end, varseg_chunk, varseg_thresh);
-    event_table et = detect_events(rt, event_detection_defaults);
+    // the part of the read sequence that the events will be aligned to
+    std::string slice_sequence = is_slice ? this->read_sequence.substr(slice_base_start, slice_base_end - slice_base_start)
+                                          : this->read_sequence;
+
+    // wrap the sample buffer in scrappie's format (for event detection), without copying
+    raw_table rt;
+    rt.n = slice_sample_end - slice_sample_start;
+    rt.start = 0;
+    rt.end = rt.n - 1;
+    rt.raw = this->samples.data() + slice_sample_start;
     assert(rt.n > 0);
-    assert(et.n > 0);
+
+    // detect events, writing them directly into nanopolish's format
+    // event times are in the same units as the fast5 event tables: seconds since
+    // the start of the experiment, so events map back to sample indices exactly
+    RawEventSink sink = { &this->events[strand_idx], this->sample_rate, this->sample_start_time + (int64_t)slice_sample_start };
+    size_t n_events = detect_events_to_sink(rt, event_detection_defaults, emit_raw_event, &sink);
+    assert(n_events > 0);
+
+    if( (flags & SRF_LOAD_RAW_SAMPLES) == 0) {
+        std::vector<float>().swap(this->samples);
+    }
     
     // Load pore model and scale to events using method-of-moments
     this->pore_model[strand_idx] = PoreModelSet::get_model(kit,
@@ -281,9 +366,9 @@ void SquiggleRead::load_from_raw(const uint32_t flags)
                                                            strand_str,
                                                            6);
     double shift, scale;
-    estimate_scalings_using_mom(this->read_sequence,
+    estimate_scalings_using_mom(slice_sequence,
                                 this->pore_model[strand_idx],
-                                et,
+                                this->events[strand_idx],
                                 shift,
                                 scale);
     
@@ -294,30 +379,28 @@ void SquiggleRead::load_from_raw(const uint32_t flags)
     this->pore_model[strand_idx].var = 1.0f;
     transform();
     this->pore_model[strand_idx].bake_gaussian_parameters();
-    
-    // copy events into nanopolish's format
-    this->events[strand_idx].resize(et.n);
-    double start_time = 0;
-    for(size_t i = 0; i < et.n; ++i) {
-        float length_in_seconds = et.event[i].length / this->sample_rate;
-        this->events[strand_idx][i] = { et.event[i].mean, et.event[i].stdv, start_time, length_in_seconds, logf(et.event[i].stdv) };
-        start_time += length_in_seconds;
-    }
-
-    // clean up scrappie raw and event tables
-    assert(rt.raw != NULL);
-    assert(et.event != NULL);
-    free(rt.raw);
-    free(et.event);
 
     // align events to the basecalled read
-    std::vector<AlignedPair> event_alignment = banded_simple_event_align(*this, read_sequence);
+    std::vector<AlignedPair> event_alignment = banded_simple_event_align(*this, slice_sequence);
+
+    // If the estimate of the slice boundaries was too poor to align,
+    // discard the slice and fall back to loading the entire read
+    if(is_slice && event_alignment.empty()) {
+        this->events[strand_idx].clear();
+        std::vector<float>().swap(this->samples);
+        delete f_p;
+        f_p = nullptr;
+        load_from_raw(flags, IndexPair());
+        return;
+    }
 
     // transform alignment into the base-to-event map
     if(event_alignment.size() > 0) {
 
         // create base-to-event map
+        // the map always covers the full read sequence, kmers outside the slice have no events
         size_t n_kmers = read_sequence.size() - k + 1;
+        size_t n_slice_kmers = slice_sequence.size() - k + 1;
         this->base_to_event_map.clear();
         this->base_to_event_map.resize(n_kmers);
 
@@ -327,7 +410,7 @@ void SquiggleRead::load_from_raw(const uint32_t flags)
         size_t prev_event_idx = -1;
         for(size_t i = 0; i < event_alignment.size(); ++i) {
 
-            size_t k_idx = event_alignment[i].ref_pos;
+            size_t k_idx = event_alignment[i].ref_pos + slice_base_start;
             size_t event_idx = event_alignment[i].read_pos;
             IndexPair& elem = this->base_to_event_map[k_idx].indices[strand_idx];
             if(event_idx != prev_event_idx) {
@@ -342,7 +425,7 @@ void SquiggleRead::load_from_raw(const uint32_t flags)
             prev_event_idx = event_idx;
         }
 
-        events_per_base[strand_idx] = (double)(max_event - min_event) / n_kmers;
+        events_per_base[strand_idx] = (double)(max_event - min_event) / n_slice_kmers;
         
         // prepare data structures for the final calibration
         std::vector<EventAlignment> alignment =
@@ -360,7 +443,7 @@ void SquiggleRead::load_from_raw(const uint32_t flags)
         // run recalibration to get the best set of scaling parameters and the residual
         // between the (scaled) event levels and the model.
         // internally this function will set shift/scale/etc of the pore model
-        bool calibrated = recalibrate_model(*this, strand_idx, alignment, this->pore_model[strand_idx].pmalphabet, true, false);
+        bool calibrated = recalibrate_model(*this, strand_idx, alignment, true, false);
 
 #ifdef DEBUG_MODEL_SELECTION
         fprintf(stderr, "[calibration] read: %s"
@@ -491,6 +574,10 @@ void SquiggleRead::_load_R9(uint32_t si,
     double p_model_state_threshold = sorted_p_model_states[sorted_p_model_states.size() * (1 - keep_fraction)];
 
     std::string blacklist_kmer = "CCTAG";
+    const Alphabet* alphabet = pore_model[si].pmalphabet;
+    bool use_blacklist = blacklist_kmer.size() == calibration_k;
+    uint32_t blacklist_rank = use_blacklist ? alphabet->kmer_rank(blacklist_kmer.c_str(), calibration_k) : 0;
+    uint32_t rc_blacklist_rank = use_blacklist ? alphabet->kmer_rank(alphabet->reverse_complement(blacklist_kmer).c_str(), calibration_k) : 0;
     std::vector<EventAlignment> filtered;
     filtered.reserve(alignment.size());
 
@@ -499,17 +586,18 @@ void SquiggleRead::_load_R9(uint32_t si,
     // This vector tracks the number of events observed (by the basecaller) for each kmer
     std::vector<size_t> event_counts;
     event_counts.reserve(read_sequence_1d.length());
-    std::string prev_kmer = "";
+    uint32_t prev_kmer_rank = EVENT_ALIGNMENT_NO_KMER;
 
     for(const auto& ea : alignment) {
-        if((!ea.rc && ea.ref_kmer == blacklist_kmer) ||
-           (ea.rc && ea.ref_kmer == gDNAAlphabet.reverse_complement(blacklist_kmer)))
+        if(use_blacklist &&
+           ((!ea.rc && ea.ref_kmer_rank == blacklist_rank) ||
+            (ea.rc && ea.ref_kmer_rank == rc_blacklist_rank)))
         {
             continue;
         }
 
-        if(ea.ref_kmer != prev_kmer) {
-            prev_kmer = ea.ref_kmer;
+        if(ea.ref_kmer_rank != prev_kmer_rank) {
+            prev_kmer_rank = ea.ref_kmer_rank;
             event_counts.push_back(1);
         } else {
             assert(!event_counts.empty());
@@ -580,7 +668,7 @@ void SquiggleRead::_load_R9(uint32_t si,
 
             // run recalibration to get the best set of scaling parameters and the residual
             // between the (scaled) event levels and the model
-            bool calibrated = recalibrate_model(*this, si, filtered, pore_model[si].pmalphabet, true, false);
+            bool calibrated = recalibrate_model(*this, si, filtered, true, false);
             if(calibrated) {
                 if(pore_model[si].var < best_model_var) {
                     best_model_var = pore_model[si].var;
@@ -1025,7 +1113,8 @@ void SquiggleRead::replace_strand_model(size_t strand_idx, const std::string& ki
         return;
     }
 
-    PoreModel incoming_model =
+    // the states of the model in the set are shared with the read, not copied
+    const PoreModel& incoming_model =
         PoreModelSet::get_model(kit_name,
                                 alphabet,
                                 this->pore_model[strand_idx].metadata.get_strand_model_name(),
@@ -1092,19 +1181,19 @@ std::vector<EventAlignment> SquiggleRead::get_eventalignment_for_1d_basecalls(co
             assert(event_idx < this->events[strand_idx].size());
 
             // since we use the 1D read seqence here we never have to reverse complement
-            std::string kmer = read_sequence_1d.substr(ki + shift_offset, k);
-            size_t kmer_rank = alphabet->kmer_rank(kmer.c_str(), k);
+            size_t kmer_rank = alphabet->kmer_rank(read_sequence_1d.c_str() + ki + shift_offset, k);
 
             EventAlignment ea;
             // ref data
-            //ea.ref_name = "read";
+            ea.ref_contig_id = -1; // not needed
             ea.read_idx = -1; // not needed
-            ea.ref_kmer = kmer;
+            ea.ref_kmer_rank = kmer_rank;
             ea.ref_position = ki;
+            ea.k = k;
             ea.strand_idx = strand_idx;
             ea.event_idx = event_idx;
             ea.rc = false;
-            ea.model_kmer = kmer;
+            ea.model_kmer_rank = kmer_rank;
             ea.hmm_state = prev_kmer_rank != kmer_rank ? 'M' : 'E';
             alignment.push_back(ea);
             prev_kmer_rank = kmer_rank;
@@ -1121,26 +1210,42 @@ size_t SquiggleRead::get_sample_index_at_time(size_t sample_time) const
 
 //
 std::vector<float> SquiggleRead::get_scaled_samples_for_event(size_t strand_idx, size_t event_idx) const
+{
+    size_t start_idx;
+    size_t end_idx;
+    get_sample_range_for_event(strand_idx, event_idx, start_idx, end_idx);
+
+    std::vector<float> out;
+    append_scaled_samples(strand_idx, start_idx, end_idx, out);
+    return out;
+}
+
+void SquiggleRead::get_sample_range_for_event(size_t strand_idx, size_t event_idx, size_t& start_idx, size_t& end_idx) const
 {
     double event_start_time = this->events[strand_idx][event_idx].start_time;
     double event_duration = this->events[strand_idx][event_idx].duration;
 
-    size_t start_idx = this->get_sample_index_at_time(event_start_time * this->sample_rate);
-    size_t end_idx = this->get_sample_index_at_time((event_start_time + event_duration) * this->sample_rate);
+    start_idx = this->get_sample_index_at_time(event_start_time * this->sample_rate);
+    end_idx = this->get_sample_index_at_time((event_start_time + event_duration) * this->sample_rate);
+}
 
-    std::vector<float> out;
+void SquiggleRead::append_scaled_samples(size_t strand_idx, size_t start_idx, size_t end_idx, std::vector<float>& out) const
+{
+    assert(end_idx <= this->samples.size());
+
+    // the drift is applied per second since the start of the read. The arithmetic
+    // is kept in this order so the output matches earlier versions exactly.
+    const PoreModel& model = this->pore_model[strand_idx];
+    double read_start_time = this->sample_start_time / this->sample_rate;
+
+    out.reserve(out.size() + (end_idx - start_idx));
     for(size_t i = start_idx; i < end_idx; ++i) {
         double curr_sample_time = (this->sample_start_time + i) / this->sample_rate;
-        //fprintf(stderr, "event_start: %.5lf sample start: %.5lf curr: %.5lf rate: %.2lf\n", event_start_time, this->sample_start_time / this->sample_rate, curr_sample_time, this->sample_rate);
-        double s = this->samples[i];
-        // apply scaling corrections
-        double scaled_s = s - this->pore_model[strand_idx].shift;
-        assert(curr_sample_time >= (this->sample_start_time / this->sample_rate));
-        scaled_s -= (curr_sample_time - (this->sample_start_time / this->sample_rate)) * this->pore_model[strand_idx].drift;
-        scaled_s /= this->pore_model[strand_idx].scale;
+        double scaled_s = this->samples[i] - model.shift;
+        scaled_s -= (curr_sample_time - read_start_time) * model.drift;
+        scaled_s /= model.scale;
         out.push_back(scaled_s);
     }
-    return out;
 }
 
 void SquiggleRead::detect_pore_type()
@@ -36,7 +36,8 @@ enum SquiggleReadType
 enum SquiggleReadFlags
 {
     SRF_NO_MODEL = 1, // do not load a model
-    SRF_LOAD_RAW_SAMPLES = 2
+    SRF_LOAD_RAW_SAMPLES = 2,
+    SRF_LOAD_SAMPLE_TIMES = 4 // load the sample rate and start time, but not the samples
 };
 
 // The raw event data for a read
@@ -69,7 +70,15 @@ class SquiggleRead
     public:
 
         SquiggleRead() : drift_correction_performed(false) {} // legacy TODO remove
-        SquiggleRead(const std::string& name, const ReadDB& read_db, const uint32_t flags = 0);
+        // If base_range is set, only the part of the raw signal estimated to cover
+        // these bases of the read sequence is event detected and aligned. The events
+        // of such a read are detected from the slice, so their indices are not the
+        // indices a whole-read load would give. Callers that output event indices
+        // must load the whole read.
+        SquiggleRead(const std::string& name,
+                     const ReadDB& read_db,
+                     const uint32_t flags = 0,
+                     const IndexPair& base_range = IndexPair());
         ~SquiggleRead();
 
         //
@@ -158,6 +167,9 @@ class SquiggleRead
         // returns true if this read has events for this strand
         bool has_events_for_strand(size_t strand_idx) const { return !this->events[strand_idx].empty(); }
 
+        // approximate number of bytes used by this read and its data
+        size_t get_memory_usage() const;
+
         // Create an eventalignment between the events of this read and its 1D basecalled sequence
         std::vector<EventAlignment> get_eventalignment_for_1d_basecalls(const std::string& read_sequence_1d,
                                                                         const std::vector<EventRangeForBase>& base_to_event_map_1d, 
@@ -169,6 +181,13 @@ class SquiggleRead
         size_t get_sample_index_at_time(size_t sample_time) const;
         std::vector<float> get_scaled_samples_for_event(size_t strand_idx, size_t event_idx) const;
 
+        // the raw samples [start_idx, end_idx) of an event, as indices into the raw signal of the read.
+        // This only needs the sample rate and start time so the samples do not have to be loaded.
+        void get_sample_range_for_event(size_t strand_idx, size_t event_idx, size_t& start_idx, size_t& end_idx) const;
+
+        // append the raw samples [start_idx, end_idx) to out, scaled to the pore model of the strand
+        void append_scaled_samples(size_t strand_idx, size_t start_idx, size_t end_idx, std::vector<float>& out) const;
+
         // print the scaling parameters for this strand
         void print_scaling_parameters(FILE* fp, size_t strand_idx) const
         {
@@ -222,8 +241,9 @@ class SquiggleRead
         // Load all read data from events in a fast5 file
         void load_from_events(const uint32_t flags);
 
-        // Load all read data from raw samples
-        void load_from_raw(const uint32_t flags);
+        // Load all read data from raw samples, optionally restricted
+        // to the signal covering a range of read bases
+        void load_from_raw(const uint32_t flags, const IndexPair& base_range);
 
         // Version-specific intialization functions
         void _load_R7(uint32_t si);
@@ -0,0 +1,66 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_squiggle_read_cache -- a memory-capped,
+// least-recently-used cache of loaded SquiggleReads
+//
+#include <assert.h>
+#include "nanopolish_squiggle_read_cache.h"
+
+std::shared_ptr<SquiggleRead> SquiggleReadCache::get(const std::string& key,
+                                                     const std::function<SquiggleRead*()>& load)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto itr = m_entries.find(key);
+        if(itr != m_entries.end()) {
+            m_hits += 1;
+            m_lru.splice(m_lru.begin(), m_lru, itr->second.lru_itr);
+            return itr->second.read;
+        }
+        m_misses += 1;
+    }
+
+    std::shared_ptr<SquiggleRead> read(load());
+    size_t bytes = read->get_memory_usage();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // another thread may have loaded this read while we were, keep its copy
+    auto itr = m_entries.find(key);
+    if(itr != m_entries.end()) {
+        return itr->second.read;
+    }
+
+    // reads that can never fit are not cached
+    if(bytes <= m_max_bytes) {
+        m_lru.push_front(key);
+        m_entries[key] = { read, m_lru.begin(), bytes };
+        m_bytes += bytes;
+        _evict();
+    }
+    return read;
+}
+
+void SquiggleReadCache::_evict()
+{
+    while(m_bytes > m_max_bytes && !m_lru.empty()) {
+        auto itr = m_entries.find(m_lru.back());
+        assert(itr != m_entries.end());
+        m_bytes -= itr->second.bytes;
+        m_entries.erase(itr);
+        m_lru.pop_back();
+        m_evictions += 1;
+    }
+}
+
+void SquiggleReadCache::print_stats(FILE* fp) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t lookups = m_hits + m_misses;
+    fprintf(fp, "[read cache] %zu lookups, %zu hits (%.1lf%%), %zu misses, %zu evictions, %zu reads (%.1lfMB) cached\n",
+        lookups, m_hits, lookups > 0 ? 100.0 * m_hits / lookups : 0.0,
+        m_misses, m_evictions, m_entries.size(), m_bytes / (1024.0 * 1024.0));
+}
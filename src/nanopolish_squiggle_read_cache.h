@@ -0,0 +1,65 @@
+//---------------------------------------------------------
+// Copyright 2026 agent
+// Written by agent (agent@local)
+//---------------------------------------------------------
+//
+// nanopolish_squiggle_read_cache -- a memory-capped,
+// least-recently-used cache of loaded SquiggleReads
+// that can be shared between threads. Reads are
+// handed out as shared_ptrs so a read that is evicted
+// while in use stays valid until its last user is done.
+//
+#ifndef NANOPOLISH_SQUIGGLE_READ_CACHE_H
+#define NANOPOLISH_SQUIGGLE_READ_CACHE_H
+
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include <stdio.h>
+#include "nanopolish_squiggle_read.h"
+
+class SquiggleReadCache
+{
+    public:
+        SquiggleReadCache(size_t max_bytes) : m_max_bytes(max_bytes) {}
+
+        // Return the read stored under key, calling load() to construct it
+        // if it is not in the cache. The key must identify everything that
+        // affects the loaded read, like the read name and model options.
+        // The lock is not held while loading so other threads can use the cache.
+        std::shared_ptr<SquiggleRead> get(const std::string& key,
+                                          const std::function<SquiggleRead*()>& load);
+
+        // write the number of hits, misses and evictions to fp
+        void print_stats(FILE* fp) const;
+
+    private:
+
+        struct CacheEntry
+        {
+            std::shared_ptr<SquiggleRead> read;
+            std::list<std::string>::iterator lru_itr;
+            size_t bytes;
+        };
+
+        // remove the least recently used reads until the cache fits in m_max_bytes
+        void _evict();
+
+        size_t m_max_bytes;
+        size_t m_bytes = 0;
+
+        // most recently used key at the front
+        std::list<std::string> m_lru;
+        std::unordered_map<std::string, CacheEntry> m_entries;
+
+        size_t m_hits = 0;
+        size_t m_misses = 0;
+        size_t m_evictions = 0;
+
+        mutable std::mutex m_mutex;
+};
+
+#endif
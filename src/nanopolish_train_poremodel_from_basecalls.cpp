@@ -132,9 +132,7 @@ PoreModel initialize_pore_model(const std::vector<KmerTrainingData>& read_traini
 
     // Set the initial pore model
     PoreModel pore_model(k);
-    pore_model.states.resize(num_kmers_in_alphabet);
-    pore_model.scaled_states.resize(num_kmers_in_alphabet);
-    pore_model.scaled_params.resize(num_kmers_in_alphabet);
+    std::vector<PoreModelStateParams> states(num_kmers_in_alphabet);
 
     pore_model.shift = 0.0;
     pore_model.scale = 1.0;
@@ -168,16 +166,17 @@ PoreModel initialize_pore_model(const std::vector<KmerTrainingData>& read_traini
                 median = values[n/2];
             }
 
-            pore_model.states[ki].level_mean = median;
-            pore_model.states[ki].level_stdv = 1.0;
-            pore_model.states[ki].sd_mean = 0.0;
-            pore_model.states[ki].sd_stdv = 0.0;
-            pore_model.states[ki].sd_lambda = 0.0;
-            pore_model.states[ki].update_logs();
+            states[ki].level_mean = median;
+            states[ki].level_stdv = 1.0;
+            states[ki].sd_mean = 0.0;
+            states[ki].sd_stdv = 0.0;
+            states[ki].sd_lambda = 0.0;
+            states[ki].update_logs();
 
             printf("k: %zu median: %.2lf values: %s\n", ki, median, ss.str().c_str());
         }
     }
+    pore_model.set_states(states);
     pore_model.bake_gaussian_parameters();
 
     return pore_model;
@@ -191,7 +190,8 @@ void alignment_to_training_data(const SquiggleRead* read,
                                 FILE* tsv_writer)
 {
     for(auto const& a : alignment) {
-        size_t kmer_rank = gDNAAlphabet.kmer_rank(a.model_kmer.c_str(), k);
+        size_t kmer_rank = a.model_kmer_rank;
+        assert(a.k == k);
         assert(kmer_rank < out_data->size());
         assert(a.strand_idx == 0);
         assert(a.event_idx < read->events[a.strand_idx].size());
@@ -207,7 +207,8 @@ void alignment_to_training_data(const SquiggleRead* read,
         }
 
         if(tsv_writer) {
-            fprintf(tsv_writer, "%zu\t%s\t%.2lf\t%.5lf\n", read_idx, a.model_kmer.c_str(), level, read->events[a.strand_idx][a.event_idx].duration);
+            std::string model_kmer = get_event_alignment_kmer(a, &gDNAAlphabet, true);
+            fprintf(tsv_writer, "%zu\t%s\t%.2lf\t%.5lf\n", read_idx, model_kmer.c_str(), level, read->events[a.strand_idx][a.event_idx].duration);
         }
     }
 }
@@ -291,7 +292,7 @@ int train_poremodel_from_basecalls_main(int argc, char** argv)
         for(size_t kmer_idx = 0; kmer_idx < num_kmers_in_alphabet; ++kmer_idx) {
 
             // untrained kmers have a mean of 0.0
-            trained_kmers[kmer_idx] = current_pore_model.states[kmer_idx].level_mean > 1.0;
+            trained_kmers[kmer_idx] = current_pore_model.get_parameters(kmer_idx).level_mean > 1.0;
             num_trained += trained_kmers[kmer_idx];
         }
 
@@ -317,8 +318,7 @@ int train_poremodel_from_basecalls_main(int argc, char** argv)
             // filter the alignment to only contain k-mers that have a distribution
             std::vector<EventAlignment> filtered_alignment;
             for(size_t i = 0; i < alignment.size(); ++i) {
-                size_t kmer_rank = gDNAAlphabet.kmer_rank(alignment[i].model_kmer.c_str(), basecalled_k);
-                if(trained_kmers[kmer_rank]) {
+                if(trained_kmers[alignment[i].model_kmer_rank]) {
                     filtered_alignment.push_back(alignment[i]);
                 }
             }
@@ -327,7 +327,6 @@ int train_poremodel_from_basecalls_main(int argc, char** argv)
             recalibrate_model(*read, 
                               training_strand,
                               filtered_alignment,
-                              &gDNAAlphabet,
                               false, true);
         
             const PoreModel& read_model = read->pore_model[training_strand];
@@ -369,6 +368,7 @@ int train_poremodel_from_basecalls_main(int argc, char** argv)
         // Train new gaussians for each k-mer
         model_kmer = std::string(basecalled_k, 'A');
         PoreModel new_pore_model = current_pore_model;
+        std::vector<PoreModelStateParams> new_states = new_pore_model.get_states();
         for(size_t kmer_idx = 0; kmer_idx < num_kmers_in_alphabet; kmer_idx++) {
 
             // we use the gaussian mixture machinery but only fit one component in the case
@@ -384,10 +384,11 @@ int train_poremodel_from_basecalls_main(int argc, char** argv)
             input_mixture.params.push_back(initial_params);
                
             ParamMixture trained_mixture = train_gaussian_mixture(kmer_training_data[kmer_idx], input_mixture);
-            new_pore_model.states[kmer_idx] = trained_mixture.params[0];
-            new_pore_model.states[kmer_idx].level_stdv = 1.5;
+            new_states[kmer_idx] = trained_mixture.params[0];
+            new_states[kmer_idx].level_stdv = 1.5;
             gDNAAlphabet.lexicographic_next(model_kmer);
         }
+        new_pore_model.set_states(new_states);
         new_pore_model.bake_gaussian_parameters();
         current_pore_model = new_pore_model;
     }
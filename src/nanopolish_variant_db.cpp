@@ -129,8 +129,9 @@ const std::vector<Variant> VariantGroup::get_variants(const VariantCombination&
 
 size_t VariantGroup::add_combination(const VariantCombination& vc)
 {
+    // the score matrix is sized by the number of combinations
+    assert(m_scores.empty());
     m_combinations.push_back(vc);
-    m_scores.resize(m_combinations.size());
     return m_combinations.size() - 1;
 }
 
@@ -150,33 +151,27 @@ std::string VariantGroup::get_vc_allele_string(size_t idx) const
     return out.substr(0, out.size() - 1);
 }
 
-void VariantGroup::set_combination_read_score(size_t combination_idx, const std::string& read_id, double score)
+void VariantGroup::set_reads(const std::vector<std::string>& read_ids)
 {
-    assert(combination_idx < m_scores.size());
-    m_scores[combination_idx][read_id] = score;
-
-    auto itr = m_read_score_sum.find(read_id);
-
-    if(itr == m_read_score_sum.end()) {
-        m_read_score_sum[read_id] = score;
-    } else {
-        itr->second = add_logs(itr->second, score);
-    }
+    m_read_ids = read_ids;
+    std::sort(m_read_ids.begin(), m_read_ids.end());
+    m_read_ids.erase(std::unique(m_read_ids.begin(), m_read_ids.end()), m_read_ids.end());
+    m_scores.assign(m_read_ids.size() * m_combinations.size(), -INFINITY);
 }
 
-double VariantGroup::get_combination_read_score(size_t combination_idx, const std::string& read_id) const
+size_t VariantGroup::find_read(const std::string& read_id) const
 {
-    assert(combination_idx < m_scores.size());
-    const auto& itr = m_scores[combination_idx].find(read_id);
-    assert(itr != m_scores[combination_idx].end());
-    return itr->second;
+    auto itr = std::lower_bound(m_read_ids.begin(), m_read_ids.end(), read_id);
+    return itr != m_read_ids.end() && *itr == read_id ? itr - m_read_ids.begin() : npos;
 }
 
-std::vector<std::pair<std::string, double>> VariantGroup::get_read_sum_scores() const
+std::vector<double> VariantGroup::get_read_sum_scores() const
 {
-    std::vector<std::pair<std::string, double>> out;
-    for(const auto& itr : m_read_score_sum) {
-        out.push_back(std::make_pair(itr.first, itr.second));
+    std::vector<double> out(m_read_ids.size(), -INFINITY);
+    for(size_t ri = 0; ri < m_read_ids.size(); ++ri) {
+        for(size_t ci = 0; ci < m_combinations.size(); ++ci) {
+            out[ri] = add_logs(out[ri], get_combination_read_score(ci, ri));
+        }
     }
     return out;
 }
@@ -107,22 +107,43 @@ class VariantGroup
         size_t get_num_combinations() const { return m_combinations.size(); }
         std::string get_vc_allele_string(size_t idx) const;
 
-        // Set the score computed by the HMM for a variant combination for a single read
-        void set_combination_read_score(size_t combination_idx, const std::string& read_id, double score);
-        double get_combination_read_score(size_t combination_idx, const std::string& read_id) const;
-
-        // Return the IDs and sum scores of all reads used in this group
-        std::vector<std::pair<std::string, double>> get_read_sum_scores() const;
+        // Set the reads that will be scored against the variant combinations. The read IDs
+        // are interned to dense indices (in sorted order) and storage for a read x combination
+        // score matrix is allocated. Must be called after all combinations have been added.
+        void set_reads(const std::vector<std::string>& read_ids);
+        size_t get_num_reads() const { return m_read_ids.size(); }
+        const std::string& get_read_id(size_t read_idx) const { return m_read_ids[read_idx]; }
+
+        // Return the index of a read, or npos if the read was not used in this group
+        size_t find_read(const std::string& read_id) const;
+        static const size_t npos = -1;
+
+        // Set the score computed by the HMM for a variant combination for a single read.
+        // Different threads may set scores concurrently without locking.
+        void set_combination_read_score(size_t combination_idx, size_t read_idx, double score)
+        {
+            assert(combination_idx < m_combinations.size() && read_idx < m_read_ids.size());
+            m_scores[read_idx * m_combinations.size() + combination_idx] = score;
+        }
+
+        double get_combination_read_score(size_t combination_idx, size_t read_idx) const
+        {
+            assert(combination_idx < m_combinations.size() && read_idx < m_read_ids.size());
+            return m_scores[read_idx * m_combinations.size() + combination_idx];
+        }
+
+        // Return the sum of the scores over all combinations for each read, indexed by read
+        std::vector<double> get_read_sum_scores() const;
 
     private:
 
         VariantGroupID m_group_id;
         std::vector<Variant> m_variants;
-
-        typedef std::map<std::string, double> ReadScoreMap;
         std::vector<VariantCombination> m_combinations;
-        std::vector<ReadScoreMap> m_scores;
-        std::map<std::string, double> m_read_score_sum;
+
+        // read x combination scores, row-major
+        std::vector<std::string> m_read_ids;
+        std::vector<double> m_scores;
 };
 
 class VariantDB
@@ -11,6 +11,8 @@
 #include <array>
 #include <vector>
 #include <random>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "logsum.h"
 #include "catch.hpp"
@@ -19,6 +21,12 @@
 #include "nanopolish_emissions.h"
 #include "nanopolish_profile_hmm.h"
 #include "nanopolish_variant_db.h"
+#include "nanopolish_fast_format.h"
+#include "nanopolish_eventalign_aggregate.h"
+#include "nanopolish_packed_reference.h"
+#include "nanopolish_eventalign.h"
+#include "nanopolish_eventalign_binary.h"
+#include "htslib/faidx.h"
 #include "training_core.hpp"
 #include "invgauss.hpp"
 #include "logger.hpp"
@@ -68,6 +76,7 @@ TEST_CASE( "alphabet", "[alphabet]" ) {
         int rank_diff = mc_alphabet.kmer_rank(next.c_str(), k) - 
                         mc_alphabet.kmer_rank(kmer.c_str(), k);
         REQUIRE( rank_diff == 1);
+        REQUIRE( mc_alphabet.kmer_from_rank(mc_alphabet.kmer_rank(next.c_str(), k), k) == next );
         kmer = next;
     }
     REQUIRE(kmer == "TTT");
@@ -242,6 +251,7 @@ TEST_CASE( "string functions", "[string_functions]" ) {
     REQUIRE( dna_alphabet.kmer_rank("AAAAA", 5) == 0 );
     REQUIRE( dna_alphabet.kmer_rank("GATGA", 5) == 568 );
     REQUIRE( dna_alphabet.kmer_rank("TTTTT", 5) == 1023 );
+    REQUIRE( dna_alphabet.kmer_from_rank(568, 5) == "GATGA" );
 
     // lexicographic increment
     std::string str = "AAAAA";
@@ -263,6 +273,331 @@ TEST_CASE( "string functions", "[string_functions]" ) {
     REQUIRE( ends_with("abcd", "") );
 }
 
+TEST_CASE( "number formatting", "[format]" ) {
+
+    // the fast formatters must match printf exactly, including ties
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> dist(-200.0, 200.0);
+    std::vector<double> values = { 0.0, -0.0, 0.005, 0.015, 0.125, 2.5, -0.001, 99999.95, 999999.5, 1e-5, 1e20, NAN, INFINITY };
+    for(size_t i = 0; i < 10000; ++i) {
+        values.push_back(dist(rng));
+    }
+
+    char buf[512];
+    for(double v : values) {
+        for(int precision = 0; precision <= 5; ++precision) {
+            std::string out;
+            append_fixed(out, v, precision);
+            snprintf(buf, sizeof(buf), "%.*f", precision, v);
+            REQUIRE( out == buf );
+        }
+
+        std::string out;
+        append_general(out, v);
+        snprintf(buf, sizeof(buf), "%g", v);
+        REQUIRE( out == buf );
+    }
+
+    std::string out;
+    append_int(out, -42);
+    out.push_back(' ');
+    append_uint(out, 18446744073709551615ull);
+    REQUIRE( out == "-42 18446744073709551615" );
+}
+
+TEST_CASE( "event statistics", "[aggregate]" ) {
+
+    // accumulators merged from parts must match one accumulator over all events
+    std::mt19937 rng(1);
+    std::normal_distribution<float> dist(90.0, 5.0);
+    EventStatsAccumulator all;
+    EventStatsAccumulator parts[3];
+    for(size_t i = 0; i < 3000; ++i) {
+        float level = dist(rng);
+        size_t read_key = i / 10;
+        all.add(level, 0.01, read_key, 20, rng);
+        parts[read_key % 3].add(level, 0.01, read_key, 20, rng);
+    }
+
+    parts[0].merge(parts[1], 20, rng);
+    parts[0].merge(parts[2], 20, rng);
+    REQUIRE( parts[0].num_events == all.num_events );
+    REQUIRE( parts[0].num_reads == 300 );
+    REQUIRE( parts[0].mean == Approx(all.mean) );
+    REQUIRE( parts[0].get_stdv() == Approx(all.get_stdv()) );
+    REQUIRE( parts[0].sum_duration == Approx(30.0) );
+    REQUIRE( parts[0].reservoir.size() == 20 );
+}
+
+TEST_CASE( "packed reference", "[reference]" ) {
+
+    // a reference with an N run, soft masked bases and an ambiguity code
+    std::string fasta_filename = "/tmp/nanopolish_test_reference." + std::to_string(getpid()) + ".fa";
+    std::string packed_filename = fasta_filename + ".npref";
+    FILE* fp = fopen(fasta_filename.c_str(), "w");
+    REQUIRE( fp != NULL );
+    fprintf(fp, ">ctg1 description\nACGTACGTNNNNNNNNNNacgtacGTRA\nTTGCAnnnnACGTAC\n");
+    fprintf(fp, ">ctg2\nggggCCCCaaaa\nT\n");
+    fclose(fp);
+
+    REQUIRE( fai_build(fasta_filename.c_str()) == 0 );
+    faidx_t* fai = fai_load(fasta_filename.c_str());
+    REQUIRE( fai != NULL );
+
+    // the first pass builds the packed file, the second maps it and the third
+    // maps a truncated copy, which must be detected and rebuilt
+    for(int pass = 0; pass < 3; ++pass) {
+        if(pass == 2) {
+            REQUIRE( truncate(packed_filename.c_str(), sizeof(PackedReferenceHeader) + 2 * sizeof(PackedContig)) == 0 );
+        }
+
+        PackedReference reference(fasta_filename);
+        REQUIRE( reference.get_num_contigs() == 2 );
+        for(int ci = 0; ci < 2; ++ci) {
+            std::string name = reference.get_contig_name(ci);
+            REQUIRE( name == faidx_iseq(fai, ci) );
+            REQUIRE( reference.get_contig_id(name) == ci );
+
+            int length = faidx_seq_len(fai, name.c_str());
+            REQUIRE( reference.get_contig_length(ci) == length );
+
+            // every interval, including ones that extend past the end of the contig
+            for(int start = 0; start < length; ++start) {
+                for(int end = start; end < length + 3; ++end) {
+                    int expected_len = 0;
+                    char* expected = faidx_fetch_seq(fai, name.c_str(), start, end, &expected_len);
+                    REQUIRE( expected != NULL );
+
+                    int fetched_len = 0;
+                    std::string fetched = get_reference_region_ts(&reference, name.c_str(), start, end, &fetched_len);
+                    REQUIRE( fetched == expected );
+                    REQUIRE( fetched_len == expected_len );
+
+                    std::vector<char> buffer(end - start + 1);
+                    size_t n = reference.copy_substring(ci, start, end, buffer.data());
+                    REQUIRE( std::string(buffer.data(), n) == expected );
+                    free(expected);
+                }
+            }
+        }
+    }
+
+    fai_destroy(fai);
+    unlink(packed_filename.c_str());
+    unlink((fasta_filename + ".fai").c_str());
+    unlink(fasta_filename.c_str());
+}
+
+// the row of the binary eventalign test with index i
+static EventalignBinaryRecord make_binary_test_record(size_t i, uint32_t read_id, uint32_t ref_kmer, uint32_t model_kmer)
+{
+    EventalignBinaryRecord record;
+    record.contig_id = (i / 1000) % 2;
+    record.position = 5000 + i / 3;
+    record.ref_kmer = ref_kmer;
+    record.read_id = read_id;
+    record.strand_idx = i % 2;
+    record.k = 6;
+    record.event_idx = i;
+    record.event_mean = 80.0f + i * 0.001f;
+    record.event_stdv = 1.5f + (i % 7) * 0.1f;
+    record.event_length = 0.002f * (1 + i % 5);
+    record.model_kmer = model_kmer;
+    record.model_mean = 90.0f - (i % 11);
+    record.model_stdv = 2.0f;
+    record.standardized_level = (i % 13) * 0.25f - 1.0f;
+    return record;
+}
+
+static std::vector<float> make_binary_test_samples(size_t i)
+{
+    std::vector<float> samples;
+    for(size_t j = 0; j < i % 4; ++j) {
+        samples.push_back(i + j * 0.25f);
+    }
+    return samples;
+}
+
+TEST_CASE( "binary eventalign", "[eventalign_binary]" ) {
+
+    std::string filename = "/tmp/nanopolish_test_eventalign." + std::to_string(getpid()) + ".bin";
+    std::vector<std::string> contigs = { "chr1", "chr2" };
+    std::vector<std::string> kmers = { "ACGTAC", "TTTTTT", "ACGNNA", "acgtac" };
+
+    // write enough rows for more than one chunk
+    const size_t num_rows = EVENTALIGN_BINARY_CHUNK_ROWS + 4464;
+    std::vector<uint32_t> kmer_codes;
+    std::vector<uint32_t> read_ids;
+    FILE* fp = fopen(filename.c_str(), "wb");
+    REQUIRE( fp != NULL );
+    {
+        EventalignBinaryWriter writer(fp, contigs, EVENTALIGN_BINARY_SAMPLES);
+        for(const std::string& kmer : kmers) {
+            kmer_codes.push_back(writer.encode_kmer(kmer));
+        }
+
+        for(size_t i = 0; i < num_rows; ++i) {
+            size_t read_idx = 7 * (i / 500);
+            read_ids.push_back(writer.add_read(read_idx, "read_" + std::to_string(read_idx)));
+            std::vector<float> samples = make_binary_test_samples(i);
+            uint32_t model_kmer = i % 17 == 0 ? EVENTALIGN_KMER_NONE : kmer_codes[(i + 1) % 4];
+            writer.append(make_binary_test_record(i, read_ids.back(), kmer_codes[i % 4], model_kmer), &samples);
+        }
+        writer.close();
+    }
+    fclose(fp);
+
+    // the two k-mers that cannot be ranked are in the dictionary
+    REQUIRE( (kmer_codes[0] & EVENTALIGN_KMER_DICTIONARY_BIT) == 0 );
+    REQUIRE( (kmer_codes[1] & EVENTALIGN_KMER_DICTIONARY_BIT) == 0 );
+    REQUIRE( kmer_codes[2] == (0 | EVENTALIGN_KMER_DICTIONARY_BIT) );
+    REQUIRE( kmer_codes[3] == (1 | EVENTALIGN_KMER_DICTIONARY_BIT) );
+
+    REQUIRE( EventalignBinaryReader::is_binary_file(filename) );
+    EventalignBinaryReader reader(filename);
+    REQUIRE( reader.get_flags() == EVENTALIGN_BINARY_SAMPLES );
+
+    // dictionaries
+    REQUIRE( reader.get_num_contigs() == contigs.size() );
+    for(size_t ci = 0; ci < contigs.size(); ++ci) {
+        REQUIRE( reader.get_contig_name(ci) == contigs[ci] );
+        REQUIRE( reader.get_contig_id(contigs[ci]) == (int)ci );
+    }
+    REQUIRE( reader.get_contig_id("chr3") == -1 );
+
+    size_t num_reads = (num_rows + 499) / 500;
+    REQUIRE( reader.get_num_reads() == num_reads );
+    for(size_t ri = 0; ri < num_reads; ++ri) {
+        REQUIRE( reader.get_read_index(ri) == 7 * ri );
+        REQUIRE( reader.get_read_name(ri) == "read_" + std::to_string(7 * ri) );
+    }
+
+    for(size_t ki = 0; ki < kmers.size(); ++ki) {
+        REQUIRE( reader.get_kmer(kmer_codes[ki], 6) == kmers[ki] );
+    }
+    REQUIRE( reader.get_kmer(EVENTALIGN_KMER_NONE, 6) == "NNNNNN" );
+
+    // chunk index and every column of every row
+    REQUIRE( reader.get_num_chunks() == 2 );
+    size_t row = 0;
+    uint64_t expected_offset = sizeof(EventalignBinaryHeader);
+    EventalignChunk chunk;
+    for(size_t ci = 0; ci < reader.get_num_chunks(); ++ci) {
+        const EventalignChunkIndex& index = reader.get_chunk_index(ci);
+        REQUIRE( index.offset == expected_offset );
+        expected_offset += index.compressed_size;
+
+        reader.read_chunk(ci, chunk);
+        REQUIRE( chunk.size() == index.num_rows );
+        REQUIRE( chunk.samples.size() == index.num_samples );
+        REQUIRE( chunk.sample_offsets.size() == chunk.size() + 1 );
+
+        uint32_t min_contig_id = UINT32_MAX, max_contig_id = 0;
+        int32_t min_position = INT32_MAX, max_position = INT32_MIN;
+        for(size_t i = 0; i < chunk.size(); ++i, ++row) {
+            uint32_t model_kmer = row % 17 == 0 ? EVENTALIGN_KMER_NONE : kmer_codes[(row + 1) % 4];
+            EventalignBinaryRecord expected = make_binary_test_record(row, read_ids[row], kmer_codes[row % 4], model_kmer);
+            REQUIRE( chunk.contig_id[i] == expected.contig_id );
+            REQUIRE( chunk.position[i] == expected.position );
+            REQUIRE( chunk.ref_kmer[i] == expected.ref_kmer );
+            REQUIRE( chunk.read_id[i] == expected.read_id );
+            REQUIRE( chunk.strand_idx[i] == expected.strand_idx );
+            REQUIRE( chunk.k[i] == expected.k );
+            REQUIRE( chunk.event_idx[i] == expected.event_idx );
+            REQUIRE( chunk.event_mean[i] == expected.event_mean );
+            REQUIRE( chunk.event_stdv[i] == expected.event_stdv );
+            REQUIRE( chunk.event_length[i] == expected.event_length );
+            REQUIRE( chunk.model_kmer[i] == expected.model_kmer );
+            REQUIRE( chunk.model_mean[i] == expected.model_mean );
+            REQUIRE( chunk.model_stdv[i] == expected.model_stdv );
+            REQUIRE( chunk.standardized_level[i] == expected.standardized_level );
+
+            std::vector<float> samples(chunk.samples.begin() + chunk.sample_offsets[i],
+                                       chunk.samples.begin() + chunk.sample_offsets[i + 1]);
+            REQUIRE( samples == make_binary_test_samples(row) );
+
+            min_contig_id = std::min(min_contig_id, expected.contig_id);
+            max_contig_id = std::max(max_contig_id, expected.contig_id);
+            min_position = std::min(min_position, expected.position);
+            max_position = std::max(max_position, expected.position);
+        }
+
+        REQUIRE( index.min_contig_id == min_contig_id );
+        REQUIRE( index.max_contig_id == max_contig_id );
+        REQUIRE( index.min_position == min_position );
+        REQUIRE( index.max_position == max_position );
+    }
+    REQUIRE( row == num_rows );
+
+    // a truncated file is rejected, the reader exits so it is opened in a child process
+    FILE* size_fp = fopen(filename.c_str(), "rb");
+    fseek(size_fp, 0, SEEK_END);
+    long file_size = ftell(size_fp);
+    fclose(size_fp);
+    REQUIRE( truncate(filename.c_str(), file_size / 2) == 0 );
+
+    fflush(NULL);
+    pid_t pid = fork();
+    REQUIRE( pid >= 0 );
+    if(pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        EventalignBinaryReader truncated_reader(filename);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status = 0;
+    REQUIRE( waitpid(pid, &status, 0) == pid );
+    REQUIRE( WIFEXITED(status) );
+    REQUIRE( WEXITSTATUS(status) == EXIT_FAILURE );
+    unlink(filename.c_str());
+}
+
+TEST_CASE( "pore model scaling", "[poremodel]" ) {
+    std::vector<PoreModelStateParams> states;
+    states.push_back(PoreModelStateParams(80.0, 2.0, 1.0, 0.5));
+    states.push_back(PoreModelStateParams(100.0, 1.5, 1.2, 0.7));
+
+    PoreModel pm(1);
+    pm.set_states(states);
+    pm.shift = 5.0;
+    pm.scale = 1.1;
+    pm.drift = 0.0;
+    pm.var = 1.3;
+    pm.scale_sd = 0.9;
+    pm.var_sd = 1.2;
+    pm.bake_gaussian_parameters();
+
+    // the scaled state must match scaling the state directly
+    PoreModelStateParams expected = states[1];
+    expected.level_mean = states[1].level_mean * pm.scale + pm.shift;
+    expected.level_stdv = states[1].level_stdv * pm.var;
+    expected.sd_mean = states[1].sd_mean * pm.scale_sd;
+    expected.sd_lambda = states[1].sd_lambda * pm.var_sd;
+    expected.update_sd_stdv();
+    expected.update_logs();
+
+    PoreModelStateParams scaled = pm.get_scaled_state(1);
+    REQUIRE( scaled.level_mean == Approx(expected.level_mean) );
+    REQUIRE( scaled.level_stdv == Approx(expected.level_stdv) );
+    REQUIRE( scaled.level_log_stdv == Approx(expected.level_log_stdv) );
+    REQUIRE( scaled.sd_mean == Approx(expected.sd_mean) );
+    REQUIRE( scaled.sd_stdv == Approx(expected.sd_stdv) );
+    REQUIRE( scaled.sd_lambda == Approx(expected.sd_lambda) );
+    REQUIRE( scaled.sd_log_lambda == Approx(expected.sd_log_lambda) );
+
+    GaussianParameters gp = pm.get_scaled_parameters(1);
+    REQUIRE( gp.mean == Approx(expected.level_mean) );
+    REQUIRE( gp.log_stdv == Approx(expected.level_log_stdv) );
+
+    // copies share the states but keep their own scaling
+    PoreModel copy = pm;
+    copy.shift = 0.0;
+    copy.bake_gaussian_parameters();
+    REQUIRE( copy.get_parameters(0).level_mean == Approx(80.0) );
+    REQUIRE( copy.get_scaled_parameters(0).mean == Approx(80.0 * pm.scale) );
+    REQUIRE( pm.get_scaled_parameters(0).mean == Approx(80.0 * pm.scale + 5.0) );
+}
+
 TEST_CASE( "math", "[math]") {
     GaussianParameters params;
     params.mean = 4;
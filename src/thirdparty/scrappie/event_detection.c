@@ -6,6 +6,7 @@
 
 #include "event_detection.h"
 #include "scrappie_stdlib.h"
+#include "sse_mathfun.h"
 
 typedef struct {
     int DEF_PEAK_POS;
@@ -21,94 +22,210 @@ typedef struct {
 } Detector;
 typedef Detector *DetectorPtr;
 
+/*  Compensated prefix sums of a signal, centred on offset.  The sum of the
+ *  first i centred samples is sum[i] + sum_c[i], likewise for the sum of
+ *  squares. */
+typedef struct {
+    float *sum;
+    float *sum_c;
+    float *sumsq;
+    float *sumsq_c;
+    float offset;
+    size_t n;
+} prefix_sums;
+
+/**
+ *   Error-free transformation of the sum of two floats
+ *
+ *   On return a + b == *s + *e exactly, where *s is the rounded sum
+ **/
+static inline void two_sum(float a, float b, float *s, float *e) {
+    const float t = a + b;
+    const float bp = t - a;
+    *e = (a - (t - bp)) + (b - bp);
+    *s = t;
+}
+
+/**
+ *   As two_sum, but requires |a| >= |b|
+ **/
+static inline void fast_two_sum(float a, float b, float *s, float *e) {
+    const float t = a + b;
+    *e = b - (t - a);
+    *s = t;
+}
+
+/**
+ *   Allocate storage for the prefix sums of d_length samples
+ *
+ *   All four arrays share a single allocation owned by ps->sum.
+ *
+ *   @returns true on success
+ **/
+static bool alloc_prefix_sums(prefix_sums * ps, size_t d_length) {
+    const size_t stride = d_length + 1;
+    float *block = calloc(4 * stride, sizeof(float));
+    RETURN_NULL_IF(NULL == block, false);
+
+    ps->n = d_length;
+    ps->offset = 0.0f;
+    ps->sum = block;
+    ps->sum_c = block + stride;
+    ps->sumsq = block + 2 * stride;
+    ps->sumsq_c = block + 3 * stride;
+    return true;
+}
+
+static void free_prefix_sums(prefix_sums * ps) {
+    free(ps->sum);
+    ps->sum = ps->sum_c = ps->sumsq = ps->sumsq_c = NULL;
+    ps->n = 0;
+}
+
 /**
  *   Compute cumulative sum and sum of squares for a vector of data
  *
  *   Element i  sum (sumsq) is the sum (sum of squares) up to but
- *   excluding element i of the inputy data.
+ *   excluding element i of the inputy data, after subtracting ps->offset
+ *   (the mean of the data) from every element.
+ *
+ *   Sums are accumulated in single precision as unevaluated pairs
+ *   sum[i] + sum_c[i], where sum_c holds the rounding error of sum and is
+ *   renormalised after every addition.  The sum over a window is recovered
+ *   by window_sum: for nearby positions the difference of the rounded sums
+ *   is exact so only the small compensation terms contribute error.
+ *   Centring the data keeps the sums of squares small, which limits
+ *   cancellation when the variance of a window is computed.
  *
- *   @param data      double[d_length]   Data to be summed over (in)
- *   @param sum       double[d_length + 1]   Vector to store sum (out)
- *   @param sumsq     double[d_length + 1]   Vector to store sum of squares (out)
+ *   @param data      float[d_length]   Data to be summed over (in)
+ *   @param ps        Prefix sums of length d_length + 1, from alloc_prefix_sums (out)
  *   @param d_length                     Length of data vector
  **/
-void compute_sum_sumsq(const float *data, double *sum,
-                       double *sumsq, size_t d_length) {
+void compute_sum_sumsq(const float *data, prefix_sums * ps, size_t d_length) {
     RETURN_NULL_IF(NULL == data, );
-    RETURN_NULL_IF(NULL == sum, );
-    RETURN_NULL_IF(NULL == sumsq, );
+    RETURN_NULL_IF(NULL == ps, );
+    RETURN_NULL_IF(NULL == ps->sum, );
     assert(d_length > 0);
+    assert(ps->n == d_length);
+
+    double total = 0.0;
+    for (size_t i = 0; i < d_length; ++i) {
+        total += data[i];
+    }
+    ps->offset = (float)(total / d_length);
 
-    sum[0] = 0.0f;
-    sumsq[0] = 0.0f;
+    float s = 0.0f, sc = 0.0f;
+    float q = 0.0f, qc = 0.0f;
+    ps->sum[0] = ps->sum_c[0] = 0.0f;
+    ps->sumsq[0] = ps->sumsq_c[0] = 0.0f;
     for (size_t i = 0; i < d_length; ++i) {
-        sum[i + 1] = sum[i] + data[i];
-        sumsq[i + 1] = sumsq[i] + data[i] * data[i];
+        const float x = data[i] - ps->offset;
+        float e;
+        two_sum(s, x, &s, &e);
+        fast_two_sum(s, sc + e, &s, &sc);
+        two_sum(q, x * x, &q, &e);
+        fast_two_sum(q, qc + e, &q, &qc);
+
+        ps->sum[i + 1] = s;
+        ps->sum_c[i + 1] = sc;
+        ps->sumsq[i + 1] = q;
+        ps->sumsq_c[i + 1] = qc;
     }
 }
 
+/**
+ *   Sum of the data over [start, end) from compensated prefix sums
+ **/
+static inline float window_sum(const float *sum, const float *sum_c,
+                               size_t start, size_t end) {
+    return (sum[end] - sum[start]) + (sum_c[end] - sum_c[start]);
+}
+
+static inline v4sf window_sum_ps(const float *sum, const float *sum_c,
+                                 size_t start, size_t end) {
+    const v4sf s = _mm_sub_ps(_mm_loadu_ps(sum + end), _mm_loadu_ps(sum + start));
+    const v4sf c = _mm_sub_ps(_mm_loadu_ps(sum_c + end), _mm_loadu_ps(sum_c + start));
+    return _mm_add_ps(s, c);
+}
+
+/**
+ *   Scalar t-statistic at position i, used for the tail of the vector loop.
+ *   The order of operations matches compute_tstat exactly.
+ **/
+static inline float tstat_at(prefix_sums const *ps, size_t i, size_t w_length) {
+    const float w_lengthf = (float)w_length;
+    const float sum1 = window_sum(ps->sum, ps->sum_c, i - w_length, i);
+    const float sumsq1 = window_sum(ps->sumsq, ps->sumsq_c, i - w_length, i);
+    const float sum2 = window_sum(ps->sum, ps->sum_c, i, i + w_length);
+    const float sumsq2 = window_sum(ps->sumsq, ps->sumsq_c, i, i + w_length);
+    const float mean1 = sum1 / w_lengthf;
+    const float mean2 = sum2 / w_lengthf;
+    float combined_var = sumsq1 / w_lengthf - mean1 * mean1
+        + sumsq2 / w_lengthf - mean2 * mean2;
+    combined_var = fmaxf(combined_var, FLT_MIN);
+    const float delta_mean = mean2 - mean1;
+    return fabsf(delta_mean) / sqrtf(combined_var / w_lengthf);
+}
+
 /**
  *   Compute windowed t-statistic from summary information
  *
- *   @param sum       double[d_length]  Cumulative sums of data (in)
- *   @param sumsq     double[d_length]  Cumulative sum of squares of data (in)
+ *   Four positions are computed per iteration using SSE.
+ *
+ *   @param ps        Compensated prefix sums of the data (in)
  *   @param d_length                    Length of data vector
  *   @param w_length                    Window length to calculate t-statistic over
  *
  *   @returns float array containing tstats.  Returns NULL on error
  **/
-float *compute_tstat(const double *sum, const double *sumsq,
-                     size_t d_length, size_t w_length) {
+float *compute_tstat(prefix_sums const *ps, size_t d_length, size_t w_length) {
     assert(d_length > 0);
     assert(w_length > 0);
-    RETURN_NULL_IF(NULL == sum, NULL);
-    RETURN_NULL_IF(NULL == sumsq, NULL);
+    RETURN_NULL_IF(NULL == ps, NULL);
+    RETURN_NULL_IF(NULL == ps->sum, NULL);
 
+    // zero initialisation also fudges the boundaries
     float *tstat = calloc(d_length, sizeof(float));
     RETURN_NULL_IF(NULL == tstat, NULL);
 
-    const float eta = FLT_MIN;
-    const float w_lengthf = (float)w_length;
-
     // Quick return:
     //   t-test not defined for number of points less than 2
     //   need at least as many points as twice the window length
     if (d_length < 2 * w_length || w_length < 2) {
-        for (size_t i = 0; i < d_length; ++i) {
-            tstat[i] = 0.0f;
-        }
         return tstat;
     }
-    // fudge boundaries
-    for (size_t i = 0; i < w_length; ++i) {
-        tstat[i] = 0;
-        tstat[d_length - i - 1] = 0;
-    }
+
+    const v4sf eta = *(v4sf *) _ps_min_norm_pos;
+    const v4sf abs_mask = *(v4sf *) _ps_inv_sign_mask;
+    const v4sf w_lengthf = _mm_set1_ps((float)w_length);
 
     // get to work on the rest
-    for (size_t i = w_length; i <= d_length - w_length; ++i) {
-        double sum1 = sum[i];
-        double sumsq1 = sumsq[i];
-        if (i > w_length) {
-            sum1 -= sum[i - w_length];
-            sumsq1 -= sumsq[i - w_length];
-        }
-        float sum2 = (float)(sum[i + w_length] - sum[i]);
-        float sumsq2 = (float)(sumsq[i + w_length] - sumsq[i]);
-        float mean1 = sum1 / w_lengthf;
-        float mean2 = sum2 / w_lengthf;
-        float combined_var = sumsq1 / w_lengthf - mean1 * mean1
-            + sumsq2 / w_lengthf - mean2 * mean2;
+    size_t i = w_length;
+    for (; i + 3 <= d_length - w_length; i += 4) {
+        const v4sf sum1 = window_sum_ps(ps->sum, ps->sum_c, i - w_length, i);
+        const v4sf sumsq1 = window_sum_ps(ps->sumsq, ps->sumsq_c, i - w_length, i);
+        const v4sf sum2 = window_sum_ps(ps->sum, ps->sum_c, i, i + w_length);
+        const v4sf sumsq2 = window_sum_ps(ps->sumsq, ps->sumsq_c, i, i + w_length);
+        const v4sf mean1 = _mm_div_ps(sum1, w_lengthf);
+        const v4sf mean2 = _mm_div_ps(sum2, w_lengthf);
+
+        v4sf combined_var = _mm_sub_ps(_mm_div_ps(sumsq1, w_lengthf), _mm_mul_ps(mean1, mean1));
+        combined_var = _mm_add_ps(combined_var, _mm_div_ps(sumsq2, w_lengthf));
+        combined_var = _mm_sub_ps(combined_var, _mm_mul_ps(mean2, mean2));
 
         // Prevent problem due to very small variances
-        combined_var = fmaxf(combined_var, eta);
+        combined_var = _mm_max_ps(combined_var, eta);
 
         //t-stat
         //  Formula is a simplified version of Student's t-statistic for the
         //  special case where there are two samples of equal size with
         //  differing variance
-        const float delta_mean = mean2 - mean1;
-        tstat[i] = fabs(delta_mean) / sqrt(combined_var / w_lengthf);
+        const v4sf delta_mean = _mm_and_ps(_mm_sub_ps(mean2, mean1), abs_mask);
+        const v4sf denom = _mm_sqrt_ps(_mm_div_ps(combined_var, w_lengthf));
+        _mm_storeu_ps(tstat + i, _mm_div_ps(delta_mean, denom));
+    }
+    for (; i <= d_length - w_length; ++i) {
+        tstat[i] = tstat_at(ps, i, w_length);
     }
 
     return tstat;
@@ -132,8 +249,42 @@ size_t *short_long_peak_detector(DetectorPtr short_detector,
     size_t *peaks = calloc(short_detector->signal_length, sizeof(size_t));
     RETURN_NULL_IF(NULL == peaks, NULL);
 
+    const v4sf peak_heightv = _mm_set1_ps(peak_height);
+    const size_t signal_length = short_detector->signal_length;
+
     size_t peak_count = 0;
-    for (size_t i = 0; i < short_detector->signal_length; i++) {
+    for (size_t i = 0; i < signal_length; i++) {
+
+        // Fast path: when neither detector can change state over the next
+        // four samples the whole block is skipped.  A detector is quiet if it
+        // is masked for the entire block, or if it is waiting for a peak and
+        // no sample in the block is a new minimum or rises peak_height above
+        // the current one.  The detectors only interact while in a peak so
+        // skipping quiet blocks gives exactly the same result.
+        if (i + 4 <= signal_length) {
+            bool quiet = true;
+            for (int k = 0; k < ndetector && quiet; k++) {
+                DetectorPtr detector = detectors[k];
+                if (detector->masked_to >= i + 3) {
+                    continue;
+                }
+                if (detector->masked_to >= i
+                    || detector->peak_pos != detector->DEF_PEAK_POS) {
+                    quiet = false;
+                    break;
+                }
+                const v4sf current = _mm_loadu_ps(detector->signal + i);
+                const v4sf peak_value = _mm_set1_ps(detector->peak_value);
+                const v4sf is_lower = _mm_cmplt_ps(current, peak_value);
+                const v4sf is_peak = _mm_cmpgt_ps(_mm_sub_ps(current, peak_value), peak_heightv);
+                quiet = 0 == _mm_movemask_ps(_mm_or_ps(is_lower, is_peak));
+            }
+            if (quiet) {
+                i += 3;
+                continue;
+            }
+        }
+
         for (int k = 0; k < ndetector; k++) {
             DetectorPtr detector = detectors[k];
             //Carry on if we've been masked out
@@ -204,38 +355,37 @@ size_t *short_long_peak_detector(DetectorPtr short_detector,
  *
  *  @param start Index of lower bound
  *  @param end Index of upper bound
- *  @param sums
- *  @param sumsqs
+ *  @param ps   Compensated prefix sums of the signal
  *  @param nsample  Total number of samples in read
  *
  *  @returns An initialised event.  A 'null' event is returned on error.
  **/
-event_t create_event(size_t start, size_t end, double const *sums,
-                     double const *sumsqs, size_t nsample) {
+event_t create_event(size_t start, size_t end, prefix_sums const *ps,
+                     size_t nsample) {
     assert(start < nsample);
     assert(end <= nsample);
 
     event_t event = { 0 };
     event.pos = -1;
     event.state = -1;
-    RETURN_NULL_IF(NULL == sums, event);
-    RETURN_NULL_IF(NULL == sumsqs, event);
+    RETURN_NULL_IF(NULL == ps, event);
+    RETURN_NULL_IF(NULL == ps->sum, event);
 
     event.start = (uint64_t)start;
     event.length = (float)(end - start);
-    event.mean = (float)(sums[end] - sums[start]) / event.length;
-    const float deltasqr = (sumsqs[end] - sumsqs[start]);
-    const float var = deltasqr / event.length - event.mean * event.mean;
+    const float centred_mean = window_sum(ps->sum, ps->sum_c, start, end) / event.length;
+    const float deltasqr = window_sum(ps->sumsq, ps->sumsq_c, start, end);
+    const float var = deltasqr / event.length - centred_mean * centred_mean;
+    event.mean = centred_mean + ps->offset;
     event.stdv = sqrtf(fmaxf(var, 0.0f));
 
     return event;
 }
 
-event_table create_events(size_t const *peaks, double const *sums,
-                          double const *sumsqs, size_t nsample) {
+event_table create_events(size_t const *peaks, prefix_sums const *ps,
+                          size_t nsample) {
     event_table et = { 0 };
-    RETURN_NULL_IF(NULL == sums, et);
-    RETURN_NULL_IF(NULL == sumsqs, et);
+    RETURN_NULL_IF(NULL == ps, et);
     RETURN_NULL_IF(NULL == peaks, et);
 
     // Count number of events found
@@ -254,28 +404,37 @@ event_table create_events(size_t const *peaks, double const *sums,
 
 
     // First event -- starts at zero
-    et.event[0] = create_event(0, peaks[0], sums, sumsqs, nsample);
+    et.event[0] = create_event(0, peaks[0], ps, nsample);
     // Other events -- peak[i-1] -> peak[i]
     for(size_t ev=1 ; ev < n - 1 ; ev++){
-        et.event[ev] = create_event(peaks[ev - 1], peaks[ev], sums, sumsqs, nsample);
+        et.event[ev] = create_event(peaks[ev - 1], peaks[ev], ps, nsample);
     }
     // Last event -- ends at nsample
-    et.event[n - 1] = create_event(peaks[n - 2], nsample, sums, sumsqs, nsample);
+    et.event[n - 1] = create_event(peaks[n - 2], nsample, ps, nsample);
 
     return et;
 }
 
-event_table detect_events(raw_table const rt, detector_param const edparam) {
-
-    event_table et = { 0 };
-    RETURN_NULL_IF(NULL == rt.raw, et);
-
-    double *sums = calloc(rt.n + 1, sizeof(double));
-    double *sumsqs = calloc(rt.n + 1, sizeof(double));
-
-    compute_sum_sumsq(rt.raw, sums, sumsqs, rt.n);
-    float *tstat1 = compute_tstat(sums, sumsqs, rt.n, edparam.window_length1);
-    float *tstat2 = compute_tstat(sums, sumsqs, rt.n, edparam.window_length2);
+/**  Run the two t-statistic peak detectors over the raw signal
+ *
+ *  @param rt       Raw signal, only rt.raw and rt.n are used
+ *  @param edparam  Detector parameters
+ *  @param ps       Output, prefix sums of the signal.  Caller frees with free_prefix_sums.
+ *
+ *  @returns array of peak positions as for short_long_peak_detector. Returns NULL on error
+ **/
+static size_t *detect_peaks(raw_table const rt, detector_param const edparam,
+                            prefix_sums * ps) {
+    RETURN_NULL_IF(!alloc_prefix_sums(ps, rt.n), NULL);
+
+    compute_sum_sumsq(rt.raw, ps, rt.n);
+    float *tstat1 = compute_tstat(ps, rt.n, edparam.window_length1);
+    float *tstat2 = compute_tstat(ps, rt.n, edparam.window_length2);
+    if (NULL == tstat1 || NULL == tstat2) {
+        free(tstat2);
+        free(tstat1);
+        return NULL;
+    }
 
     Detector short_detector = {
         .DEF_PEAK_POS = -1,
@@ -307,13 +466,58 @@ event_table detect_events(raw_table const rt, detector_param const edparam) {
         short_long_peak_detector(&short_detector, &long_detector,
                                  edparam.peak_height);
 
-    et = create_events(peaks, sums, sumsqs, rt.n);
-
-    free(peaks);
     free(tstat2);
     free(tstat1);
-    free(sumsqs);
-    free(sums);
+
+    return peaks;
+}
+
+event_table detect_events(raw_table const rt, detector_param const edparam) {
+
+    event_table et = { 0 };
+    RETURN_NULL_IF(NULL == rt.raw, et);
+
+    prefix_sums ps = { 0 };
+    size_t *peaks = detect_peaks(rt, edparam, &ps);
+
+    et = create_events(peaks, &ps, rt.n);
+
+    free(peaks);
+    free_prefix_sums(&ps);
 
     return et;
 }
+
+size_t detect_events_to_sink(raw_table const rt, detector_param const edparam,
+                             event_sink sink, void *sink_data) {
+    RETURN_NULL_IF(NULL == rt.raw, 0);
+    RETURN_NULL_IF(NULL == sink, 0);
+
+    prefix_sums ps = { 0 };
+    size_t *peaks = detect_peaks(rt, edparam, &ps);
+    if (NULL == peaks) {
+        free_prefix_sums(&ps);
+        return 0;
+    }
+
+    // Count number of events found, as in create_events
+    size_t n = 1;
+    for (size_t i = 0; i < rt.n; ++i) {
+        if (peaks[i] > 0 && peaks[i] < rt.n) {
+            n++;
+        }
+    }
+
+    // Events are emitted in order, using the same boundaries as create_events
+    for (size_t ev = 0; ev < n; ev++) {
+        size_t start = ev == 0 ? 0 : peaks[ev - 1];
+        size_t end = ev == n - 1 ? rt.n : peaks[ev];
+        event_t event = create_event(start, end, &ps, rt.n);
+        sink(sink_data, n, ev, &event);
+    }
+
+    free(peaks);
+    free_prefix_sums(&ps);
+
+    return n;
+}
@@ -24,4 +24,14 @@ static detector_param const event_detection_defaults = {
 
 event_table detect_events(raw_table const rt, detector_param const edparam);
 
+/*  Callback receiving each detected event, in order. n_events is the total
+ *  number of events that will be emitted so the first call can size storage. */
+typedef void (*event_sink)(void *data, size_t n_events, size_t event_idx,
+                           event_t const *event);
+
+/*  As detect_events, but rather than allocating an event table each event is
+ *  passed to the sink. rt.raw is only read. Returns the number of events. */
+size_t detect_events_to_sink(raw_table const rt, detector_param const edparam,
+                             event_sink sink, void *sink_data);
+
 #endif                          /* EVENT_DETECTION_H */
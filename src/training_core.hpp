@@ -24,8 +24,9 @@ struct MinimalStateTrainingData
     MinimalStateTrainingData(const SquiggleRead& sr,
                              const EventAlignment& ea,
                              uint32_t,
-                             const std::string&,
-                             const std::string&)
+                             uint32_t,
+                             uint32_t,
+                             const Alphabet*)
     {
         initialize(sr.get_fully_scaled_level(ea.event_idx, ea.strand_idx),
                    sr.get_scaled_stdv(ea.event_idx, ea.strand_idx),
@@ -122,17 +123,18 @@ struct FullStateTrainingData
     FullStateTrainingData(const SquiggleRead& sr,
                           const EventAlignment& ea,
                           uint32_t rank,
-                          const std::string& prev_kmer,
-                          const std::string& next_kmer)
-        : MinimalStateTrainingData(sr, ea, rank, prev_kmer, next_kmer)
+                          uint32_t prev_kmer_rank,
+                          uint32_t next_kmer_rank,
+                          const Alphabet* alphabet)
+        : MinimalStateTrainingData(sr, ea, rank, prev_kmer_rank, next_kmer_rank, alphabet)
     {
         this->duration = sr.events[ea.strand_idx][ea.event_idx].duration;
         this->ref_position = ea.ref_position;
         this->ref_strand = ea.rc;
         GaussianParameters model = sr.pore_model[ea.strand_idx].get_scaled_parameters(rank);
         this->z = (sr.get_drift_corrected_level(ea.event_idx, ea.strand_idx) -  model.mean ) / model.stdv;
-        this->prev_kmer = prev_kmer;
-        this->next_kmer = next_kmer;
+        this->prev_kmer = prev_kmer_rank != EVENT_ALIGNMENT_NO_KMER ? alphabet->kmer_from_rank(prev_kmer_rank, ea.k) : "";
+        this->next_kmer = next_kmer_rank != EVENT_ALIGNMENT_NO_KMER ? alphabet->kmer_from_rank(next_kmer_rank, ea.k) : "";
     }
 
     static void write_header(std::ostream& os)